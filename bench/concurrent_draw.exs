@@ -0,0 +1,124 @@
+# Concurrent drawing benchmark.
+#
+# Starts 32 widget processes that each redraw their own band of the screen at
+# 60 Hz while a presenter process calls present/0 at 60 Hz, first drawing
+# directly through the NIF (set_cells/1) and then, for comparison, through the
+# old path of one GenServer cast per cell to ExTermbox.Server. Reports how long
+# a widget's redraw takes and how many frames each widget managed.
+#
+# Run in a real terminal (the screen is taken over while it runs):
+#
+#     mix run bench/concurrent_draw.exs [seconds]
+#
+# Results are printed after the terminal is restored.
+
+defmodule Bench.ConcurrentDraw do
+  alias ExTermbox.Constants
+
+  @widgets 32
+  @hz 60
+
+  def run(seconds) do
+    {:ok, _} = ExTermbox.init(owner: self())
+    {:ok, width} = ExTermbox.width()
+    {:ok, height} = ExTermbox.height()
+
+    results =
+      for mode <- [:direct, :server] do
+        ExTermbox.clear()
+        {mode, run_mode(mode, seconds, width, height)}
+      end
+
+    ExTermbox.shutdown()
+
+    IO.puts("#{@widgets} widgets at #{@hz} Hz for #{seconds}s on a #{width}x#{height} terminal\n")
+
+    for {mode, {draw_us, frames}} <- results do
+      sorted = Enum.sort(draw_us)
+
+      IO.puts(
+        "#{String.pad_trailing(to_string(mode), 7)} " <>
+          "draw p50 #{percentile(sorted, 50)}us p99 #{percentile(sorted, 99)}us " <>
+          "max #{List.last(sorted)}us, frames/widget min #{Enum.min(frames)} " <>
+          "avg #{div(Enum.sum(frames), length(frames))} (target #{seconds * @hz})"
+      )
+    end
+  end
+
+  defp run_mode(mode, seconds, width, height) do
+    deadline = System.monotonic_time(:millisecond) + seconds * 1000
+    parent = self()
+    presenter = spawn_link(fn -> present_loop(deadline) end)
+
+    widgets =
+      for i <- 0..(@widgets - 1) do
+        spawn_link(fn ->
+          send(parent, {:done, self(), widget_loop(mode, i, width, height, deadline, 0, [])})
+        end)
+      end
+
+    results =
+      for pid <- widgets do
+        receive do
+          {:done, ^pid, result} -> result
+        end
+      end
+
+    Process.unlink(presenter)
+
+    {Enum.flat_map(results, &elem(&1, 0)), Enum.map(results, &elem(&1, 1))}
+  end
+
+  defp present_loop(deadline) do
+    if System.monotonic_time(:millisecond) < deadline do
+      ExTermbox.present()
+      Process.sleep(div(1000, @hz))
+      present_loop(deadline)
+    end
+  end
+
+  defp widget_loop(mode, i, width, height, deadline, frame, times) do
+    now = System.monotonic_time(:millisecond)
+
+    if now >= deadline do
+      {times, frame}
+    else
+      cells = widget_cells(i, frame, width, height)
+      {us, _} = :timer.tc(fn -> draw(mode, cells) end)
+      Process.sleep(max(div(1000, @hz) - div(us, 1000), 0))
+      widget_loop(mode, i, width, height, deadline, frame + 1, [us | times])
+    end
+  end
+
+  # Each widget owns every 32nd row and fills it with a moving pattern
+  defp widget_cells(i, frame, width, height) do
+    fg = Constants.color(Enum.at([:red, :green, :yellow, :blue, :magenta, :cyan], rem(i, 6)))
+
+    for y <- i..(height - 1)//@widgets, x <- 0..(width - 1) do
+      {x, y, ?a + rem(x + frame, 26), fg, Constants.color(:default)}
+    end
+  end
+
+  defp draw(:direct, cells), do: ExTermbox.set_cells(cells)
+
+  # The call waits behind the casts, so the time includes the mailbox backlog
+  # other widgets created
+  defp draw(:server, cells) do
+    Enum.each(cells, fn {x, y, ch, fg, bg} ->
+      GenServer.cast(ExTermbox.Server, {:change_cell, x, y, ch, fg, bg})
+    end)
+
+    GenServer.call(ExTermbox.Server, :width)
+  end
+
+  defp percentile([], _), do: 0
+  defp percentile(sorted, p), do: Enum.at(sorted, div((length(sorted) - 1) * p, 100))
+end
+
+seconds =
+  case System.argv() do
+    [s | _] -> String.to_integer(s)
+    [] -> 5
+  end
+
+Bench.ConcurrentDraw.run(seconds)
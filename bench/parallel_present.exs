@@ -0,0 +1,74 @@
+# Parallel present benchmark.
+#
+# Redraws every cell of the screen with a moving pattern and times present/0
+# with 1, 2, 4 and 8 present threads. Only frames of at least 65536 cells are
+# split across threads, so use a large terminal (or a tiny font) to see any
+# difference; smaller screens measure the serial path throughout.
+#
+# Run in a real terminal (the screen is taken over while it runs):
+#
+#     mix run bench/parallel_present.exs [frames]
+#
+# Results are printed after the terminal is restored.
+
+defmodule Bench.ParallelPresent do
+  alias ExTermbox.Constants
+
+  @threads [1, 2, 4, 8]
+
+  def run(frames) do
+    {:ok, _} = ExTermbox.init(owner: self())
+    {:ok, width} = ExTermbox.width()
+    {:ok, height} = ExTermbox.height()
+    ExTermbox.set_output_mode(:truecolor)
+
+    results =
+      for n <- @threads do
+        :ok = ExTermbox.set_present_threads(n)
+        {n, present_times(frames, width, height)}
+      end
+
+    ExTermbox.shutdown()
+
+    IO.puts("#{frames} full-screen frames on a #{width}x#{height} terminal\n")
+    {_, base} = hd(results)
+    base_p50 = percentile(base, 50)
+
+    for {n, times} <- results do
+      p50 = percentile(times, 50)
+
+      IO.puts(
+        "#{String.pad_leading(to_string(n), 2)} threads " <>
+          "present p50 #{p50}us p99 #{percentile(times, 99)}us " <>
+          "speedup #{Float.round(base_p50 / max(p50, 1), 2)}x"
+      )
+    end
+  end
+
+  defp present_times(frames, width, height) do
+    for frame <- 1..frames do
+      ExTermbox.set_cells(frame_cells(frame, width, height))
+      {us, :ok} = :timer.tc(&ExTermbox.present/0)
+      us
+    end
+    |> Enum.sort()
+  end
+
+  # Every cell changes every frame, in a different color per row
+  defp frame_cells(frame, width, height) do
+    for y <- 0..(height - 1), x <- 0..(width - 1) do
+      fg = rem(y * 2048 + x * 16 + frame * 64, 0xFFFFFF)
+      {x, y, ?a + rem(x + y + frame, 26), fg, Constants.color(:default)}
+    end
+  end
+
+  defp percentile(sorted, p), do: Enum.at(sorted, div((length(sorted) - 1) * p, 100))
+end
+
+frames =
+  case System.argv() do
+    [n | _] -> String.to_integer(n)
+    [] -> 100
+  end
+
+Bench.ParallelPresent.run(frames)
@@ -1,7 +1,16 @@
 #!/bin/bash
 set -uo pipefail
 
+# Partial TERM matches take the first entry whose name or alias is a substring
+# of TERM, so more specific names go first (e.g., kitty before xterm to catch
+# xterm-kitty).
 read -r -d '' builtin_terms <<'EOD'
+    alacritty
+    kitty
+    foot
+    wezterm
+    tmux-256color tmux
+    xterm-256color
     xterm
     linux
     screen        tmux
@@ -61,6 +70,8 @@ read -r -d '' extra_keys <<'EOD'
     MOUSE_RELEASE
     MOUSE_WHEEL_UP
     MOUSE_WHEEL_DOWN
+    FOCUS_IN
+    FOCUS_OUT
 EOD
 
 main() {
@@ -121,6 +132,11 @@ main() {
             term_alias=$(awk '{print $2}' <<<"$builtin_terms_tuple")
             c_term_name=$(tr -d '\n' <<<$term_name | tr -c 'A-Za-z0-9' '_' | tr 'A-Z' 'a-z')
 
+            if ! infocmp -E "$term_name" >/dev/null 2>&1; then
+                echo "$0: no terminfo entry for $term_name" >&2
+                exit 1
+            fi
+
             c_term_caps="static const char *${c_term_name}_caps[] = {"$'\n'
             for terminfo_cap_tuple in $terminfo_keys $terminfo_funcs; do
                 string_name=$(awk '{print $1}' <<<"$terminfo_cap_tuple")
@@ -34,6 +34,7 @@ SOFTWARE.
 #define _DEFAULT_SOURCE
 #endif
 
+#include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
@@ -44,11 +45,18 @@ SOFTWARE.
 #include <stdlib.h>
 #include <string.h>
 #include <sys/ioctl.h>
+#ifdef TB_OPT_PARALLEL_PRESENT
+#include <pthread.h>
+#endif
+#ifdef TB_OPT_CAP_CACHE
+#include <sys/mman.h>
+#endif
 #include <sys/select.h>
 #include <sys/stat.h>
 #include <sys/time.h>
 #include <sys/types.h>
 #include <termios.h>
+#include <time.h>
 #include <unistd.h>
 #include <wchar.h>
 
@@ -86,6 +94,32 @@ extern "C" {
  *
  *   TB_OPT_READ_BUF: Read buffer size for tty reads. Defaults to 64.
  *
+ *  TB_OPT_CAP_CACHE: If set, caps parsed from terminfo are cached under
+ *                    $XDG_CACHE_HOME/termbox2 (or ~/.cache/termbox2), keyed
+ *                    by TERM and the terminfo environment. Later tb_init calls
+ *                    mmap the cache and use it as-is, skipping terminfo path
+ *                    probing and parsing, as long as the terminfo file it was
+ *                    built from is unchanged (mtime, size, inode). Defaults
+ *                    off.
+ *
+ * TB_OPT_PREFER_BUILTIN: If set and TERMINFO is not set, a TERM that exactly
+ *                    matches one of the built-in terminals uses the compiled-in
+ *                    caps without looking for terminfo at all. Defaults off,
+ *                    i.e., built-in caps are only a fallback.
+ *
+ *      TB_OPT_PROBE: If set, tb_init asks the terminal which features it
+ *                    supports (DA1, XTVERSION and DECRQM queries) without
+ *                    waiting for the answers, which are parsed out of the
+ *                    input stream. Results are cached under the same
+ *                    directory as TB_OPT_CAP_CACHE, keyed by the terminal's
+ *                    identity, so later runs start with them. See
+ *                    tb_get_features(). Defaults off.
+ *
+ * TB_OPT_PARALLEL_PRESENT: If set, tb_present can split large frames into
+ *                    bands of rows and diff and encode them on a pool of
+ *                    threads. See tb_set_present_threads(). Requires
+ *                    pthreads. Defaults off.
+ *
  *  TB_OPT_TRUECOLOR: Deprecated. Sets TB_OPT_ATTR_W to 32 if not already set.
  */
 
@@ -192,6 +226,8 @@ extern "C" {
 #define TB_KEY_MOUSE_RELEASE    (0xffff - 26)
 #define TB_KEY_MOUSE_WHEEL_UP   (0xffff - 27)
 #define TB_KEY_MOUSE_WHEEL_DOWN (0xffff - 28)
+#define TB_KEY_FOCUS_IN         (0xffff - 29)
+#define TB_KEY_FOCUS_OUT        (0xffff - 30)
 
 #define TB_CAP_F1               0
 #define TB_CAP_F2               1
@@ -238,6 +274,8 @@ extern "C" {
 /* Some hard-coded caps */
 #define TB_HARDCAP_ENTER_MOUSE  "\x1b[?1000h\x1b[?1002h\x1b[?1015h\x1b[?1006h"
 #define TB_HARDCAP_EXIT_MOUSE   "\x1b[?1006l\x1b[?1015l\x1b[?1002l\x1b[?1000l"
+#define TB_HARDCAP_ENTER_FOCUS  "\x1b[?1004h"
+#define TB_HARDCAP_EXIT_FOCUS   "\x1b[?1004l"
 #define TB_HARDCAP_STRIKEOUT    "\x1b[9m"
 #define TB_HARDCAP_UNDERLINE_2  "\x1b[21m"
 #define TB_HARDCAP_OVERLINE     "\x1b[53m"
@@ -291,6 +329,7 @@ extern "C" {
 #define TB_EVENT_KEY        1
 #define TB_EVENT_RESIZE     2
 #define TB_EVENT_MOUSE      3
+#define TB_EVENT_FOCUS      4
 
 /* Key modifiers (bitwise) (tb_event.mod) */
 #define TB_MOD_ALT          1
@@ -303,6 +342,7 @@ extern "C" {
 #define TB_INPUT_ESC        1
 #define TB_INPUT_ALT        2
 #define TB_INPUT_MOUSE      4
+#define TB_INPUT_FOCUS      8
 
 /* Output modes (tb_set_output_mode) */
 #define TB_OUTPUT_CURRENT   0
@@ -314,6 +354,21 @@ extern "C" {
 #define TB_OUTPUT_TRUECOLOR 5
 #endif
 
+/* Present policies (tb_set_present_policy) */
+#define TB_PRESENT_ALWAYS   0
+#define TB_PRESENT_VISIBLE  1
+
+/* Terminal features (tb_get_features) */
+#define TB_FEATURE_SYNC_OUTPUT     0x0001 /* DECSET 2026, used by tb_present */
+#define TB_FEATURE_BRACKETED_PASTE 0x0002 /* DECSET 2004                    */
+#define TB_FEATURE_KITTY_KEYBOARD  0x0004 /* CSI > flags u                  */
+#define TB_FEATURE_TRUECOLOR       0x0008 /* 24-bit SGR colors              */
+#define TB_FEATURE_REP             0x0010 /* CSI n b, used by tb_present    */
+
+/* Input replay speeds (tb_set_input_replay), in percent of recorded time */
+#define TB_REPLAY_MAX_SPEED 0
+#define TB_REPLAY_REALTIME  100
+
 /* Common function return values unless otherwise noted.
  *
  * Library behavior is undefined after receiving TB_ERR_MEM. Callers may
@@ -343,6 +398,7 @@ extern "C" {
 #define TB_ERR_RESIZE_READ      -20
 #define TB_ERR_RESIZE_SSCANF    -21
 #define TB_ERR_CAP_COLLISION    -22
+#define TB_ERR_REPLAY_FORMAT    -23
 
 #define TB_ERR_SELECT           TB_ERR_POLL
 #define TB_ERR_RESIZE_SELECT    TB_ERR_RESIZE_POLL
@@ -365,6 +421,46 @@ extern "C" {
 #define TB_OPT_READ_BUF 64
 #endif
 
+/* Define this to set how many separate tty reads buffered input keeps read
+ * times for (see tb_event.ts). Reads beyond that share the time of the newest
+ * one kept.
+ */
+#ifndef TB_OPT_IN_CHUNKS
+#define TB_OPT_IN_CHUNKS 16
+#endif
+
+/* Define this to set the smallest frame, in cells, that tb_present() splits
+ * across threads (see tb_set_present_threads)
+ */
+#ifndef TB_PRESENT_PARALLEL_MIN_CELLS
+#define TB_PRESENT_PARALLEL_MIN_CELLS 65536
+#endif
+
+/* Upper bound for tb_set_present_threads() */
+#define TB_PRESENT_MAX_THREADS 64
+
+/* Define this to set how many layers can be added at once (see tb_layer_add)
+ */
+#ifndef TB_OPT_LAYERS_MAX
+#define TB_OPT_LAYERS_MAX 32
+#endif
+
+/* Define this to set how many canvases can be shown at once (see
+ * tb_canvas_show)
+ */
+#ifndef TB_OPT_CANVASES_MAX
+#define TB_OPT_CANVASES_MAX 8
+#endif
+
+/* Define this to set how deep the clip stack goes (see tb_clip_push) */
+#ifndef TB_OPT_CLIP_DEPTH
+#define TB_OPT_CLIP_DEPTH 32
+#endif
+
+/* Size of a canvas tile in cells */
+#define TB_CANVAS_TILE_W 64
+#define TB_CANVAS_TILE_H 16
+
 /* Define this for limited back compat with termbox v1 */
 #ifdef TB_OPT_V1_COMPAT
 #define tb_change_cell          tb_set_cell
@@ -433,6 +529,15 @@ struct tb_cell {
  *   when TB_EVENT_RESIZE: w, h
  *
  *    when TB_EVENT_MOUSE: key (TB_KEY_MOUSE_*), x, y
+ *
+ *    when TB_EVENT_FOCUS: key (TB_KEY_FOCUS_IN or TB_KEY_FOCUS_OUT)
+ *
+ * ts is set for every event. It is the CLOCK_MONOTONIC time, in nanoseconds,
+ * at which the input the event was decoded from was read from the tty (or at
+ * which the resize was noticed). An event spanning several reads gets the time
+ * of the read holding its first byte, so bytes left over from an earlier read
+ * keep their own time. Compare it against tb_last_present_ts() to measure
+ * latency.
  */
 struct tb_event {
     uint8_t type; /* one of TB_EVENT_* constants */
@@ -443,12 +548,20 @@ struct tb_event {
     int32_t h;    /* resize height */
     int32_t x;    /* mouse x */
     int32_t y;    /* mouse y */
+    uint64_t ts;  /* monotonic input time in nanoseconds */
 };
 
 /* Initializes the termbox library. This function should be called before any
  * other functions. tb_init() is equivalent to tb_init_file("/dev/tty"). After
  * successful initialization, the library must be finalized using the
  * tb_shutdown() function.
+ *
+ * If the terminal size cannot be read with TIOCGWINSZ (e.g., non-tty fds
+ * passed to tb_init_rwfd(), or consoles reporting 0x0), init does not wait for
+ * the terminal. It starts with a provisional TB_RESIZE_FALLBACK_W x
+ * TB_RESIZE_FALLBACK_H (80x24) size and asks the terminal for its cursor
+ * position; the reply is parsed out of the normal input and delivered as a
+ * TB_EVENT_RESIZE.
  */
 int tb_init(void);
 int tb_init_file(const char *path);
@@ -456,6 +569,24 @@ int tb_init_fd(int ttyfd);
 int tb_init_rwfd(int rfd, int wfd);
 int tb_shutdown(void);
 
+/* Moves a live session between two copies of termbox in one process, e.g.,
+ * when a shared library that embeds termbox is reloaded, without touching the
+ * terminal: no reinit, no clear and no repaint.
+ *
+ * tb_session_state() returns the old copy's internal state and its size, or
+ * NULL if it is not initialized. While the old copy is still loaded, the new
+ * copy passes that to tb_session_adopt(), which takes over the tty fds,
+ * termios, cell buffers, caps and pending input and reinstalls its own signal
+ * handlers. It returns TB_ERR if the size does not match (an incompatible
+ * build). The old copy must then call tb_session_release(), which forgets the
+ * session without restoring the terminal and leaves it uninitialized.
+ *
+ * Custom functions set with tb_set_func() are carried over as-is.
+ */
+void *tb_session_state(size_t *size);
+int tb_session_adopt(const void *state, size_t size);
+int tb_session_release(void);
+
 /* Returns the size of the internal back buffer (which is the same as terminal's
  * window size in rows and columns). The internal buffer can be resized after
  * tb_clear() or tb_present() function calls. Both dimensions have an
@@ -474,6 +605,105 @@ int tb_set_clear_attrs(uintattr_t fg, uintattr_t bg);
 /* Synchronizes the internal back buffer with the terminal by writing to tty. */
 int tb_present(void);
 
+/* Sets the present policy and returns TB_OK, or returns the current policy if
+ * policy is -1.
+ *
+ * With TB_PRESENT_ALWAYS (the default) every tb_present() writes to the tty.
+ *
+ * With TB_PRESENT_VISIBLE, tb_present() returns TB_OK without writing anything
+ * while the terminal is unfocused (requires TB_INPUT_FOCUS) or the process is
+ * suspended (SIGTSTP), so hidden UIs cost next to nothing. Once focus returns
+ * tb_present_pending() reports the skipped frame, and the next tb_present() or
+ * tb_flush_backlog() presents it.
+ *
+ * termbox's SIGTSTP and SIGCONT handlers only note the signal. The next
+ * tb_peek_event() / tb_poll_event() restores the original terminal state and
+ * stops the process; once resumed it re-enters raw mode, redraws the back
+ * buffer, and returns a TB_EVENT_RESIZE event. Threads sharing a session
+ * should hold their lock across those calls, as for any other.
+ */
+int tb_set_present_policy(int policy);
+
+/* Returns 1 if tb_present() skipped a frame (see tb_set_present_policy() and
+ * tb_set_output_backlog()) that could now be written, or 0.
+ */
+int tb_present_pending(void);
+
+/* Returns 1 if tb_present() currently skips frames because the terminal is
+ * unfocused or the process is suspended (see tb_set_present_policy()), or 0.
+ */
+int tb_present_hidden(void);
+
+/* Returns the CLOCK_MONOTONIC time, in nanoseconds, at which the last
+ * tb_present() finished writing to the tty, or 0 if nothing was presented yet.
+ * Uses the same clock as tb_event.ts. With an output backlog (see
+ * tb_set_output_backlog()) a frame is only finished once the backlog holding
+ * it has drained, which may be a later tb_flush_backlog() call.
+ */
+uint64_t tb_last_present_ts(void);
+
+/* Sets the number of threads tb_present() uses to diff and encode the back
+ * buffer and returns TB_OK, or returns the current number if n is -1.
+ *
+ * With n > 1 (requires TB_OPT_PARALLEL_PRESENT), frames of at least
+ * TB_PRESENT_PARALLEL_MIN_CELLS cells are split into up to n bands of rows.
+ * The calling thread encodes the first band and n - 1 worker threads, started
+ * on the next tb_present(), encode the others into private buffers, which are
+ * then written in row order. Each band begins with an explicit cursor move
+ * and SGR reset, so the output is equivalent to a serial present. Smaller
+ * frames are always presented serially. Defaults to 1.
+ */
+int tb_set_present_threads(int n);
+
+/* Sets the output backlog limit in bytes and returns TB_OK, or returns the
+ * current limit if max is -1.
+ *
+ * With 0 (the default) writes to the tty block until the tty has taken
+ * everything. With max > 0 they never block: whatever the tty does not take
+ * right away is kept in a backlog, in order, ahead of any later output. While
+ * the backlog holds more than max bytes, tb_present() skips frames (returning
+ * TB_OK) so a slow tty gets one up-to-date frame once it catches up rather
+ * than every frame in between. Call tb_flush_backlog() when the tty becomes
+ * writable to drain it. Setting 0 writes out a pending backlog first.
+ */
+int tb_set_output_backlog(int max);
+
+/* Writes as much of the output backlog as the tty takes without blocking and
+ * returns the number of bytes still pending, or a negative error. Once the
+ * backlog is back under its limit, a frame tb_present() skipped because of it
+ * is presented. Poll the tty fd from tb_get_fds() for writability to know
+ * when to call it.
+ */
+int tb_flush_backlog(void);
+
+/* Returns the number of bytes in the output backlog. */
+int tb_backlog_len(void);
+
+/* Stores the number of bytes produced for the tty since tb_init() in total,
+ * and how many of them the tty has taken in written. Their difference is the
+ * output backlog. A frame has reached the tty once written catches up with
+ * the total read right after the tb_present() that produced it.
+ */
+int tb_output_counts(uint64_t *total, uint64_t *written);
+
+/* Returns the TB_FEATURE_* bits known for the terminal. With TB_OPT_PROBE,
+ * tb_init starts from the bits cached for this terminal on an earlier run and
+ * sends DA1, XTVERSION and DECRQM queries; the replies are consumed by
+ * tb_peek_event() / tb_poll_event() (they never surface as events) and
+ * replace the bits once the terminal answers DA1. Without TB_OPT_PROBE only
+ * COLORTERM is consulted.
+ *
+ * tb_present() wraps frames in synchronized output (TB_FEATURE_SYNC_OUTPUT)
+ * and repeats runs of identical cells with REP (TB_FEATURE_REP) when the
+ * terminal supports them. The other bits are informational.
+ */
+int tb_get_features(void);
+
+/* Returns the terminal's XTVERSION reply (e.g., "XTerm(390)"), or an empty
+ * string if it has not answered (yet).
+ */
+const char *tb_get_term_version(void);
+
 /* Clears the internal front buffer effectively forcing a complete re-render of
  * the back buffer to the tty. It is not necessary to call this under normal
  * circumstances. */
@@ -499,6 +729,14 @@ int tb_set_cell_ex(int x, int y, uint32_t *ch, size_t nch, uintattr_t fg,
     uintattr_t bg);
 int tb_extend_cell(int x, int y, uint32_t ch);
 
+/* Retrieves the cell at x,y of the back buffer (back 1) or of the front
+ * buffer, i.e. what the last tb_present() sent (back 0). The pointer is into
+ * the buffer and only valid until it is next drawn into, presented or
+ * resized. Returns TB_ERR_OUT_OF_BOUNDS outside the screen. The clip stack
+ * does not apply.
+ */
+int tb_get_cell(int x, int y, int back, struct tb_cell **cell);
+
 /* Sets the input mode. Termbox has two input modes:
  *
  * 1. TB_INPUT_ESC
@@ -511,6 +749,8 @@ int tb_extend_cell(int x, int y, uint32_t ch);
  *
  * You can also apply TB_INPUT_MOUSE via bitwise OR operation to either of the
  * modes (e.g., TB_INPUT_ESC | TB_INPUT_MOUSE) to receive TB_EVENT_MOUSE events.
+ * Likewise, TB_INPUT_FOCUS enables focus reporting (CSI ? 1004 h) so that
+ * TB_EVENT_FOCUS events are returned when the terminal gains or loses focus.
  * If none of the main two modes were set, but the mouse mode was, TB_INPUT_ESC
  * mode is used. If for some reason you've decided to use
  * (TB_INPUT_ESC | TB_INPUT_ALT) combination, it will behave as if only
@@ -631,9 +871,56 @@ int tb_poll_event(struct tb_event *event);
  * tb_poll_event() / tb_peek_event() if activity is detected. */
 int tb_get_fds(int *ttyfd, int *resizefd);
 
+/* Replays recorded input instead of reading the tty. While records remain,
+ * tb_peek_event() / tb_poll_event() parse events from the recording at path
+ * and never read the tty; once it runs out they return TB_ERR_NO_EVENT once
+ * and then go back to the tty. Pass a NULL path to stop a replay early.
+ *
+ * Two recording formats are understood:
+ *
+ *   - termbox input records, as written by tb_set_input_record(): the magic
+ *     "tbinput1", then per record a little-endian uint32 delay in
+ *     microseconds since the previous record, a little-endian uint32 length
+ *     and that many bytes of raw input. If the top bit of the length is set
+ *     the payload is instead a resize: little-endian uint16 width and height.
+ *   - asciicast v2 or v3 (asciinema rec --stdin). "i" events are replayed as
+ *     input and "r" events as resizes; all other events are ignored. A size in
+ *     the header is applied up front as a resize.
+ *
+ * A recording holding a resize below 1x1 or above 4096 cells a side is
+ * rejected with TB_ERR_REPLAY_FORMAT.
+ *
+ * speed is a percentage of recorded time: TB_REPLAY_REALTIME (100) keeps the
+ * recorded gaps, 200 halves them, and TB_REPLAY_MAX_SPEED (0) hands out input
+ * as fast as events are consumed. Replayed events are timestamped when they
+ * are handed out, like live input.
+ */
+int tb_set_input_replay(const char *path, int speed);
+
+/* Returns the number of records the active replay has yet to hand out (0 once
+ * it has finished), or -1 if no replay was started.
+ */
+int tb_input_replay_remaining(void);
+
+/* Returns the CLOCK_MONOTONIC time, in nanoseconds, at which the active
+ * replay's next record is due, or 0 once no record remains. Uses the same
+ * clock as tb_event.ts. A caller that must not block inside tb_peek_event()
+ * can sleep until then and peek with a zero timeout.
+ */
+uint64_t tb_input_replay_due(void);
+
+/* Writes all input read from the tty from now on, with its timing and any
+ * resizes, to path in the termbox input record format described above. Pass a
+ * NULL path to stop recording. Write errors while recording are ignored.
+ */
+int tb_set_input_record(const char *path);
+
 /* Print and printf functions. Specify param out_w to determine width of printed
  * string. Incomplete trailing UTF-8 byte sequences are replaced with U+FFFD.
- * For finer control, use tb_set_cell().
+ * Characters that fall outside the back buffer (or the clip rectangle, see
+ * tb_clip_push) are skipped and the rest of the string is still laid out; the
+ * functions then return TB_ERR_OUT_OF_BOUNDS. For finer control, use
+ * tb_set_cell().
  */
 int tb_print(int x, int y, uintattr_t fg, uintattr_t bg, const char *str);
 int tb_printf(int x, int y, uintattr_t fg, uintattr_t bg, const char *fmt, ...);
@@ -642,6 +929,180 @@ int tb_print_ex(int x, int y, uintattr_t fg, uintattr_t bg, size_t *out_w,
 int tb_printf_ex(int x, int y, uintattr_t fg, uintattr_t bg, size_t *out_w,
     const char *fmt, ...);
 
+/* Clip-and-translate stack for drawing into the back buffer, so widget code
+ * can draw in its own coordinates without checking bounds.
+ *
+ * tb_clip_push() moves the origin to x,y (in current coordinates) and limits
+ * drawing to the w x h rectangle there, intersected with the current clip
+ * rectangle. tb_set_cell(), tb_set_cell_ex(), tb_extend_cell(), the print
+ * functions and the destination of tb_blit() then take coordinates relative
+ * to the origin, and never write outside the clip rectangle: a cell outside
+ * it is rejected with TB_ERR_OUT_OF_BOUNDS, as one outside the screen is.
+ * tb_clip_pop() restores the previous origin and clip rectangle.
+ *
+ * tb_clip_push() returns TB_ERR if w or h is negative or TB_OPT_CLIP_DEPTH
+ * rectangles are pushed already; tb_clip_pop() returns TB_ERR if none are.
+ * tb_clip_origin() stores the current origin (in screen coordinates) in x and
+ * y and returns the depth of the stack. tb_clear(), tb_set_cursor() and
+ * tb_cell_buffer() are not affected. tb_shutdown() empties the stack.
+ *
+ * The stack is shared by everything drawing into the back buffer. Callers
+ * that draw concurrently, each in its own rectangle, keep their own struct
+ * tb_clip instead and pass it to the *_clip variants of the drawing
+ * functions (tb_set_cell_clip(), tb_print_clip(), tb_blit_clip(),
+ * tb_blend_rect_clip(), tb_surface_blend_clip()), which behave like the
+ * plain ones with c in place of the top of the stack and never read or
+ * change the stack. A NULL c means no clip and no translation.
+ * tb_clip_make() computes into c what tb_clip_push() would push on top of
+ * parent (NULL for the whole screen); it needs no tb_init().
+ */
+struct tb_clip {
+    int x0, y0, x1, y1; // clip rectangle in screen coordinates, x1/y1 exclusive
+    int ox, oy;         // origin in screen coordinates
+};
+
+int tb_clip_push(int x, int y, int w, int h);
+int tb_clip_pop(void);
+int tb_clip_origin(int *x, int *y);
+int tb_clip_make(struct tb_clip *c, const struct tb_clip *parent, int x,
+    int y, int w, int h);
+int tb_set_cell_clip(const struct tb_clip *c, int x, int y, uint32_t ch,
+    uintattr_t fg, uintattr_t bg);
+int tb_print_clip(const struct tb_clip *c, int x, int y, uintattr_t fg,
+    uintattr_t bg, size_t *out_w, const char *str);
+
+/* Offscreen surfaces: cell buffers of any size, independent of the screen and
+ * usable without tb_init(). Draw into them with the tb_surface_* functions,
+ * which behave like their back buffer counterparts, and copy them onto the
+ * back buffer with tb_blit(). Something drawn rarely but shown every frame
+ * can then be drawn once and blitted.
+ *
+ * tb_surface_new() returns NULL if out of memory. A new surface is filled
+ * with spaces in TB_DEFAULT colors.
+ *
+ * tb_surface_fill() sets every cell of the w x h rectangle at x,y, clipped to
+ * the surface.
+ *
+ * tb_blit() copies the w x h rectangle at sx,sy of the surface to dx,dy in
+ * the back buffer. Both sides are clipped, so any part of the rectangle that
+ * is outside the surface or the screen is skipped.
+ */
+struct tb_surface;
+struct tb_surface *tb_surface_new(int w, int h);
+void tb_surface_free(struct tb_surface *s);
+int tb_surface_width(struct tb_surface *s);
+int tb_surface_height(struct tb_surface *s);
+int tb_surface_set_cell(struct tb_surface *s, int x, int y, uint32_t ch,
+    uintattr_t fg, uintattr_t bg);
+int tb_surface_print(struct tb_surface *s, int x, int y, uintattr_t fg,
+    uintattr_t bg, size_t *out_w, const char *str);
+int tb_surface_fill(struct tb_surface *s, int x, int y, int w, int h,
+    uint32_t ch, uintattr_t fg, uintattr_t bg);
+int tb_blit(struct tb_surface *s, int sx, int sy, int w, int h, int dx,
+    int dy);
+int tb_blit_clip(const struct tb_clip *c, struct tb_surface *s, int sx,
+    int sy, int w, int h, int dx, int dy);
+
+/* Layers: surfaces that tb_present() composites over the back buffer without
+ * changing it. Popups, tooltips and modals drawn as layers can be shown,
+ * hidden and moved without redrawing what is under them; the next present
+ * writes out only the cells that changed.
+ *
+ * tb_layer_add() puts surface s at x,y with z-order z and returns the layer's
+ * id (>= 0), or TB_ERR if TB_OPT_LAYERS_MAX layers are in use. Higher z is
+ * drawn on top; layers of equal z are drawn in the order they were added. A
+ * new layer is visible. Surface cells with ch 0 are transparent and show
+ * whatever is under them. The surface must outlive the layer.
+ *
+ * tb_layer_move() changes a layer's position and z-order, tb_layer_show()
+ * shows it (visible != 0) or hides it, and tb_layer_remove() removes it.
+ * tb_layer_surface() returns a layer's surface, or NULL if there is no such
+ * layer. Layers are removed by tb_shutdown().
+ */
+int tb_layer_add(struct tb_surface *s, int x, int y, int z);
+int tb_layer_move(int id, int x, int y, int z);
+int tb_layer_show(int id, int visible);
+int tb_layer_remove(int id);
+struct tb_surface *tb_layer_surface(int id);
+
+/* Canvases: cell areas much larger than the screen, of which a viewport is
+ * shown in a rectangle of the screen. Cells are stored in TB_CANVAS_TILE_W x
+ * TB_CANVAS_TILE_H tiles that are only allocated once something is drawn in
+ * them, so blank areas cost nothing. Like surfaces, canvases are usable
+ * without tb_init() and are drawn with the tb_canvas_* functions; blank cells
+ * are spaces in TB_DEFAULT colors.
+ *
+ * tb_canvas_new() returns NULL if out of memory. tb_canvas_fill() allocates
+ * every tile the rectangle touches. tb_canvas_tiles() returns the number of
+ * allocated tiles.
+ *
+ * tb_canvas_show() shows the canvas in the w x h rectangle at x,y of the
+ * screen, or moves it there if it is already shown; it returns TB_ERR if
+ * TB_OPT_CANVASES_MAX canvases are shown. Every tb_present() draws the
+ * viewport into that rectangle of the back buffer, over whatever was drawn
+ * there, before compositing layers. tb_canvas_hide() stops showing it. A
+ * shown canvas must not be freed.
+ *
+ * tb_canvas_scroll_to() moves the viewport so that canvas cell vx,vy is at
+ * the top left of the rectangle; parts of the viewport outside the canvas are
+ * blank. When the rectangle spans the whole width of the screen and only vy
+ * changed, by less than the rectangle's height, tb_present() scrolls those
+ * rows on the terminal itself (with a scroll region) and only writes the rows
+ * that scrolled in.
+ */
+struct tb_canvas;
+struct tb_canvas *tb_canvas_new(int w, int h);
+void tb_canvas_free(struct tb_canvas *c);
+int tb_canvas_width(struct tb_canvas *c);
+int tb_canvas_height(struct tb_canvas *c);
+int tb_canvas_tiles(struct tb_canvas *c);
+int tb_canvas_set_cell(struct tb_canvas *c, int x, int y, uint32_t ch,
+    uintattr_t fg, uintattr_t bg);
+int tb_canvas_print(struct tb_canvas *c, int x, int y, uintattr_t fg,
+    uintattr_t bg, size_t *out_w, const char *str);
+int tb_canvas_fill(struct tb_canvas *c, int x, int y, int w, int h,
+    uint32_t ch, uintattr_t fg, uintattr_t bg);
+int tb_canvas_show(struct tb_canvas *c, int x, int y, int w, int h);
+int tb_canvas_hide(struct tb_canvas *c);
+int tb_canvas_scroll_to(struct tb_canvas *c, int vx, int vy);
+
+/* Alpha blending of truecolor cells (TB_OPT_ATTR_W 32 or 64 only; TB_ERR
+ * otherwise). Colors are blended as 0xRRGGBB values; TB_HI_BLACK counts as
+ * black, and a TB_DEFAULT color as the RGB value set for it with
+ * tb_set_blend_defaults() (0xffffff fg and 0x000000 bg unless set). Blended
+ * colors keep their style attributes. Rows are blended with both red and blue
+ * channels in one multiply, so dimming the whole screen every frame is cheap.
+ *
+ * tb_blend_rect() blends the rgba color 0xRRGGBBAA over the fg and/or bg
+ * (flags TB_BLEND_FG, TB_BLEND_BG) of every cell in the w x h rectangle at
+ * x,y of the back buffer, leaving characters alone: a translucent black over
+ * TB_BLEND_FG | TB_BLEND_BG dims what is behind a dialog. Alpha 0xff replaces
+ * the colors outright and alpha 0 changes nothing, not even default colors.
+ * Requires TB_OUTPUT_TRUECOLOR.
+ *
+ * tb_surface_blend() composites the w x h rectangle at sx,sy of src over dx,dy
+ * of dst with opacity alpha (0 to 255), clipped like tb_blit(); a NULL dst is
+ * the back buffer (which requires TB_OUTPUT_TRUECOLOR). Source cells with ch 0
+ * are transparent. Each bg is mixed toward the source bg. A source space keeps
+ * the destination character and tints its fg toward the source bg, like
+ * tinted glass; any other character replaces it and fades in from the
+ * destination bg to its own fg. Alpha 0 leaves dst as it was. dst and src
+ * must differ.
+ *
+ * Both go through the clip stack when drawing into the back buffer.
+ */
+#define TB_BLEND_FG 1
+#define TB_BLEND_BG 2
+int tb_blend_rect(int x, int y, int w, int h, uint32_t rgba, int flags);
+int tb_surface_blend(struct tb_surface *dst, struct tb_surface *src, int sx,
+    int sy, int w, int h, int dx, int dy, uint8_t alpha);
+int tb_blend_rect_clip(const struct tb_clip *c, int x, int y, int w, int h,
+    uint32_t rgba, int flags);
+int tb_surface_blend_clip(const struct tb_clip *c, struct tb_surface *dst,
+    struct tb_surface *src, int sx, int sy, int w, int h, int dx, int dy,
+    uint8_t alpha);
+int tb_set_blend_defaults(uint32_t fg, uint32_t bg);
+
 /* Send raw bytes to terminal. */
 int tb_send(const char *buf, size_t nbuf);
 int tb_sendf(const char *fmt, ...);
@@ -706,12 +1167,12 @@ const char *tb_version(void);
 #define if_ok_or_need_more_return(rv, expr)                                    \
     if (((rv) = (expr)) == TB_OK || (rv) == TB_ERR_NEED_MORE) return (rv)
 
-#define send_literal(rv, a)                                                    \
-    if_err_return((rv), bytebuf_nputs(&global.out, (a), sizeof(a) - 1))
+#define send_literal(rv, e, a)                                                 \
+    if_err_return((rv), bytebuf_nputs(&(e)->out, (a), sizeof(a) - 1))
 
-#define send_num(rv, nbuf, n)                                                  \
+#define send_num(rv, e, nbuf, n)                                               \
     if_err_return((rv),                                                        \
-        bytebuf_nputs(&global.out, (nbuf), convert_num((n), (nbuf))))
+        bytebuf_nputs(&(e)->out, (nbuf), convert_num((n), (nbuf))))
 
 #define snprintf_or_return(rv, str, sz, fmt, ...)                              \
     do {                                                                       \
@@ -722,18 +1183,80 @@ const char *tb_version(void);
 #define if_not_init_return()                                                   \
     if (!global.initialized) return TB_ERR_NOT_INIT
 
+#define TB_REPLAY_MAGIC      "tbinput1"
+#define TB_CAP_CACHE_MAGIC   "tbcaps01"
+#define TB_PROBE_CACHE_MAGIC "tbprob01"
+#define TB_REPLAY_RESIZE_BIT 0x80000000u
+#define TB_REPLAY_MAX_SIZE   4096 // widest or tallest replayed resize
+
 struct bytebuf_t {
     char *buf;
     size_t len;
     size_t cap;
 };
 
+// Bytes of global.in before end that were read at ts (and after the previous
+// chunk's end)
+struct tb_in_chunk_t {
+    size_t end;
+    uint64_t ts;
+};
+
+// Output buffer plus the cursor position and attributes the terminal is
+// assumed to have once it is written
+struct tb_enc_t {
+    struct bytebuf_t out;
+    int last_x;
+    int last_y;
+    uintattr_t last_fg;
+    uintattr_t last_bg;
+};
+
 struct cellbuf_t {
     int width;
     int height;
     struct tb_cell *cells;
 };
 
+struct tb_surface {
+    struct cellbuf_t buf;
+};
+
+struct tb_layer_t {
+    struct tb_surface *surface; // NULL for an unused slot
+    int x;
+    int y;
+    int z;
+    int visible;
+    uint64_t seq; // order of addition, breaks z ties
+};
+
+// A back buffer cell a layer covers during tb_present()
+struct tb_layer_saved_t {
+    int idx;
+    struct tb_cell cell;
+};
+
+struct tb_canvas_tile_t {
+    uint64_t key; // ty << 32 | tx
+    struct tb_cell *cells; // NULL for an unused slot
+};
+
+struct tb_canvas {
+    int width;
+    int height;
+    struct tb_canvas_tile_t *tiles; // open addressing, power of two slots
+    size_t ntiles;
+    size_t ctiles;
+    int x, y, w, h; // screen rectangle, while shown
+    int vx, vy; // viewport
+    int shown_vx, shown_vy; // viewport of the last present
+    int presented; // shown_vx and shown_vy are valid
+};
+
+// Finds (or, with create, allocates) the cell at x,y of a drawing target
+typedef int (*cell_at_fn)(void *target, int x, int y, struct tb_cell **out);
+
 struct cap_trie_t {
     char c;
     struct cap_trie_t *children;
@@ -743,6 +1266,40 @@ struct cap_trie_t {
     uint8_t mod;
 };
 
+struct tb_replay_rec_t {
+    uint64_t at_ns;
+    size_t off;
+    size_t len;
+    int w;
+    int h;
+};
+
+#ifdef TB_OPT_CAP_CACHE
+struct tb_cap_cache_t {
+    char magic[8];
+    uint32_t ncaps;
+    uint32_t nkey;
+    uint32_t npath;
+    uint32_t nstrs;
+    int64_t src_mtime;
+    int64_t src_size;
+    uint64_t src_ino;
+    uint32_t cap_offs[TB_CAP__COUNT];
+    // Followed by nkey bytes of key, npath bytes of terminfo path and nstrs
+    // bytes of NUL-terminated caps
+};
+#endif
+
+#ifdef TB_OPT_PROBE
+struct tb_probe_cache_t {
+    char magic[8];
+    uint32_t nkey;
+    uint32_t features;
+    char term_version[128];
+    // Followed by nkey bytes of key
+};
+#endif
+
 struct tb_global_t {
     int ttyfd;
     int rfd;
@@ -753,12 +1310,8 @@ struct tb_global_t {
     int height;
     int cursor_x;
     int cursor_y;
-    int last_x;
-    int last_y;
     uintattr_t fg;
     uintattr_t bg;
-    uintattr_t last_fg;
-    uintattr_t last_bg;
     int input_mode;
     int output_mode;
     char *terminfo;
@@ -766,13 +1319,61 @@ struct tb_global_t {
     const char *caps[TB_CAP__COUNT];
     struct cap_trie_t cap_trie;
     struct bytebuf_t in;
-    struct bytebuf_t out;
+    struct tb_enc_t enc;
     struct cellbuf_t back;
     struct cellbuf_t front;
     struct termios orig_tios;
+    struct termios raw_tios;
     int has_orig_tios;
     int last_errno;
     int initialized;
+    struct tb_in_chunk_t in_chunks[TB_OPT_IN_CHUNKS];
+    int nin_chunks;
+    uint64_t last_present_ts;
+    int present_unwritten;
+    int present_policy;
+    int present_deferred;
+    int present_threads;
+    struct bytebuf_t backlog;
+    int max_backlog;
+    uint64_t out_written;
+    struct tb_layer_t layers[TB_OPT_LAYERS_MAX];
+    uint64_t layer_seq;
+    struct tb_layer_saved_t *layer_saved;
+    size_t nlayer_saved;
+    size_t clayer_saved;
+    struct tb_canvas *canvases[TB_OPT_CANVASES_MAX];
+    struct tb_clip clips[TB_OPT_CLIP_DEPTH];
+    int nclips;
+    int blend_defaults_set;
+    uint32_t blend_fg;
+    uint32_t blend_bg;
+    int unfocused;
+    int suspended;
+    struct tb_replay_rec_t *replay;
+    size_t nreplay;
+    size_t replay_pos;
+    struct bytebuf_t replay_bytes;
+    uint64_t replay_start_ts;
+    int replay_speed;
+    int replay_in; // global.in holds replayed bytes
+    int recordfd;
+    uint64_t last_record_ts;
+    uint64_t size_probe_ts;
+    char *caps_owned;
+    int features;
+    char term_version[128];
+#ifdef TB_OPT_PROBE
+    uint64_t probe_ts;
+    int probe_features;
+    char probe_version[128];
+#endif
+#ifdef TB_OPT_CAP_CACHE
+    void *cap_cache;
+    size_t ncap_cache;
+    char terminfo_path[TB_PATH_MAX];
+    struct stat terminfo_st;
+#endif
     int (*fn_extract_esc_pre)(struct tb_event *, size_t *);
     int (*fn_extract_esc_post)(struct tb_event *, size_t *);
     char errbuf[1024];
@@ -781,7 +1382,7 @@ struct tb_global_t {
 static struct tb_global_t global = {0};
 
 /* BEGIN codegen c */
-/* Produced by ./codegen.sh on Thu, 13 Jul 2023 05:46:13 +0000 */
+/* Produced by ./codegen.sh on Sat, 17 Oct 2026 16:07:37 +0000 */
 
 static const int16_t terminfo_cap_indexes[] = {
     66,  // kf1 (TB_CAP_F1)
@@ -824,8 +1425,8 @@ static const int16_t terminfo_cap_indexes[] = {
     32,  // invis (TB_CAP_INVISIBLE)
 };
 
-// xterm
-static const char *xterm_caps[] = {
+// alacritty
+static const char *alacritty_caps[] = {
     "\033OP",                  // kf1 (TB_CAP_F1)
     "\033OQ",                  // kf2 (TB_CAP_F2)
     "\033OR",                  // kf3 (TB_CAP_F3)
@@ -866,13 +1467,139 @@ static const char *xterm_caps[] = {
     "\033[8m",                 // invis (TB_CAP_INVISIBLE)
 };
 
-// linux
-static const char *linux_caps[] = {
-    "\033[[A",           // kf1 (TB_CAP_F1)
-    "\033[[B",           // kf2 (TB_CAP_F2)
-    "\033[[C",           // kf3 (TB_CAP_F3)
-    "\033[[D",           // kf4 (TB_CAP_F4)
-    "\033[[E",           // kf5 (TB_CAP_F5)
+// kitty
+static const char *kitty_caps[] = {
+    "\033OP",             // kf1 (TB_CAP_F1)
+    "\033OQ",             // kf2 (TB_CAP_F2)
+    "\033OR",             // kf3 (TB_CAP_F3)
+    "\033OS",             // kf4 (TB_CAP_F4)
+    "\033[15~",           // kf5 (TB_CAP_F5)
+    "\033[17~",           // kf6 (TB_CAP_F6)
+    "\033[18~",           // kf7 (TB_CAP_F7)
+    "\033[19~",           // kf8 (TB_CAP_F8)
+    "\033[20~",           // kf9 (TB_CAP_F9)
+    "\033[21~",           // kf10 (TB_CAP_F10)
+    "\033[23~",           // kf11 (TB_CAP_F11)
+    "\033[24~",           // kf12 (TB_CAP_F12)
+    "\033[2~",            // kich1 (TB_CAP_INSERT)
+    "\033[3~",            // kdch1 (TB_CAP_DELETE)
+    "\033OH",             // khome (TB_CAP_HOME)
+    "\033OF",             // kend (TB_CAP_END)
+    "\033[5~",            // kpp (TB_CAP_PGUP)
+    "\033[6~",            // knp (TB_CAP_PGDN)
+    "\033OA",             // kcuu1 (TB_CAP_ARROW_UP)
+    "\033OB",             // kcud1 (TB_CAP_ARROW_DOWN)
+    "\033OD",             // kcub1 (TB_CAP_ARROW_LEFT)
+    "\033OC",             // kcuf1 (TB_CAP_ARROW_RIGHT)
+    "\033[Z",             // kcbt (TB_CAP_BACK_TAB)
+    "\033[?1049h",        // smcup (TB_CAP_ENTER_CA)
+    "\033[?1049l",        // rmcup (TB_CAP_EXIT_CA)
+    "\033[?12l\033[?25h", // cnorm (TB_CAP_SHOW_CURSOR)
+    "\033[?25l",          // civis (TB_CAP_HIDE_CURSOR)
+    "\033[H\033[2J",      // clear (TB_CAP_CLEAR_SCREEN)
+    "\033(B\033[m",       // sgr0 (TB_CAP_SGR0)
+    "\033[4m",            // smul (TB_CAP_UNDERLINE)
+    "\033[1m",            // bold (TB_CAP_BOLD)
+    "",                   // blink (TB_CAP_BLINK)
+    "\033[3m",            // sitm (TB_CAP_ITALIC)
+    "\033[7m",            // rev (TB_CAP_REVERSE)
+    "\033[?1h",           // smkx (TB_CAP_ENTER_KEYPAD)
+    "\033[?1l",           // rmkx (TB_CAP_EXIT_KEYPAD)
+    "\033[2m",            // dim (TB_CAP_DIM)
+    "",                   // invis (TB_CAP_INVISIBLE)
+};
+
+// foot
+static const char *foot_caps[] = {
+    "\033OP",                  // kf1 (TB_CAP_F1)
+    "\033OQ",                  // kf2 (TB_CAP_F2)
+    "\033OR",                  // kf3 (TB_CAP_F3)
+    "\033OS",                  // kf4 (TB_CAP_F4)
+    "\033[15~",                // kf5 (TB_CAP_F5)
+    "\033[17~",                // kf6 (TB_CAP_F6)
+    "\033[18~",                // kf7 (TB_CAP_F7)
+    "\033[19~",                // kf8 (TB_CAP_F8)
+    "\033[20~",                // kf9 (TB_CAP_F9)
+    "\033[21~",                // kf10 (TB_CAP_F10)
+    "\033[23~",                // kf11 (TB_CAP_F11)
+    "\033[24~",                // kf12 (TB_CAP_F12)
+    "\033[2~",                 // kich1 (TB_CAP_INSERT)
+    "\033[3~",                 // kdch1 (TB_CAP_DELETE)
+    "\033OH",                  // khome (TB_CAP_HOME)
+    "\033OF",                  // kend (TB_CAP_END)
+    "\033[5~",                 // kpp (TB_CAP_PGUP)
+    "\033[6~",                 // knp (TB_CAP_PGDN)
+    "\033OA",                  // kcuu1 (TB_CAP_ARROW_UP)
+    "\033OB",                  // kcud1 (TB_CAP_ARROW_DOWN)
+    "\033OD",                  // kcub1 (TB_CAP_ARROW_LEFT)
+    "\033OC",                  // kcuf1 (TB_CAP_ARROW_RIGHT)
+    "\033[Z",                  // kcbt (TB_CAP_BACK_TAB)
+    "\033[?1049h\033[22;0;0t", // smcup (TB_CAP_ENTER_CA)
+    "\033[?1049l\033[23;0;0t", // rmcup (TB_CAP_EXIT_CA)
+    "\033[?12l\033[?25h",      // cnorm (TB_CAP_SHOW_CURSOR)
+    "\033[?25l",               // civis (TB_CAP_HIDE_CURSOR)
+    "\033[H\033[2J",           // clear (TB_CAP_CLEAR_SCREEN)
+    "\033(B\033[m",            // sgr0 (TB_CAP_SGR0)
+    "\033[4m",                 // smul (TB_CAP_UNDERLINE)
+    "\033[1m",                 // bold (TB_CAP_BOLD)
+    "\033[5m",                 // blink (TB_CAP_BLINK)
+    "\033[3m",                 // sitm (TB_CAP_ITALIC)
+    "\033[7m",                 // rev (TB_CAP_REVERSE)
+    "\033[?1h\033=",           // smkx (TB_CAP_ENTER_KEYPAD)
+    "\033[?1l\033>",           // rmkx (TB_CAP_EXIT_KEYPAD)
+    "\033[2m",                 // dim (TB_CAP_DIM)
+    "\033[8m",                 // invis (TB_CAP_INVISIBLE)
+};
+
+// wezterm
+static const char *wezterm_caps[] = {
+    "\033OP",                  // kf1 (TB_CAP_F1)
+    "\033OQ",                  // kf2 (TB_CAP_F2)
+    "\033OR",                  // kf3 (TB_CAP_F3)
+    "\033OS",                  // kf4 (TB_CAP_F4)
+    "\033[15~",                // kf5 (TB_CAP_F5)
+    "\033[17~",                // kf6 (TB_CAP_F6)
+    "\033[18~",                // kf7 (TB_CAP_F7)
+    "\033[19~",                // kf8 (TB_CAP_F8)
+    "\033[20~",                // kf9 (TB_CAP_F9)
+    "\033[21~",                // kf10 (TB_CAP_F10)
+    "\033[23~",                // kf11 (TB_CAP_F11)
+    "\033[24~",                // kf12 (TB_CAP_F12)
+    "\033[2~",                 // kich1 (TB_CAP_INSERT)
+    "\033[3~",                 // kdch1 (TB_CAP_DELETE)
+    "\033OH",                  // khome (TB_CAP_HOME)
+    "\033OF",                  // kend (TB_CAP_END)
+    "\033[5~",                 // kpp (TB_CAP_PGUP)
+    "\033[6~",                 // knp (TB_CAP_PGDN)
+    "\033OA",                  // kcuu1 (TB_CAP_ARROW_UP)
+    "\033OB",                  // kcud1 (TB_CAP_ARROW_DOWN)
+    "\033OD",                  // kcub1 (TB_CAP_ARROW_LEFT)
+    "\033OC",                  // kcuf1 (TB_CAP_ARROW_RIGHT)
+    "\033[Z",                  // kcbt (TB_CAP_BACK_TAB)
+    "\033[?1049h\033[22;0;0t", // smcup (TB_CAP_ENTER_CA)
+    "\033[?1049l\033[23;0;0t", // rmcup (TB_CAP_EXIT_CA)
+    "\033[?12l\033[?25h",      // cnorm (TB_CAP_SHOW_CURSOR)
+    "\033[?25l",               // civis (TB_CAP_HIDE_CURSOR)
+    "\033[H\033[2J",           // clear (TB_CAP_CLEAR_SCREEN)
+    "\033(B\033[m",            // sgr0 (TB_CAP_SGR0)
+    "\033[4m",                 // smul (TB_CAP_UNDERLINE)
+    "\033[1m",                 // bold (TB_CAP_BOLD)
+    "\033[5m",                 // blink (TB_CAP_BLINK)
+    "\033[3m",                 // sitm (TB_CAP_ITALIC)
+    "\033[7m",                 // rev (TB_CAP_REVERSE)
+    "\033[?1h",                // smkx (TB_CAP_ENTER_KEYPAD)
+    "\033[?1l",                // rmkx (TB_CAP_EXIT_KEYPAD)
+    "\033[2m",                 // dim (TB_CAP_DIM)
+    "\033[8m",                 // invis (TB_CAP_INVISIBLE)
+};
+
+// tmux-256color
+static const char *tmux_256color_caps[] = {
+    "\033OP",            // kf1 (TB_CAP_F1)
+    "\033OQ",            // kf2 (TB_CAP_F2)
+    "\033OR",            // kf3 (TB_CAP_F3)
+    "\033OS",            // kf4 (TB_CAP_F4)
+    "\033[15~",          // kf5 (TB_CAP_F5)
     "\033[17~",          // kf6 (TB_CAP_F6)
     "\033[18~",          // kf7 (TB_CAP_F7)
     "\033[19~",          // kf8 (TB_CAP_F8)
@@ -886,9 +1613,135 @@ static const char *linux_caps[] = {
     "\033[4~",           // kend (TB_CAP_END)
     "\033[5~",           // kpp (TB_CAP_PGUP)
     "\033[6~",           // knp (TB_CAP_PGDN)
-    "\033[A",            // kcuu1 (TB_CAP_ARROW_UP)
-    "\033[B",            // kcud1 (TB_CAP_ARROW_DOWN)
-    "\033[D",            // kcub1 (TB_CAP_ARROW_LEFT)
+    "\033OA",            // kcuu1 (TB_CAP_ARROW_UP)
+    "\033OB",            // kcud1 (TB_CAP_ARROW_DOWN)
+    "\033OD",            // kcub1 (TB_CAP_ARROW_LEFT)
+    "\033OC",            // kcuf1 (TB_CAP_ARROW_RIGHT)
+    "\033[Z",            // kcbt (TB_CAP_BACK_TAB)
+    "\033[?1049h",       // smcup (TB_CAP_ENTER_CA)
+    "\033[?1049l",       // rmcup (TB_CAP_EXIT_CA)
+    "\033[34h\033[?25h", // cnorm (TB_CAP_SHOW_CURSOR)
+    "\033[?25l",         // civis (TB_CAP_HIDE_CURSOR)
+    "\033[H\033[J",      // clear (TB_CAP_CLEAR_SCREEN)
+    "\033[m\017",        // sgr0 (TB_CAP_SGR0)
+    "\033[4m",           // smul (TB_CAP_UNDERLINE)
+    "\033[1m",           // bold (TB_CAP_BOLD)
+    "\033[5m",           // blink (TB_CAP_BLINK)
+    "\033[3m",           // sitm (TB_CAP_ITALIC)
+    "\033[7m",           // rev (TB_CAP_REVERSE)
+    "\033[?1h\033=",     // smkx (TB_CAP_ENTER_KEYPAD)
+    "\033[?1l\033>",     // rmkx (TB_CAP_EXIT_KEYPAD)
+    "\033[2m",           // dim (TB_CAP_DIM)
+    "\033[8m",           // invis (TB_CAP_INVISIBLE)
+};
+
+// xterm-256color
+static const char *xterm_256color_caps[] = {
+    "\033OP",                  // kf1 (TB_CAP_F1)
+    "\033OQ",                  // kf2 (TB_CAP_F2)
+    "\033OR",                  // kf3 (TB_CAP_F3)
+    "\033OS",                  // kf4 (TB_CAP_F4)
+    "\033[15~",                // kf5 (TB_CAP_F5)
+    "\033[17~",                // kf6 (TB_CAP_F6)
+    "\033[18~",                // kf7 (TB_CAP_F7)
+    "\033[19~",                // kf8 (TB_CAP_F8)
+    "\033[20~",                // kf9 (TB_CAP_F9)
+    "\033[21~",                // kf10 (TB_CAP_F10)
+    "\033[23~",                // kf11 (TB_CAP_F11)
+    "\033[24~",                // kf12 (TB_CAP_F12)
+    "\033[2~",                 // kich1 (TB_CAP_INSERT)
+    "\033[3~",                 // kdch1 (TB_CAP_DELETE)
+    "\033OH",                  // khome (TB_CAP_HOME)
+    "\033OF",                  // kend (TB_CAP_END)
+    "\033[5~",                 // kpp (TB_CAP_PGUP)
+    "\033[6~",                 // knp (TB_CAP_PGDN)
+    "\033OA",                  // kcuu1 (TB_CAP_ARROW_UP)
+    "\033OB",                  // kcud1 (TB_CAP_ARROW_DOWN)
+    "\033OD",                  // kcub1 (TB_CAP_ARROW_LEFT)
+    "\033OC",                  // kcuf1 (TB_CAP_ARROW_RIGHT)
+    "\033[Z",                  // kcbt (TB_CAP_BACK_TAB)
+    "\033[?1049h\033[22;0;0t", // smcup (TB_CAP_ENTER_CA)
+    "\033[?1049l\033[23;0;0t", // rmcup (TB_CAP_EXIT_CA)
+    "\033[?12l\033[?25h",      // cnorm (TB_CAP_SHOW_CURSOR)
+    "\033[?25l",               // civis (TB_CAP_HIDE_CURSOR)
+    "\033[H\033[2J",           // clear (TB_CAP_CLEAR_SCREEN)
+    "\033(B\033[m",            // sgr0 (TB_CAP_SGR0)
+    "\033[4m",                 // smul (TB_CAP_UNDERLINE)
+    "\033[1m",                 // bold (TB_CAP_BOLD)
+    "\033[5m",                 // blink (TB_CAP_BLINK)
+    "\033[3m",                 // sitm (TB_CAP_ITALIC)
+    "\033[7m",                 // rev (TB_CAP_REVERSE)
+    "\033[?1h\033=",           // smkx (TB_CAP_ENTER_KEYPAD)
+    "\033[?1l\033>",           // rmkx (TB_CAP_EXIT_KEYPAD)
+    "\033[2m",                 // dim (TB_CAP_DIM)
+    "\033[8m",                 // invis (TB_CAP_INVISIBLE)
+};
+
+// xterm
+static const char *xterm_caps[] = {
+    "\033OP",                  // kf1 (TB_CAP_F1)
+    "\033OQ",                  // kf2 (TB_CAP_F2)
+    "\033OR",                  // kf3 (TB_CAP_F3)
+    "\033OS",                  // kf4 (TB_CAP_F4)
+    "\033[15~",                // kf5 (TB_CAP_F5)
+    "\033[17~",                // kf6 (TB_CAP_F6)
+    "\033[18~",                // kf7 (TB_CAP_F7)
+    "\033[19~",                // kf8 (TB_CAP_F8)
+    "\033[20~",                // kf9 (TB_CAP_F9)
+    "\033[21~",                // kf10 (TB_CAP_F10)
+    "\033[23~",                // kf11 (TB_CAP_F11)
+    "\033[24~",                // kf12 (TB_CAP_F12)
+    "\033[2~",                 // kich1 (TB_CAP_INSERT)
+    "\033[3~",                 // kdch1 (TB_CAP_DELETE)
+    "\033OH",                  // khome (TB_CAP_HOME)
+    "\033OF",                  // kend (TB_CAP_END)
+    "\033[5~",                 // kpp (TB_CAP_PGUP)
+    "\033[6~",                 // knp (TB_CAP_PGDN)
+    "\033OA",                  // kcuu1 (TB_CAP_ARROW_UP)
+    "\033OB",                  // kcud1 (TB_CAP_ARROW_DOWN)
+    "\033OD",                  // kcub1 (TB_CAP_ARROW_LEFT)
+    "\033OC",                  // kcuf1 (TB_CAP_ARROW_RIGHT)
+    "\033[Z",                  // kcbt (TB_CAP_BACK_TAB)
+    "\033[?1049h\033[22;0;0t", // smcup (TB_CAP_ENTER_CA)
+    "\033[?1049l\033[23;0;0t", // rmcup (TB_CAP_EXIT_CA)
+    "\033[?12l\033[?25h",      // cnorm (TB_CAP_SHOW_CURSOR)
+    "\033[?25l",               // civis (TB_CAP_HIDE_CURSOR)
+    "\033[H\033[2J",           // clear (TB_CAP_CLEAR_SCREEN)
+    "\033(B\033[m",            // sgr0 (TB_CAP_SGR0)
+    "\033[4m",                 // smul (TB_CAP_UNDERLINE)
+    "\033[1m",                 // bold (TB_CAP_BOLD)
+    "\033[5m",                 // blink (TB_CAP_BLINK)
+    "\033[3m",                 // sitm (TB_CAP_ITALIC)
+    "\033[7m",                 // rev (TB_CAP_REVERSE)
+    "\033[?1h\033=",           // smkx (TB_CAP_ENTER_KEYPAD)
+    "\033[?1l\033>",           // rmkx (TB_CAP_EXIT_KEYPAD)
+    "\033[2m",                 // dim (TB_CAP_DIM)
+    "\033[8m",                 // invis (TB_CAP_INVISIBLE)
+};
+
+// linux
+static const char *linux_caps[] = {
+    "\033[[A",           // kf1 (TB_CAP_F1)
+    "\033[[B",           // kf2 (TB_CAP_F2)
+    "\033[[C",           // kf3 (TB_CAP_F3)
+    "\033[[D",           // kf4 (TB_CAP_F4)
+    "\033[[E",           // kf5 (TB_CAP_F5)
+    "\033[17~",          // kf6 (TB_CAP_F6)
+    "\033[18~",          // kf7 (TB_CAP_F7)
+    "\033[19~",          // kf8 (TB_CAP_F8)
+    "\033[20~",          // kf9 (TB_CAP_F9)
+    "\033[21~",          // kf10 (TB_CAP_F10)
+    "\033[23~",          // kf11 (TB_CAP_F11)
+    "\033[24~",          // kf12 (TB_CAP_F12)
+    "\033[2~",           // kich1 (TB_CAP_INSERT)
+    "\033[3~",           // kdch1 (TB_CAP_DELETE)
+    "\033[1~",           // khome (TB_CAP_HOME)
+    "\033[4~",           // kend (TB_CAP_END)
+    "\033[5~",           // kpp (TB_CAP_PGUP)
+    "\033[6~",           // knp (TB_CAP_PGDN)
+    "\033[A",            // kcuu1 (TB_CAP_ARROW_UP)
+    "\033[B",            // kcud1 (TB_CAP_ARROW_DOWN)
+    "\033[D",            // kcub1 (TB_CAP_ARROW_LEFT)
     "\033[C",            // kcuf1 (TB_CAP_ARROW_RIGHT)
     "\033\011",          // kcbt (TB_CAP_BACK_TAB)
     "",                  // smcup (TB_CAP_ENTER_CA)
@@ -1081,13 +1934,19 @@ static struct {
     const char **caps;
     const char *alias;
 } builtin_terms[] = {
-    {"xterm",         xterm_caps,         ""    },
-    {"linux",         linux_caps,         ""    },
-    {"screen",        screen_caps,        "tmux"},
-    {"rxvt-256color", rxvt_256color_caps, ""    },
-    {"rxvt-unicode",  rxvt_unicode_caps,  "rxvt"},
-    {"Eterm",         eterm_caps,         ""    },
-    {NULL,            NULL,               NULL  },
+    {"alacritty",      alacritty_caps,      ""    },
+    {"kitty",          kitty_caps,          ""    },
+    {"foot",           foot_caps,           ""    },
+    {"wezterm",        wezterm_caps,        ""    },
+    {"tmux-256color",  tmux_256color_caps,  "tmux"},
+    {"xterm-256color", xterm_256color_caps, ""    },
+    {"xterm",          xterm_caps,          ""    },
+    {"linux",          linux_caps,          ""    },
+    {"screen",         screen_caps,         "tmux"},
+    {"rxvt-256color",  rxvt_256color_caps,  ""    },
+    {"rxvt-unicode",   rxvt_unicode_caps,   "rxvt"},
+    {"Eterm",          eterm_caps,          ""    },
+    {NULL,             NULL,                NULL  },
 };
 
 /* END codegen c */
@@ -1489,6 +2348,8 @@ static int cap_trie_find(const char *buf, size_t nbuf, struct cap_trie_t **last,
     size_t *depth);
 static int cap_trie_deinit(struct cap_trie_t *node);
 static int init_resize_handler(void);
+static int init_resize_sigaction(void);
+static int init_suspend_handler(void);
 static int send_init_escape_codes(void);
 static int send_clear(void);
 static int update_term_size(void);
@@ -1499,24 +2360,75 @@ static int load_terminfo(void);
 static int load_terminfo_from_path(const char *path, const char *term);
 static int read_terminfo_path(const char *path);
 static int parse_terminfo_caps(void);
-static int load_builtin_caps(void);
+static int load_builtin_caps(int exact_only);
+#ifdef TB_OPT_CAP_CACHE
+static int load_cap_cache(void);
+static int save_cap_cache(void);
+static int cap_cache_key(char *key, size_t nkey, size_t *out_nkey);
+#endif
+#if defined TB_OPT_CAP_CACHE || defined TB_OPT_PROBE
+static int cap_cache_path(char *path, size_t npath, const char *key,
+    size_t nkey, int mkdirs);
+#endif
+static int init_features(void);
+#ifdef TB_OPT_PROBE
+static int send_probe(void);
+static void finish_probe(void);
+static int load_probe_cache(void);
+static int save_probe_cache(void);
+static int probe_cache_key(char *key, size_t nkey, size_t *out_nkey);
+static int extract_probe_reply(void);
+#endif
 static const char *get_terminfo_string(int16_t str_offsets_pos,
     int16_t str_offsets_len, int16_t str_table_pos, int16_t str_table_len,
     int16_t str_index);
 static int wait_event(struct tb_event *event, int timeout);
+static int wait_replay_event(struct tb_event *event, int timeout);
+static int replay_load(const char *path);
+static int replay_load_records(const char *data, size_t ndata);
+static int replay_load_asciicast(const char *data, size_t ndata);
+static int replay_load_asciicast_line(const char *p, const char *end,
+    int version, double *t);
+static int replay_add(uint64_t at_ns, const char *buf, size_t nbuf, int w,
+    int h);
+static int replay_check_size(int w, int h);
+static void replay_free(void);
+static int json_get_int(const char *p, const char *end, const char *key);
+static int json_get_str(const char **pp, const char *end,
+    struct bytebuf_t *out);
+static int json_get_hex4(const char *p, const char *end, uint32_t *out);
+static void record_input(uint32_t kind, const char *buf, size_t nbuf);
+static uint32_t le32_get(const char *buf);
+static void le32_put(char *buf, uint32_t n);
 static int extract_event(struct tb_event *event);
+static int extract_timed_event(struct tb_event *event);
+static void in_mark(uint64_t ts);
+static void in_forget(size_t n);
 static int extract_esc(struct tb_event *event);
 static int extract_esc_user(struct tb_event *event, int is_post);
 static int extract_esc_cap(struct tb_event *event);
 static int extract_esc_mouse(struct tb_event *event);
+static int extract_esc_focus(struct tb_event *event);
+static int extract_esc_cpr(struct tb_event *event);
 static int resize_cellbufs(void);
 static void handle_resize(int sig);
-static int send_attr(uintattr_t fg, uintattr_t bg);
-static int send_sgr(uint32_t fg, uint32_t bg, int fg_is_default,
-    int bg_is_default);
-static int send_cursor_if(int x, int y);
-static int send_char(int x, int y, uint32_t ch);
-static int send_cluster(int x, int y, uint32_t *ch, size_t nch);
+static void handle_suspend(int sig);
+static int suspend_tty(void);
+static int send_attr(struct tb_enc_t *e, uintattr_t fg, uintattr_t bg);
+static int send_sgr(struct tb_enc_t *e, uint32_t fg, uint32_t bg,
+    int fg_is_default, int bg_is_default);
+static int send_cursor_if(struct tb_enc_t *e, int x, int y);
+static int send_char(struct tb_enc_t *e, int x, int y, uint32_t ch);
+static int send_cluster(struct tb_enc_t *e, int x, int y, uint32_t *ch,
+    size_t nch);
+static int send_rep(struct tb_enc_t *e, int x, int y, struct tb_cell *cell,
+    int *nrep);
+static int present_rows(struct tb_enc_t *e, int y0, int y1);
+static int present_parallel(int *presented);
+static void present_pool_stop(void);
+static int flush_out(void);
+static int write_backlog(void);
+static void backlog_written(void);
 static int convert_num(uint32_t num, char *buf);
 static int cell_cmp(struct tb_cell *a, struct tb_cell *b);
 static int cell_copy(struct tb_cell *dst, struct tb_cell *src);
@@ -1529,12 +2441,46 @@ static int cellbuf_free(struct cellbuf_t *c);
 static int cellbuf_clear(struct cellbuf_t *c);
 static int cellbuf_get(struct cellbuf_t *c, int x, int y, struct tb_cell **out);
 static int cellbuf_resize(struct cellbuf_t *c, int w, int h);
+static int cellbuf_at(void *target, int x, int y, struct tb_cell **out);
+static int back_at(void *target, int x, int y, struct tb_cell **out);
+static int extend_cell_at(void *target, cell_at_fn at, int x, int y,
+    uint32_t ch);
+static int print_at(void *target, cell_at_fn at, int x, int y, uintattr_t fg,
+    uintattr_t bg, size_t *out_w, const char *str);
+static int cellbuf_fill(struct cellbuf_t *c, int x, int y, int w, int h,
+    uint32_t ch, uintattr_t fg, uintattr_t bg);
+static int cellbuf_blit(struct cellbuf_t *dst, struct cellbuf_t *src, int sx,
+    int sy, int w, int h, int dx, int dy);
+static void blit_clip(struct cellbuf_t *dst, struct cellbuf_t *src, int *sx,
+    int *sy, int *w, int *h, int *dx, int *dy);
+static const struct tb_clip *clip_top(void);
+static int clip_dst(const struct tb_clip *c, int *sx, int *sy, int *w, int *h,
+    int *dx, int *dy);
+#if TB_OPT_ATTR_W >= 32
+static uint32_t blend_mix(uint32_t c, uint32_t o, uint32_t a);
+static uint32_t blend_rgb(uintattr_t attr, int bg);
+static uintattr_t blend_attr(uintattr_t attr, uint32_t rgb);
+static void blend_row(struct tb_cell *row, int n, uint32_t rgb, uint32_t a,
+    int flags);
+static int blend_over_row(struct tb_cell *to, struct tb_cell *from, int n,
+    uint32_t a);
+static int cellbuf_blend(struct cellbuf_t *dst, struct cellbuf_t *src, int sx,
+    int sy, int w, int h, int dx, int dy, uint32_t a);
+#endif
+static int layers_apply(void);
+static void layers_restore(void);
+static int canvas_at(void *target, int x, int y, struct tb_cell **out);
+static struct tb_cell *canvas_tile(struct tb_canvas *c, int tx, int ty,
+    int create);
+static int canvases_render(void);
+static int send_scroll(int top, int bottom, int n);
 static int bytebuf_puts(struct bytebuf_t *b, const char *str);
 static int bytebuf_nputs(struct bytebuf_t *b, const char *str, size_t nstr);
 static int bytebuf_shift(struct bytebuf_t *b, size_t n);
 static int bytebuf_flush(struct bytebuf_t *b, int fd);
 static int bytebuf_reserve(struct bytebuf_t *b, size_t sz);
 static int bytebuf_free(struct bytebuf_t *b);
+static uint64_t monotonic_ns(void);
 
 int tb_init(void) {
     return tb_init_file("/dev/tty");
@@ -1570,9 +2516,11 @@ int tb_init_rwfd(int rfd, int wfd) {
         if_err_break(rv, init_term_caps());
         if_err_break(rv, init_cap_trie());
         if_err_break(rv, init_resize_handler());
+        if_err_break(rv, init_suspend_handler());
         if_err_break(rv, send_init_escape_codes());
         if_err_break(rv, send_clear());
         if_err_break(rv, update_term_size());
+        if_err_break(rv, init_features());
         if_err_break(rv, init_cellbuf());
         global.initialized = 1;
     } while (0);
@@ -1590,6 +2538,73 @@ int tb_shutdown(void) {
     return TB_OK;
 }
 
+void *tb_session_state(size_t *size) {
+    if (size) {
+        *size = sizeof(global);
+    }
+    return global.initialized ? &global : NULL;
+}
+
+int tb_session_adopt(const void *state, size_t size) {
+    int rv, i;
+    size_t ncaps = 0;
+
+    if (global.initialized) {
+        return TB_ERR_INIT_ALREADY;
+    }
+    if (!state || size != sizeof(global)) {
+        return TB_ERR;
+    }
+
+    // Caps may point at string literals in the old copy (built-in tables,
+    // absent terminfo caps), which go away with it, so keep our own copy.
+    // Everything else is heap, mmap or fds, and stays valid.
+    const struct tb_global_t *old = state;
+    for (i = 0; i < TB_CAP__COUNT; i++) {
+        ncaps += strlen(old->caps[i]) + 1;
+    }
+    char *caps = tb_malloc(ncaps);
+    if (!caps) {
+        return TB_ERR_MEM;
+    }
+
+    memcpy(&global, old, sizeof(global));
+    char *p = caps;
+    for (i = 0; i < TB_CAP__COUNT; i++) {
+        size_t n = strlen(global.caps[i]) + 1;
+        memcpy(p, global.caps[i], n);
+        global.caps[i] = p;
+        p += n;
+    }
+    char *old_caps = global.caps_owned;
+    global.caps_owned = caps;
+
+    // The installed handlers still point into the old copy
+    if ((rv = init_resize_sigaction()) != TB_OK ||
+        (rv = init_suspend_handler()) != TB_OK)
+    {
+        // Leave the session with the old copy
+        tb_free(caps);
+        global.ttyfd_open = 0;
+        tb_reset();
+        return rv;
+    }
+
+    if (old_caps) {
+        tb_free(old_caps);
+    }
+    return TB_OK;
+}
+
+int tb_session_release(void) {
+    if_not_init_return();
+    // Everything now belongs to the adopting copy; just forget it
+    present_pool_stop();
+    global.ttyfd_open = 0;
+    tb_reset();
+    return TB_OK;
+}
+
 int tb_width(void) {
     if_not_init_return();
     return global.width;
@@ -1617,142 +2632,244 @@ int tb_present(void) {
 
     int rv;
 
-    // TODO Assert global.back.(width,height) == global.front.(width,height)
+    if (tb_present_hidden()) {
+        global.present_deferred = 1;
+        return TB_OK;
+    }
+    if (global.max_backlog > 0 &&
+        global.backlog.len > (size_t)global.max_backlog)
+    {
+        // The tty is behind; tb_flush_backlog presents once it catches up
+        global.present_deferred = 1;
+        return TB_OK;
+    }
+    global.present_deferred = 0;
 
-    global.last_x = -1;
-    global.last_y = -1;
+    // TODO Assert global.back.(width,height) == global.front.(width,height)
 
-    int x, y, i;
-    for (y = 0; y < global.front.height; y++) {
-        for (x = 0; x < global.front.width;) {
-            struct tb_cell *back, *front;
-            if_err_return(rv, cellbuf_get(&global.back, x, y, &back));
-            if_err_return(rv, cellbuf_get(&global.front, x, y, &front));
+    global.enc.last_x = -1;
+    global.enc.last_y = -1;
 
-            int w;
-            {
-#ifdef TB_OPT_EGC
-                if (back->nech > 0)
-                    w = wcswidth((wchar_t *)back->ech, back->nech);
-                else
-#endif
-                    /* wcwidth() simply returns -1 on overflow of wchar_t */
-                    w = wcwidth((wchar_t)back->ch);
-            }
-            if (w < 1) {
-                w = 1;
-            }
+    // Output queued before this call is kept if the frame fails
+    size_t out_len = global.enc.out.len;
 
-            if (cell_cmp(back, front) != 0) {
-                cell_copy(front, back);
+    // Have the terminal apply the whole frame at once instead of showing it
+    // half-drawn
+    rv = TB_OK;
+    if (global.features & TB_FEATURE_SYNC_OUTPUT) {
+        rv = bytebuf_puts(&global.enc.out, "\x1b[?2026h");
+    }
+    if (rv == TB_OK) {
+        rv = canvases_render();
+    }
 
-                send_attr(back->fg, back->bg);
-                if (w > 1 && x >= global.front.width - (w - 1)) {
-                    for (i = x; i < global.front.width; i++) {
-                        send_char(i, y, ' ');
-                    }
-                } else {
-                    {
-#ifdef TB_OPT_EGC
-                        if (back->nech > 0)
-                            send_cluster(x, y, back->ech, back->nech);
-                        else
-#endif
-                            send_char(x, y, back->ch);
-                    }
-                    for (i = 1; i < w; i++) {
-                        struct tb_cell *front_wide;
-                        if_err_return(rv,
-                            cellbuf_get(&global.front, x + i, y, &front_wide));
-                        if_err_return(rv,
-                            cell_set(front_wide, 0, 1, back->fg, back->bg));
-                    }
-                }
-            }
-            x += w;
+    // Layers are drawn into the back buffer only while it is encoded
+    if (rv == TB_OK) {
+        int presented = 0;
+        rv = layers_apply();
+        if (rv == TB_OK) {
+            rv = present_parallel(&presented);
+        }
+        if (rv == TB_OK && !presented) {
+            rv = present_rows(&global.enc, 0, global.front.height);
         }
+        layers_restore();
     }
 
-    if_err_return(rv, send_cursor_if(global.cursor_x, global.cursor_y));
-    if_err_return(rv, bytebuf_flush(&global.out, global.wfd));
+    if (rv == TB_OK) {
+        rv = send_cursor_if(&global.enc, global.cursor_x, global.cursor_y);
+    }
+    if (rv == TB_OK && (global.features & TB_FEATURE_SYNC_OUTPUT)) {
+        rv = bytebuf_puts(&global.enc.out, "\x1b[?2026l");
+    }
+    if (rv != TB_OK) {
+        // Drop the partial frame with its sync-begin, which would otherwise
+        // leave the terminal holding back everything written after it
+        global.enc.out.len = out_len;
+        return rv;
+    }
+    if_err_return(rv, flush_out());
 
-    return TB_OK;
-}
+    // Behind a backlog the frame is not written yet; write_backlog() stamps it
+    global.present_unwritten = 1;
+    backlog_written();
 
-int tb_invalidate(void) {
-    int rv;
-    if_not_init_return();
-    if_err_return(rv, resize_cellbufs());
     return TB_OK;
 }
 
-int tb_set_cursor(int cx, int cy) {
+int tb_set_present_policy(int policy) {
     if_not_init_return();
-    int rv;
-    if (cx < 0) cx = 0;
-    if (cy < 0) cy = 0;
-    if (global.cursor_x == -1) {
-        if_err_return(rv,
-            bytebuf_puts(&global.out, global.caps[TB_CAP_SHOW_CURSOR]));
+    switch (policy) {
+        case -1:
+            return global.present_policy;
+        case TB_PRESENT_ALWAYS:
+        case TB_PRESENT_VISIBLE:
+            global.present_policy = policy;
+            if (global.present_deferred && policy == TB_PRESENT_ALWAYS) {
+                return tb_present();
+            }
+            return TB_OK;
     }
-    if_err_return(rv, send_cursor_if(cx, cy));
-    global.cursor_x = cx;
-    global.cursor_y = cy;
-    return TB_OK;
+    return TB_ERR;
 }
 
-int tb_hide_cursor(void) {
-    if_not_init_return();
+uint64_t tb_last_present_ts(void) {
+    return global.last_present_ts;
+}
+
+int tb_set_output_backlog(int max) {
     int rv;
-    if (global.cursor_x >= 0) {
-        if_err_return(rv,
-            bytebuf_puts(&global.out, global.caps[TB_CAP_HIDE_CURSOR]));
+    if_not_init_return();
+    if (max == -1) {
+        return global.max_backlog;
     }
-    global.cursor_x = -1;
-    global.cursor_y = -1;
+    if (max < 0) {
+        return TB_ERR;
+    }
+    if (max == 0 && global.backlog.len > 0) {
+        size_t len = global.backlog.len;
+        if_err_return(rv, bytebuf_flush(&global.backlog, global.wfd));
+        global.out_written += len;
+        backlog_written();
+    }
+    global.max_backlog = max;
     return TB_OK;
 }
 
-int tb_set_cell(int x, int y, uint32_t ch, uintattr_t fg, uintattr_t bg) {
-    return tb_set_cell_ex(x, y, &ch, 1, fg, bg);
+int tb_present_pending(void) {
+    if_not_init_return();
+    return global.present_deferred &&
+           global.backlog.len <= (size_t)global.max_backlog &&
+           !tb_present_hidden();
 }
 
-int tb_set_cell_ex(int x, int y, uint32_t *ch, size_t nch, uintattr_t fg,
-    uintattr_t bg) {
+int tb_present_hidden(void) {
     if_not_init_return();
-    int rv;
-    struct tb_cell *cell;
-    if_err_return(rv, cellbuf_get(&global.back, x, y, &cell));
-    if_err_return(rv, cell_set(cell, ch, nch, fg, bg));
-    return TB_OK;
+    return global.present_policy == TB_PRESENT_VISIBLE &&
+           (global.unfocused || global.suspended);
 }
 
-int tb_extend_cell(int x, int y, uint32_t ch) {
-    if_not_init_return();
-#ifdef TB_OPT_EGC
+int tb_flush_backlog(void) {
     int rv;
-    struct tb_cell *cell;
-    size_t nech;
-    if_err_return(rv, cellbuf_get(&global.back, x, y, &cell));
-    if (cell->nech > 0) { // append to ech
-        nech = cell->nech + 1;
-        if_err_return(rv, cell_reserve_ech(cell, nech));
-        cell->ech[nech - 1] = ch;
-    } else { // make new ech
-        nech = 2;
-        if_err_return(rv, cell_reserve_ech(cell, nech));
-        cell->ech[0] = cell->ch;
-        cell->ech[1] = ch;
+    if_not_init_return();
+    if_err_return(rv, write_backlog());
+    if (tb_present_pending() > 0) {
+        if_err_return(rv, tb_present());
+    }
+    return (int)global.backlog.len;
+}
+
+int tb_backlog_len(void) {
+    if_not_init_return();
+    return (int)global.backlog.len;
+}
+
+int tb_output_counts(uint64_t *total, uint64_t *written) {
+    if_not_init_return();
+    if (written) {
+        *written = global.out_written;
+    }
+    if (total) {
+        *total = global.out_written + global.backlog.len;
     }
-    cell->ech[nech] = '\0';
-    cell->nech = nech;
     return TB_OK;
-#else
-    (void)x;
-    (void)y;
-    (void)ch;
-    return TB_ERR;
+}
+
+int tb_set_present_threads(int n) {
+    if_not_init_return();
+    if (n == -1) {
+        return global.present_threads;
+    }
+    if (n < 1 || n > TB_PRESENT_MAX_THREADS) {
+        return TB_ERR;
+    }
+#ifndef TB_OPT_PARALLEL_PRESENT
+    if (n > 1) {
+        return TB_ERR;
+    }
 #endif
+    if (n != global.present_threads) {
+        // Workers for the new count are started by the next tb_present
+        present_pool_stop();
+        global.present_threads = n;
+    }
+    return TB_OK;
+}
+
+int tb_get_features(void) {
+    if_not_init_return();
+    return global.features;
+}
+
+const char *tb_get_term_version(void) {
+    return global.term_version;
+}
+
+int tb_invalidate(void) {
+    int rv;
+    if_not_init_return();
+    if_err_return(rv, resize_cellbufs());
+    return TB_OK;
+}
+
+int tb_set_cursor(int cx, int cy) {
+    if_not_init_return();
+    int rv;
+    if (cx < 0) cx = 0;
+    if (cy < 0) cy = 0;
+    if (global.cursor_x == -1) {
+        if_err_return(rv,
+            bytebuf_puts(&global.enc.out, global.caps[TB_CAP_SHOW_CURSOR]));
+    }
+    if_err_return(rv, send_cursor_if(&global.enc, cx, cy));
+    global.cursor_x = cx;
+    global.cursor_y = cy;
+    return TB_OK;
+}
+
+int tb_hide_cursor(void) {
+    if_not_init_return();
+    int rv;
+    if (global.cursor_x >= 0) {
+        if_err_return(rv,
+            bytebuf_puts(&global.enc.out, global.caps[TB_CAP_HIDE_CURSOR]));
+    }
+    global.cursor_x = -1;
+    global.cursor_y = -1;
+    return TB_OK;
+}
+
+int tb_set_cell(int x, int y, uint32_t ch, uintattr_t fg, uintattr_t bg) {
+    return tb_set_cell_ex(x, y, &ch, 1, fg, bg);
+}
+
+int tb_set_cell_ex(int x, int y, uint32_t *ch, size_t nch, uintattr_t fg,
+    uintattr_t bg) {
+    if_not_init_return();
+    int rv;
+    struct tb_cell *cell;
+    if_err_return(rv, back_at((void *)clip_top(), x, y, &cell));
+    if_err_return(rv, cell_set(cell, ch, nch, fg, bg));
+    return TB_OK;
+}
+
+int tb_extend_cell(int x, int y, uint32_t ch) {
+    if_not_init_return();
+    return extend_cell_at((void *)clip_top(), back_at, x, y, ch);
+}
+
+int tb_get_cell(int x, int y, int back, struct tb_cell **cell) {
+    if_not_init_return();
+    return cellbuf_get(back ? &global.back : &global.front, x, y, cell);
+}
+
+int tb_set_cell_clip(const struct tb_clip *c, int x, int y, uint32_t ch,
+    uintattr_t fg, uintattr_t bg) {
+    if_not_init_return();
+    int rv;
+    struct tb_cell *cell;
+    if_err_return(rv, back_at((void *)c, x, y, &cell));
+    return cell_set(cell, &ch, 1, fg, bg);
 }
 
 int tb_set_input_mode(int mode) {
@@ -1771,11 +2888,20 @@ int tb_set_input_mode(int mode) {
     }
 
     if (mode & TB_INPUT_MOUSE) {
-        bytebuf_puts(&global.out, TB_HARDCAP_ENTER_MOUSE);
-        bytebuf_flush(&global.out, global.wfd);
+        bytebuf_puts(&global.enc.out, TB_HARDCAP_ENTER_MOUSE);
+        flush_out();
     } else {
-        bytebuf_puts(&global.out, TB_HARDCAP_EXIT_MOUSE);
-        bytebuf_flush(&global.out, global.wfd);
+        bytebuf_puts(&global.enc.out, TB_HARDCAP_EXIT_MOUSE);
+        flush_out();
+    }
+
+    if (mode & TB_INPUT_FOCUS) {
+        bytebuf_puts(&global.enc.out, TB_HARDCAP_ENTER_FOCUS);
+        flush_out();
+    } else if (global.input_mode & TB_INPUT_FOCUS) {
+        bytebuf_puts(&global.enc.out, TB_HARDCAP_EXIT_FOCUS);
+        flush_out();
+        global.unfocused = 0;
     }
 
     global.input_mode = mode;
@@ -1794,8 +2920,8 @@ int tb_set_output_mode(int mode) {
 #if TB_OPT_ATTR_W >= 32
         case TB_OUTPUT_TRUECOLOR:
 #endif
-            global.last_fg = ~global.fg;
-            global.last_bg = ~global.bg;
+            global.enc.last_fg = ~global.fg;
+            global.enc.last_bg = ~global.bg;
             global.output_mode = mode;
             return TB_OK;
     }
@@ -1821,41 +2947,85 @@ int tb_get_fds(int *ttyfd, int *resizefd) {
     return TB_OK;
 }
 
+int tb_set_input_replay(const char *path, int speed) {
+    int rv;
+    if_not_init_return();
+    if (speed < 0) {
+        return TB_ERR;
+    }
+    replay_free();
+    if (!path) {
+        return TB_OK;
+    }
+    if_err_return(rv, replay_load(path));
+    global.replay_speed = speed;
+    global.replay_start_ts = monotonic_ns();
+    return TB_OK;
+}
+
+int tb_input_replay_remaining(void) {
+    if_not_init_return();
+    if (!global.replay) {
+        return -1;
+    }
+    return (int)(global.nreplay - global.replay_pos);
+}
+
+uint64_t tb_input_replay_due(void) {
+    if (global.replay_pos >= global.nreplay) {
+        return 0;
+    }
+    if (global.replay_speed == 0) {
+        return global.replay_start_ts;
+    }
+    return global.replay_start_ts +
+           global.replay[global.replay_pos].at_ns * 100 / global.replay_speed;
+}
+
+int tb_set_input_record(const char *path) {
+    if_not_init_return();
+    if (global.recordfd >= 0) {
+        close(global.recordfd);
+        global.recordfd = -1;
+    }
+    if (!path) {
+        return TB_OK;
+    }
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        global.last_errno = errno;
+        return TB_ERR_INIT_OPEN;
+    }
+    if (write(fd, TB_REPLAY_MAGIC, 8) != 8) {
+        global.last_errno = errno;
+        close(fd);
+        return TB_ERR;
+    }
+    global.recordfd = fd;
+    global.last_record_ts = monotonic_ns();
+    return TB_OK;
+}
+
 int tb_print(int x, int y, uintattr_t fg, uintattr_t bg, const char *str) {
     return tb_print_ex(x, y, fg, bg, NULL, str);
 }
 
 int tb_print_ex(int x, int y, uintattr_t fg, uintattr_t bg, size_t *out_w,
     const char *str) {
-    int rv;
-    uint32_t uni;
-    int w, ix = x;
     if (out_w) {
         *out_w = 0;
     }
-    while (*str) {
-        rv = tb_utf8_char_to_unicode(&uni, str);
-        if (rv < 0) {
-            uni = 0xfffd; // replace invalid UTF-8 char with U+FFFD
-            str += rv * -1;
-        } else if (rv > 0) {
-            str += rv;
-        } else {
-            break; // shouldn't get here
-        }
-        w = wcwidth((wchar_t)uni);
-        if (w < 0) w = 1;
-        if (w == 0 && x > ix) {
-            if_err_return(rv, tb_extend_cell(x - 1, y, uni));
-        } else {
-            if_err_return(rv, tb_set_cell(x, y, uni, fg, bg));
-        }
-        x += w;
-        if (out_w) {
-            *out_w += w;
-        }
+    if_not_init_return();
+    return print_at((void *)clip_top(), back_at, x, y, fg, bg, out_w, str);
+}
+
+int tb_print_clip(const struct tb_clip *c, int x, int y, uintattr_t fg,
+    uintattr_t bg, size_t *out_w, const char *str) {
+    if (out_w) {
+        *out_w = 0;
     }
-    return TB_OK;
+    if_not_init_return();
+    return print_at((void *)c, back_at, x, y, fg, bg, out_w, str);
 }
 
 int tb_printf(int x, int y, uintattr_t fg, uintattr_t bg, const char *fmt,
@@ -1879,7 +3049,7 @@ int tb_printf_ex(int x, int y, uintattr_t fg, uintattr_t bg, size_t *out_w,
 }
 
 int tb_send(const char *buf, size_t nbuf) {
-    return bytebuf_nputs(&global.out, buf, nbuf);
+    return bytebuf_nputs(&global.enc.out, buf, nbuf);
 }
 
 int tb_sendf(const char *fmt, ...) {
@@ -1907,77 +3077,438 @@ int tb_set_func(int fn_type, int (*fn)(struct tb_event *, size_t *)) {
     return TB_ERR;
 }
 
-struct tb_cell *tb_cell_buffer(void) {
-    if (!global.initialized) return NULL;
-    return global.back.cells;
+struct tb_surface *tb_surface_new(int w, int h) {
+    struct tb_surface *s;
+    if (w < 1 || h < 1) return NULL;
+    s = tb_malloc(sizeof(*s));
+    if (!s) return NULL;
+    if (cellbuf_init(&s->buf, w, h) != TB_OK) {
+        tb_free(s);
+        return NULL;
+    }
+    cellbuf_fill(&s->buf, 0, 0, w, h, ' ', TB_DEFAULT, TB_DEFAULT);
+    return s;
 }
 
-int tb_utf8_char_length(char c) {
-    return utf8_length[(unsigned char)c];
+void tb_surface_free(struct tb_surface *s) {
+    if (!s) return;
+    cellbuf_free(&s->buf);
+    tb_free(s);
 }
 
-int tb_utf8_char_to_unicode(uint32_t *out, const char *c) {
-    if (*c == '\0') return 0;
+int tb_surface_width(struct tb_surface *s) {
+    return s->buf.width;
+}
 
-    int i;
-    unsigned char len = tb_utf8_char_length(*c);
-    unsigned char mask = utf8_mask[len - 1];
-    uint32_t result = c[0] & mask;
-    for (i = 1; i < len && c[i] != '\0'; ++i) {
-        result <<= 6;
-        result |= c[i] & 0x3f;
+int tb_surface_height(struct tb_surface *s) {
+    return s->buf.height;
+}
+
+int tb_surface_set_cell(struct tb_surface *s, int x, int y, uint32_t ch,
+    uintattr_t fg, uintattr_t bg) {
+    int rv;
+    struct tb_cell *cell;
+    if_err_return(rv, cellbuf_get(&s->buf, x, y, &cell));
+    return cell_set(cell, &ch, 1, fg, bg);
+}
+
+int tb_surface_print(struct tb_surface *s, int x, int y, uintattr_t fg,
+    uintattr_t bg, size_t *out_w, const char *str) {
+    if (out_w) {
+        *out_w = 0;
     }
+    return print_at(&s->buf, cellbuf_at, x, y, fg, bg, out_w, str);
+}
 
-    if (i != len) return i * -1;
+int tb_surface_fill(struct tb_surface *s, int x, int y, int w, int h,
+    uint32_t ch, uintattr_t fg, uintattr_t bg) {
+    return cellbuf_fill(&s->buf, x, y, w, h, ch, fg, bg);
+}
 
-    *out = result;
-    return (int)len;
+int tb_blit(struct tb_surface *s, int sx, int sy, int w, int h, int dx,
+    int dy) {
+    return tb_blit_clip(clip_top(), s, sx, sy, w, h, dx, dy);
 }
 
-int tb_utf8_unicode_to_char(char *out, uint32_t c) {
-    int len = 0;
-    int first;
-    int i;
+int tb_blit_clip(const struct tb_clip *c, struct tb_surface *s, int sx,
+    int sy, int w, int h, int dx, int dy) {
+    if_not_init_return();
+    if (!clip_dst(c, &sx, &sy, &w, &h, &dx, &dy)) return TB_OK;
+    return cellbuf_blit(&global.back, &s->buf, sx, sy, w, h, dx, dy);
+}
 
-    if (c < 0x80) {
-        first = 0;
-        len = 1;
-    } else if (c < 0x800) {
-        first = 0xc0;
-        len = 2;
-    } else if (c < 0x10000) {
-        first = 0xe0;
-        len = 3;
-    } else if (c < 0x200000) {
-        first = 0xf0;
-        len = 4;
-    } else if (c < 0x4000000) {
-        first = 0xf8;
-        len = 5;
-    } else {
-        first = 0xfc;
-        len = 6;
+int tb_blend_rect(int x, int y, int w, int h, uint32_t rgba, int flags) {
+    return tb_blend_rect_clip(clip_top(), x, y, w, h, rgba, flags);
+}
+
+int tb_blend_rect_clip(const struct tb_clip *c, int x, int y, int w, int h,
+    uint32_t rgba, int flags) {
+    if_not_init_return();
+#if TB_OPT_ATTR_W >= 32
+    int sx = 0, sy = 0, row;
+    if (global.output_mode != TB_OUTPUT_TRUECOLOR) return TB_ERR;
+    // Blending would still turn default colors into explicit ones
+    if ((rgba & 0xff) == 0) return TB_OK;
+    if (!clip_dst(c, &sx, &sy, &w, &h, &x, &y)) return TB_OK;
+    if (x < 0) {
+        w += x;
+        x = 0;
+    }
+    if (y < 0) {
+        h += y;
+        y = 0;
+    }
+    if (w > global.back.width - x) w = global.back.width - x;
+    if (h > global.back.height - y) h = global.back.height - y;
+    for (row = 0; row < h; row++) {
+        blend_row(&global.back.cells[(y + row) * global.back.width + x], w,
+            rgba >> 8, (rgba & 0xff) + ((rgba & 0xff) >> 7), flags);
     }
+    return TB_OK;
+#else
+    (void)c;
+    (void)x;
+    (void)y;
+    (void)w;
+    (void)h;
+    (void)rgba;
+    (void)flags;
+    return TB_ERR;
+#endif
+}
 
-    for (i = len - 1; i > 0; --i) {
-        out[i] = (c & 0x3f) | 0x80;
-        c >>= 6;
+int tb_surface_blend(struct tb_surface *dst, struct tb_surface *src, int sx,
+    int sy, int w, int h, int dx, int dy, uint8_t alpha) {
+    return tb_surface_blend_clip(dst ? NULL : clip_top(), dst, src, sx, sy, w,
+        h, dx, dy, alpha);
+}
+
+int tb_surface_blend_clip(const struct tb_clip *c, struct tb_surface *dst,
+    struct tb_surface *src, int sx, int sy, int w, int h, int dx, int dy,
+    uint8_t alpha) {
+#if TB_OPT_ATTR_W >= 32
+    uint32_t a = (uint32_t)alpha + (alpha >> 7);
+    if (dst == src) return TB_ERR;
+    if (dst) {
+        // A fully transparent character would still replace the one below
+        if (a == 0) return TB_OK;
+        return cellbuf_blend(&dst->buf, &src->buf, sx, sy, w, h, dx, dy, a);
     }
-    out[0] = c | first;
-    out[len] = '\0';
+    if_not_init_return();
+    if (global.output_mode != TB_OUTPUT_TRUECOLOR) return TB_ERR;
+    if (a == 0) return TB_OK;
+    if (!clip_dst(c, &sx, &sy, &w, &h, &dx, &dy)) return TB_OK;
+    return cellbuf_blend(&global.back, &src->buf, sx, sy, w, h, dx, dy, a);
+#else
+    (void)c;
+    (void)dst;
+    (void)src;
+    (void)sx;
+    (void)sy;
+    (void)w;
+    (void)h;
+    (void)dx;
+    (void)dy;
+    (void)alpha;
+    return TB_ERR;
+#endif
+}
 
-    return len;
+int tb_set_blend_defaults(uint32_t fg, uint32_t bg) {
+    global.blend_defaults_set = 1;
+    global.blend_fg = fg & 0xffffff;
+    global.blend_bg = bg & 0xffffff;
+    return TB_OK;
 }
 
-int tb_last_errno(void) {
-    return global.last_errno;
+int tb_clip_push(int x, int y, int w, int h) {
+    if_not_init_return();
+    int rv;
+    if (global.nclips >= TB_OPT_CLIP_DEPTH) return TB_ERR;
+    rv = tb_clip_make(&global.clips[global.nclips], clip_top(), x, y, w, h);
+    if (rv == TB_OK) global.nclips++;
+    return rv;
 }
 
-const char *tb_strerror(int err) {
-    switch (err) {
-        case TB_OK:
-            return "Success";
-        case TB_ERR_NEED_MORE:
+int tb_clip_make(struct tb_clip *c, const struct tb_clip *parent, int x,
+    int y, int w, int h) {
+    int64_t ax = x, ay = y, x1, y1;
+    if (w < 0 || h < 0) return TB_ERR;
+    if (parent) {
+        ax += parent->ox;
+        ay += parent->oy;
+    }
+    // Kept well inside int so coordinates relative to it cannot overflow
+    ax = ax < -(1 << 30) ? -(1 << 30) : ax > (1 << 30) ? (1 << 30) : ax;
+    ay = ay < -(1 << 30) ? -(1 << 30) : ay > (1 << 30) ? (1 << 30) : ay;
+    x1 = ax + w > (1 << 30) ? (1 << 30) : ax + w;
+    y1 = ay + h > (1 << 30) ? (1 << 30) : ay + h;
+    c->ox = (int)ax;
+    c->oy = (int)ay;
+    c->x0 = (int)ax;
+    c->y0 = (int)ay;
+    c->x1 = (int)x1;
+    c->y1 = (int)y1;
+    if (parent) {
+        if (c->x0 < parent->x0) c->x0 = parent->x0;
+        if (c->y0 < parent->y0) c->y0 = parent->y0;
+        if (c->x1 > parent->x1) c->x1 = parent->x1;
+        if (c->y1 > parent->y1) c->y1 = parent->y1;
+    }
+    return TB_OK;
+}
+
+int tb_clip_pop(void) {
+    if_not_init_return();
+    if (global.nclips == 0) return TB_ERR;
+    global.nclips--;
+    return TB_OK;
+}
+
+int tb_clip_origin(int *x, int *y) {
+    if_not_init_return();
+    if (global.nclips > 0) {
+        *x = global.clips[global.nclips - 1].ox;
+        *y = global.clips[global.nclips - 1].oy;
+    } else {
+        *x = 0;
+        *y = 0;
+    }
+    return global.nclips;
+}
+
+int tb_layer_add(struct tb_surface *s, int x, int y, int z) {
+    if_not_init_return();
+    int id;
+    if (!s) return TB_ERR;
+    for (id = 0; id < TB_OPT_LAYERS_MAX; id++) {
+        struct tb_layer_t *l = &global.layers[id];
+        if (!l->surface) {
+            l->surface = s;
+            l->x = x;
+            l->y = y;
+            l->z = z;
+            l->visible = 1;
+            l->seq = global.layer_seq++;
+            return id;
+        }
+    }
+    return TB_ERR;
+}
+
+int tb_layer_move(int id, int x, int y, int z) {
+    if_not_init_return();
+    if (!tb_layer_surface(id)) return TB_ERR;
+    global.layers[id].x = x;
+    global.layers[id].y = y;
+    global.layers[id].z = z;
+    return TB_OK;
+}
+
+int tb_layer_show(int id, int visible) {
+    if_not_init_return();
+    if (!tb_layer_surface(id)) return TB_ERR;
+    global.layers[id].visible = visible ? 1 : 0;
+    return TB_OK;
+}
+
+int tb_layer_remove(int id) {
+    if_not_init_return();
+    if (!tb_layer_surface(id)) return TB_ERR;
+    memset(&global.layers[id], 0, sizeof(global.layers[id]));
+    return TB_OK;
+}
+
+struct tb_surface *tb_layer_surface(int id) {
+    if (!global.initialized || id < 0 || id >= TB_OPT_LAYERS_MAX) return NULL;
+    return global.layers[id].surface;
+}
+
+struct tb_canvas *tb_canvas_new(int w, int h) {
+    struct tb_canvas *c;
+    if (w < 1 || h < 1) return NULL;
+    c = tb_malloc(sizeof(*c));
+    if (!c) return NULL;
+    memset(c, 0, sizeof(*c));
+    c->width = w;
+    c->height = h;
+    return c;
+}
+
+void tb_canvas_free(struct tb_canvas *c) {
+    size_t i;
+    int j;
+    if (!c) return;
+    for (i = 0; i < c->ctiles; i++) {
+        if (!c->tiles[i].cells) continue;
+        for (j = 0; j < TB_CANVAS_TILE_W * TB_CANVAS_TILE_H; j++) {
+            cell_free(&c->tiles[i].cells[j]);
+        }
+        tb_free(c->tiles[i].cells);
+    }
+    if (c->tiles) tb_free(c->tiles);
+    tb_free(c);
+}
+
+int tb_canvas_width(struct tb_canvas *c) {
+    return c->width;
+}
+
+int tb_canvas_height(struct tb_canvas *c) {
+    return c->height;
+}
+
+int tb_canvas_tiles(struct tb_canvas *c) {
+    return (int)c->ntiles;
+}
+
+int tb_canvas_set_cell(struct tb_canvas *c, int x, int y, uint32_t ch,
+    uintattr_t fg, uintattr_t bg) {
+    int rv;
+    struct tb_cell *cell;
+    if_err_return(rv, canvas_at(c, x, y, &cell));
+    return cell_set(cell, &ch, 1, fg, bg);
+}
+
+int tb_canvas_print(struct tb_canvas *c, int x, int y, uintattr_t fg,
+    uintattr_t bg, size_t *out_w, const char *str) {
+    if (out_w) {
+        *out_w = 0;
+    }
+    return print_at(c, canvas_at, x, y, fg, bg, out_w, str);
+}
+
+int tb_canvas_fill(struct tb_canvas *c, int x, int y, int w, int h,
+    uint32_t ch, uintattr_t fg, uintattr_t bg) {
+    int rv, cx, cy;
+    int64_t x1 = (int64_t)x + w, y1 = (int64_t)y + h;
+    struct tb_cell *cell;
+    if (x1 > c->width) x1 = c->width;
+    if (y1 > c->height) y1 = c->height;
+    if (x < 0) x = 0;
+    if (y < 0) y = 0;
+    for (cy = y; cy < y1; cy++) {
+        for (cx = x; cx < x1; cx++) {
+            if_err_return(rv, canvas_at(c, cx, cy, &cell));
+            if_err_return(rv, cell_set(cell, &ch, 1, fg, bg));
+        }
+    }
+    return TB_OK;
+}
+
+int tb_canvas_show(struct tb_canvas *c, int x, int y, int w, int h) {
+    if_not_init_return();
+    int i, slot = -1;
+    for (i = 0; i < TB_OPT_CANVASES_MAX; i++) {
+        if (global.canvases[i] == c) {
+            slot = i;
+            break;
+        }
+        if (!global.canvases[i] && slot < 0) slot = i;
+    }
+    if (slot < 0) return TB_ERR;
+    if (global.canvases[slot] != c) {
+        global.canvases[slot] = c;
+        c->presented = 0;
+    }
+    // Content scrolled into a different rectangle is not on screen
+    if (c->x != x || c->y != y || c->w != w || c->h != h) c->presented = 0;
+    c->x = x;
+    c->y = y;
+    c->w = w;
+    c->h = h;
+    return TB_OK;
+}
+
+int tb_canvas_hide(struct tb_canvas *c) {
+    if_not_init_return();
+    int i;
+    for (i = 0; i < TB_OPT_CANVASES_MAX; i++) {
+        if (global.canvases[i] == c) {
+            global.canvases[i] = NULL;
+            return TB_OK;
+        }
+    }
+    return TB_ERR;
+}
+
+int tb_canvas_scroll_to(struct tb_canvas *c, int vx, int vy) {
+    c->vx = vx;
+    c->vy = vy;
+    return TB_OK;
+}
+
+struct tb_cell *tb_cell_buffer(void) {
+    if (!global.initialized) return NULL;
+    return global.back.cells;
+}
+
+int tb_utf8_char_length(char c) {
+    return utf8_length[(unsigned char)c];
+}
+
+int tb_utf8_char_to_unicode(uint32_t *out, const char *c) {
+    if (*c == '\0') return 0;
+
+    int i;
+    unsigned char len = tb_utf8_char_length(*c);
+    unsigned char mask = utf8_mask[len - 1];
+    uint32_t result = c[0] & mask;
+    for (i = 1; i < len && c[i] != '\0'; ++i) {
+        result <<= 6;
+        result |= c[i] & 0x3f;
+    }
+
+    if (i != len) return i * -1;
+
+    *out = result;
+    return (int)len;
+}
+
+int tb_utf8_unicode_to_char(char *out, uint32_t c) {
+    int len = 0;
+    int first;
+    int i;
+
+    if (c < 0x80) {
+        first = 0;
+        len = 1;
+    } else if (c < 0x800) {
+        first = 0xc0;
+        len = 2;
+    } else if (c < 0x10000) {
+        first = 0xe0;
+        len = 3;
+    } else if (c < 0x200000) {
+        first = 0xf0;
+        len = 4;
+    } else if (c < 0x4000000) {
+        first = 0xf8;
+        len = 5;
+    } else {
+        first = 0xfc;
+        len = 6;
+    }
+
+    for (i = len - 1; i > 0; --i) {
+        out[i] = (c & 0x3f) | 0x80;
+        c >>= 6;
+    }
+    out[0] = c | first;
+    out[len] = '\0';
+
+    return len;
+}
+
+int tb_last_errno(void) {
+    return global.last_errno;
+}
+
+const char *tb_strerror(int err) {
+    switch (err) {
+        case TB_OK:
+            return "Success";
+        case TB_ERR_NEED_MORE:
             return "Not enough input";
         case TB_ERR_INIT_ALREADY:
             return "Termbox initialized already";
@@ -1995,6 +3526,8 @@ const char *tb_strerror(int err) {
             return "Unsupported terminal";
         case TB_ERR_CAP_COLLISION:
             return "Termcaps collision";
+        case TB_ERR_REPLAY_FORMAT:
+            return "Unrecognized input recording";
         case TB_ERR_RESIZE_SSCANF:
             return "Terminal width/height not received by sscanf() after "
                    "resize";
@@ -2049,18 +3582,20 @@ static int tb_reset(void) {
     global.ttyfd_open = ttyfd_open;
     global.resize_pipefd[0] = -1;
     global.resize_pipefd[1] = -1;
+    global.recordfd = -1;
     global.width = -1;
     global.height = -1;
     global.cursor_x = -1;
     global.cursor_y = -1;
-    global.last_x = -1;
-    global.last_y = -1;
+    global.enc.last_x = -1;
+    global.enc.last_y = -1;
     global.fg = TB_DEFAULT;
     global.bg = TB_DEFAULT;
-    global.last_fg = ~global.fg;
-    global.last_bg = ~global.bg;
+    global.enc.last_fg = ~global.fg;
+    global.enc.last_bg = ~global.bg;
     global.input_mode = TB_INPUT_ESC;
     global.output_mode = TB_OUTPUT_NORMAL;
+    global.present_threads = 1;
     return TB_OK;
 }
 
@@ -2081,6 +3616,7 @@ static int init_term_attrs(void) {
     cfmakeraw(&tios);
     tios.c_cc[VMIN] = 1;
     tios.c_cc[VTIME] = 0;
+    memcpy(&global.raw_tios, &tios, sizeof(tios));
 
     if (tcsetattr(global.ttyfd, TCSAFLUSH, &tios) != 0) {
         global.last_errno = errno;
@@ -2102,10 +3638,27 @@ int tb_printf_inner(int x, int y, uintattr_t fg, uintattr_t bg, size_t *out_w,
 }
 
 static int init_term_caps(void) {
+#ifdef TB_OPT_PREFER_BUILTIN
+    // Zero I/O for known terminals, unless terminfo was asked for explicitly
+    if (!getenv("TERMINFO") && load_builtin_caps(1) == TB_OK) {
+        return TB_OK;
+    }
+#endif
+#ifdef TB_OPT_CAP_CACHE
+    if (load_cap_cache() == TB_OK) {
+        return TB_OK;
+    }
+#endif
     if (load_terminfo() == TB_OK) {
-        return parse_terminfo_caps();
+        int rv;
+        if_err_return(rv, parse_terminfo_caps());
+#ifdef TB_OPT_CAP_CACHE
+        // Best effort; a missing cache only costs the next tb_init a parse
+        save_cap_cache();
+#endif
+        return TB_OK;
     }
-    return load_builtin_caps();
+    return load_builtin_caps(0);
 }
 
 static int init_cap_trie(void) {
@@ -2231,6 +3784,10 @@ static int init_resize_handler(void) {
         return TB_ERR_RESIZE_PIPE;
     }
 
+    return init_resize_sigaction();
+}
+
+static int init_resize_sigaction(void) {
     struct sigaction sa;
     memset(&sa, 0, sizeof(sa));
     sa.sa_handler = handle_resize;
@@ -2242,99 +3799,89 @@ static int init_resize_handler(void) {
     return TB_OK;
 }
 
+static int init_suspend_handler(void) {
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = handle_suspend;
+    if (sigaction(SIGTSTP, &sa, NULL) != 0 ||
+        sigaction(SIGCONT, &sa, NULL) != 0)
+    {
+        global.last_errno = errno;
+        return TB_ERR_RESIZE_SIGACTION;
+    }
+
+    return TB_OK;
+}
+
 static int send_init_escape_codes(void) {
     int rv;
-    if_err_return(rv, bytebuf_puts(&global.out, global.caps[TB_CAP_ENTER_CA]));
     if_err_return(rv,
-        bytebuf_puts(&global.out, global.caps[TB_CAP_ENTER_KEYPAD]));
+        bytebuf_puts(&global.enc.out, global.caps[TB_CAP_ENTER_CA]));
     if_err_return(rv,
-        bytebuf_puts(&global.out, global.caps[TB_CAP_HIDE_CURSOR]));
+        bytebuf_puts(&global.enc.out, global.caps[TB_CAP_ENTER_KEYPAD]));
+    if_err_return(rv,
+        bytebuf_puts(&global.enc.out, global.caps[TB_CAP_HIDE_CURSOR]));
     return TB_OK;
 }
 
 static int send_clear(void) {
     int rv;
 
-    if_err_return(rv, send_attr(global.fg, global.bg));
+    if_err_return(rv, send_attr(&global.enc, global.fg, global.bg));
     if_err_return(rv,
-        bytebuf_puts(&global.out, global.caps[TB_CAP_CLEAR_SCREEN]));
+        bytebuf_puts(&global.enc.out, global.caps[TB_CAP_CLEAR_SCREEN]));
 
-    if_err_return(rv, send_cursor_if(global.cursor_x, global.cursor_y));
-    if_err_return(rv, bytebuf_flush(&global.out, global.wfd));
+    if_err_return(rv,
+        send_cursor_if(&global.enc, global.cursor_x, global.cursor_y));
+    if_err_return(rv, flush_out());
 
-    global.last_x = -1;
-    global.last_y = -1;
+    global.enc.last_x = -1;
+    global.enc.last_y = -1;
 
     return TB_OK;
 }
 
 static int update_term_size(void) {
-    int rv, ioctl_errno;
-
-    if (global.ttyfd < 0) {
-        return TB_OK;
-    }
+#ifndef TB_RESIZE_FALLBACK_W
+#define TB_RESIZE_FALLBACK_W 80
+#endif
+#ifndef TB_RESIZE_FALLBACK_H
+#define TB_RESIZE_FALLBACK_H 24
+#endif
 
+    int fd = global.ttyfd >= 0 ? global.ttyfd : global.wfd;
     struct winsize sz;
     memset(&sz, 0, sizeof(sz));
 
-    // Try ioctl TIOCGWINSZ
-    if (ioctl(global.ttyfd, TIOCGWINSZ, &sz) == 0) {
+    // Try ioctl TIOCGWINSZ. Some serial consoles succeed but report 0x0.
+    if (ioctl(fd, TIOCGWINSZ, &sz) == 0 && sz.ws_col > 0 && sz.ws_row > 0) {
         global.width = sz.ws_col;
         global.height = sz.ws_row;
         return TB_OK;
     }
-    ioctl_errno = errno;
 
-    // Try >cursor(9999,9999), >u7, <u6
-    if_ok_return(rv, update_term_size_via_esc());
-
-    global.last_errno = ioctl_errno;
-    return TB_ERR_RESIZE_IOCTL;
+    // Keep going with a provisional size (the last known one, if any) and let
+    // the terminal tell us the real one
+    if (global.width <= 0 || global.height <= 0) {
+        global.width = TB_RESIZE_FALLBACK_W;
+        global.height = TB_RESIZE_FALLBACK_H;
+    }
+    return update_term_size_via_esc();
 }
 
 static int update_term_size_via_esc(void) {
-#ifndef TB_RESIZE_FALLBACK_MS
-#define TB_RESIZE_FALLBACK_MS 1000
-#endif
-
+    // >cursor(9999,9999), >u7. The <u6 reply arrives with the rest of the
+    // input and is picked up by extract_esc_cpr(), which turns it into a
+    // TB_EVENT_RESIZE, so nothing blocks here and no input is lost.
     char *move_and_report = "\x1b[9999;9999H\x1b[6n";
     ssize_t write_rv =
         write(global.wfd, move_and_report, strlen(move_and_report));
     if (write_rv != (ssize_t)strlen(move_and_report)) {
-        return TB_ERR_RESIZE_WRITE;
-    }
-
-    fd_set fds;
-    FD_ZERO(&fds);
-    FD_SET(global.rfd, &fds);
-
-    struct timeval timeout;
-    timeout.tv_sec = 0;
-    timeout.tv_usec = TB_RESIZE_FALLBACK_MS * 1000;
-
-    int select_rv = select(global.rfd + 1, &fds, NULL, NULL, &timeout);
-
-    if (select_rv != 1) {
-        global.last_errno = errno;
-        return TB_ERR_RESIZE_POLL;
-    }
-
-    char buf[TB_OPT_READ_BUF];
-    ssize_t read_rv = read(global.rfd, buf, sizeof(buf) - 1);
-    if (read_rv < 1) {
         global.last_errno = errno;
-        return TB_ERR_RESIZE_READ;
-    }
-    buf[read_rv] = '\0';
-
-    int rw, rh;
-    if (sscanf(buf, "\x1b[%d;%dR", &rh, &rw) != 2) {
-        return TB_ERR_RESIZE_SSCANF;
+        return TB_ERR_RESIZE_WRITE;
     }
 
-    global.width = rw;
-    global.height = rh;
+    global.size_probe_ts = monotonic_ns();
     return TB_OK;
 }
 
@@ -2349,13 +3896,18 @@ static int init_cellbuf(void) {
 
 static int tb_deinit(void) {
     if (global.caps[0] != NULL && global.wfd >= 0) {
-        bytebuf_puts(&global.out, global.caps[TB_CAP_SHOW_CURSOR]);
-        bytebuf_puts(&global.out, global.caps[TB_CAP_SGR0]);
-        bytebuf_puts(&global.out, global.caps[TB_CAP_CLEAR_SCREEN]);
-        bytebuf_puts(&global.out, global.caps[TB_CAP_EXIT_CA]);
-        bytebuf_puts(&global.out, global.caps[TB_CAP_EXIT_KEYPAD]);
-        bytebuf_puts(&global.out, TB_HARDCAP_EXIT_MOUSE);
-        bytebuf_flush(&global.out, global.wfd);
+        bytebuf_puts(&global.enc.out, global.caps[TB_CAP_SHOW_CURSOR]);
+        bytebuf_puts(&global.enc.out, global.caps[TB_CAP_SGR0]);
+        bytebuf_puts(&global.enc.out, global.caps[TB_CAP_CLEAR_SCREEN]);
+        bytebuf_puts(&global.enc.out, global.caps[TB_CAP_EXIT_CA]);
+        bytebuf_puts(&global.enc.out, global.caps[TB_CAP_EXIT_KEYPAD]);
+        bytebuf_puts(&global.enc.out, TB_HARDCAP_EXIT_MOUSE);
+        if (global.input_mode & TB_INPUT_FOCUS) {
+            bytebuf_puts(&global.enc.out, TB_HARDCAP_EXIT_FOCUS);
+        }
+        // Drain the backlog ahead of the reset, blocking if need be
+        bytebuf_flush(&global.backlog, global.wfd);
+        bytebuf_flush(&global.enc.out, global.wfd);
     }
     if (global.ttyfd >= 0) {
         if (global.has_orig_tios) {
@@ -2368,15 +3920,26 @@ static int tb_deinit(void) {
     }
 
     sigaction(SIGWINCH, &(struct sigaction){.sa_handler = SIG_DFL}, NULL);
+    sigaction(SIGTSTP, &(struct sigaction){.sa_handler = SIG_DFL}, NULL);
+    sigaction(SIGCONT, &(struct sigaction){.sa_handler = SIG_DFL}, NULL);
     if (global.resize_pipefd[0] >= 0) close(global.resize_pipefd[0]);
     if (global.resize_pipefd[1] >= 0) close(global.resize_pipefd[1]);
+    if (global.recordfd >= 0) close(global.recordfd);
 
+    present_pool_stop();
+    replay_free();
     cellbuf_free(&global.back);
     cellbuf_free(&global.front);
     bytebuf_free(&global.in);
-    bytebuf_free(&global.out);
+    bytebuf_free(&global.enc.out);
+    bytebuf_free(&global.backlog);
+    if (global.layer_saved) tb_free(global.layer_saved);
 
     if (global.terminfo) tb_free(global.terminfo);
+    if (global.caps_owned) tb_free(global.caps_owned);
+#ifdef TB_OPT_CAP_CACHE
+    if (global.cap_cache) munmap(global.cap_cache, global.ncap_cache);
+#endif
 
     cap_trie_deinit(&global.cap_trie);
 
@@ -2488,6 +4051,10 @@ static int read_terminfo_path(const char *path) {
 
     global.terminfo = data;
     global.nterminfo = fsize;
+#ifdef TB_OPT_CAP_CACHE
+    snprintf(global.terminfo_path, sizeof(global.terminfo_path), "%s", path);
+    global.terminfo_st = st;
+#endif
 
     fclose(fp);
     return TB_OK;
@@ -2545,38 +4112,481 @@ static int parse_terminfo_caps(void) {
     return TB_OK;
 }
 
-static int load_builtin_caps(void) {
-    int i, j;
-    const char *term = getenv("TERM");
+#ifdef TB_OPT_CAP_CACHE
+static int load_cap_cache(void) {
+    int rv;
+    char key[TB_PATH_MAX];
+    char path[TB_PATH_MAX];
+    size_t nkey;
 
-    if (!term) {
-        return TB_ERR_NO_TERM;
+    if_err_return(rv, cap_cache_key(key, sizeof(key), &nkey));
+    if_err_return(rv, cap_cache_path(path, sizeof(path), key, nkey, 0));
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return TB_ERR;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 ||
+        (size_t)st.st_size < sizeof(struct tb_cap_cache_t))
+    {
+        close(fd);
+        return TB_ERR;
+    }
+    size_t nmap = st.st_size;
+    char *map = mmap(NULL, nmap, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return TB_ERR;
     }
 
-    // Check for exact TERM match
-    for (i = 0; builtin_terms[i].name != NULL; i++) {
-        if (strcmp(term, builtin_terms[i].name) == 0) {
-            for (j = 0; j < TB_CAP__COUNT; j++) {
-                global.caps[j] = builtin_terms[i].caps[j];
-            }
-            return TB_OK;
+    // Validate everything before trusting a single pointer into the map
+    struct tb_cap_cache_t *hdr = (struct tb_cap_cache_t *)map;
+    const char *ckey = map + sizeof(*hdr);
+    const char *cpath = ckey + hdr->nkey;
+    const char *strs = cpath + hdr->npath;
+    struct stat src;
+    int i;
+    rv = TB_ERR;
+    do {
+        if (memcmp(hdr->magic, TB_CAP_CACHE_MAGIC, 8) != 0) break;
+        if (hdr->ncaps != TB_CAP__COUNT) break;
+        if ((uint64_t)hdr->nkey + hdr->npath + hdr->nstrs !=
+            nmap - sizeof(*hdr))
+            break;
+        if (hdr->nkey != nkey || memcmp(ckey, key, nkey) != 0) break;
+        if (hdr->npath == 0 || cpath[hdr->npath - 1] != '\0') break;
+        if (hdr->nstrs == 0 || strs[hdr->nstrs - 1] != '\0') break;
+        for (i = 0; i < TB_CAP__COUNT; i++) {
+            if (hdr->cap_offs[i] >= hdr->nstrs) break;
         }
+        if (i < TB_CAP__COUNT) break;
+
+        // Stale if the terminfo file it came from was touched
+        if (stat(cpath, &src) != 0) break;
+        if ((int64_t)src.st_mtime != hdr->src_mtime ||
+            (int64_t)src.st_size != hdr->src_size ||
+            (uint64_t)src.st_ino != hdr->src_ino)
+            break;
+
+        rv = TB_OK;
+    } while (0);
+
+    if (rv != TB_OK) {
+        munmap(map, nmap);
+        return rv;
     }
 
-    // Check for partial TERM or alias match
-    for (i = 0; builtin_terms[i].name != NULL; i++) {
-        if (strstr(term, builtin_terms[i].name) != NULL ||
-            (*(builtin_terms[i].alias) != '\0' &&
-                strstr(term, builtin_terms[i].alias) != NULL))
+    for (i = 0; i < TB_CAP__COUNT; i++) {
+        global.caps[i] = strs + hdr->cap_offs[i];
+    }
+    global.cap_cache = map;
+    global.ncap_cache = nmap;
+    return TB_OK;
+}
+
+static int save_cap_cache(void) {
+    int rv, i;
+    char key[TB_PATH_MAX];
+    char path[TB_PATH_MAX];
+    char tmp[TB_PATH_MAX];
+    size_t nkey;
+    struct bytebuf_t strs = {0};
+
+    if_err_return(rv, cap_cache_key(key, sizeof(key), &nkey));
+    if_err_return(rv, cap_cache_path(path, sizeof(path), key, nkey, 1));
+    snprintf_or_return(rv, tmp, sizeof(tmp), "%s.%ld", path, (long)getpid());
+
+    struct tb_cap_cache_t hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, TB_CAP_CACHE_MAGIC, 8);
+    hdr.ncaps = TB_CAP__COUNT;
+    hdr.nkey = (uint32_t)nkey;
+    hdr.npath = (uint32_t)strlen(global.terminfo_path) + 1;
+    hdr.src_mtime = (int64_t)global.terminfo_st.st_mtime;
+    hdr.src_size = (int64_t)global.terminfo_st.st_size;
+    hdr.src_ino = (uint64_t)global.terminfo_st.st_ino;
+    for (i = 0; i < TB_CAP__COUNT; i++) {
+        hdr.cap_offs[i] = (uint32_t)strs.len;
+        if ((rv = bytebuf_nputs(&strs, global.caps[i],
+                 strlen(global.caps[i]) + 1)) != TB_OK)
         {
-            for (j = 0; j < TB_CAP__COUNT; j++) {
-                global.caps[j] = builtin_terms[i].caps[j];
-            }
-            return TB_OK;
+            bytebuf_free(&strs);
+            return rv;
         }
     }
+    hdr.nstrs = (uint32_t)strs.len;
 
-    return TB_ERR_UNSUPPORTED_TERM;
+    // Write to a private name and rename over the real one so concurrent
+    // tb_init calls never map a half-written cache
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0) {
+        bytebuf_free(&strs);
+        return TB_ERR;
+    }
+    rv = TB_ERR;
+    if (write(fd, &hdr, sizeof(hdr)) == (ssize_t)sizeof(hdr) &&
+        write(fd, key, nkey) == (ssize_t)nkey &&
+        write(fd, global.terminfo_path, hdr.npath) == (ssize_t)hdr.npath &&
+        write(fd, strs.buf, strs.len) == (ssize_t)strs.len)
+    {
+        rv = TB_OK;
+    }
+    close(fd);
+    bytebuf_free(&strs);
+
+    if (rv != TB_OK || rename(tmp, path) != 0) {
+        unlink(tmp);
+        return TB_ERR;
+    }
+    return TB_OK;
+}
+
+static int cap_cache_key(char *key, size_t nkey, size_t *out_nkey) {
+    // Everything load_terminfo() looks at, so a cache built under one
+    // environment is never used under another. The version covers changes
+    // to the cap list itself.
+    const char *term = getenv("TERM");
+    const char *terminfo = getenv("TERMINFO");
+    const char *dirs = getenv("TERMINFO_DIRS");
+    const char *home = getenv("HOME");
+    if (!term) {
+        return TB_ERR_NO_TERM;
+    }
+    int rv = snprintf(key, nkey, "%s%c%s%c%s%c%s%c%s", TB_VERSION_STR, 0,
+        term, 0, terminfo ? terminfo : "", 0, dirs ? dirs : "", 0,
+        home ? home : "");
+    if (rv < 0 || (size_t)rv >= nkey) {
+        return TB_ERR;
+    }
+    *out_nkey = (size_t)rv;
+    return TB_OK;
+}
+#endif /* TB_OPT_CAP_CACHE */
+
+#if defined TB_OPT_CAP_CACHE || defined TB_OPT_PROBE
+static int cap_cache_path(char *path, size_t npath, const char *key,
+    size_t nkey, int mkdirs) {
+    int rv;
+    char base[TB_PATH_MAX];
+    char dir[TB_PATH_MAX];
+    const char *xdg = getenv("XDG_CACHE_HOME");
+    const char *home = getenv("HOME");
+
+    // Relative XDG_CACHE_HOME is invalid per the XDG spec and is ignored
+    if (xdg && *xdg == '/') {
+        snprintf_or_return(rv, base, sizeof(base), "%s", xdg);
+    } else if (home && *home != '\0') {
+        snprintf_or_return(rv, base, sizeof(base), "%s/.cache", home);
+    } else {
+        return TB_ERR;
+    }
+    snprintf_or_return(rv, dir, sizeof(dir), "%s/termbox2", base);
+    if (mkdirs) {
+        mkdir(base, 0700);
+        mkdir(dir, 0700);
+    }
+
+    // FNV-1a of the key names the file; the key itself is stored inside and
+    // compared on load, so collisions only cost a reparse
+    uint64_t hash = 0xcbf29ce484222325ull;
+    size_t i;
+    for (i = 0; i < nkey; i++) {
+        hash = (hash ^ (unsigned char)key[i]) * 0x100000001b3ull;
+    }
+    snprintf_or_return(rv, path, npath, "%s/%016llx", dir,
+        (unsigned long long)hash);
+    return TB_OK;
+}
+#endif
+
+static int init_features(void) {
+    // What the environment tells us for free; the probe refines the rest
+    const char *colorterm = getenv("COLORTERM");
+    if (colorterm &&
+        (strcmp(colorterm, "truecolor") == 0 || strcmp(colorterm, "24bit") == 0))
+    {
+        global.features |= TB_FEATURE_TRUECOLOR;
+    }
+#ifdef TB_OPT_PROBE
+    global.probe_features = global.features;
+    load_probe_cache();
+    return send_probe();
+#else
+    return TB_OK;
+#endif
+}
+
+#ifdef TB_OPT_PROBE
+static int send_probe(void) {
+#ifndef TB_PROBE_TIMEOUT_MS
+#define TB_PROBE_TIMEOUT_MS 1000
+#endif
+
+    // Every terminal answers DA1, and answers in order, so it goes last and
+    // its reply marks the end of the probe. The others are ignored by
+    // terminals that do not know them.
+    char *probe = "\x1b[?2026$p" // DECRQM synchronized output
+                  "\x1b[?2004$p" // DECRQM bracketed paste
+                  "\x1b[?u"      // Kitty keyboard flags
+                  "\x1b[>0q"     // XTVERSION
+                  "\x1b[c";      // DA1
+    ssize_t write_rv = write(global.wfd, probe, strlen(probe));
+    if (write_rv != (ssize_t)strlen(probe)) {
+        global.last_errno = errno;
+        return TB_ERR;
+    }
+
+    global.probe_ts = monotonic_ns();
+    return TB_OK;
+}
+
+static void finish_probe(void) {
+    // Features that cannot be queried, vouched for by the terminal's name
+    static const char *rep_terms[] = {"XTerm(", "kitty(", "foot(", "WezTerm ",
+        "ghostty ", "contour ", NULL};
+    static const char *truecolor_terms[] = {"iTerm2 ", "tmux ", NULL};
+    const char **t;
+
+    for (t = rep_terms; *t; t++) {
+        if (strncmp(global.probe_version, *t, strlen(*t)) == 0) {
+            global.probe_features |= TB_FEATURE_REP | TB_FEATURE_TRUECOLOR;
+        }
+    }
+    for (t = truecolor_terms; *t; t++) {
+        if (strncmp(global.probe_version, *t, strlen(*t)) == 0) {
+            global.probe_features |= TB_FEATURE_TRUECOLOR;
+        }
+    }
+
+    global.probe_ts = 0;
+    if (global.features != global.probe_features ||
+        strcmp(global.term_version, global.probe_version) != 0)
+    {
+        global.features = global.probe_features;
+        memcpy(global.term_version, global.probe_version,
+            sizeof(global.term_version));
+        save_probe_cache();
+    }
+}
+
+static int load_probe_cache(void) {
+    int rv;
+    char key[TB_PATH_MAX];
+    char path[TB_PATH_MAX];
+    char ckey[TB_PATH_MAX];
+    size_t nkey;
+    struct tb_probe_cache_t hdr;
+
+    if_err_return(rv, probe_cache_key(key, sizeof(key), &nkey));
+    if_err_return(rv, cap_cache_path(path, sizeof(path), key, nkey, 0));
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return TB_ERR;
+    }
+    rv = TB_ERR;
+    if (read(fd, &hdr, sizeof(hdr)) == (ssize_t)sizeof(hdr) &&
+        memcmp(hdr.magic, TB_PROBE_CACHE_MAGIC, 8) == 0 && hdr.nkey == nkey &&
+        read(fd, ckey, nkey) == (ssize_t)nkey && memcmp(ckey, key, nkey) == 0 &&
+        hdr.term_version[sizeof(hdr.term_version) - 1] == '\0')
+    {
+        rv = TB_OK;
+    }
+    close(fd);
+    if (rv != TB_OK) {
+        return rv;
+    }
+
+    global.features |= (int)hdr.features;
+    memcpy(global.term_version, hdr.term_version, sizeof(global.term_version));
+    return TB_OK;
+}
+
+static int save_probe_cache(void) {
+    int rv;
+    char key[TB_PATH_MAX];
+    char path[TB_PATH_MAX];
+    char tmp[TB_PATH_MAX];
+    size_t nkey;
+    struct tb_probe_cache_t hdr;
+
+    if_err_return(rv, probe_cache_key(key, sizeof(key), &nkey));
+    if_err_return(rv, cap_cache_path(path, sizeof(path), key, nkey, 1));
+    snprintf_or_return(rv, tmp, sizeof(tmp), "%s.%ld", path, (long)getpid());
+
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, TB_PROBE_CACHE_MAGIC, 8);
+    hdr.nkey = (uint32_t)nkey;
+    hdr.features = (uint32_t)global.features;
+    memcpy(hdr.term_version, global.term_version, sizeof(hdr.term_version));
+
+    // Same write-then-rename as save_cap_cache()
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0) {
+        return TB_ERR;
+    }
+    rv = TB_ERR;
+    if (write(fd, &hdr, sizeof(hdr)) == (ssize_t)sizeof(hdr) &&
+        write(fd, key, nkey) == (ssize_t)nkey)
+    {
+        rv = TB_OK;
+    }
+    close(fd);
+
+    if (rv != TB_OK || rename(tmp, path) != 0) {
+        unlink(tmp);
+        return TB_ERR;
+    }
+    return TB_OK;
+}
+
+static int probe_cache_key(char *key, size_t nkey, size_t *out_nkey) {
+    // The variables terminals set to identify themselves. Terminals that
+    // share a TERM and set none of these share an entry; the probe corrects
+    // it within one round trip of startup.
+    static const char *vars[] = {"TERM", "TERM_PROGRAM", "TERM_PROGRAM_VERSION",
+        "LC_TERMINAL", "LC_TERMINAL_VERSION", "VTE_VERSION", "TMUX", NULL};
+    const char **v;
+    size_t len;
+    int rv;
+
+    rv = snprintf(key, nkey, "probe%c%s", 0, TB_VERSION_STR);
+    if (rv < 0 || (size_t)rv >= nkey) {
+        return TB_ERR;
+    }
+    len = (size_t)rv;
+    for (v = vars; *v; v++) {
+        const char *val = getenv(*v);
+        if (strcmp(*v, "TMUX") == 0 && val) {
+            val = "1"; // A socket path, the same terminal either way
+        }
+        rv = snprintf(key + len, nkey - len, "%c%s", 0, val ? val : "");
+        if (rv < 0 || (size_t)rv >= nkey - len) {
+            return TB_ERR;
+        }
+        len += (size_t)rv;
+    }
+    *out_nkey = len;
+    return TB_OK;
+}
+
+static int extract_probe_reply(void) {
+    struct bytebuf_t *in = &global.in;
+    size_t i;
+
+    // Only while the probe is outstanding, like extract_esc_cpr()
+    if (!global.probe_ts) {
+        return TB_ERR;
+    }
+    if (monotonic_ns() - global.probe_ts >
+        (uint64_t)TB_PROBE_TIMEOUT_MS * 1000000)
+    {
+        // Never answered; keep what the cache said
+        global.probe_ts = 0;
+        return TB_ERR;
+    }
+
+    if (in->len >= 4 && strncmp(in->buf, "\x1bP>|", 4) == 0) {
+        // XTVERSION: DCS > | name ST
+        for (i = 4; i + 1 < in->len; i++) {
+            if (in->buf[i] == '\x1b' && in->buf[i + 1] == '\\') break;
+        }
+        if (i + 1 >= in->len) {
+            return in->len < 256 ? TB_ERR_NEED_MORE : TB_ERR;
+        }
+        size_t n = i - 4;
+        if (n >= sizeof(global.probe_version)) {
+            n = sizeof(global.probe_version) - 1;
+        }
+        memcpy(global.probe_version, in->buf + 4, n);
+        global.probe_version[n] = '\0';
+        bytebuf_shift(in, i + 2);
+        return TB_OK;
+    }
+
+    if (in->len < 3 || strncmp(in->buf, "\x1b[?", 3) != 0) {
+        return TB_ERR;
+    }
+
+    // \x1b [ ? params [$] final
+    int p[2] = {0, 0};
+    int np = 0, dollar = 0;
+    for (i = 3; i < in->len; i++) {
+        char c = in->buf[i];
+        if (c >= '0' && c <= '9' && !dollar) {
+            if (np < 2 && p[np] < 100000) p[np] = p[np] * 10 + (c - '0');
+        } else if (c == ';' && !dollar) {
+            np++;
+        } else if (c == '$' && !dollar) {
+            dollar = 1;
+        } else {
+            break;
+        }
+    }
+    if (i == in->len) {
+        return i < 64 ? TB_ERR_NEED_MORE : TB_ERR;
+    }
+
+    char final = in->buf[i];
+    if (dollar && final == 'y' && np == 1) {
+        // DECRPM: 1 set, 2 reset, 3 permanently set; 0 and 4 mean no
+        int supported = p[1] >= 1 && p[1] <= 3;
+        int bit = p[0] == 2026   ? TB_FEATURE_SYNC_OUTPUT
+                  : p[0] == 2004 ? TB_FEATURE_BRACKETED_PASTE
+                                 : 0;
+        if (supported) global.probe_features |= bit;
+    } else if (!dollar && final == 'u' && np == 0) {
+        global.probe_features |= TB_FEATURE_KITTY_KEYBOARD;
+    } else if (!dollar && final == 'c') {
+        bytebuf_shift(in, i + 1);
+        finish_probe();
+        return TB_OK;
+    } else {
+        return TB_ERR;
+    }
+
+    bytebuf_shift(in, i + 1);
+    return TB_OK;
+}
+#endif /* TB_OPT_PROBE */
+
+static int load_builtin_caps(int exact_only) {
+    int i, j;
+    const char *term = getenv("TERM");
+
+    if (!term) {
+        return TB_ERR_NO_TERM;
+    }
+
+    // Check for exact TERM match
+    for (i = 0; builtin_terms[i].name != NULL; i++) {
+        if (strcmp(term, builtin_terms[i].name) == 0) {
+            for (j = 0; j < TB_CAP__COUNT; j++) {
+                global.caps[j] = builtin_terms[i].caps[j];
+            }
+            return TB_OK;
+        }
+    }
+
+    if (exact_only) {
+        return TB_ERR_UNSUPPORTED_TERM;
+    }
+
+    // Check for partial TERM or alias match
+    for (i = 0; builtin_terms[i].name != NULL; i++) {
+        if (strstr(term, builtin_terms[i].name) != NULL ||
+            (*(builtin_terms[i].alias) != '\0' &&
+                strstr(term, builtin_terms[i].alias) != NULL))
+        {
+            for (j = 0; j < TB_CAP__COUNT; j++) {
+                global.caps[j] = builtin_terms[i].caps[j];
+            }
+            return TB_OK;
+        }
+    }
+
+    return TB_ERR_UNSUPPORTED_TERM;
 }
 
 static const char *get_terminfo_string(int16_t str_offsets_pos,
@@ -2614,66 +4624,534 @@ static int wait_event(struct tb_event *event, int timeout) {
     int rv;
     char buf[TB_OPT_READ_BUF];
 
-    memset(event, 0, sizeof(*event));
-    if_ok_return(rv, extract_event(event));
+    if ((rv = extract_timed_event(event)) == TB_OK) {
+        return rv;
+    }
+
+    if (global.replay_pos < global.nreplay) {
+        // Replaying recorded input; the tty is left alone until it runs out
+        return wait_replay_event(event, timeout);
+    }
+    if (global.replay_in) {
+        // A recording cut off mid-sequence must not prefix the first tty read
+        in_forget(global.in.len);
+        bytebuf_shift(&global.in, global.in.len);
+        global.replay_in = 0;
+    }
+
+    fd_set fds;
+    struct timeval tv;
+    tv.tv_sec = timeout / 1000;
+    tv.tv_usec = (timeout - (tv.tv_sec * 1000)) * 1000;
+
+    do {
+        FD_ZERO(&fds);
+        FD_SET(global.rfd, &fds);
+        FD_SET(global.resize_pipefd[0], &fds);
+
+        int maxfd = global.resize_pipefd[0] > global.rfd
+                        ? global.resize_pipefd[0]
+                        : global.rfd;
+
+        int select_rv =
+            select(maxfd + 1, &fds, NULL, NULL, (timeout < 0) ? NULL : &tv);
+
+        if (select_rv < 0) {
+            // Let EINTR/EAGAIN bubble up
+            global.last_errno = errno;
+            return TB_ERR_POLL;
+        } else if (select_rv == 0) {
+            return TB_ERR_NO_EVENT;
+        }
+
+        int tty_has_events = (FD_ISSET(global.rfd, &fds));
+        int resize_has_events = (FD_ISSET(global.resize_pipefd[0], &fds));
+
+        if (tty_has_events) {
+            ssize_t read_rv = read(global.rfd, buf, sizeof(buf));
+            if (read_rv < 0) {
+                global.last_errno = errno;
+                return TB_ERR_READ;
+            } else if (read_rv > 0) {
+                bytebuf_nputs(&global.in, buf, read_rv);
+                in_mark(monotonic_ns());
+                if (global.recordfd >= 0) {
+                    record_input(0, buf, read_rv);
+                }
+            }
+        }
+
+        if (resize_has_events) {
+            int sig = 0;
+            read(global.resize_pipefd[0], &sig, sizeof(sig));
+            if (sig == SIGTSTP) {
+                // Returns once resumed, with raw mode re-entered
+                if_err_return(rv, suspend_tty());
+            } else if (sig == SIGCONT && global.ttyfd >= 0 &&
+                       global.has_orig_tios)
+            {
+                // Continued after an uncatchable SIGSTOP
+                tcsetattr(global.ttyfd, TCSADRAIN, &global.raw_tios);
+            }
+            // TODO Harden against errors encountered mid-resize
+            if_err_return(rv, update_term_size());
+            if_err_return(rv, resize_cellbufs());
+            if (global.recordfd >= 0) {
+                char sz[4] = {(char)(global.width & 0xff),
+                    (char)(global.width >> 8), (char)(global.height & 0xff),
+                    (char)(global.height >> 8)};
+                record_input(TB_REPLAY_RESIZE_BIT, sz, sizeof(sz));
+            }
+            if (sig == SIGTSTP || sig == SIGCONT) {
+                // The screen was handed back to the shell meanwhile, so
+                // repaint what the back buffer last held
+                if_err_return(rv, tb_present());
+            }
+            event->type = TB_EVENT_RESIZE;
+            event->w = global.width;
+            event->h = global.height;
+            event->ts = monotonic_ns();
+            return TB_OK;
+        }
+
+        if ((rv = extract_timed_event(event)) == TB_OK) {
+            return rv;
+        }
+    } while (timeout == -1);
+
+    return rv;
+}
+
+static int wait_replay_event(struct tb_event *event, int timeout) {
+    int rv;
+    uint64_t deadline = monotonic_ns() + (uint64_t)(timeout > 0 ? timeout : 0) *
+                                             1000000;
+
+    while (global.replay_pos < global.nreplay) {
+        struct tb_replay_rec_t *rec = &global.replay[global.replay_pos];
+        uint64_t now = monotonic_ns();
+        uint64_t due = tb_input_replay_due();
+
+        if (due > now) {
+            uint64_t until = (timeout >= 0 && deadline < due) ? deadline : due;
+            if (until > now) {
+                struct timeval tv;
+                tv.tv_sec = (until - now) / 1000000000;
+                tv.tv_usec = ((until - now) % 1000000000) / 1000;
+                select(0, NULL, NULL, NULL, &tv);
+            }
+            if (timeout >= 0 && monotonic_ns() >= deadline) {
+                return TB_ERR_NO_EVENT;
+            }
+            continue;
+        }
+
+        global.replay_pos++;
+
+        if (rec->w > 0 && rec->h > 0) {
+            global.width = rec->w;
+            global.height = rec->h;
+            if_err_return(rv, resize_cellbufs());
+            event->type = TB_EVENT_RESIZE;
+            event->w = global.width;
+            event->h = global.height;
+            event->ts = now;
+            return TB_OK;
+        }
+
+        if_err_return(rv, bytebuf_nputs(&global.in,
+                              global.replay_bytes.buf + rec->off, rec->len));
+        in_mark(now);
+        global.replay_in = 1;
+
+        if ((rv = extract_timed_event(event)) == TB_OK) {
+            return rv;
+        }
+    }
+
+    return TB_ERR_NO_EVENT;
+}
+
+static int replay_load(const char *path) {
+    int rv;
+    FILE *fp = fopen(path, "rb");
+    if (!fp) {
+        global.last_errno = errno;
+        return TB_ERR_INIT_OPEN;
+    }
+
+    struct stat st;
+    if (fstat(fileno(fp), &st) != 0) {
+        global.last_errno = errno;
+        fclose(fp);
+        return TB_ERR_READ;
+    }
+
+    // NUL-terminated so strtod() and friends stop at the end of the data
+    size_t fsize = st.st_size;
+    char *data = tb_malloc(fsize + 1);
+    if (!data) {
+        fclose(fp);
+        return TB_ERR_MEM;
+    }
+    if (fread(data, 1, fsize, fp) != fsize) {
+        global.last_errno = errno;
+        fclose(fp);
+        tb_free(data);
+        return TB_ERR_READ;
+    }
+    data[fsize] = '\0';
+    fclose(fp);
+
+    if (fsize >= 8 && memcmp(data, TB_REPLAY_MAGIC, 8) == 0) {
+        rv = replay_load_records(data + 8, fsize - 8);
+    } else {
+        rv = replay_load_asciicast(data, fsize);
+    }
+
+    tb_free(data);
+    if (rv != TB_OK) {
+        replay_free();
+    }
+    return rv;
+}
+
+static int replay_load_records(const char *data, size_t ndata) {
+    int rv;
+    uint64_t at_ns = 0;
+    size_t i = 0;
+
+    while (i < ndata) {
+        if (ndata - i < 8) {
+            return TB_ERR_REPLAY_FORMAT;
+        }
+        uint32_t delay_us = le32_get(data + i);
+        uint32_t len = le32_get(data + i + 4);
+        int is_resize = (len & TB_REPLAY_RESIZE_BIT) != 0;
+        len &= ~TB_REPLAY_RESIZE_BIT;
+        i += 8;
+        if (ndata - i < len || (is_resize && len < 4)) {
+            return TB_ERR_REPLAY_FORMAT;
+        }
+
+        at_ns += (uint64_t)delay_us * 1000;
+        if (is_resize) {
+            const unsigned char *sz = (const unsigned char *)data + i;
+            int w = sz[0] | (sz[1] << 8), h = sz[2] | (sz[3] << 8);
+            if_err_return(rv, replay_check_size(w, h));
+            if_err_return(rv, replay_add(at_ns, NULL, 0, w, h));
+        } else {
+            if_err_return(rv, replay_add(at_ns, data + i, len, 0, 0));
+        }
+        i += len;
+    }
+
+    return TB_OK;
+}
+
+static int replay_load_asciicast(const char *data, size_t ndata) {
+    int rv;
+    const char *end = data + ndata;
+    const char *eol = memchr(data, '\n', ndata);
+    if (!eol) {
+        eol = end;
+    }
+
+    // The header is a JSON object on the first line. Only the version and
+    // terminal size are of interest.
+    if (*data != '{') {
+        return TB_ERR_REPLAY_FORMAT;
+    }
+    int version = json_get_int(data, eol, "\"version\"");
+    if (version != 2 && version != 3) {
+        return TB_ERR_REPLAY_FORMAT;
+    }
+    int w = json_get_int(data, eol, version == 2 ? "\"width\"" : "\"cols\"");
+    int h = json_get_int(data, eol, version == 2 ? "\"height\"" : "\"rows\"");
+    if (w > 0 && h > 0) {
+        if_err_return(rv, replay_check_size(w, h));
+        if_err_return(rv, replay_add(0, NULL, 0, w, h));
+    }
+
+    // Then one JSON array per line: [time, code, data]
+    double t = 0;
+    const char *p = eol;
+    while (p < end) {
+        p++;
+        eol = memchr(p, '\n', end - p);
+        if (!eol) {
+            eol = end;
+        }
+        if_err_return(rv, replay_load_asciicast_line(p, eol, version, &t));
+        p = eol;
+    }
+
+    return TB_OK;
+}
+
+static int replay_load_asciicast_line(const char *p, const char *end,
+    int version, double *t) {
+    int rv;
+    struct bytebuf_t code = {0};
+    struct bytebuf_t str = {0};
+
+    while (p < end && isspace((unsigned char)*p)) p++;
+    if (p == end || *p == '#') {
+        // Blank line or v3 comment
+        return TB_OK;
+    }
+
+    rv = TB_ERR_REPLAY_FORMAT;
+    do {
+        if (*p++ != '[') break;
+        char *num_end;
+        double v = strtod(p, &num_end);
+        if (num_end == p || num_end >= end) break;
+        p = num_end;
+        // v2 stores time since start, v3 time since the previous event
+        *t = version == 2 ? v : *t + v;
+
+        while (p < end && (isspace((unsigned char)*p) || *p == ',')) p++;
+        if (json_get_str(&p, end, &code) != TB_OK) break;
+        while (p < end && (isspace((unsigned char)*p) || *p == ',')) p++;
+        if (json_get_str(&p, end, &str) != TB_OK) break;
+
+        uint64_t at_ns = *t > 0 ? (uint64_t)(*t * 1e9) : 0;
+        int w, h;
+        if (strcmp(code.buf, "i") == 0) {
+            rv = replay_add(at_ns, str.buf, str.len, 0, 0);
+        } else if (strcmp(code.buf, "r") == 0 &&
+                   sscanf(str.buf, "%dx%d", &w, &h) == 2) {
+            rv = replay_check_size(w, h);
+            if (rv == TB_OK) {
+                rv = replay_add(at_ns, NULL, 0, w, h);
+            }
+        } else {
+            rv = TB_OK;
+        }
+    } while (0);
+
+    bytebuf_free(&code);
+    bytebuf_free(&str);
+    return rv;
+}
+
+static int replay_add(uint64_t at_ns, const char *buf, size_t nbuf, int w,
+    int h) {
+    int rv;
+
+    if (global.nreplay % 64 == 0) {
+        struct tb_replay_rec_t *replay = tb_realloc(global.replay,
+            sizeof(*replay) * (global.nreplay + 64));
+        if (!replay) {
+            return TB_ERR_MEM;
+        }
+        global.replay = replay;
+    }
+
+    struct tb_replay_rec_t *rec = &global.replay[global.nreplay];
+    rec->at_ns = at_ns;
+    rec->off = global.replay_bytes.len;
+    rec->len = nbuf;
+    rec->w = w;
+    rec->h = h;
+    if (nbuf > 0) {
+        if_err_return(rv, bytebuf_nputs(&global.replay_bytes, buf, nbuf));
+    }
+    global.nreplay++;
+
+    return TB_OK;
+}
+
+// A replayed resize reallocates the cell buffers, so an absurd size in a
+// recording must not get that far
+static int replay_check_size(int w, int h) {
+    if (w < 1 || h < 1 || w > TB_REPLAY_MAX_SIZE || h > TB_REPLAY_MAX_SIZE) {
+        return TB_ERR_REPLAY_FORMAT;
+    }
+    return TB_OK;
+}
+
+static void replay_free(void) {
+    if (global.replay) {
+        tb_free(global.replay);
+    }
+    global.replay = NULL;
+    global.nreplay = 0;
+    global.replay_pos = 0;
+    bytebuf_free(&global.replay_bytes);
+}
+
+static int json_get_int(const char *p, const char *end, const char *key) {
+    size_t nkey = strlen(key);
+    for (; p + nkey < end; p++) {
+        if (memcmp(p, key, nkey) != 0) continue;
+        p += nkey;
+        while (p < end && (isspace((unsigned char)*p) || *p == ':')) p++;
+        return p < end ? atoi(p) : 0;
+    }
+    return 0;
+}
+
+static int json_get_str(const char **pp, const char *end,
+    struct bytebuf_t *out) {
+    int rv;
+    const char *p = *pp;
+
+    out->len = 0;
+    if_err_return(rv, bytebuf_reserve(out, 1));
+    out->buf[0] = '\0';
+
+    if (p >= end || *p++ != '"') {
+        return TB_ERR_REPLAY_FORMAT;
+    }
+    while (p < end && *p != '"') {
+        char c = *p++;
+        if (c == '\\') {
+            if (p >= end) {
+                return TB_ERR_REPLAY_FORMAT;
+            }
+            c = *p++;
+            switch (c) {
+                case 'b': c = '\b'; break;
+                case 'f': c = '\f'; break;
+                case 'n': c = '\n'; break;
+                case 'r': c = '\r'; break;
+                case 't': c = '\t'; break;
+                case 'u': {
+                    uint32_t cp, lo;
+                    if (json_get_hex4(p, end, &cp) != TB_OK) {
+                        return TB_ERR_REPLAY_FORMAT;
+                    }
+                    p += 4;
+                    // Combine a UTF-16 surrogate pair
+                    if (cp >= 0xd800 && cp <= 0xdbff && end - p >= 6 &&
+                        p[0] == '\\' && p[1] == 'u' &&
+                        json_get_hex4(p + 2, end, &lo) == TB_OK &&
+                        lo >= 0xdc00 && lo <= 0xdfff)
+                    {
+                        cp = 0x10000 + ((cp - 0xd800) << 10) + (lo - 0xdc00);
+                        p += 6;
+                    }
+                    char utf8[7];
+                    int nutf8 = tb_utf8_unicode_to_char(utf8, cp);
+                    if_err_return(rv, bytebuf_nputs(out, utf8, nutf8));
+                    continue;
+                }
+                default: break; // '"', '\\' and '/' stand for themselves
+            }
+        }
+        if_err_return(rv, bytebuf_nputs(out, &c, 1));
+    }
+    if (p >= end) {
+        return TB_ERR_REPLAY_FORMAT;
+    }
 
-    fd_set fds;
-    struct timeval tv;
-    tv.tv_sec = timeout / 1000;
-    tv.tv_usec = (timeout - (tv.tv_sec * 1000)) * 1000;
+    *pp = p + 1;
+    return TB_OK;
+}
 
-    do {
-        FD_ZERO(&fds);
-        FD_SET(global.rfd, &fds);
-        FD_SET(global.resize_pipefd[0], &fds);
+static int json_get_hex4(const char *p, const char *end, uint32_t *out) {
+    int i;
+    *out = 0;
+    for (i = 0; i < 4; i++) {
+        if (p + i >= end || !isxdigit((unsigned char)p[i])) {
+            return TB_ERR;
+        }
+        char c = (char)tolower((unsigned char)p[i]);
+        *out = (*out << 4) | (uint32_t)(isdigit((unsigned char)c) ? c - '0'
+                                                                  : c - 'a' + 10);
+    }
+    return TB_OK;
+}
 
-        int maxfd = global.resize_pipefd[0] > global.rfd
-                        ? global.resize_pipefd[0]
-                        : global.rfd;
+static void record_input(uint32_t kind, const char *buf, size_t nbuf) {
+    char hdr[8];
+    uint64_t now = monotonic_ns();
+    uint64_t delay_us = (now - global.last_record_ts) / 1000;
+    global.last_record_ts = now;
 
-        int select_rv =
-            select(maxfd + 1, &fds, NULL, NULL, (timeout < 0) ? NULL : &tv);
+    le32_put(hdr, delay_us > UINT32_MAX ? UINT32_MAX : (uint32_t)delay_us);
+    le32_put(hdr + 4, kind | (uint32_t)nbuf);
 
-        if (select_rv < 0) {
-            // Let EINTR/EAGAIN bubble up
+    // Best effort; a failing recorder must not break input handling
+    if (write(global.recordfd, hdr, sizeof(hdr)) == (ssize_t)sizeof(hdr)) {
+        if (write(global.recordfd, buf, nbuf) != (ssize_t)nbuf) {
             global.last_errno = errno;
-            return TB_ERR_POLL;
-        } else if (select_rv == 0) {
-            return TB_ERR_NO_EVENT;
         }
+    }
+}
 
-        int tty_has_events = (FD_ISSET(global.rfd, &fds));
-        int resize_has_events = (FD_ISSET(global.resize_pipefd[0], &fds));
+static uint32_t le32_get(const char *buf) {
+    const unsigned char *b = (const unsigned char *)buf;
+    return (uint32_t)b[0] | ((uint32_t)b[1] << 8) | ((uint32_t)b[2] << 16) |
+           ((uint32_t)b[3] << 24);
+}
 
-        if (tty_has_events) {
-            ssize_t read_rv = read(global.rfd, buf, sizeof(buf));
-            if (read_rv < 0) {
-                global.last_errno = errno;
-                return TB_ERR_READ;
-            } else if (read_rv > 0) {
-                bytebuf_nputs(&global.in, buf, read_rv);
-            }
-        }
+static void le32_put(char *buf, uint32_t n) {
+    buf[0] = (char)(n & 0xff);
+    buf[1] = (char)((n >> 8) & 0xff);
+    buf[2] = (char)((n >> 16) & 0xff);
+    buf[3] = (char)((n >> 24) & 0xff);
+}
 
-        if (resize_has_events) {
-            int ignore = 0;
-            read(global.resize_pipefd[0], &ignore, sizeof(ignore));
-            // TODO Harden against errors encountered mid-resize
-            if_err_return(rv, update_term_size());
-            if_err_return(rv, resize_cellbufs());
-            event->type = TB_EVENT_RESIZE;
-            event->w = global.width;
-            event->h = global.height;
-            return TB_OK;
+// Like extract_event(), but stamps the event with the time its first byte was
+// read, and forgets the read times of the bytes it took
+static int extract_timed_event(struct tb_event *event) {
+    int rv;
+    size_t len;
+    uint64_t ts;
+
+#ifdef TB_OPT_PROBE
+    // Replies to the feature probe are not events
+    while (global.in.len > 0 && global.in.buf[0] == '\x1b') {
+        len = global.in.len;
+        rv = extract_probe_reply();
+        if (rv == TB_ERR_NEED_MORE) {
+            return rv;
+        } else if (rv != TB_OK) {
+            break;
         }
+        in_forget(len - global.in.len);
+    }
+#endif
 
-        memset(event, 0, sizeof(*event));
-        if_ok_return(rv, extract_event(event));
-    } while (timeout == -1);
-
+    len = global.in.len;
+    ts = global.nin_chunks > 0 ? global.in_chunks[0].ts : 0;
+    memset(event, 0, sizeof(*event));
+    rv = extract_event(event);
+    if (global.in.len < len) {
+        in_forget(len - global.in.len);
+    }
+    if (rv == TB_OK) {
+        event->ts = ts;
+    }
     return rv;
 }
 
+// Records that the bytes just appended to global.in were read at ts
+static void in_mark(uint64_t ts) {
+    if (global.nin_chunks == TB_OPT_IN_CHUNKS) {
+        global.in_chunks[global.nin_chunks - 1].end = global.in.len;
+        return;
+    }
+    global.in_chunks[global.nin_chunks].end = global.in.len;
+    global.in_chunks[global.nin_chunks].ts = ts;
+    global.nin_chunks++;
+}
+
+// Drops the read times of the n bytes just taken off the front of global.in
+static void in_forget(size_t n) {
+    int i, j = 0;
+    for (i = 0; i < global.nin_chunks; i++) {
+        if (global.in_chunks[i].end <= n) continue;
+        global.in_chunks[j].end = global.in_chunks[i].end - n;
+        global.in_chunks[j].ts = global.in_chunks[i].ts;
+        j++;
+    }
+    global.nin_chunks = j;
+}
+
 static int extract_event(struct tb_event *event) {
     int rv;
     struct bytebuf_t *in = &global.in;
@@ -2732,7 +5210,9 @@ static int extract_event(struct tb_event *event) {
 static int extract_esc(struct tb_event *event) {
     int rv;
     if_ok_or_need_more_return(rv, extract_esc_user(event, 0));
+    if_ok_or_need_more_return(rv, extract_esc_cpr(event));
     if_ok_or_need_more_return(rv, extract_esc_cap(event));
+    if_ok_or_need_more_return(rv, extract_esc_focus(event));
     if_ok_or_need_more_return(rv, extract_esc_mouse(event));
     if_ok_or_need_more_return(rv, extract_esc_user(event, 1));
     return TB_ERR;
@@ -2932,63 +5412,493 @@ static int extract_esc_mouse(struct tb_event *event) {
 
                 buf_shift = in->len;
 
-                if (!fail) {
-                    if (!m_is_capital) {
-                        // on xterm mouse release is signaled by lowercase m
-                        event->key = TB_KEY_MOUSE_RELEASE;
-                    }
+                if (!fail) {
+                    if (!m_is_capital) {
+                        // on xterm mouse release is signaled by lowercase m
+                        event->key = TB_KEY_MOUSE_RELEASE;
+                    }
+
+                    if ((n1 & 32) != 0) {
+                        event->mod |= TB_MOD_MOTION;
+                    }
+
+                    event->x = ((uint8_t)n2) - 1;
+                    event->y = ((uint8_t)n3) - 1;
+
+                    ret = TB_OK;
+                }
+            }
+        } break;
+        case TYPE_MAX:
+            ret = TB_ERR;
+    }
+
+    if (buf_shift > 0) {
+        bytebuf_shift(in, buf_shift);
+    }
+
+    if (ret == TB_OK) {
+        event->type = TB_EVENT_MOUSE;
+    }
+
+    return ret;
+}
+
+static int extract_esc_focus(struct tb_event *event) {
+    struct bytebuf_t *in = &global.in;
+
+    // Focus in: \x1b [ I, focus out: \x1b [ O
+    if (in->len < 3 || strncmp(in->buf, "\x1b[", 2) != 0 ||
+        (in->buf[2] != 'I' && in->buf[2] != 'O'))
+    {
+        return TB_ERR;
+    }
+
+    event->type = TB_EVENT_FOCUS;
+    event->key = in->buf[2] == 'I' ? TB_KEY_FOCUS_IN : TB_KEY_FOCUS_OUT;
+    bytebuf_shift(in, 3);
+
+    // A frame skipped while unfocused stays pending; see tb_present_pending
+    global.unfocused = event->key == TB_KEY_FOCUS_OUT;
+
+    return TB_OK;
+}
+
+static int extract_esc_cpr(struct tb_event *event) {
+#ifndef TB_RESIZE_FALLBACK_MS
+#define TB_RESIZE_FALLBACK_MS 1000
+#endif
+
+    int rv;
+    struct bytebuf_t *in = &global.in;
+    int rw = 0, rh = 0;
+    int *n = &rh;
+    size_t i;
+
+    // Only look for a cursor report while a size probe is outstanding, as
+    // \x1b[1;5R is also Ctrl-F3. A terminal that never answers gets
+    // TB_RESIZE_FALLBACK_MS to do so.
+    if (!global.size_probe_ts) {
+        return TB_ERR;
+    }
+    if (monotonic_ns() - global.size_probe_ts >
+        (uint64_t)TB_RESIZE_FALLBACK_MS * 1000000)
+    {
+        global.size_probe_ts = 0;
+        return TB_ERR;
+    }
+
+    // \x1b [ rows ; cols R
+    if (in->len < 2 || strncmp(in->buf, "\x1b[", 2) != 0) {
+        return TB_ERR;
+    }
+    for (i = 2; i < in->len; i++) {
+        char c = in->buf[i];
+        if (c >= '0' && c <= '9') {
+            *n = *n * 10 + (c - '0');
+            if (*n > 0xffff) return TB_ERR;
+        } else if (c == ';' && n == &rh && i > 2) {
+            n = &rw;
+        } else if (c == 'R' && n == &rw && rw > 0) {
+            break;
+        } else {
+            return TB_ERR;
+        }
+    }
+    if (i == in->len) {
+        return TB_ERR_NEED_MORE;
+    }
+    if (rh <= 1) {
+        // A one-row report is a modified F3 rather than a real terminal
+        return TB_ERR;
+    }
+
+    bytebuf_shift(in, i + 1);
+    global.size_probe_ts = 0;
+    global.width = rw;
+    global.height = rh;
+    if_err_return(rv, resize_cellbufs());
+
+    event->type = TB_EVENT_RESIZE;
+    event->w = global.width;
+    event->h = global.height;
+    return TB_OK;
+}
+
+static int resize_cellbufs(void) {
+    int rv;
+    if_err_return(rv,
+        cellbuf_resize(&global.back, global.width, global.height));
+    if_err_return(rv,
+        cellbuf_resize(&global.front, global.width, global.height));
+    if_err_return(rv, cellbuf_clear(&global.front));
+    if_err_return(rv, send_clear());
+    return TB_OK;
+}
+
+static void handle_resize(int sig) {
+    int errno_copy = errno;
+    write(global.resize_pipefd[1], &sig, sizeof(sig));
+    errno = errno_copy;
+}
+
+static void handle_suspend(int sig) {
+    // Only note the signal; wait_event acts on it in the caller's thread, so
+    // nothing else is writing to the tty meanwhile
+    int errno_copy = errno;
+    write(global.resize_pipefd[1], &sig, sizeof(sig));
+    errno = errno_copy;
+}
+
+static int suspend_tty(void) {
+    int rv;
+    size_t len = global.backlog.len;
+    struct bytebuf_t *out = &global.enc.out;
+
+    // Hand the terminal back in its original state
+    if_err_return(rv, bytebuf_puts(out, global.caps[TB_CAP_SHOW_CURSOR]));
+    if_err_return(rv, bytebuf_puts(out, global.caps[TB_CAP_SGR0]));
+    if_err_return(rv, bytebuf_puts(out, global.caps[TB_CAP_EXIT_CA]));
+    if_err_return(rv, bytebuf_puts(out, global.caps[TB_CAP_EXIT_KEYPAD]));
+    if (global.input_mode & TB_INPUT_MOUSE) {
+        if_err_return(rv, bytebuf_puts(out, TB_HARDCAP_EXIT_MOUSE));
+    }
+    if (global.input_mode & TB_INPUT_FOCUS) {
+        if_err_return(rv, bytebuf_puts(out, TB_HARDCAP_EXIT_FOCUS));
+    }
+    // Drain the backlog ahead of the reset, blocking if need be
+    if_err_return(rv, bytebuf_flush(&global.backlog, global.wfd));
+    global.out_written += len;
+    if_err_return(rv, bytebuf_flush(out, global.wfd));
+    if (global.ttyfd >= 0 && global.has_orig_tios) {
+        tcsetattr(global.ttyfd, TCSADRAIN, &global.orig_tios);
+    }
+    global.suspended = 1;
+
+    // Stop for real with the default disposition. kill() returns once the
+    // process is continued, or at once if the stop was discarded (e.g., an
+    // orphaned process group); the terminal is taken back either way.
+    struct sigaction sa, prev;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = SIG_DFL;
+    sigaction(SIGTSTP, &sa, &prev);
+    sigset_t mask, prev_mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGTSTP);
+    pthread_sigmask(SIG_UNBLOCK, &mask, &prev_mask);
+    kill(getpid(), SIGTSTP);
+    pthread_sigmask(SIG_SETMASK, &prev_mask, NULL);
+    sigaction(SIGTSTP, &prev, NULL);
+
+    if (global.ttyfd >= 0 && global.has_orig_tios) {
+        tcsetattr(global.ttyfd, TCSADRAIN, &global.raw_tios);
+    }
+    if_err_return(rv, bytebuf_puts(out, global.caps[TB_CAP_ENTER_CA]));
+    if_err_return(rv, bytebuf_puts(out, global.caps[TB_CAP_ENTER_KEYPAD]));
+    if (global.cursor_x < 0) {
+        if_err_return(rv, bytebuf_puts(out, global.caps[TB_CAP_HIDE_CURSOR]));
+    }
+    if (global.input_mode & TB_INPUT_MOUSE) {
+        if_err_return(rv, bytebuf_puts(out, TB_HARDCAP_ENTER_MOUSE));
+    }
+    if (global.input_mode & TB_INPUT_FOCUS) {
+        if_err_return(rv, bytebuf_puts(out, TB_HARDCAP_ENTER_FOCUS));
+    }
+    global.suspended = 0;
+    return TB_OK;
+}
+
+// Writes out global.enc.out, or with an output backlog, moves it to the end of
+// the backlog and writes what the tty takes without blocking
+static int flush_out(void) {
+    int rv;
+    struct bytebuf_t *out = &global.enc.out;
+    if (global.max_backlog == 0) {
+        size_t len = out->len;
+        if_err_return(rv, bytebuf_flush(out, global.wfd));
+        global.out_written += len;
+        return TB_OK;
+    }
+    if_err_return(rv, bytebuf_nputs(&global.backlog, out->buf, out->len));
+    out->len = 0;
+    return write_backlog();
+}
+
+static int write_backlog(void) {
+    if (global.backlog.len == 0) {
+        return TB_OK;
+    }
+    // O_NONBLOCK is shared with everything else using the tty's open file
+    // description, so only set it for the duration of the write
+    int fl = fcntl(global.wfd, F_GETFL);
+    if (fl < 0 || fcntl(global.wfd, F_SETFL, fl | O_NONBLOCK) < 0) {
+        global.last_errno = errno;
+        return TB_ERR;
+    }
+    int rv = TB_OK;
+    while (global.backlog.len > 0) {
+        ssize_t n = write(global.wfd, global.backlog.buf, global.backlog.len);
+        if (n < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                global.last_errno = errno;
+                rv = TB_ERR;
+            }
+            if (errno != EINTR) {
+                break;
+            }
+            continue;
+        }
+        bytebuf_shift(&global.backlog, (size_t)n);
+        global.out_written += (uint64_t)n;
+    }
+    fcntl(global.wfd, F_SETFL, fl);
+    backlog_written();
+    return rv;
+}
+
+// Once the backlog is empty, the last presented frame has reached the tty
+static void backlog_written(void) {
+    if (global.backlog.len == 0 && global.present_unwritten) {
+        global.present_unwritten = 0;
+        global.last_present_ts = monotonic_ns();
+    }
+}
+
+// Diffs rows [y0, y1) of the back buffer against the front buffer, encoding
+// changed cells into e and updating the front buffer. Only touches those rows,
+// so disjoint bands can run concurrently.
+static int present_rows(struct tb_enc_t *e, int y0, int y1) {
+    int rv, x, y, i, nrep;
+    for (y = y0; y < y1; y++) {
+        for (x = 0; x < global.front.width;) {
+            struct tb_cell *back, *front;
+            if_err_return(rv, cellbuf_get(&global.back, x, y, &back));
+            if_err_return(rv, cellbuf_get(&global.front, x, y, &front));
+
+            int w;
+            {
+#ifdef TB_OPT_EGC
+                if (back->nech > 0)
+                    w = wcswidth((wchar_t *)back->ech, back->nech);
+                else
+#endif
+                    /* wcwidth() simply returns -1 on overflow of wchar_t */
+                    w = wcwidth((wchar_t)back->ch);
+            }
+            if (w < 1) {
+                w = 1;
+            }
+
+            if (cell_cmp(back, front) != 0) {
+                cell_copy(front, back);
+
+                send_attr(e, back->fg, back->bg);
+                if (w > 1 && x >= global.front.width - (w - 1)) {
+                    for (i = x; i < global.front.width; i++) {
+                        send_char(e, i, y, ' ');
+                    }
+                } else {
+                    {
+#ifdef TB_OPT_EGC
+                        if (back->nech > 0)
+                            send_cluster(e, x, y, back->ech, back->nech);
+                        else
+#endif
+                        {
+                            send_char(e, x, y, back->ch);
+                            if (w == 1) {
+                                if_err_return(rv,
+                                    send_rep(e, x, y, back, &nrep));
+                                x += nrep;
+                            }
+                        }
+                    }
+                    for (i = 1; i < w; i++) {
+                        struct tb_cell *front_wide;
+                        if_err_return(rv,
+                            cellbuf_get(&global.front, x + i, y, &front_wide));
+                        if_err_return(rv,
+                            cell_set(front_wide, 0, 1, back->fg, back->bg));
+                    }
+                }
+            }
+            x += w;
+        }
+    }
+    return TB_OK;
+}
+
+#ifdef TB_OPT_PARALLEL_PRESENT
+struct tb_band_t {
+    struct tb_enc_t enc;
+    int y0;
+    int y1;
+    int rv;
+};
+
+// The pool is not part of global: its threads run this copy's code, so they
+// must not follow the session into another copy (tb_session_adopt).
+// bands[0] belongs to the thread calling tb_present, which encodes it straight
+// into global.enc; worker i encodes bands[i].
+static struct {
+    pthread_t threads[TB_PRESENT_MAX_THREADS];
+    struct tb_band_t bands[TB_PRESENT_MAX_THREADS];
+    int nthreads;
+    int nbands;
+    int pending;
+    int stop;
+    uint64_t frame;
+    pthread_mutex_t lock;
+    pthread_cond_t start;
+    pthread_cond_t done;
+} present_pool = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .start = PTHREAD_COND_INITIALIZER,
+    .done = PTHREAD_COND_INITIALIZER,
+};
+
+static void *present_worker(void *arg) {
+    int i = (int)(intptr_t)arg;
+    uint64_t frame = 0;
+
+    pthread_mutex_lock(&present_pool.lock);
+    for (;;) {
+        while (!present_pool.stop && present_pool.frame == frame) {
+            pthread_cond_wait(&present_pool.start, &present_pool.lock);
+        }
+        if (present_pool.stop) {
+            break;
+        }
+        frame = present_pool.frame;
+        if (i >= present_pool.nbands) {
+            continue;
+        }
+        pthread_mutex_unlock(&present_pool.lock);
+        struct tb_band_t *band = &present_pool.bands[i];
+        band->rv = present_rows(&band->enc, band->y0, band->y1);
+        pthread_mutex_lock(&present_pool.lock);
+        if (--present_pool.pending == 0) {
+            pthread_cond_signal(&present_pool.done);
+        }
+    }
+    pthread_mutex_unlock(&present_pool.lock);
+    return NULL;
+}
+
+static int present_pool_start(int nthreads) {
+    int i;
+    present_pool.stop = 0;
+    present_pool.nbands = 0;
+    for (i = 1; i < nthreads; i++) {
+        if (pthread_create(&present_pool.threads[i], NULL, present_worker,
+                (void *)(intptr_t)i) != 0)
+        {
+            present_pool_stop();
+            return TB_ERR;
+        }
+        present_pool.nthreads = i + 1;
+    }
+    return TB_OK;
+}
 
-                    if ((n1 & 32) != 0) {
-                        event->mod |= TB_MOD_MOTION;
-                    }
+static void present_pool_stop(void) {
+    int i;
+    pthread_mutex_lock(&present_pool.lock);
+    present_pool.stop = 1;
+    pthread_cond_broadcast(&present_pool.start);
+    pthread_mutex_unlock(&present_pool.lock);
+    for (i = 1; i < present_pool.nthreads; i++) {
+        pthread_join(present_pool.threads[i], NULL);
+    }
+    for (i = 0; i < TB_PRESENT_MAX_THREADS; i++) {
+        bytebuf_free(&present_pool.bands[i].enc.out);
+    }
+    present_pool.nthreads = 0;
+}
 
-                    event->x = ((uint8_t)n2) - 1;
-                    event->y = ((uint8_t)n3) - 1;
+// Presents the frame on the pool if it is worth it and sets *presented.
+// Leaves *presented at 0, and the front buffer untouched, if the frame should
+// be presented serially instead.
+static int present_parallel(int *presented) {
+    int rv, i;
+    int w = global.front.width;
+    int h = global.front.height;
+    int n = global.present_threads;
 
-                    ret = TB_OK;
-                }
-            }
-        } break;
-        case TYPE_MAX:
-            ret = TB_ERR;
+    if (n > h) {
+        n = h;
+    }
+    if (n < 2 || (size_t)w * (size_t)h < TB_PRESENT_PARALLEL_MIN_CELLS) {
+        return TB_OK;
+    }
+    if (present_pool.nthreads != global.present_threads) {
+        present_pool_stop();
+        if (present_pool_start(global.present_threads) != TB_OK) {
+            return TB_OK;
+        }
     }
 
-    if (buf_shift > 0) {
-        bytebuf_shift(in, buf_shift);
+    pthread_mutex_lock(&present_pool.lock);
+    for (i = 1; i < n; i++) {
+        struct tb_band_t *band = &present_pool.bands[i];
+        band->enc.out.len = 0;
+        band->enc.last_x = -1;
+        band->enc.last_y = -1;
+        band->enc.last_fg = ~global.fg;
+        band->enc.last_bg = ~global.bg;
+        band->y0 = (int)((int64_t)h * i / n);
+        band->y1 = (int)((int64_t)h * (i + 1) / n);
+        band->rv = TB_OK;
     }
+    present_pool.nbands = n;
+    present_pool.pending = n - 1;
+    present_pool.frame++;
+    pthread_cond_broadcast(&present_pool.start);
+    pthread_mutex_unlock(&present_pool.lock);
 
-    if (ret == TB_OK) {
-        event->type = TB_EVENT_MOUSE;
+    rv = present_rows(&global.enc, 0, h / n);
+
+    pthread_mutex_lock(&present_pool.lock);
+    while (present_pool.pending > 0) {
+        pthread_cond_wait(&present_pool.done, &present_pool.lock);
     }
+    pthread_mutex_unlock(&present_pool.lock);
 
-    return ret;
+    *presented = 1;
+    for (i = 1; i < n; i++) {
+        struct tb_band_t *band = &present_pool.bands[i];
+        if (rv == TB_OK) {
+            rv = band->rv;
+        }
+        if (rv == TB_OK && band->enc.out.len > 0) {
+            rv = bytebuf_nputs(&global.enc.out, band->enc.out.buf,
+                band->enc.out.len);
+            global.enc.last_x = band->enc.last_x;
+            global.enc.last_y = band->enc.last_y;
+            global.enc.last_fg = band->enc.last_fg;
+            global.enc.last_bg = band->enc.last_bg;
+        }
+    }
+    return rv;
 }
-
-static int resize_cellbufs(void) {
-    int rv;
-    if_err_return(rv,
-        cellbuf_resize(&global.back, global.width, global.height));
-    if_err_return(rv,
-        cellbuf_resize(&global.front, global.width, global.height));
-    if_err_return(rv, cellbuf_clear(&global.front));
-    if_err_return(rv, send_clear());
+#else
+static int present_parallel(int *presented) {
+    (void)presented;
     return TB_OK;
 }
 
-static void handle_resize(int sig) {
-    int errno_copy = errno;
-    write(global.resize_pipefd[1], &sig, sizeof(sig));
-    errno = errno_copy;
+static void present_pool_stop(void) {
 }
+#endif
 
-static int send_attr(uintattr_t fg, uintattr_t bg) {
+static int send_attr(struct tb_enc_t *e, uintattr_t fg, uintattr_t bg) {
     int rv;
 
-    if (fg == global.last_fg && bg == global.last_bg) {
+    if (fg == e->last_fg && bg == e->last_bg) {
         return TB_OK;
     }
 
-    if_err_return(rv, bytebuf_puts(&global.out, global.caps[TB_CAP_SGR0]));
+    if_err_return(rv, bytebuf_puts(&e->out, global.caps[TB_CAP_SGR0]));
 
     uint32_t cfg, cbg;
     switch (global.output_mode) {
@@ -3038,40 +5948,40 @@ static int send_attr(uintattr_t fg, uintattr_t bg) {
     }
 
     if (fg & TB_BOLD)
-        if_err_return(rv, bytebuf_puts(&global.out, global.caps[TB_CAP_BOLD]));
+        if_err_return(rv, bytebuf_puts(&e->out, global.caps[TB_CAP_BOLD]));
 
     if (fg & TB_BLINK)
-        if_err_return(rv, bytebuf_puts(&global.out, global.caps[TB_CAP_BLINK]));
+        if_err_return(rv, bytebuf_puts(&e->out, global.caps[TB_CAP_BLINK]));
 
     if (fg & TB_UNDERLINE)
         if_err_return(rv,
-            bytebuf_puts(&global.out, global.caps[TB_CAP_UNDERLINE]));
+            bytebuf_puts(&e->out, global.caps[TB_CAP_UNDERLINE]));
 
     if (fg & TB_ITALIC)
         if_err_return(rv,
-            bytebuf_puts(&global.out, global.caps[TB_CAP_ITALIC]));
+            bytebuf_puts(&e->out, global.caps[TB_CAP_ITALIC]));
 
     if (fg & TB_DIM)
-        if_err_return(rv, bytebuf_puts(&global.out, global.caps[TB_CAP_DIM]));
+        if_err_return(rv, bytebuf_puts(&e->out, global.caps[TB_CAP_DIM]));
 
 #if TB_OPT_ATTR_W == 64
     if (fg & TB_STRIKEOUT)
-        if_err_return(rv, bytebuf_puts(&global.out, TB_HARDCAP_STRIKEOUT));
+        if_err_return(rv, bytebuf_puts(&e->out, TB_HARDCAP_STRIKEOUT));
 
     if (fg & TB_UNDERLINE_2)
-        if_err_return(rv, bytebuf_puts(&global.out, TB_HARDCAP_UNDERLINE_2));
+        if_err_return(rv, bytebuf_puts(&e->out, TB_HARDCAP_UNDERLINE_2));
 
     if (fg & TB_OVERLINE)
-        if_err_return(rv, bytebuf_puts(&global.out, TB_HARDCAP_OVERLINE));
+        if_err_return(rv, bytebuf_puts(&e->out, TB_HARDCAP_OVERLINE));
 
     if (fg & TB_INVISIBLE)
         if_err_return(rv,
-            bytebuf_puts(&global.out, global.caps[TB_CAP_INVISIBLE]));
+            bytebuf_puts(&e->out, global.caps[TB_CAP_INVISIBLE]));
 #endif
 
     if ((fg & TB_REVERSE) || (bg & TB_REVERSE))
         if_err_return(rv,
-            bytebuf_puts(&global.out, global.caps[TB_CAP_REVERSE]));
+            bytebuf_puts(&e->out, global.caps[TB_CAP_REVERSE]));
 
     int fg_is_default = (fg & 0xff) == 0;
     int bg_is_default = (bg & 0xff) == 0;
@@ -3086,16 +5996,16 @@ static int send_attr(uintattr_t fg, uintattr_t bg) {
     }
 #endif
 
-    if_err_return(rv, send_sgr(cfg, cbg, fg_is_default, bg_is_default));
+    if_err_return(rv, send_sgr(e, cfg, cbg, fg_is_default, bg_is_default));
 
-    global.last_fg = fg;
-    global.last_bg = bg;
+    e->last_fg = fg;
+    e->last_bg = bg;
 
     return TB_OK;
 }
 
-static int send_sgr(uint32_t cfg, uint32_t cbg, int fg_is_default,
-    int bg_is_default) {
+static int send_sgr(struct tb_enc_t *e, uint32_t cfg, uint32_t cbg,
+    int fg_is_default, int bg_is_default) {
     int rv;
     char nbuf[32];
 
@@ -3106,93 +6016,94 @@ static int send_sgr(uint32_t cfg, uint32_t cbg, int fg_is_default,
     switch (global.output_mode) {
         default:
         case TB_OUTPUT_NORMAL:
-            send_literal(rv, "\x1b[");
+            send_literal(rv, e, "\x1b[");
             if (!fg_is_default) {
-                send_num(rv, nbuf, cfg);
+                send_num(rv, e, nbuf, cfg);
                 if (!bg_is_default) {
-                    send_literal(rv, ";");
+                    send_literal(rv, e, ";");
                 }
             }
             if (!bg_is_default) {
-                send_num(rv, nbuf, cbg);
+                send_num(rv, e, nbuf, cbg);
             }
-            send_literal(rv, "m");
+            send_literal(rv, e, "m");
             break;
 
         case TB_OUTPUT_256:
         case TB_OUTPUT_216:
         case TB_OUTPUT_GRAYSCALE:
-            send_literal(rv, "\x1b[");
+            send_literal(rv, e, "\x1b[");
             if (!fg_is_default) {
-                send_literal(rv, "38;5;");
-                send_num(rv, nbuf, cfg);
+                send_literal(rv, e, "38;5;");
+                send_num(rv, e, nbuf, cfg);
                 if (!bg_is_default) {
-                    send_literal(rv, ";");
+                    send_literal(rv, e, ";");
                 }
             }
             if (!bg_is_default) {
-                send_literal(rv, "48;5;");
-                send_num(rv, nbuf, cbg);
+                send_literal(rv, e, "48;5;");
+                send_num(rv, e, nbuf, cbg);
             }
-            send_literal(rv, "m");
+            send_literal(rv, e, "m");
             break;
 
 #if TB_OPT_ATTR_W >= 32
         case TB_OUTPUT_TRUECOLOR:
-            send_literal(rv, "\x1b[");
+            send_literal(rv, e, "\x1b[");
             if (!fg_is_default) {
-                send_literal(rv, "38;2;");
-                send_num(rv, nbuf, (cfg >> 16) & 0xff);
-                send_literal(rv, ";");
-                send_num(rv, nbuf, (cfg >> 8) & 0xff);
-                send_literal(rv, ";");
-                send_num(rv, nbuf, cfg & 0xff);
+                send_literal(rv, e, "38;2;");
+                send_num(rv, e, nbuf, (cfg >> 16) & 0xff);
+                send_literal(rv, e, ";");
+                send_num(rv, e, nbuf, (cfg >> 8) & 0xff);
+                send_literal(rv, e, ";");
+                send_num(rv, e, nbuf, cfg & 0xff);
                 if (!bg_is_default) {
-                    send_literal(rv, ";");
+                    send_literal(rv, e, ";");
                 }
             }
             if (!bg_is_default) {
-                send_literal(rv, "48;2;");
-                send_num(rv, nbuf, (cbg >> 16) & 0xff);
-                send_literal(rv, ";");
-                send_num(rv, nbuf, (cbg >> 8) & 0xff);
-                send_literal(rv, ";");
-                send_num(rv, nbuf, cbg & 0xff);
+                send_literal(rv, e, "48;2;");
+                send_num(rv, e, nbuf, (cbg >> 16) & 0xff);
+                send_literal(rv, e, ";");
+                send_num(rv, e, nbuf, (cbg >> 8) & 0xff);
+                send_literal(rv, e, ";");
+                send_num(rv, e, nbuf, cbg & 0xff);
             }
-            send_literal(rv, "m");
+            send_literal(rv, e, "m");
             break;
 #endif
     }
     return TB_OK;
 }
 
-static int send_cursor_if(int x, int y) {
+static int send_cursor_if(struct tb_enc_t *e, int x, int y) {
     int rv;
     char nbuf[32];
     if (x < 0 || y < 0) {
         return TB_OK;
     }
-    send_literal(rv, "\x1b[");
-    send_num(rv, nbuf, y + 1);
-    send_literal(rv, ";");
-    send_num(rv, nbuf, x + 1);
-    send_literal(rv, "H");
+    send_literal(rv, e, "\x1b[");
+    send_num(rv, e, nbuf, y + 1);
+    send_literal(rv, e, ";");
+    send_num(rv, e, nbuf, x + 1);
+    send_literal(rv, e, "H");
     return TB_OK;
 }
 
-static int send_char(int x, int y, uint32_t ch) {
-    return send_cluster(x, y, &ch, 1);
+static int send_char(struct tb_enc_t *e, int x, int y, uint32_t ch) {
+    return send_cluster(e, x, y, &ch, 1);
 }
 
-static int send_cluster(int x, int y, uint32_t *ch, size_t nch) {
+static int send_cluster(struct tb_enc_t *e, int x, int y, uint32_t *ch,
+    size_t nch) {
     int rv;
     char chu8[8];
 
-    if (global.last_x != x - 1 || global.last_y != y) {
-        if_err_return(rv, send_cursor_if(x, y));
+    if (e->last_x != x - 1 || e->last_y != y) {
+        if_err_return(rv, send_cursor_if(e, x, y));
     }
-    global.last_x = x;
-    global.last_y = y;
+    e->last_x = x;
+    e->last_y = y;
 
     int i;
     for (i = 0; i < (int)nch; i++) {
@@ -3204,12 +6115,61 @@ static int send_cluster(int x, int y, uint32_t *ch, size_t nch) {
         } else {
             chu8_len = tb_utf8_unicode_to_char(chu8, ch32);
         }
-        if_err_return(rv, bytebuf_nputs(&global.out, chu8, (size_t)chu8_len));
+        if_err_return(rv, bytebuf_nputs(&e->out, chu8, (size_t)chu8_len));
     }
 
     return TB_OK;
 }
 
+static int send_rep(struct tb_enc_t *e, int x, int y, struct tb_cell *cell,
+    int *nrep) {
+    // Called right after cell was sent at (x, y). Covers the run of changed
+    // cells that follows with identical content by repeating it (REP), if
+    // that takes fewer bytes than sending them.
+    int rv, n;
+    char nbuf[32];
+    struct tb_cell *back, *front;
+
+    *nrep = 0;
+    if (!(global.features & TB_FEATURE_REP) ||
+        (cell->ch != 0 && cell->ch < 0x20))
+    {
+        return TB_OK;
+    }
+#ifdef TB_OPT_EGC
+    if (cell->nech > 0) {
+        return TB_OK;
+    }
+#endif
+
+    for (n = 0; x + 1 + n < global.front.width; n++) {
+        if_err_return(rv, cellbuf_get(&global.back, x + 1 + n, y, &back));
+        if_err_return(rv, cellbuf_get(&global.front, x + 1 + n, y, &front));
+        if (cell_cmp(back, cell) != 0 || cell_cmp(back, front) == 0) {
+            break;
+        }
+    }
+
+    // "\x1b[" n "b" against n copies of the UTF-8 encoding
+    char chu8[8];
+    int chu8_len = cell->ch == 0 ? 1 : tb_utf8_unicode_to_char(chu8, cell->ch);
+    if (n * chu8_len <= 3 + convert_num((uint32_t)n, nbuf)) {
+        return TB_OK;
+    }
+
+    send_literal(rv, e, "\x1b[");
+    send_num(rv, e, nbuf, n);
+    send_literal(rv, e, "b");
+    for (*nrep = 0; *nrep < n; (*nrep)++) {
+        if_err_return(rv, cellbuf_get(&global.back, x + 1 + *nrep, y, &back));
+        if_err_return(rv,
+            cellbuf_get(&global.front, x + 1 + *nrep, y, &front));
+        cell_copy(front, back);
+    }
+    e->last_x = x + n;
+    return TB_OK;
+}
+
 static int convert_num(uint32_t num, char *buf) {
     int i, l = 0;
     char ch;
@@ -3377,6 +6337,523 @@ static int cellbuf_resize(struct cellbuf_t *c, int w, int h) {
     return TB_OK;
 }
 
+static int cellbuf_at(void *target, int x, int y, struct tb_cell **out) {
+    return cellbuf_get(target, x, y, out);
+}
+
+// Like cellbuf_at() for the back buffer, through the clip target points to
+// (none if NULL)
+static int back_at(void *target, int x, int y, struct tb_cell **out) {
+    const struct tb_clip *c = target;
+    if (c) {
+        int64_t ax = (int64_t)x + c->ox, ay = (int64_t)y + c->oy;
+        if (ax < c->x0 || ax >= c->x1 || ay < c->y0 || ay >= c->y1) {
+            *out = NULL;
+            return TB_ERR_OUT_OF_BOUNDS;
+        }
+        x = (int)ax;
+        y = (int)ay;
+    }
+    return cellbuf_get(&global.back, x, y, out);
+}
+
+static int extend_cell_at(void *target, cell_at_fn at, int x, int y,
+    uint32_t ch) {
+#ifdef TB_OPT_EGC
+    int rv;
+    struct tb_cell *cell;
+    size_t nech;
+    if_err_return(rv, at(target, x, y, &cell));
+    if (cell->nech > 0) { // append to ech
+        nech = cell->nech + 1;
+        if_err_return(rv, cell_reserve_ech(cell, nech));
+        cell->ech[nech - 1] = ch;
+    } else { // make new ech
+        nech = 2;
+        if_err_return(rv, cell_reserve_ech(cell, nech));
+        cell->ech[0] = cell->ch;
+        cell->ech[1] = ch;
+    }
+    cell->ech[nech] = '\0';
+    cell->nech = nech;
+    return TB_OK;
+#else
+    (void)target;
+    (void)at;
+    (void)x;
+    (void)y;
+    (void)ch;
+    return TB_ERR;
+#endif
+}
+
+// Caller zeroes *out_w
+static int print_at(void *target, cell_at_fn at, int x, int y, uintattr_t fg,
+    uintattr_t bg, size_t *out_w, const char *str) {
+    int rv, clipped = 0;
+    uint32_t uni;
+    int w, ix = x;
+    struct tb_cell *cell;
+    while (*str) {
+        rv = tb_utf8_char_to_unicode(&uni, str);
+        if (rv < 0) {
+            uni = 0xfffd; // replace invalid UTF-8 char with U+FFFD
+            str += rv * -1;
+        } else if (rv > 0) {
+            str += rv;
+        } else {
+            break; // shouldn't get here
+        }
+        w = wcwidth((wchar_t)uni);
+        if (w < 0) w = 1;
+        if (w == 0 && x > ix) {
+            rv = extend_cell_at(target, at, x - 1, y, uni);
+        } else {
+            // A wide character is drawn whole or not at all
+            rv = w > 1 ? at(target, x + w - 1, y, &cell) : TB_OK;
+            if (rv == TB_OK) rv = at(target, x, y, &cell);
+            if (rv == TB_OK) rv = cell_set(cell, &uni, 1, fg, bg);
+        }
+        // Skip what falls outside and lay out the rest of the string
+        if (rv == TB_ERR_OUT_OF_BOUNDS) {
+            clipped = 1;
+        } else if (rv != TB_OK) {
+            return rv;
+        }
+        x += w;
+        if (out_w) {
+            *out_w += w;
+        }
+    }
+    return clipped ? TB_ERR_OUT_OF_BOUNDS : TB_OK;
+}
+
+static int cellbuf_fill(struct cellbuf_t *c, int x, int y, int w, int h,
+    uint32_t ch, uintattr_t fg, uintattr_t bg) {
+    int rv, cx, cy;
+    int x1 = x + w < c->width ? x + w : c->width;
+    int y1 = y + h < c->height ? y + h : c->height;
+    if (x < 0) x = 0;
+    if (y < 0) y = 0;
+    for (cy = y; cy < y1; cy++) {
+        for (cx = x; cx < x1; cx++) {
+            if_err_return(rv,
+                cell_set(&c->cells[cy * c->width + cx], &ch, 1, fg, bg));
+        }
+    }
+    return TB_OK;
+}
+
+static int cellbuf_blit(struct cellbuf_t *dst, struct cellbuf_t *src, int sx,
+    int sy, int w, int h, int dx, int dy) {
+    int rv, x, y;
+
+    blit_clip(dst, src, &sx, &sy, &w, &h, &dx, &dy);
+    for (y = 0; y < h; y++) {
+        struct tb_cell *from = &src->cells[(sy + y) * src->width + sx];
+        struct tb_cell *to = &dst->cells[(dy + y) * dst->width + dx];
+#ifdef TB_OPT_EGC
+        for (x = 0; x < w; x++) {
+            if_err_return(rv, cell_copy(&to[x], &from[x]));
+        }
+#else
+        (void)rv;
+        (void)x;
+        if (w > 0) memcpy(to, from, sizeof(struct tb_cell) * w);
+#endif
+    }
+    return TB_OK;
+}
+
+// Clips the source rectangle to src, then the destination to dst, moving the
+// other side's origin along with each cut
+static void blit_clip(struct cellbuf_t *dst, struct cellbuf_t *src, int *sx,
+    int *sy, int *w, int *h, int *dx, int *dy) {
+    if (*sx < 0) { *w += *sx; *dx -= *sx; *sx = 0; }
+    if (*sy < 0) { *h += *sy; *dy -= *sy; *sy = 0; }
+    if (*dx < 0) { *w += *dx; *sx -= *dx; *dx = 0; }
+    if (*dy < 0) { *h += *dy; *sy -= *dy; *dy = 0; }
+    if (*w > src->width - *sx) *w = src->width - *sx;
+    if (*h > src->height - *sy) *h = src->height - *sy;
+    if (*w > dst->width - *dx) *w = dst->width - *dx;
+    if (*h > dst->height - *dy) *h = dst->height - *dy;
+}
+
+static const struct tb_clip *clip_top(void) {
+    return global.nclips > 0 ? &global.clips[global.nclips - 1] : NULL;
+}
+
+// Translates a back buffer destination rectangle through clip c (if any) and
+// cuts it down to the clip rectangle, moving the source origin along. Returns
+// 0 if nothing is left.
+static int clip_dst(const struct tb_clip *c, int *sx, int *sy, int *w, int *h,
+    int *dx, int *dy) {
+    int64_t ax, ay;
+    if (!c) return *w > 0 && *h > 0;
+    ax = (int64_t)*dx + c->ox;
+    ay = (int64_t)*dy + c->oy;
+    if (ax < c->x0) {
+        *w -= (int)(c->x0 - ax);
+        *sx += (int)(c->x0 - ax);
+        ax = c->x0;
+    }
+    if (ay < c->y0) {
+        *h -= (int)(c->y0 - ay);
+        *sy += (int)(c->y0 - ay);
+        ay = c->y0;
+    }
+    if (ax + *w > c->x1) *w = (int)(c->x1 - ax);
+    if (ay + *h > c->y1) *h = (int)(c->y1 - ay);
+    *dx = (int)ax;
+    *dy = (int)ay;
+    return *w > 0 && *h > 0;
+}
+
+#if TB_OPT_ATTR_W >= 32
+// Mixes 0xRRGGBB colors c and o, with o weighted a/256. Red and blue share
+// one multiply and green takes another; the lanes cannot carry into each
+// other since each product fits in 16 bits.
+static uint32_t blend_mix(uint32_t c, uint32_t o, uint32_t a) {
+    uint32_t rb = (c & 0xff00ff) * (256 - a) + (o & 0xff00ff) * a;
+    uint32_t g = (c & 0x00ff00) * (256 - a) + (o & 0x00ff00) * a;
+    return ((rb >> 8) & 0xff00ff) | ((g >> 8) & 0x00ff00);
+}
+
+// The 0xRRGGBB a truecolor fg or bg attribute stands for
+static uint32_t blend_rgb(uintattr_t attr, int bg) {
+    uint32_t rgb = (uint32_t)(attr & 0xffffff);
+    if (attr & TB_HI_BLACK) return 0;
+    if (rgb) return rgb;
+    if (global.blend_defaults_set) return bg ? global.blend_bg : global.blend_fg;
+    return bg ? 0x000000 : 0xffffff;
+}
+
+// attr with its color replaced by rgb, keeping the style bits
+static uintattr_t blend_attr(uintattr_t attr, uint32_t rgb) {
+    attr &= ~(uintattr_t)(0xffffff | TB_HI_BLACK);
+    return attr | (rgb ? (uintattr_t)rgb : (uintattr_t)TB_HI_BLACK);
+}
+
+// Blends rgb with weight a/256 over n cells of a row
+static void blend_row(struct tb_cell *row, int n, uint32_t rgb, uint32_t a,
+    int flags) {
+    int i;
+    for (i = 0; i < n; i++) {
+        if (flags & TB_BLEND_FG) {
+            row[i].fg = blend_attr(row[i].fg,
+                blend_mix(blend_rgb(row[i].fg, 0), rgb, a));
+        }
+        if (flags & TB_BLEND_BG) {
+            row[i].bg = blend_attr(row[i].bg,
+                blend_mix(blend_rgb(row[i].bg, 1), rgb, a));
+        }
+    }
+}
+
+// Composites n source cells over n destination cells with opacity a/256
+static int blend_over_row(struct tb_cell *to, struct tb_cell *from, int n,
+    uint32_t a) {
+    int rv, i;
+    for (i = 0; i < n; i++) {
+        uint32_t to_bg, from_bg;
+        uintattr_t fg;
+        if (from[i].ch == 0) continue;
+        to_bg = blend_rgb(to[i].bg, 1);
+        from_bg = blend_rgb(from[i].bg, 1);
+        if (from[i].ch == ' ') {
+            to[i].fg = blend_attr(to[i].fg,
+                blend_mix(blend_rgb(to[i].fg, 0), from_bg, a));
+        } else {
+            fg = blend_attr(from[i].fg,
+                blend_mix(to_bg, blend_rgb(from[i].fg, 0), a));
+            if_err_return(rv, cell_copy(&to[i], &from[i]));
+            to[i].fg = fg;
+        }
+        to[i].bg = blend_attr(from[i].bg, blend_mix(to_bg, from_bg, a));
+    }
+    return TB_OK;
+}
+
+static int cellbuf_blend(struct cellbuf_t *dst, struct cellbuf_t *src, int sx,
+    int sy, int w, int h, int dx, int dy, uint32_t a) {
+    int rv, y;
+    blit_clip(dst, src, &sx, &sy, &w, &h, &dx, &dy);
+    for (y = 0; y < h; y++) {
+        if_err_return(rv,
+            blend_over_row(&dst->cells[(dy + y) * dst->width + dx],
+                &src->cells[(sy + y) * src->width + sx], w, a));
+    }
+    return TB_OK;
+}
+#endif
+
+// Draws the visible layers into the back buffer, bottom to top, saving every
+// back buffer cell they cover so layers_restore() can put it back. Costs the
+// layers' footprint, not the screen.
+static int layers_apply(void) {
+    int order[TB_OPT_LAYERS_MAX];
+    int n = 0, i, j, x, y;
+
+    global.nlayer_saved = 0;
+    for (i = 0; i < TB_OPT_LAYERS_MAX; i++) {
+        struct tb_layer_t *l = &global.layers[i];
+        if (!l->surface || !l->visible) continue;
+        // Insertion sort by (z, seq)
+        for (j = n; j > 0; j--) {
+            struct tb_layer_t *p = &global.layers[order[j - 1]];
+            if (p->z < l->z || (p->z == l->z && p->seq < l->seq)) break;
+            order[j] = order[j - 1];
+        }
+        order[j] = i;
+        n++;
+    }
+
+    for (i = 0; i < n; i++) {
+        struct tb_layer_t *l = &global.layers[order[i]];
+        struct cellbuf_t *src = &l->surface->buf;
+        int x0 = l->x < 0 ? -l->x : 0;
+        int y0 = l->y < 0 ? -l->y : 0;
+        int x1 = src->width, y1 = src->height;
+        if (l->x + x1 > global.back.width) x1 = global.back.width - l->x;
+        if (l->y + y1 > global.back.height) y1 = global.back.height - l->y;
+
+        for (y = y0; y < y1; y++) {
+            struct tb_cell *from = &src->cells[y * src->width];
+            int row = (l->y + y) * global.back.width + l->x;
+            for (x = x0; x < x1; x++) {
+                struct tb_cell *to = &global.back.cells[row + x];
+                if (from[x].ch == 0) continue; // transparent
+                if (global.nlayer_saved == global.clayer_saved) {
+                    size_t cap = global.clayer_saved ? global.clayer_saved * 2
+                                                     : 256;
+                    struct tb_layer_saved_t *saved = tb_realloc(
+                        global.layer_saved, cap * sizeof(*saved));
+                    if (!saved) return TB_ERR_MEM;
+                    global.layer_saved = saved;
+                    global.clayer_saved = cap;
+                }
+                global.layer_saved[global.nlayer_saved].idx = row + x;
+                global.layer_saved[global.nlayer_saved].cell = *to;
+                global.nlayer_saved++;
+#ifdef TB_OPT_EGC
+                // The saved copy keeps the cluster; give the cell a new one
+                to->ech = NULL;
+                to->nech = 0;
+                to->cech = 0;
+#endif
+                cell_copy(to, &from[x]);
+            }
+        }
+    }
+    return TB_OK;
+}
+
+// Undoes layers_apply(), newest first, so cells covered by several layers end
+// up as they were before any of them
+static void layers_restore(void) {
+    while (global.nlayer_saved > 0) {
+        struct tb_layer_saved_t *s =
+            &global.layer_saved[--global.nlayer_saved];
+#ifdef TB_OPT_EGC
+        cell_free(&global.back.cells[s->idx]);
+#endif
+        global.back.cells[s->idx] = s->cell;
+    }
+}
+
+static int canvas_at(void *target, int x, int y, struct tb_cell **out) {
+    struct tb_canvas *c = target;
+    struct tb_cell *tile;
+    if (x < 0 || x >= c->width || y < 0 || y >= c->height) {
+        *out = NULL;
+        return TB_ERR_OUT_OF_BOUNDS;
+    }
+    tile = canvas_tile(c, x / TB_CANVAS_TILE_W, y / TB_CANVAS_TILE_H, 1);
+    if (!tile) return TB_ERR_MEM;
+    *out = &tile[(y % TB_CANVAS_TILE_H) * TB_CANVAS_TILE_W +
+                 x % TB_CANVAS_TILE_W];
+    return TB_OK;
+}
+
+static size_t canvas_slot(struct tb_canvas_tile_t *tiles, size_t ctiles,
+    uint64_t key) {
+    size_t i = (size_t)((key * 0x9e3779b97f4a7c15ull) >> 32) & (ctiles - 1);
+    while (tiles[i].cells && tiles[i].key != key) {
+        i = (i + 1) & (ctiles - 1);
+    }
+    return i;
+}
+
+// Returns the cells of tile tx,ty, or NULL if it was never drawn in (or, with
+// create, if out of memory)
+static struct tb_cell *canvas_tile(struct tb_canvas *c, int tx, int ty,
+    int create) {
+    uint64_t key = (uint64_t)(uint32_t)ty << 32 | (uint32_t)tx;
+    size_t i, n = TB_CANVAS_TILE_W * TB_CANVAS_TILE_H;
+    uint32_t space = ' ';
+    struct tb_cell *cells;
+
+    if (c->ctiles > 0) {
+        i = canvas_slot(c->tiles, c->ctiles, key);
+        if (c->tiles[i].cells) return c->tiles[i].cells;
+    }
+    if (!create) return NULL;
+
+    // Keep the table at most half full
+    if ((c->ntiles + 1) * 2 > c->ctiles) {
+        size_t cap = c->ctiles ? c->ctiles * 2 : 64;
+        struct tb_canvas_tile_t *tiles = tb_malloc(cap * sizeof(*tiles));
+        if (!tiles) return NULL;
+        memset(tiles, 0, cap * sizeof(*tiles));
+        for (i = 0; i < c->ctiles; i++) {
+            if (c->tiles[i].cells) {
+                tiles[canvas_slot(tiles, cap, c->tiles[i].key)] = c->tiles[i];
+            }
+        }
+        if (c->tiles) tb_free(c->tiles);
+        c->tiles = tiles;
+        c->ctiles = cap;
+    }
+
+    cells = tb_malloc(n * sizeof(*cells));
+    if (!cells) return NULL;
+    memset(cells, 0, n * sizeof(*cells));
+    for (i = 0; i < n; i++) {
+        cell_set(&cells[i], &space, 1, TB_DEFAULT, TB_DEFAULT);
+    }
+    i = canvas_slot(c->tiles, c->ctiles, key);
+    c->tiles[i].key = key;
+    c->tiles[i].cells = cells;
+    c->ntiles++;
+    return cells;
+}
+
+// Draws each shown canvas's viewport into its rectangle of the back buffer,
+// after scrolling the terminal for it where that saves output
+static int canvases_render(void) {
+    int rv, i, x, y, top, bottom, left, right, dy;
+    uint32_t space = ' ';
+
+    for (i = 0; i < TB_OPT_CANVASES_MAX; i++) {
+        struct tb_canvas *c = global.canvases[i];
+        if (!c) continue;
+        left = c->x < 0 ? 0 : c->x;
+        top = c->y < 0 ? 0 : c->y;
+        right = c->x + c->w < global.back.width ? c->x + c->w
+                                                : global.back.width;
+        bottom = c->y + c->h < global.back.height ? c->y + c->h
+                                                  : global.back.height;
+
+        dy = c->vy - c->shown_vy;
+        if (c->presented && dy != 0 && c->vx == c->shown_vx && left == 0 &&
+            right == global.back.width && dy > -(bottom - top) &&
+            dy < bottom - top)
+        {
+            if_err_return(rv, send_scroll(top, bottom, dy));
+        }
+        c->shown_vx = c->vx;
+        c->shown_vy = c->vy;
+        c->presented = 1;
+
+        for (y = top; y < bottom; y++) {
+            int cy = c->vy + (y - c->y);
+            struct tb_cell *to = &global.back.cells[y * global.back.width];
+            for (x = left; x < right;) {
+                int cx = c->vx + (x - c->x);
+                // A run of cells within one tile (or one blank stretch)
+                int run = right - x;
+                struct tb_cell *tile = NULL;
+                if (cy >= 0 && cy < c->height && cx >= 0 && cx < c->width) {
+                    int in_tile = TB_CANVAS_TILE_W - cx % TB_CANVAS_TILE_W;
+                    if (in_tile > c->width - cx) in_tile = c->width - cx;
+                    if (run > in_tile) run = in_tile;
+                    tile = canvas_tile(c, cx / TB_CANVAS_TILE_W,
+                        cy / TB_CANVAS_TILE_H, 0);
+                } else if (cy >= 0 && cy < c->height && cx < 0 &&
+                           run > -cx)
+                {
+                    run = -cx;
+                }
+                if (tile) {
+                    struct tb_cell *from =
+                        &tile[(cy % TB_CANVAS_TILE_H) * TB_CANVAS_TILE_W +
+                              cx % TB_CANVAS_TILE_W];
+                    int k;
+                    for (k = 0; k < run; k++) {
+                        if_err_return(rv, cell_copy(&to[x + k], &from[k]));
+                    }
+                } else {
+                    int k;
+                    for (k = 0; k < run; k++) {
+                        if_err_return(rv, cell_set(&to[x + k], &space, 1,
+                            TB_DEFAULT, TB_DEFAULT));
+                    }
+                }
+                x += run;
+            }
+        }
+    }
+    return TB_OK;
+}
+
+// Scrolls screen rows [top, bottom) up by n rows (down if n < 0) using a
+// scroll region, and shifts the front buffer to match so the diff only
+// repaints the rows that scrolled in. They come in blank in the clear
+// attributes, as after send_clear().
+static int send_scroll(int top, int bottom, int n) {
+    int rv, y, i, count = n > 0 ? n : -n;
+    int width = global.front.width;
+    struct tb_cell *rows = global.front.cells;
+    struct tb_enc_t *e = &global.enc;
+    uint32_t space = ' ';
+    char nbuf[32];
+
+    if_err_return(rv, send_attr(e, global.fg, global.bg));
+    send_literal(rv, e, "\x1b[");
+    send_num(rv, e, nbuf, top + 1);
+    send_literal(rv, e, ";");
+    send_num(rv, e, nbuf, bottom);
+    send_literal(rv, e, "r");
+    // Index at the bottom margin scrolls up, reverse index at the top down
+    if_err_return(rv, send_cursor_if(e, 0, n > 0 ? bottom - 1 : top));
+    for (i = 0; i < count; i++) {
+        if (n > 0) {
+            send_literal(rv, e, "\x1b" "D");
+        } else {
+            send_literal(rv, e, "\x1b" "M");
+        }
+    }
+    send_literal(rv, e, "\x1b[r");
+    global.enc.last_x = -1;
+    global.enc.last_y = -1;
+
+    // Rows leaving the region go first so their clusters are freed once
+    int gone = n > 0 ? top : bottom - count;
+    int fresh = n > 0 ? bottom - count : top;
+    for (y = gone; y < gone + count; y++) {
+        for (i = 0; i < width; i++) {
+            cell_free(&rows[y * width + i]);
+        }
+    }
+    memmove(&rows[(n > 0 ? top : top + count) * width],
+        &rows[(n > 0 ? top + count : top) * width],
+        sizeof(struct tb_cell) * width * (bottom - top - count));
+    memset(&rows[fresh * width], 0, sizeof(struct tb_cell) * width * count);
+    for (i = 0; i < width * count; i++) {
+        if_err_return(rv, cell_set(&rows[fresh * width + i], &space, 1,
+            global.fg, global.bg));
+    }
+    return TB_OK;
+}
+
+static uint64_t monotonic_ns(void) {
+    struct timespec ts;
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) != 0) {
+        return 0;
+    }
+    return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
 static int bytebuf_puts(struct bytebuf_t *b, const char *str) {
     if (!str || strlen(str) <= 0) return TB_OK; // Nothing to do for empty caps
     return bytebuf_nputs(b, str, (size_t)strlen(str));
@@ -0,0 +1,25 @@
+<?php
+declare(strict_types=1);
+
+// load a second copy of the library, as a reloaded NIF would be
+$repo_dir = dirname(__DIR__, 2);
+$copy_so = tempnam(sys_get_temp_dir(), 'tb_so');
+copy("$repo_dir/libtermbox2.so", $copy_so);
+$new_ffi = FFI::cdef(file_get_contents("$repo_dir/termbox2.ffi.h"), $copy_so);
+
+$test->ffi->tb_init();
+$test->ffi->tb_printf(0, 0, 0, 0, "before=%d", 1);
+$test->ffi->tb_present();
+
+// hand the live session over; the new copy must not reinit or repaint
+$size = $test->ffi->new('size_t');
+$state = $test->ffi->tb_session_state(FFI::addr($size));
+$adopt = $new_ffi->tb_session_adopt($state, $size->cdata);
+$release = $test->ffi->tb_session_release();
+unlink($copy_so);
+
+// only the new row is written
+$new_ffi->tb_printf(0, 1, 0, 0, "adopt=%d release=%d old_width=%d new_width=%d",
+    $adopt, $release, $test->ffi->tb_width(), $new_ffi->tb_width());
+$new_ffi->tb_present();
+$test->screencap();
@@ -0,0 +1,91 @@
+<?php
+declare(strict_types=1);
+
+// init termbox with a "fake" tty backed by memfds, reading $input_data
+$libc = FFI::cdef(
+    'int memfd_create(const char *name, unsigned int flags);' .
+    'int close(int fd);'
+);
+$fake_tty = function(string $input_data) use ($test, $libc): array {
+    $ttyin = $libc->memfd_create('ttyin', 0);
+    $ttyout = $libc->memfd_create('ttyout', 0);
+    $fttyin = fopen("php://fd/$ttyin", 'w');
+    fwrite($fttyin, $input_data);
+    fseek($fttyin, strlen($input_data) * -1, SEEK_CUR);
+    $test->ffi->tb_init_rwfd($ttyin, $ttyout);
+    return [ $ttyin, $ttyout, $fttyin ];
+};
+$close_tty = function(array $tty) use ($test, $libc): void {
+    [ $ttyin, $ttyout, $fttyin ] = $tty;
+    fclose($fttyin);
+    $libc->close($ttyin);
+    $libc->close($ttyout);
+    $test->ffi->tb_shutdown();
+};
+
+// record events that termbox emits
+$read_events = function() use ($test): array {
+    $events = [];
+    $e = $test->ffi->new('struct tb_event');
+    do {
+        $rv = $test->ffi->tb_peek_event(FFI::addr($e), 1000);
+        if ($rv == 0) {
+            $events[] = implode(',', [ $e->type, $e->mod, $e->key, $e->ch ]);
+        }
+    } while ($rv == 0);
+    return $events;
+};
+
+// record typed input, then replay the recording as fast as possible
+$rec_path = tempnam(sys_get_temp_dir(), 'tb_rec');
+$tty = $fake_tty("a\x1bOA\xf0\x9f\x98\x80");
+$test->ffi->tb_set_input_record($rec_path);
+$recorded = $read_events();
+$close_tty($tty);
+
+$tty = $fake_tty('');
+$replay_rv = $test->ffi->tb_set_input_replay($rec_path,
+    $test->defines['TB_REPLAY_MAX_SPEED']);
+$replayed = $read_events();
+$close_tty($tty);
+unlink($rec_path);
+
+// a recording cut off mid-sequence must not swallow the next typed key
+$cast_path = tempnam(sys_get_temp_dir(), 'tb_cast');
+file_put_contents($cast_path, "{\"version\": 2}\n[0.0, \"i\", \"x\\u001b[1;\"]\n");
+$tty = $fake_tty('B');
+$test->ffi->tb_set_input_replay($cast_path,
+    $test->defines['TB_REPLAY_MAX_SPEED']);
+$cut = $read_events();
+$close_tty($tty);
+unlink($cast_path);
+
+// a resize past any sane terminal size is rejected, in either format
+$huge_path = tempnam(sys_get_temp_dir(), 'tb_huge');
+$tty = $fake_tty('');
+file_put_contents($huge_path, 'tbinput1' . pack('VVvv', 0, 0x80000004, 65535, 5));
+$huge_rec_rv = $test->ffi->tb_set_input_replay($huge_path,
+    $test->defines['TB_REPLAY_MAX_SPEED']);
+file_put_contents($huge_path, "{\"version\": 2}\n[0.0, \"r\", \"100000x5\"]\n");
+$huge_cast_rv = $test->ffi->tb_set_input_replay($huge_path,
+    $test->defines['TB_REPLAY_MAX_SPEED']);
+$close_tty($tty);
+unlink($huge_path);
+
+// display events
+$test->ffi->tb_init();
+$y = 0;
+$test->ffi->tb_printf(0, $y++, 0, 0, "replay_rv=%d", $replay_rv);
+foreach ($recorded as $e) {
+    $test->ffi->tb_printf(0, $y++, 0, 0, "record=%s", $e);
+}
+foreach ($replayed as $e) {
+    $test->ffi->tb_printf(0, $y++, 0, 0, "replay=%s", $e);
+}
+foreach ($cut as $e) {
+    $test->ffi->tb_printf(0, $y++, 0, 0, "cut=%s", $e);
+}
+$test->ffi->tb_printf(0, $y++, 0, 0, "huge_rec_rv=%d", $huge_rec_rv);
+$test->ffi->tb_printf(0, $y++, 0, 0, "huge_cast_rv=%d", $huge_cast_rv);
+$test->ffi->tb_present();
+$test->screencap();
@@ -0,0 +1,49 @@
+<?php
+declare(strict_types=1);
+
+// init termbox with a "fake" tty backed by memfds. TIOCGWINSZ fails on them,
+// so termbox starts at a provisional size and asks for a cursor report.
+$libc = FFI::cdef(
+    'int memfd_create(const char *name, unsigned int flags);' .
+    'int close(int fd);'
+);
+$ttyin = $libc->memfd_create('ttyin', 0);
+$ttyout = $libc->memfd_create('ttyout', 0);
+$input_data =
+    "a" .           // typed before the report arrives
+    "\x1b[1;5R" .   // TB_KEY_F3, TB_MOD_CTRL (a one-row report is not a size)
+    "\x1b[30;100R" . // the cursor report: 30 rows, 100 cols
+    "b";
+$fttyin = fopen("php://fd/$ttyin", 'w');
+$nbytes = fwrite($fttyin, $input_data);
+fseek($fttyin, strlen($input_data) * -1, SEEK_CUR);
+$test->ffi->tb_init_rwfd($ttyin, $ttyout);
+$init_size = sprintf('%dx%d', $test->ffi->tb_width(), $test->ffi->tb_height());
+
+// record events that termbox emits
+$events = [];
+$e = $test->ffi->new('struct tb_event');
+do {
+    $rv = $test->ffi->tb_peek_event(FFI::addr($e), 1000);
+    if ($rv == 0) {
+        $events[] = [ $e->type, $e->mod, $e->key, $e->ch, $e->w, $e->h ];
+    }
+} while ($rv == 0);
+$final_size = sprintf('%dx%d', $test->ffi->tb_width(), $test->ffi->tb_height());
+
+// close fake termbox setup
+fclose($fttyin);
+$libc->close($ttyin);
+$libc->close($ttyout);
+$test->ffi->tb_shutdown();
+
+// display sizes and events
+$test->ffi->tb_init();
+$y = 0;
+$test->ffi->tb_printf(0, $y++, 0, 0, "init_size=%s", $init_size);
+foreach ($events as $e) {
+    $test->ffi->tb_printf(0, $y++, 0, 0, "event=%s", implode(',', $e));
+}
+$test->ffi->tb_printf(0, $y++, 0, 0, "final_size=%s", $final_size);
+$test->ffi->tb_present();
+$test->screencap();
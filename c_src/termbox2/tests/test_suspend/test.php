@@ -0,0 +1,29 @@
+<?php
+declare(strict_types=1);
+
+$libc = FFI::cdef(
+    'int raise(int signum);'
+);
+
+$test->ffi->tb_init();
+
+$test->ffi->tb_printf(0, 0, 0, 0, "drawn before SIGTSTP");
+$test->ffi->tb_present();
+
+// The test runs in an orphaned process group, so the stop itself is
+// discarded. termbox must still hand the tty back, then take it again and
+// repaint the back buffer.
+$libc->raise(SIGTSTP);
+
+$event = $test->ffi->new('struct tb_event');
+$rv = $test->ffi->tb_peek_event(FFI::addr($event), 1000);
+
+$test->ffi->tb_printf(0, 1, 0, 0, "event rv=%d type=%d pending=%d",
+    $rv,
+    $event->type,
+    $test->ffi->tb_present_pending(),
+);
+
+$test->ffi->tb_present();
+
+$test->screencap();
@@ -1,61 +1,1368 @@
 #define TB_IMPL
+#define TB_OPT_ATTR_W 32
+#define TB_OPT_CAP_CACHE
+#define TB_OPT_PREFER_BUILTIN
+#define TB_OPT_PROBE
+#define TB_OPT_PARALLEL_PRESENT
 #include "termbox2/termbox2.h"
+#include "termbox2_shm.h"
 #include <erl_nif.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/timerfd.h>
+#endif
+
+/*
+ * Session lock.
+ *
+ * termbox keeps a single global session. Every NIF that touches it, or the
+ * event queue below, holds this lock, so any process may draw directly while
+ * ExTermbox.Server owns the lifecycle and polls for events. Waiting for input
+ * happens outside the lock (see peek_event_unlocked).
+ *
+ * Cell writes only take the lock shared, plus the spinlock of the row they
+ * write, so producers drawing disjoint rows proceed in parallel. Everything
+ * else, tb_present included, takes it exclusively: that waits out in-flight
+ * cell writes and keeps the back buffer from being resized under them.
+ */
+static ErlNifRWLock *session_lock = NULL;
+
+static void writer_wake(void);
+static int async_step(void);
+static int async_waiting(void);
+static int layers_release(void **out);
+static int canvases_release(void **out);
+
+#define with_session_lock(rv, expr)                                            \
+  do {                                                                         \
+    enif_rwlock_rwlock(session_lock);                                          \
+    (rv) = (expr);                                                             \
+    writer_wake();                                                             \
+    enif_rwlock_rwunlock(session_lock);                                        \
+  } while (0)
+
+/* Rows map onto ROW_LOCKS stripes (taller terminals share stripes), each on
+ * its own cache line so neighbouring rows do not bounce one line around. */
+#define ROW_LOCKS 256
+
+static struct {
+  char locked;
+  char pad[63];
+} row_locks[ROW_LOCKS];
+
+static void row_lock(unsigned y)
+{
+  char *l = &row_locks[y % ROW_LOCKS].locked;
+  while (__atomic_test_and_set(l, __ATOMIC_ACQUIRE)) {
+    while (__atomic_load_n(l, __ATOMIC_RELAXED)) {}
+  }
+}
+
+static void row_unlock(unsigned y)
+{
+  __atomic_clear(&row_locks[y % ROW_LOCKS].locked, __ATOMIC_RELEASE);
+}
+
+/* Reads an {x, y, w, h} tuple */
+static int get_rect(ErlNifEnv *env, ERL_NIF_TERM term, int rect[4])
+{
+  const ERL_NIF_TERM *t;
+  int arity;
+  return enif_get_tuple(env, term, &arity, &t) && arity == 4 &&
+         enif_get_int(env, t[0], &rect[0]) && enif_get_int(env, t[1], &rect[1]) &&
+         enif_get_int(env, t[2], &rect[2]) && enif_get_int(env, t[3], &rect[3]);
+}
+
+/* Each process keeps its own clip (tb_clip_make/2) and passes it with every
+ * draw, so termbox's session-wide clip stack is never used here. Reads a
+ * clip tuple into c and points *out at it, or sets *out to NULL for the atom
+ * nil (no clip). */
+static int get_clip(ErlNifEnv *env, ERL_NIF_TERM term, struct tb_clip *c, const struct tb_clip **out)
+{
+  const ERL_NIF_TERM *t;
+  int arity;
+  if (enif_is_atom(env, term)) {
+    *out = NULL;
+    return 1;
+  }
+  if (!enif_get_tuple(env, term, &arity, &t) || arity != 6 ||
+      !enif_get_int(env, t[0], &c->x0) || !enif_get_int(env, t[1], &c->y0) ||
+      !enif_get_int(env, t[2], &c->x1) || !enif_get_int(env, t[3], &c->y1) ||
+      !enif_get_int(env, t[4], &c->ox) || !enif_get_int(env, t[5], &c->oy)) {
+    return 0;
+  }
+  *out = c;
+  return 1;
+}
+
+/* Drawing coordinates are relative to the clip's origin, so row y is locked
+ * as row y + clip_row(clip) */
+static unsigned clip_row(const struct tb_clip *clip)
+{
+  return clip ? (unsigned)clip->oy : 0;
+}
+
+/*
+ * Writer thread.
+ *
+ * With an output backlog (tb_set_output_backlog), presents never block on the
+ * tty: whatever it does not take right away waits in termbox's backlog, and
+ * frames are skipped while that is over its limit. This thread drains the
+ * backlog as the tty becomes writable, so a slow terminal costs drawing
+ * processes nothing. It only wakes up while there is something to write.
+ * It also presents and acknowledges frames requested with tb_present_async.
+ */
+static struct {
+  ErlNifTid tid;
+  ErlNifMutex *lock;
+  ErlNifCond *cond;
+  int running;
+  int stop;
+  int pending;
+} writer;
+
+static void *writer_main(void *arg)
+{
+  struct pollfd pfd;
+  int resizefd, left;
+
+  enif_mutex_lock(writer.lock);
+  while (!writer.stop) {
+    if (!writer.pending) {
+      enif_cond_wait(writer.cond, writer.lock);
+      continue;
+    }
+    writer.pending = 0;
+    enif_mutex_unlock(writer.lock);
+
+    enif_rwlock_rwlock(session_lock);
+    left = tb_flush_backlog();
+    if (async_step()) left = tb_backlog_len();
+    if (left > 0 && tb_get_fds(&pfd.fd, &resizefd) != TB_OK) left = 0;
+    enif_rwlock_rwunlock(session_lock);
+
+    if (left > 0) {
+      /* tb_init reads and writes the same tty fd. The timeout only bounds
+       * how long a stop can go unnoticed. */
+      pfd.events = POLLOUT;
+      poll(&pfd, 1, 100);
+    }
+    enif_mutex_lock(writer.lock);
+    if (left > 0) writer.pending = 1;
+  }
+  enif_mutex_unlock(writer.lock);
+  return NULL;
+}
+
+static int writer_start(void)
+{
+  int rv = 0;
+  enif_mutex_lock(writer.lock);
+  if (!writer.running) {
+    writer.stop = 0;
+    writer.pending = 0;
+    rv = enif_thread_create("termbox2_writer", &writer.tid, writer_main, NULL, NULL);
+    writer.running = rv == 0;
+  }
+  enif_mutex_unlock(writer.lock);
+  return rv;
+}
+
+/* Must not be called with the session lock held: the thread may be waiting
+ * for it */
+static void writer_stop(void)
+{
+  enif_mutex_lock(writer.lock);
+  if (!writer.running) {
+    enif_mutex_unlock(writer.lock);
+    return;
+  }
+  writer.stop = 1;
+  enif_cond_signal(writer.cond);
+  enif_mutex_unlock(writer.lock);
+  enif_thread_join(writer.tid, NULL);
+  enif_mutex_lock(writer.lock);
+  writer.running = 0;
+  enif_mutex_unlock(writer.lock);
+}
+
+/* Hands pending output to the writer thread. Called with the session lock
+ * held exclusively, after anything that may have written to the tty. */
+static void writer_wake(void)
+{
+  /* A frame skipped while the terminal was hidden goes out once it is shown */
+  if (tb_present_pending() > 0) tb_flush_backlog();
+  if (tb_backlog_len() <= 0 && !async_waiting()) return;
+  enif_mutex_lock(writer.lock);
+  if (writer.running) {
+    writer.pending = 1;
+    enif_cond_signal(writer.cond);
+  }
+  enif_mutex_unlock(writer.lock);
+}
+
+/*
+ * Bounded event queue.
+ *
+ * Events are pulled out of termbox into a fixed pool of slots so the owner
+ * process only ever receives as many messages as it has room for. What
+ * happens when the pool is full is decided by the overflow policy. Queued
+ * events are linked in arrival order, and mouse motion events are also
+ * linked into a motion index, so evicting the oldest motion event from the
+ * middle of the queue costs the same as taking from its head.
+ */
+
+#define EVQ_DEFAULT_CAPACITY 1024
+
+#define EVQ_DROP_OLDEST_MOTION 0 /* evict the oldest mouse motion event  */
+#define EVQ_COALESCE           1 /* merge repeated motion/resize events  */
+#define EVQ_BLOCK              2 /* stop reading the tty until drained   */
+
+#define EVQ_NIL ((size_t)-1)
+
+struct evq_node_t {
+  struct tb_event ev;
+  size_t prev, next;   /* arrival order; next also chains the free slots */
+  size_t mprev, mnext; /* motion index, for motion events only */
+};
+
+struct evq_t {
+  struct evq_node_t *nodes;
+  size_t cap;
+  size_t len;
+  size_t head, tail;   /* oldest and newest event */
+  size_t mhead, mtail; /* oldest and newest motion event */
+  size_t free;
+  int overflow;
+  uint64_t dropped;
+  uint64_t coalesced;
+};
+
+static struct evq_t evq = {0};
+
+static int evq_is_motion(const struct tb_event *ev)
+{
+  return ev->type == TB_EVENT_MOUSE && (ev->mod & TB_MOD_MOTION);
+}
+
+static int evq_init(size_t cap, int overflow)
+{
+  struct evq_node_t *nodes = enif_alloc(sizeof(struct evq_node_t) * cap);
+  size_t i;
+  if (nodes == NULL) return TB_ERR_MEM;
+  if (evq.nodes != NULL) enif_free(evq.nodes);
+  memset(&evq, 0, sizeof(evq));
+  for (i = 0; i < cap; i++) nodes[i].next = i + 1 < cap ? i + 1 : EVQ_NIL;
+  evq.nodes = nodes;
+  evq.cap = cap;
+  evq.head = evq.tail = evq.mhead = evq.mtail = EVQ_NIL;
+  evq.free = 0;
+  evq.overflow = overflow;
+  return TB_OK;
+}
+
+static void evq_free(void)
+{
+  if (evq.nodes != NULL) enif_free(evq.nodes);
+  memset(&evq, 0, sizeof(evq));
+}
+
+/* Unlinks slot i from the queue and the motion index, and frees it */
+static void evq_remove(size_t i)
+{
+  struct evq_node_t *n = &evq.nodes[i];
+  if (n->prev != EVQ_NIL) evq.nodes[n->prev].next = n->next; else evq.head = n->next;
+  if (n->next != EVQ_NIL) evq.nodes[n->next].prev = n->prev; else evq.tail = n->prev;
+  if (evq_is_motion(&n->ev)) {
+    if (n->mprev != EVQ_NIL) evq.nodes[n->mprev].mnext = n->mnext; else evq.mhead = n->mnext;
+    if (n->mnext != EVQ_NIL) evq.nodes[n->mnext].mprev = n->mprev; else evq.mtail = n->mprev;
+  }
+  n->next = evq.free;
+  evq.free = i;
+  evq.len--;
+}
+
+/* Make room for one more event by evicting the oldest motion event, or the
+ * oldest event of any kind if there is no motion in the queue. */
+static void evq_evict(void)
+{
+  evq_remove(evq.mhead != EVQ_NIL ? evq.mhead : evq.head);
+  evq.dropped++;
+}
+
+static void evq_push(const struct tb_event *ev)
+{
+  struct evq_node_t *n;
+  size_t i;
+  if (evq.overflow == EVQ_COALESCE && evq.len > 0) {
+    struct tb_event *tail = &evq.nodes[evq.tail].ev;
+    int same_motion = evq_is_motion(ev) && evq_is_motion(tail) &&
+                      ev->key == tail->key && ev->mod == tail->mod;
+    int same_resize = ev->type == TB_EVENT_RESIZE && tail->type == TB_EVENT_RESIZE;
+    if (same_motion || same_resize) {
+      /* Still motion or still a resize, so the motion index holds */
+      *tail = *ev;
+      evq.coalesced++;
+      return;
+    }
+  }
+  if (evq.len == evq.cap) evq_evict();
+  i = evq.free;
+  n = &evq.nodes[i];
+  evq.free = n->next;
+  n->ev = *ev;
+  n->prev = evq.tail;
+  n->next = EVQ_NIL;
+  if (evq.tail != EVQ_NIL) evq.nodes[evq.tail].next = i; else evq.head = i;
+  evq.tail = i;
+  if (evq_is_motion(ev)) {
+    n->mprev = evq.mtail;
+    n->mnext = EVQ_NIL;
+    if (evq.mtail != EVQ_NIL) evq.nodes[evq.mtail].mnext = i; else evq.mhead = i;
+    evq.mtail = i;
+  }
+  evq.len++;
+}
+
+static ERL_NIF_TERM make_event_term(ErlNifEnv *env, const struct tb_event *ev)
+{
+  return enif_make_tuple9
+    (env,
+     enif_make_int(env, ev->type),
+     enif_make_int(env, ev->mod),
+     enif_make_int(env, ev->key),
+     enif_make_uint(env, ev->ch),
+     enif_make_int(env, ev->w),
+     enif_make_int(env, ev->h),
+     enif_make_int(env, ev->x),
+     enif_make_int(env, ev->y),
+     enif_make_uint64(env, ev->ts));
+}
+
+/*
+ * Event subscribers.
+ *
+ * Besides the owner, which gets every event through the queue, any process
+ * may subscribe to the events it cares about: a set of event types, a
+ * rectangle mouse events must fall in, and optionally the keys and
+ * characters key events must match. Matching events are sent to each
+ * subscriber as {termbox_raw_event, Event} as soon as they are read, so
+ * widgets get their input in one hop instead of through the owner. Guarded by
+ * the session lock.
+ */
+#define SUB_MAX_KEYS 32
+
+struct sub_t {
+  ErlNifPid pid;
+  int types;      /* 1 << TB_EVENT_* */
+  int x, y, w, h; /* mouse events must fall in here, unless w < 0 */
+  unsigned nkeys, nchs;
+  uint16_t keys[SUB_MAX_KEYS];
+  uint32_t chs[SUB_MAX_KEYS];
+};
+
+struct subs_t {
+  struct sub_t *subs;
+  size_t len;
+  size_t cap;
+};
+
+static struct subs_t subs = {0};
+static ErlNifEnv *subs_env = NULL;
+
+static struct sub_t *subs_find(const ErlNifPid *pid)
+{
+  size_t i;
+  for (i = 0; i < subs.len; i++) {
+    if (enif_compare_pids(&subs.subs[i].pid, pid) == 0) return &subs.subs[i];
+  }
+  return NULL;
+}
+
+static void subs_remove(const ErlNifPid *pid)
+{
+  struct sub_t *s = subs_find(pid);
+  if (s != NULL) *s = subs.subs[--subs.len];
+}
+
+static void subs_free(void)
+{
+  if (subs.subs != NULL) enif_free(subs.subs);
+  memset(&subs, 0, sizeof(subs));
+}
+
+static int sub_matches(const struct sub_t *s, const struct tb_event *ev)
+{
+  unsigned i;
+  if (!(s->types & (1 << ev->type))) return 0;
+  if (ev->type == TB_EVENT_MOUSE && s->w >= 0) {
+    return ev->x >= s->x && ev->x < s->x + s->w &&
+           ev->y >= s->y && ev->y < s->y + s->h;
+  }
+  if (ev->type == TB_EVENT_KEY && (s->nkeys > 0 || s->nchs > 0)) {
+    for (i = 0; i < s->nkeys; i++) {
+      if (ev->key != 0 && ev->key == s->keys[i]) return 1;
+    }
+    for (i = 0; i < s->nchs; i++) {
+      if (ev->key == 0 && ev->ch == s->chs[i]) return 1;
+    }
+    return 0;
+  }
+  return 1;
+}
+
+/* Sends ev to every subscriber it matches. caller_env is NULL on our own
+ * threads. */
+static void subs_dispatch(ErlNifEnv *caller_env, const struct tb_event *ev)
+{
+  size_t i;
+  for (i = 0; i < subs.len; i++) {
+    if (!sub_matches(&subs.subs[i], ev)) continue;
+    enif_send(caller_env, &subs.subs[i].pid, subs_env,
+              enif_make_tuple2(subs_env, enif_make_atom(subs_env, "termbox_raw_event"),
+                               make_event_term(subs_env, ev)));
+    enif_clear_env(subs_env);
+  }
+}
+
+/* Drains every event termbox can produce without blocking into the queue.
+ * Called with the session lock held exclusively. Returns the queue length, or
+ * a negative TB_ERR_* code. */
+static int evq_fill(ErlNifEnv *caller_env)
+{
+  struct tb_event ev;
+  int rv = TB_OK;
+  if (evq.nodes == NULL) rv = evq_init(EVQ_DEFAULT_CAPACITY, EVQ_COALESCE);
+  while (rv == TB_OK) {
+    if (evq.overflow == EVQ_BLOCK && evq.len == evq.cap) break;
+    rv = tb_peek_event(&ev, 0);
+    if (rv == TB_OK) {
+      subs_dispatch(caller_env, &ev);
+      evq_push(&ev);
+    }
+  }
+  if (rv == TB_ERR_NO_EVENT || rv == TB_OK) rv = (int)evq.len;
+  return rv;
+}
+
+/*
+ * Input reactor.
+ *
+ * Instead of ExTermbox.Server polling the queue on a timer, one thread waits
+ * on the tty and the resize pipe, fills the event queue as soon as either is
+ * readable and sends the registered process a single 'termbox_events' message
+ * until it takes from the queue again. An idle terminal costs no wakeups.
+ * termbox has one session, so poll() on its two fds (plus the wake pipe) does
+ * what an epoll set would, and also builds on macOS and FreeBSD.
+ */
+static struct {
+  ErlNifTid tid;
+  ErlNifMutex *lock;
+  ErlNifPid pid;
+  int running;
+  int stop;
+  int notified; /* guarded by the session lock */
+  int wakefd[2];
+} reactor = {.wakefd = {-1, -1}};
+
+static void reactor_wake(void)
+{
+  char c = 0;
+  if (reactor.wakefd[1] >= 0) (void)write(reactor.wakefd[1], &c, 1);
+}
+
+/* Longest sleep between replay checks, so a replay stopped or replaced
+ * meanwhile is noticed */
+#define REPLAY_SLICE_MS 10
+
+/* Milliseconds until a replay record due at due, at most REPLAY_SLICE_MS */
+static int replay_wait_ms(uint64_t due)
+{
+  uint64_t now = monotonic_ns();
+  if (due <= now) return 0;
+  if (due - now >= (uint64_t)REPLAY_SLICE_MS * 1000000) return REPLAY_SLICE_MS;
+  return (int)((due - now + 999999) / 1000000);
+}
+
+static void *reactor_main(void *arg)
+{
+  ErlNifEnv *msg_env = enif_alloc_env();
+  struct pollfd fds[3];
+  char buf[64];
+  uint64_t due;
+  int queued, ready, notify, stop;
+
+  for (;;) {
+    enif_rwlock_rwlock(session_lock);
+    queued = evq_fill(NULL);
+    ready = tb_get_fds(&fds[0].fd, &fds[1].fd) == TB_OK;
+    due = tb_input_replay_due();
+    /* With EVQ_BLOCK and a full queue the tty is left unread until taken */
+    if (!ready || (evq.overflow == EVQ_BLOCK && evq.len == evq.cap)) {
+      fds[0].fd = fds[1].fd = -1;
+      due = 0;
+    }
+    notify = queued > 0 && !reactor.notified;
+    if (notify) reactor.notified = 1;
+    writer_wake();
+    enif_rwlock_rwunlock(session_lock);
+
+    enif_mutex_lock(reactor.lock);
+    stop = reactor.stop;
+    if (notify && !stop) {
+      enif_send(NULL, &reactor.pid, msg_env, enif_make_atom(msg_env, "termbox_events"));
+      enif_clear_env(msg_env);
+    }
+    enif_mutex_unlock(reactor.lock);
+    if (stop) break;
+
+    fds[0].events = fds[1].events = POLLIN;
+    fds[2].fd = reactor.wakefd[0];
+    fds[2].events = POLLIN;
+    /* Replayed input is paced by termbox, which has no fd to wait on */
+    if (poll(fds, 3, due ? replay_wait_ms(due) : -1) > 0 && fds[2].revents) {
+      while (read(reactor.wakefd[0], buf, sizeof(buf)) > 0) {}
+    }
+  }
+
+  enif_free_env(msg_env);
+  return NULL;
+}
+
+/* Starts the reactor, or points a running one at another process */
+static int reactor_start(const ErlNifPid *pid)
+{
+  int rv = 0;
+  enif_mutex_lock(reactor.lock);
+  reactor.pid = *pid;
+  if (!reactor.running) {
+    reactor.stop = 0;
+    rv = enif_thread_create("termbox2_reactor", &reactor.tid, reactor_main, NULL, NULL);
+    reactor.running = rv == 0;
+  }
+  enif_mutex_unlock(reactor.lock);
+  reactor_wake();
+  return rv;
+}
+
+/* Must not be called with the session lock held */
+static void reactor_stop(void)
+{
+  enif_mutex_lock(reactor.lock);
+  if (!reactor.running) {
+    enif_mutex_unlock(reactor.lock);
+    return;
+  }
+  reactor.stop = 1;
+  enif_mutex_unlock(reactor.lock);
+  reactor_wake();
+  enif_thread_join(reactor.tid, NULL);
+  enif_mutex_lock(reactor.lock);
+  reactor.running = 0;
+  enif_mutex_unlock(reactor.lock);
+}
+
+/*
+ * Shared-memory producers.
+ *
+ * tb_shm_open maps a POSIX shared-memory segment onto a rectangle of the
+ * screen so other OS processes can write cells without going through
+ * Erlang; termbox2_shm.h documents the layout and the seqlock. Each present
+ * first copies the rows producers marked dirty into the back buffer. Rows are
+ * staged in a private scratch buffer and only applied once the seqlock shows
+ * the producer did not write in the meantime; otherwise they stay dirty for
+ * the next present. The header is writable by producers, so its geometry is
+ * only ever read from the copy kept here. Guarded by the session lock.
+ */
+#define SHM_MAX_SEGMENTS 8
+#define SHM_MAX_SIZE 4096
+
+struct shm_seg_t {
+  struct tb_shm_header *hdr;
+  size_t size;
+  int x, y;
+  uint32_t w, h, cells_offset; /* as created, whatever the header says now */
+  char *name;
+  struct tb_shm_cell *scratch;
+};
+
+static struct shm_seg_t shm_segs[SHM_MAX_SEGMENTS];
+static int shm_count = 0; /* atomic; read by the frame clock without the lock */
+
+static uint64_t *shm_dirty(const struct shm_seg_t *seg)
+{
+  return (uint64_t *)(seg->hdr + 1);
+}
+
+static struct tb_shm_cell *shm_cells(const struct shm_seg_t *seg)
+{
+  return (struct tb_shm_cell *)((char *)seg->hdr + seg->cells_offset);
+}
+
+/* Whether any producer has rows waiting to be copied */
+static int shm_pending(void)
+{
+  int i;
+  uint32_t w;
+  for (i = 0; i < SHM_MAX_SEGMENTS; i++) {
+    if (shm_segs[i].hdr == NULL) continue;
+    for (w = 0; w < (shm_segs[i].h + 63) / 64; w++) {
+      if (__atomic_load_n(&shm_dirty(&shm_segs[i])[w], __ATOMIC_RELAXED)) return 1;
+    }
+  }
+  return 0;
+}
+
+/* Copies one segment's dirty rows into the back buffer, if the producer
+ * left them consistent */
+static void shm_merge_seg(struct shm_seg_t *seg)
+{
+  uint64_t taken[SHM_MAX_SIZE / 64], bits;
+  uint32_t w = seg->w, h = seg->h, words = (h + 63) / 64;
+  uint32_t seq, i, x, y;
+  uint64_t *dirty = shm_dirty(seg);
+  struct tb_shm_cell *cells = shm_cells(seg), *c;
+  struct tb_cell *back;
+  int any = 0, tw, th, sx, sy;
+
+  seq = __atomic_load_n(&seg->hdr->seq, __ATOMIC_ACQUIRE);
+  if (seq & 1) return;
+  for (i = 0; i < words; i++) {
+    taken[i] = __atomic_exchange_n(&dirty[i], 0, __ATOMIC_ACQ_REL);
+    /* Bits past the last row are the producer's mistake; drop them */
+    if (i == words - 1 && h % 64) taken[i] &= (1ull << (h % 64)) - 1;
+    for (bits = taken[i]; bits; bits &= bits - 1) {
+      y = i * 64 + (uint32_t)__builtin_ctzll(bits);
+      memcpy(&seg->scratch[y * w], &cells[y * w], w * sizeof(struct tb_shm_cell));
+      any = 1;
+    }
+  }
+  if (!any) return;
+
+  __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  if (__atomic_load_n(&seg->hdr->seq, __ATOMIC_RELAXED) != seq) {
+    /* Torn: try again on the next present */
+    for (i = 0; i < words; i++) {
+      if (taken[i]) __atomic_fetch_or(&dirty[i], taken[i], __ATOMIC_RELEASE);
+    }
+    return;
+  }
+  /* Straight into the back buffer: segments sit at screen coordinates, not
+   * under whatever clip rectangle a drawing process has pushed */
+  back = tb_cell_buffer();
+  tw = tb_width();
+  th = tb_height();
+  for (i = 0; back != NULL && i < words; i++) {
+    for (bits = taken[i]; bits; bits &= bits - 1) {
+      y = i * 64 + (uint32_t)__builtin_ctzll(bits);
+      sy = seg->y + (int)y;
+      if (sy < 0 || sy >= th) continue;
+      for (x = 0, c = &seg->scratch[y * w]; x < w; x++, c++) {
+        sx = seg->x + (int)x;
+        if (c->ch == 0 || sx < 0 || sx >= tw) continue;
+        back[sy * tw + sx].ch = c->ch;
+        back[sy * tw + sx].fg = c->fg;
+        back[sy * tw + sx].bg = c->bg;
+      }
+    }
+  }
+  __atomic_fetch_add(&seg->hdr->presented, 1, __ATOMIC_RELEASE);
+}
+
+/* Called with the session lock held exclusively, before every present */
+static void shm_merge(void)
+{
+  int i;
+  if (__atomic_load_n(&shm_count, __ATOMIC_RELAXED) == 0) return;
+  for (i = 0; i < SHM_MAX_SEGMENTS; i++) {
+    if (shm_segs[i].hdr != NULL) shm_merge_seg(&shm_segs[i]);
+  }
+}
+
+static void shm_unmap(struct shm_seg_t *seg)
+{
+  munmap(seg->hdr, seg->size);
+  shm_unlink(seg->name);
+  enif_free(seg->name);
+  enif_free(seg->scratch);
+  memset(seg, 0, sizeof(*seg));
+}
+
+/* Creates the segment and returns its id, or a negative TB_ERR_* code.
+ * name takes over into the segment on success. */
+static int shm_create(char *name, int x, int y, int w, int h)
+{
+  struct shm_seg_t seg = {0};
+  size_t cells_offset;
+  int fd, id;
+
+  cells_offset = sizeof(struct tb_shm_header) + (size_t)((h + 63) / 64) * 8;
+  seg.size = cells_offset + (size_t)w * (size_t)h * sizeof(struct tb_shm_cell);
+  seg.scratch = enif_alloc((size_t)w * (size_t)h * sizeof(struct tb_shm_cell));
+  if (seg.scratch == NULL) return TB_ERR_MEM;
+
+  fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+  if (fd < 0) {
+    enif_free(seg.scratch);
+    return TB_ERR;
+  }
+  if (ftruncate(fd, (off_t)seg.size) != 0 ||
+      (seg.hdr = mmap(NULL, seg.size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+    close(fd);
+    shm_unlink(name);
+    enif_free(seg.scratch);
+    return TB_ERR;
+  }
+  close(fd);
+
+  /* ftruncate zero-filled it: no dirty rows, seq 0 */
+  seg.hdr->width = (uint32_t)w;
+  seg.hdr->height = (uint32_t)h;
+  seg.hdr->cell_size = sizeof(struct tb_shm_cell);
+  seg.hdr->cells_offset = (uint32_t)cells_offset;
+  seg.x = x;
+  seg.y = y;
+  seg.w = (uint32_t)w;
+  seg.h = (uint32_t)h;
+  seg.cells_offset = (uint32_t)cells_offset;
+  seg.name = name;
+
+  enif_rwlock_rwlock(session_lock);
+  for (id = 0; id < SHM_MAX_SEGMENTS && shm_segs[id].hdr != NULL; id++) {}
+  if (id < SHM_MAX_SEGMENTS) {
+    shm_segs[id] = seg;
+    __atomic_fetch_add(&shm_count, 1, __ATOMIC_RELAXED);
+  }
+  enif_rwlock_rwunlock(session_lock);
+  if (id == SHM_MAX_SEGMENTS) {
+    seg.name = NULL;
+    munmap(seg.hdr, seg.size);
+    shm_unlink(name);
+    enif_free(seg.scratch);
+    return TB_ERR;
+  }
+  /* Producers may start once the magic is there */
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  memcpy(seg.hdr->magic, TB_SHM_MAGIC, 8);
+  return id;
+}
+
+/* Unmaps and unlinks every segment. Called with the session lock held, or
+ * from unload. */
+static void shm_close_all(void)
+{
+  int i;
+  for (i = 0; i < SHM_MAX_SEGMENTS; i++) {
+    if (shm_segs[i].hdr != NULL) shm_unmap(&shm_segs[i]);
+  }
+  __atomic_store_n(&shm_count, 0, __ATOMIC_RELAXED);
+}
+
+/*
+ * Frame clock.
+ *
+ * With a frame rate set (tb_set_frame_rate), apps only draw: every cell
+ * write marks the back buffer dirty, and this thread presents it at most once
+ * per frame period, so any number of draws between two ticks cost a single
+ * diff. Only the first write after a present wakes the thread, and a clean
+ * buffer leaves it asleep, so an idle screen costs no wakeups (unless
+ * shared-memory producers are attached, see above). On Linux it
+ * sleeps on a one-shot timerfd armed for the next frame; elsewhere a poll()
+ * timeout does with millisecond resolution.
+ */
+#define FRAME_RATE_MAX 1000
+
+static struct {
+  ErlNifTid tid;
+  ErlNifMutex *lock;
+  int running;
+  int stop;
+  int rate;
+  int dirty; /* atomic; only set while the clock runs */
+  int wakefd[2];
+  int timerfd;
+} frames = {.wakefd = {-1, -1}, .timerfd = -1};
+
+/* Called after writing cells, with or without the session lock */
+static void frame_dirty(void)
+{
+  char c = 0;
+  if (!__atomic_load_n(&frames.rate, __ATOMIC_RELAXED)) return;
+  if (!__atomic_exchange_n(&frames.dirty, 1, __ATOMIC_ACQ_REL)) {
+    (void)write(frames.wakefd[1], &c, 1);
+  }
+}
+
+/* Called with the session lock held exclusively. Whatever is drawn after this
+ * point belongs to the next frame. */
+static int frame_present(void)
+{
+  __atomic_store_n(&frames.dirty, 0, __ATOMIC_RELEASE);
+  shm_merge();
+  return tb_present();
+}
+
+/* Sleeps until due (CLOCK_MONOTONIC, 0 for no limit) or a wakeup */
+static void frame_sleep(uint64_t due)
+{
+  struct pollfd fds[2];
+  char buf[64];
+  int timeout = -1, nfds = 1;
+  uint64_t now;
+
+  fds[0].fd = frames.wakefd[0];
+  fds[0].events = POLLIN;
+  if (due != 0) {
+#ifdef __linux__
+    struct itimerspec its = {0};
+    its.it_value.tv_sec = due / 1000000000;
+    its.it_value.tv_nsec = due % 1000000000;
+    if (frames.timerfd >= 0 &&
+        timerfd_settime(frames.timerfd, TFD_TIMER_ABSTIME, &its, NULL) == 0) {
+      fds[1].fd = frames.timerfd;
+      fds[1].events = POLLIN;
+      nfds = 2;
+    }
+#endif
+    if (nfds == 1) {
+      now = monotonic_ns();
+      timeout = due > now ? (int)((due - now + 999999) / 1000000) : 0;
+    }
+  }
+  if (poll(fds, nfds, timeout) > 0) {
+    if (fds[0].revents) {
+      while (read(frames.wakefd[0], buf, sizeof(buf)) > 0) {}
+    }
+    if (nfds == 2 && fds[1].revents) (void)read(frames.timerfd, buf, 8);
+  }
+}
+
+static void *frames_main(void *arg)
+{
+  uint64_t now, last = 0, period;
+  int stop, rate;
+
+  for (;;) {
+    enif_mutex_lock(frames.lock);
+    stop = frames.stop;
+    rate = frames.rate;
+    enif_mutex_unlock(frames.lock);
+    if (stop) break;
+
+    /* Shared-memory producers cannot wake the clock, so while any are
+     * attached it checks on them every frame */
+    if (!__atomic_load_n(&frames.dirty, __ATOMIC_ACQUIRE) &&
+        !__atomic_load_n(&shm_count, __ATOMIC_RELAXED)) {
+      frame_sleep(0);
+      continue;
+    }
+    /* Ticks are spaced from the start of the last frame, not its end, so a
+     * slow present does not lower the rate further */
+    period = 1000000000ull / (uint64_t)rate;
+    now = monotonic_ns();
+    if (now - last < period) {
+      frame_sleep(last + period);
+      continue;
+    }
+
+    enif_rwlock_rwlock(session_lock);
+    if (__atomic_load_n(&frames.dirty, __ATOMIC_ACQUIRE) || shm_pending()) frame_present();
+    writer_wake();
+    enif_rwlock_rwunlock(session_lock);
+    last = now;
+  }
+  return NULL;
+}
+
+static void frames_wake(void)
+{
+  char c = 0;
+  if (frames.wakefd[1] >= 0) (void)write(frames.wakefd[1], &c, 1);
+}
+
+/* Starts the clock at rate frames per second, or changes its rate */
+static int frames_start(int rate)
+{
+  int rv = 0;
+  enif_mutex_lock(frames.lock);
+  if (!frames.running) {
+    frames.stop = 0;
+    /* Whatever was drawn before the clock started is presented by it */
+    __atomic_store_n(&frames.dirty, 1, __ATOMIC_RELEASE);
+    rv = enif_thread_create("termbox2_frames", &frames.tid, frames_main, NULL, NULL);
+    frames.running = rv == 0;
+  }
+  if (rv == 0) __atomic_store_n(&frames.rate, rate, __ATOMIC_RELEASE);
+  enif_mutex_unlock(frames.lock);
+  frames_wake();
+  return rv;
+}
+
+/* Must not be called with the session lock held: the thread may be waiting
+ * for it to present */
+static void frames_stop(void)
+{
+  enif_mutex_lock(frames.lock);
+  if (!frames.running) {
+    enif_mutex_unlock(frames.lock);
+    return;
+  }
+  frames.stop = 1;
+  enif_mutex_unlock(frames.lock);
+  frames_wake();
+  enif_thread_join(frames.tid, NULL);
+  enif_mutex_lock(frames.lock);
+  frames.running = 0;
+  __atomic_store_n(&frames.rate, 0, __ATOMIC_RELEASE);
+  __atomic_store_n(&frames.dirty, 0, __ATOMIC_RELEASE);
+  enif_mutex_unlock(frames.lock);
+}
+
+/*
+ * Pipelined present.
+ *
+ * tb_present_async queues a frame and returns at once; the writer thread
+ * presents it and sends the caller {presented, Ref, Stats} once the tty has
+ * taken the whole frame. With an output backlog that happens while the app
+ * is already drawing the next one. At most max_in_flight presented frames
+ * wait for the tty. One more waits to be presented, and every request made
+ * until then joins it, since it presents whatever the back buffer holds by
+ * then. While the terminal is hidden (tb_present_hidden) that frame waits
+ * too, so an app pacing itself on acknowledgements stops drawing. Everything
+ * here is guarded by the session lock.
+ */
+#define ASYNC_MAX_IN_FLIGHT 16
+#define ASYNC_DEFAULT_IN_FLIGHT 2
+
+struct async_waiter_t {
+  ErlNifPid pid;
+  ERL_NIF_TERM ref; /* in the frame's env */
+  uint64_t ts;
+};
+
+struct async_frame_t {
+  ErlNifEnv *env;
+  struct async_waiter_t *waiters;
+  unsigned n, cap;
+  uint64_t end;   /* tb_output_counts total right after its present */
+  uint64_t bytes;
+};
+
+static struct {
+  struct async_frame_t ring[ASYNC_MAX_IN_FLIGHT + 1];
+  unsigned head, len; /* len counts the unpresented frame, if any */
+  int pending;        /* the newest frame has not been presented yet */
+  int max_in_flight;
+  ErlNifEnv *msg_env; /* only used by the writer thread */
+} async = {.max_in_flight = ASYNC_DEFAULT_IN_FLIGHT};
+
+static struct async_frame_t *async_at(unsigned i)
+{
+  return &async.ring[(async.head + i) % (ASYNC_MAX_IN_FLIGHT + 1)];
+}
+
+static int async_waiting(void)
+{
+  return async.pending;
+}
+
+/* Queues a request from pid on the unpresented frame, opening one if need be */
+static int async_request(const ErlNifPid *pid, ERL_NIF_TERM ref)
+{
+  struct async_frame_t *f;
+  struct async_waiter_t *w;
+  int rv = tb_backlog_len();
+  if (rv < 0) return rv;
+
+  if (!async.pending) {
+    f = async_at(async.len);
+    if (f->env == NULL && (f->env = enif_alloc_env()) == NULL) return TB_ERR_MEM;
+    f->n = 0;
+    async.len++;
+    async.pending = 1;
+  }
+  f = async_at(async.len - 1);
+  if (f->n == f->cap) {
+    unsigned cap = f->cap ? f->cap * 2 : 4;
+    w = enif_realloc(f->waiters, cap * sizeof(*w));
+    if (w == NULL) return TB_ERR_MEM;
+    f->waiters = w;
+    f->cap = cap;
+  }
+  w = &f->waiters[f->n++];
+  w->pid = *pid;
+  w->ref = enif_make_copy(f->env, ref);
+  w->ts = monotonic_ns();
+  return TB_OK;
+}
+
+/* Sends every process waiting on the oldest frame {presented, Ref, Stats},
+ * where Stats is a map, or {error, Code} if rv is an error, and drops it */
+static void async_done(ErlNifEnv *caller_env, int rv)
+{
+  struct async_frame_t *f = async_at(0);
+  ErlNifEnv *env = async.msg_env;
+  ERL_NIF_TERM keys[3], vals[3], stats;
+  uint64_t now = monotonic_ns();
+  unsigned i;
+
+  for (i = 0; i < f->n; i++) {
+    if (rv == TB_OK) {
+      keys[0] = enif_make_atom(env, "bytes");
+      vals[0] = enif_make_uint64(env, f->bytes);
+      keys[1] = enif_make_atom(env, "latency_us");
+      vals[1] = enif_make_uint64(env, (now - f->waiters[i].ts) / 1000);
+      keys[2] = enif_make_atom(env, "coalesced");
+      vals[2] = enif_make_uint(env, f->n - 1);
+      enif_make_map_from_arrays(env, keys, vals, 3, &stats);
+    } else {
+      stats = enif_make_tuple2(env, enif_make_atom(env, "error"), enif_make_int(env, rv));
+    }
+    enif_send(caller_env, &f->waiters[i].pid, env,
+              enif_make_tuple3(env, enif_make_atom(env, "presented"),
+                               enif_make_copy(env, f->waiters[i].ref), stats));
+    enif_clear_env(env);
+  }
+  f->n = 0;
+  enif_clear_env(f->env);
+  async.head = (async.head + 1) % (ASYNC_MAX_IN_FLIGHT + 1);
+  async.len--;
+  if (async.len == 0) async.pending = 0;
+}
+
+static void async_free(void)
+{
+  unsigned i;
+  for (i = 0; i <= ASYNC_MAX_IN_FLIGHT; i++) {
+    if (async.ring[i].env != NULL) enif_free_env(async.ring[i].env);
+    if (async.ring[i].waiters != NULL) enif_free(async.ring[i].waiters);
+  }
+  if (async.msg_env != NULL) enif_free_env(async.msg_env);
+  memset(&async, 0, sizeof(async));
+  async.max_in_flight = ASYNC_DEFAULT_IN_FLIGHT;
+}
+
+/* Fails every queued frame with rv */
+static void async_cancel(ErlNifEnv *caller_env, int rv)
+{
+  while (async.len > 0) async_done(caller_env, rv);
+}
+
+/* Called by the writer thread with the session lock held exclusively.
+ * Acknowledges frames the tty has fully taken and presents the queued one
+ * if there is room for it. Returns whether it presented. */
+static int async_step(void)
+{
+  uint64_t total, written, before;
+  struct async_frame_t *f;
+  int rv, presented = 0;
+
+  if (async.len == 0) return 0;
+  rv = tb_output_counts(&before, &written);
+  if (rv != TB_OK) {
+    async_cancel(NULL, rv);
+    return 0;
+  }
+
+  for (;;) {
+    while (async.len > (unsigned)async.pending && async_at(0)->end <= written) {
+      async_done(NULL, TB_OK);
+    }
+    if (!async.pending || presented || tb_present_hidden() > 0 ||
+        async.len - 1 >= (unsigned)async.max_in_flight ||
+        (tb_set_output_backlog(-1) > 0 &&
+         tb_backlog_len() > tb_set_output_backlog(-1))) {
+      return presented;
+    }
+
+    /* A full backlog would only defer the frame; that waits above */
+    f = async_at(async.len - 1);
+    async.pending = 0;
+    presented = 1;
+    rv = frame_present();
+    if (rv == TB_OK) rv = tb_output_counts(&total, &written);
+    if (rv != TB_OK) {
+      async_cancel(NULL, rv);
+      return presented;
+    }
+    f->bytes = total - before;
+    f->end = total;
+  }
+}
 
 static ERL_NIF_TERM nif_tb_init(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
 {
-  return enif_make_int(env, tb_init());
+  int res;
+  with_session_lock(res, tb_init());
+  return enif_make_int(env, res);
 }
 
 static ERL_NIF_TERM nif_tb_shutdown(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
 {
-  return enif_make_int(env, tb_shutdown());
+  void *held[TB_OPT_LAYERS_MAX + TB_OPT_CANVASES_MAX];
+  int res, n, i;
+  /* tb_shutdown drains the backlog itself */
+  frames_stop();
+  writer_stop();
+  reactor_stop();
+  enif_rwlock_rwlock(session_lock);
+  async_cancel(env, TB_ERR_NOT_INIT);
+  evq_free();
+  subs_free();
+  shm_close_all();
+  n = layers_release(held);
+  n += canvases_release(held + n);
+  res = tb_shutdown();
+  enif_rwlock_rwunlock(session_lock);
+  /* Outside the lock: this may free surfaces and canvases */
+  for (i = 0; i < n; i++) enif_release_resource(held[i]);
+  return enif_make_int(env, res);
 }
 
 static ERL_NIF_TERM nif_tb_width(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
 {
-  return enif_make_int(env, tb_width());
+  int res;
+  with_session_lock(res, tb_width());
+  return enif_make_int(env, res);
 }
 
 static ERL_NIF_TERM nif_tb_height(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
 {
-  return enif_make_int(env, tb_height());
+  int res;
+  with_session_lock(res, tb_height());
+  return enif_make_int(env, res);
 }
 
 static ERL_NIF_TERM nif_tb_clear(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
 {
-  return enif_make_int(env, tb_clear());
+  int res;
+  with_session_lock(res, (frame_dirty(), tb_clear()));
+  return enif_make_int(env, res);
 }
 
 static ERL_NIF_TERM nif_tb_present(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
 {
-  return enif_make_int(env, tb_present());
+  int res;
+  with_session_lock(res, frame_present());
+  return enif_make_int(env, res);
+}
+
+/* Queues a present for the writer thread, which sends the caller
+ * {presented, Ref, Stats} once the tty has taken the frame */
+static ERL_NIF_TERM nif_tb_present_async(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+  ErlNifPid pid;
+  int res;
+  if (!enif_is_ref(env, argv[0]) || !enif_self(env, &pid)) return enif_make_badarg(env);
+  if (writer_start() != 0) return enif_make_int(env, TB_ERR);
+  with_session_lock(res, async_request(&pid, argv[0]));
+  return enif_make_int(env, res);
+}
+
+/* Sets how many presented frames may wait for the tty before queued ones
+ * coalesce, or returns the current limit for -1 */
+static ERL_NIF_TERM nif_tb_set_frames_in_flight(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+  int n, res = TB_OK;
+  if (!enif_get_int(env, argv[0], &n)) return enif_make_badarg(env);
+  if (n != -1 && (n < 1 || n > ASYNC_MAX_IN_FLIGHT)) return enif_make_int(env, TB_ERR);
+  enif_rwlock_rwlock(session_lock);
+  if (n == -1) {
+    res = async.max_in_flight;
+  } else {
+    async.max_in_flight = n;
+    /* A raised limit may let the queued frame go */
+    writer_wake();
+  }
+  enif_rwlock_rwunlock(session_lock);
+  return enif_make_int(env, res);
+}
+
+static ERL_NIF_TERM nif_tb_last_present_ts(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+  uint64_t ts;
+  with_session_lock(ts, tb_last_present_ts());
+  return enif_make_uint64(env, ts);
+}
+
+static ERL_NIF_TERM nif_tb_get_features(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+  int res;
+  with_session_lock(res, tb_get_features());
+  return enif_make_int(env, res);
+}
+
+static ERL_NIF_TERM nif_tb_get_term_version(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+  ERL_NIF_TERM bin;
+  enif_rwlock_rwlock(session_lock);
+  const char *version = tb_get_term_version();
+  unsigned char *buf = enif_make_new_binary(env, strlen(version), &bin);
+  memcpy(buf, version, strlen(version));
+  enif_rwlock_rwunlock(session_lock);
+  return bin;
 }
 
 static ERL_NIF_TERM nif_tb_set_cursor(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
 {
-  int cx, cy;
+  int cx, cy, res;
   if (!enif_get_int(env, argv[0], &cx)) return enif_make_badarg(env);
   if (!enif_get_int(env, argv[1], &cy)) return enif_make_badarg(env);
-  return enif_make_int(env, tb_set_cursor(cx, cy));
+  with_session_lock(res, (frame_dirty(), tb_set_cursor(cx, cy)));
+  return enif_make_int(env, res);
 }
 
 static ERL_NIF_TERM nif_tb_hide_cursor(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
 {
-  return enif_make_int(env, tb_hide_cursor());
+  int res;
+  with_session_lock(res, (frame_dirty(), tb_hide_cursor()));
+  return enif_make_int(env, res);
 }
 
+/* tb_set_cell(X, Y, Ch, Fg, Bg[, Clip]) */
 static ERL_NIF_TERM nif_tb_set_cell(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
 {
   int x, y;
   uint32_t ch;
   unsigned long fg, bg;
+  struct tb_clip c;
+  const struct tb_clip *clip = NULL;
   if (!enif_get_int(env, argv[0], &x)) return enif_make_badarg(env);
   if (!enif_get_int(env, argv[1], &y)) return enif_make_badarg(env);
   if (!enif_get_uint(env, argv[2], &ch)) return enif_make_badarg(env);
   if (!enif_get_uint64(env, argv[3], &fg)) return enif_make_badarg(env);
   if (!enif_get_uint64(env, argv[4], &bg)) return enif_make_badarg(env);
-  return enif_make_int(env, tb_set_cell(x, y, ch, fg, bg));
+  if (argc > 5 && !get_clip(env, argv[5], &c, &clip)) return enif_make_badarg(env);
+  int res;
+  unsigned row;
+  enif_rwlock_rlock(session_lock);
+  row = (unsigned)y + clip_row(clip);
+  row_lock(row);
+  res = tb_set_cell_clip(clip, x, y, ch, fg, bg);
+  row_unlock(row);
+  frame_dirty();
+  enif_rwlock_runlock(session_lock);
+  return enif_make_int(env, res);
+}
+
+struct nif_cell_t {
+  int x;
+  int y;
+  uint32_t ch;
+  unsigned long fg;
+  unsigned long bg;
+};
+
+/* Decodes a list of {x, y, ch, fg, bg} tuples into a new array, so locks are
+ * held only for termbox work. Returns TB_OK, TB_ERR_MEM, or TB_ERR for a
+ * malformed list (badarg). */
+static int get_cells(ErlNifEnv *env, ERL_NIF_TERM list, struct nif_cell_t **out, unsigned *n)
+{
+  ERL_NIF_TERM head;
+  const ERL_NIF_TERM *t;
+  struct nif_cell_t *cells;
+  unsigned i;
+  int arity;
+  if (!enif_get_list_length(env, list, n)) return TB_ERR;
+
+  cells = enif_alloc(sizeof(struct nif_cell_t) * (*n > 0 ? *n : 1));
+  if (cells == NULL) return TB_ERR_MEM;
+  for (i = 0; enif_get_list_cell(env, list, &head, &list); i++) {
+    if (!enif_get_tuple(env, head, &arity, &t) || arity != 5 ||
+        !enif_get_int(env, t[0], &cells[i].x) ||
+        !enif_get_int(env, t[1], &cells[i].y) ||
+        !enif_get_uint(env, t[2], &cells[i].ch) ||
+        !enif_get_uint64(env, t[3], &cells[i].fg) ||
+        !enif_get_uint64(env, t[4], &cells[i].bg)) {
+      enif_free(cells);
+      return TB_ERR;
+    }
+  }
+  *out = cells;
+  return TB_OK;
+}
+
+/* tb_set_cells(Cells[, Clip]): sets a list of {x, y, ch, fg, bg} tuples
+ * under a single acquisition of the session lock, holding each row's lock
+ * across a run of cells in that row. Every cell is attempted; returns TB_OK
+ * or the first error. */
+static ERL_NIF_TERM nif_tb_set_cells(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+  struct nif_cell_t *cells;
+  struct tb_clip c;
+  const struct tb_clip *clip = NULL;
+  unsigned n, i, origin;
+  int rv, res = TB_OK;
+
+  if (argc > 1 && !get_clip(env, argv[1], &c, &clip)) return enif_make_badarg(env);
+  rv = get_cells(env, argv[0], &cells, &n);
+  if (rv == TB_ERR) return enif_make_badarg(env);
+  if (rv != TB_OK) return enif_make_int(env, rv);
+
+  enif_rwlock_rlock(session_lock);
+  origin = clip_row(clip);
+  for (i = 0; i < n; i++) {
+    if (i == 0 || cells[i].y != cells[i - 1].y) {
+      if (i > 0) row_unlock((unsigned)cells[i - 1].y + origin);
+      row_lock((unsigned)cells[i].y + origin);
+    }
+    rv = tb_set_cell_clip(clip, cells[i].x, cells[i].y, cells[i].ch, cells[i].fg, cells[i].bg);
+    if (rv != TB_OK && res == TB_OK) res = rv;
+  }
+  if (n > 0) row_unlock((unsigned)cells[n - 1].y + origin);
+  frame_dirty();
+  enif_rwlock_runlock(session_lock);
+
+  enif_free(cells);
+  return enif_make_int(env, res);
+}
+
+/* tb_peek_event() that waits for the tty, or for the next replayed record,
+ * without holding the session lock, so drawing from other processes is never
+ * stalled by a blocked reader. A negative timeout waits forever, like
+ * tb_poll_event(). */
+static int peek_event_unlocked(struct tb_event *ev, int timeout_ms)
+{
+  uint64_t deadline = monotonic_ns() + (uint64_t)(timeout_ms > 0 ? timeout_ms : 0) * 1000000;
+  uint64_t due;
+  struct pollfd fds[2];
+  int rv, wait_ms;
+
+  for (;;) {
+    enif_rwlock_rwlock(session_lock);
+    rv = tb_peek_event(ev, 0);
+    due = 0;
+    if (rv == TB_ERR_NO_EVENT && timeout_ms != 0) {
+      /* Replayed input is paced by termbox and has no fd to wait on */
+      due = tb_input_replay_due();
+      if (!due) {
+        rv = tb_get_fds(&fds[0].fd, &fds[1].fd);
+        if (rv == TB_OK) rv = TB_ERR_NO_EVENT;
+      }
+    }
+    /* Regaining focus presents a deferred frame */
+    writer_wake();
+    enif_rwlock_rwunlock(session_lock);
+    if (rv != TB_ERR_NO_EVENT || timeout_ms == 0) return rv;
+
+    wait_ms = -1;
+    if (timeout_ms > 0) {
+      uint64_t now = monotonic_ns();
+      if (now >= deadline) return TB_ERR_NO_EVENT;
+      wait_ms = (int)((deadline - now + 999999) / 1000000);
+    }
+    if (due) {
+      int due_ms = replay_wait_ms(due);
+      if (wait_ms < 0 || due_ms < wait_ms) wait_ms = due_ms;
+      if (poll(NULL, 0, wait_ms) < 0 && errno != EINTR) return TB_ERR_POLL;
+      continue;
+    }
+    fds[0].events = fds[1].events = POLLIN;
+    if (poll(fds, 2, wait_ms) < 0 && errno != EINTR) return TB_ERR_POLL;
+  }
 }
 
 static ERL_NIF_TERM nif_tb_peek_event(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
@@ -63,7 +1370,7 @@ static ERL_NIF_TERM nif_tb_peek_event(ErlNifEnv *env, int argc, const ERL_NIF_TE
   struct tb_event ev;
   int timeout_ms;
   if (!enif_get_int(env, argv[0], &timeout_ms)) return enif_make_badarg(env);
-  int res = tb_peek_event(&ev, timeout_ms);
+  int res = peek_event_unlocked(&ev, timeout_ms);
   return enif_make_tuple4
     (env,
      enif_make_int(env, res),
@@ -75,7 +1382,7 @@ static ERL_NIF_TERM nif_tb_peek_event(ErlNifEnv *env, int argc, const ERL_NIF_TE
 static ERL_NIF_TERM nif_tb_poll_event(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
 {
   struct tb_event ev;
-  int res = tb_poll_event(&ev);
+  int res = peek_event_unlocked(&ev, -1);
   return enif_make_tuple4
     (env,
      enif_make_int(env, res),
@@ -84,40 +1391,147 @@ static ERL_NIF_TERM nif_tb_poll_event(ErlNifEnv *env, int argc, const ERL_NIF_TE
      enif_make_int(env, ev.ch));
 }
 
+/* tb_print(X, Y, Fg, Bg, String[, Clip]) */
 static ERL_NIF_TERM nif_tb_print(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
 {
   int x, y;
   unsigned long fg, bg;
   ErlNifBinary binary;
+  struct tb_clip c;
+  const struct tb_clip *clip = NULL;
   if (!enif_get_int(env, argv[0], &x)) return enif_make_badarg(env);
   if (!enif_get_int(env, argv[1], &y)) return enif_make_badarg(env);
   if (!enif_get_uint64(env, argv[2], &fg)) return enif_make_badarg(env);
   if (!enif_get_uint64(env, argv[3], &bg)) return enif_make_badarg(env);
   if (!enif_inspect_binary(env, argv[4], &binary)) return enif_make_atom(env, "err");
+  if (argc > 5 && !get_clip(env, argv[5], &c, &clip)) return enif_make_badarg(env);
 
   char* string = enif_alloc(binary.size + 1);
   if (string == NULL) return enif_make_badarg(env);
 
   memcpy(string, binary.data, binary.size);
   string[binary.size] = '\0';
-  int res = enif_make_int(env, tb_print(x, y, fg, bg, string));
+  int res;
+  unsigned row;
+  enif_rwlock_rlock(session_lock);
+  row = (unsigned)y + clip_row(clip);
+  row_lock(row);
+  res = tb_print_clip(clip, x, y, fg, bg, NULL, string);
+  row_unlock(row);
+  frame_dirty();
+  enif_rwlock_runlock(session_lock);
 
   enif_free(string);
-  return res;
+  return enif_make_int(env, res);
+}
+
+/* tb_clip_make(Parent, {X, Y, W, H}) -> Clip | ErrorCode: the clip a
+ * process pushes on top of Parent (nil for the whole screen). Pure, so it
+ * takes no lock. */
+static ERL_NIF_TERM nif_tb_clip_make(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+  struct tb_clip p, c;
+  const struct tb_clip *parent;
+  int rect[4], rv;
+  if (!get_clip(env, argv[0], &p, &parent) || !get_rect(env, argv[1], rect)) {
+    return enif_make_badarg(env);
+  }
+  rv = tb_clip_make(&c, parent, rect[0], rect[1], rect[2], rect[3]);
+  if (rv != TB_OK) return enif_make_int(env, rv);
+  return enif_make_tuple6(env, enif_make_int(env, c.x0), enif_make_int(env, c.y0),
+                          enif_make_int(env, c.x1), enif_make_int(env, c.y1),
+                          enif_make_int(env, c.ox), enif_make_int(env, c.oy));
+}
+
+/* tb_get_cell(X, Y, Back) -> {Ch, Fg, Bg} | ErrorCode: a cell of the back
+ * buffer (Back 1) or of what the last present sent (Back 0), in screen
+ * coordinates */
+static ERL_NIF_TERM nif_tb_get_cell(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+  int x, y, back, rv;
+  struct tb_cell *cell;
+  ERL_NIF_TERM out;
+  if (!enif_get_int(env, argv[0], &x) || !enif_get_int(env, argv[1], &y) ||
+      !enif_get_int(env, argv[2], &back)) {
+    return enif_make_badarg(env);
+  }
+  /* The front buffer only changes under the exclusive lock, a back buffer
+   * row under its row lock */
+  enif_rwlock_rlock(session_lock);
+  if (back) row_lock((unsigned)y);
+  rv = tb_get_cell(x, y, back, &cell);
+  if (rv == TB_OK) {
+    out = enif_make_tuple3(env, enif_make_uint(env, cell->ch),
+                           enif_make_uint64(env, cell->fg), enif_make_uint64(env, cell->bg));
+  } else {
+    out = enif_make_int(env, rv);
+  }
+  if (back) row_unlock((unsigned)y);
+  enif_rwlock_runlock(session_lock);
+  return out;
 }
 
 static ERL_NIF_TERM nif_tb_set_input_mode(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
 {
   int mode;
   if (!enif_get_int(env, argv[0], &mode)) return enif_make_badarg(env);
-  return enif_make_int(env, tb_set_input_mode(mode));
+  int res;
+  with_session_lock(res, tb_set_input_mode(mode));
+  return enif_make_int(env, res);
 }
 
 static ERL_NIF_TERM nif_tb_set_output_mode(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
 {
   int mode;
   if (!enif_get_int(env, argv[0], &mode)) return enif_make_badarg(env);
-  return enif_make_int(env, tb_set_output_mode(mode));
+  int res;
+  with_session_lock(res, tb_set_output_mode(mode));
+  return enif_make_int(env, res);
+}
+
+static ERL_NIF_TERM nif_tb_set_present_policy(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+  int policy;
+  if (!enif_get_int(env, argv[0], &policy)) return enif_make_badarg(env);
+  int res;
+  with_session_lock(res, tb_set_present_policy(policy));
+  return enif_make_int(env, res);
+}
+
+static ERL_NIF_TERM nif_tb_set_present_threads(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+  int n;
+  if (!enif_get_int(env, argv[0], &n)) return enif_make_badarg(env);
+  int res;
+  with_session_lock(res, tb_set_present_threads(n));
+  return enif_make_int(env, res);
+}
+
+static ERL_NIF_TERM nif_tb_set_output_backlog(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+  int max;
+  if (!enif_get_int(env, argv[0], &max)) return enif_make_badarg(env);
+  if (max > 0 && writer_start() != 0) return enif_make_int(env, TB_ERR);
+  int res;
+  /* With 0 the writer stays, idle, for tb_present_async */
+  with_session_lock(res, tb_set_output_backlog(max));
+  return enif_make_int(env, res);
+}
+
+/* Presents dirty frames from the frame clock at up to rate per second, stops
+ * it with 0, or returns the current rate (0 if stopped) for -1 */
+static ERL_NIF_TERM nif_tb_set_frame_rate(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+  int rate;
+  if (!enif_get_int(env, argv[0], &rate)) return enif_make_badarg(env);
+  if (rate == -1) return enif_make_int(env, __atomic_load_n(&frames.rate, __ATOMIC_ACQUIRE));
+  if (rate < 0 || rate > FRAME_RATE_MAX) return enif_make_int(env, TB_ERR);
+  if (rate == 0) {
+    frames_stop();
+  } else if (frames_start(rate) != 0) {
+    return enif_make_int(env, TB_ERR);
+  }
+  return enif_make_int(env, TB_OK);
 }
 
 static ERL_NIF_TERM nif_tb_set_clear_attrs(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
@@ -125,25 +1539,1151 @@ static ERL_NIF_TERM nif_tb_set_clear_attrs(ErlNifEnv *env, int argc, const ERL_N
   unsigned long fg, bg;
   if (!enif_get_uint64(env, argv[0], &fg)) return enif_make_badarg(env);
   if (!enif_get_uint64(env, argv[1], &bg)) return enif_make_badarg(env);
-  return enif_make_int(env, tb_set_clear_attrs((uintattr_t)fg, (uintattr_t)bg));
+  int res;
+  with_session_lock(res, tb_set_clear_attrs((uintattr_t)fg, (uintattr_t)bg));
+  return enif_make_int(env, res);
+}
+
+static ERL_NIF_TERM nif_tb_event_queue_configure(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+  int cap, overflow;
+  if (!enif_get_int(env, argv[0], &cap) || cap < 1) return enif_make_badarg(env);
+  if (!enif_get_int(env, argv[1], &overflow)) return enif_make_badarg(env);
+  if (overflow < EVQ_DROP_OLDEST_MOTION || overflow > EVQ_BLOCK) return enif_make_badarg(env);
+  int res;
+  with_session_lock(res, evq_init((size_t)cap, overflow));
+  return enif_make_int(env, res);
+}
+
+static ERL_NIF_TERM nif_tb_event_queue_fill(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+  int rv;
+  with_session_lock(rv, evq_fill(env));
+  return enif_make_int(env, rv);
+}
+
+/* Subscribes pid to the events matching a filter, replacing any filter it
+ * had: a bitmask of 1 << TB_EVENT_* types, an {X, Y, W, H} rectangle for
+ * mouse events (W < 0 for anywhere), and lists of key codes and characters
+ * key events must match (both empty for any key) */
+static ERL_NIF_TERM nif_tb_event_subscribe(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+  ERL_NIF_TERM list, head;
+  const ERL_NIF_TERM *rect;
+  struct sub_t sub = {0}, *s;
+  unsigned key;
+  int arity, res = TB_OK;
+
+  if (!enif_get_local_pid(env, argv[0], &sub.pid) ||
+      !enif_get_int(env, argv[1], &sub.types) ||
+      !enif_get_tuple(env, argv[2], &arity, &rect) || arity != 4 ||
+      !enif_get_int(env, rect[0], &sub.x) || !enif_get_int(env, rect[1], &sub.y) ||
+      !enif_get_int(env, rect[2], &sub.w) || !enif_get_int(env, rect[3], &sub.h)) {
+    return enif_make_badarg(env);
+  }
+  for (list = argv[3]; enif_get_list_cell(env, list, &head, &list);) {
+    if (!enif_get_uint(env, head, &key) || key > 0xffff) return enif_make_badarg(env);
+    if (sub.nkeys == SUB_MAX_KEYS) return enif_make_int(env, TB_ERR);
+    sub.keys[sub.nkeys++] = (uint16_t)key;
+  }
+  for (list = argv[4]; enif_get_list_cell(env, list, &head, &list);) {
+    if (!enif_get_uint(env, head, &key)) return enif_make_badarg(env);
+    if (sub.nchs == SUB_MAX_KEYS) return enif_make_int(env, TB_ERR);
+    sub.chs[sub.nchs++] = key;
+  }
+
+  enif_rwlock_rwlock(session_lock);
+  if ((s = subs_find(&sub.pid)) == NULL) {
+    if (subs.len == subs.cap) {
+      size_t cap = subs.cap ? subs.cap * 2 : 8;
+      s = enif_realloc(subs.subs, cap * sizeof(struct sub_t));
+      if (s == NULL) res = TB_ERR_MEM;
+      else {
+        subs.subs = s;
+        subs.cap = cap;
+      }
+    }
+    if (res == TB_OK) s = &subs.subs[subs.len++];
+  }
+  if (res == TB_OK) *s = sub;
+  enif_rwlock_rwunlock(session_lock);
+  return enif_make_int(env, res);
+}
+
+static ERL_NIF_TERM nif_tb_event_unsubscribe(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+  ErlNifPid pid;
+  if (!enif_get_local_pid(env, argv[0], &pid)) return enif_make_badarg(env);
+  enif_rwlock_rwlock(session_lock);
+  subs_remove(&pid);
+  enif_rwlock_rwunlock(session_lock);
+  return enif_make_int(env, TB_OK);
+}
+
+/* Has the reactor send 'termbox_events' to pid whenever events are queued */
+static ERL_NIF_TERM nif_tb_event_notify(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+  ErlNifPid pid;
+  if (!enif_get_local_pid(env, argv[0], &pid)) return enif_make_badarg(env);
+  enif_rwlock_rwlock(session_lock);
+  reactor.notified = 0;
+  enif_rwlock_rwunlock(session_lock);
+  return enif_make_int(env, reactor_start(&pid) == 0 ? TB_OK : TB_ERR);
+}
+
+static ERL_NIF_TERM nif_tb_event_queue_take(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+  int max;
+  if (!enif_get_int(env, argv[0], &max)) return enif_make_badarg(env);
+  ERL_NIF_TERM list = enif_make_list(env, 0);
+  enif_rwlock_rwlock(session_lock);
+  size_t n = max > 0 ? ((size_t)max < evq.len ? (size_t)max : evq.len) : 0;
+  size_t i, at = evq.head;
+  for (i = 1; i < n; i++) at = evq.nodes[at].next;
+  /* Build the list back to front so it comes out oldest first */
+  for (i = 0; i < n; i++, at = evq.nodes[at].prev) {
+    list = enif_make_list_cell(env, make_event_term(env, &evq.nodes[at].ev), list);
+  }
+  for (i = 0; i < n; i++) evq_remove(evq.head);
+  reactor.notified = 0;
+  int unblocked = n > 0 && evq.overflow == EVQ_BLOCK;
+  enif_rwlock_rwunlock(session_lock);
+  /* Room again for a queue that stopped reading the tty */
+  if (unblocked) reactor_wake();
+  return list;
+}
+
+static ERL_NIF_TERM nif_tb_event_queue_stats(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+  enif_rwlock_rwlock(session_lock);
+  struct evq_t stats = evq;
+  enif_rwlock_rwunlock(session_lock);
+  return enif_make_tuple3
+    (env,
+     enif_make_uint64(env, stats.len),
+     enif_make_uint64(env, stats.dropped),
+     enif_make_uint64(env, stats.coalesced));
+}
+
+/* Copies a binary into a NUL-terminated path, or NULL for an empty binary
+ * (which stops the replay/recording). Returns 0 if term is not a binary. */
+static int get_path(ErlNifEnv *env, ERL_NIF_TERM term, char **path)
+{
+  ErlNifBinary binary;
+  if (!enif_inspect_binary(env, term, &binary)) return 0;
+
+  *path = NULL;
+  if (binary.size == 0) return 1;
+
+  *path = enif_alloc(binary.size + 1);
+  if (*path == NULL) return 0;
+  memcpy(*path, binary.data, binary.size);
+  (*path)[binary.size] = '\0';
+  return 1;
+}
+
+static ERL_NIF_TERM nif_tb_set_input_replay(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+  char *path;
+  int speed;
+  if (!enif_get_int(env, argv[1], &speed)) return enif_make_badarg(env);
+  if (!get_path(env, argv[0], &path)) return enif_make_badarg(env);
+
+  int res;
+  with_session_lock(res, tb_set_input_replay(path, speed));
+  if (path) enif_free(path);
+  /* A reactor asleep on the tty would not notice the replay otherwise */
+  if (res == TB_OK) reactor_wake();
+  return enif_make_int(env, res);
+}
+
+static ERL_NIF_TERM nif_tb_input_replay_remaining(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+  int res;
+  with_session_lock(res, tb_input_replay_remaining());
+  return enif_make_int(env, res);
+}
+
+static ERL_NIF_TERM nif_tb_set_input_record(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+  char *path;
+  if (!get_path(env, argv[0], &path)) return enif_make_badarg(env);
+
+  int res;
+  with_session_lock(res, tb_set_input_record(path));
+  if (path) enif_free(path);
+  return enif_make_int(env, res);
+}
+
+/* tb_shm_open(Name, X, Y, Width, Height) -> Id | ErrorCode (negative).
+ * Name is a POSIX shared-memory name ("/something") that must not exist yet;
+ * the segment maps onto the Width x Height rectangle at X,Y of the screen. */
+static ERL_NIF_TERM nif_tb_shm_open(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+  char *name;
+  int x, y, w, h, res;
+  if (!enif_get_int(env, argv[1], &x) || !enif_get_int(env, argv[2], &y) ||
+      !enif_get_int(env, argv[3], &w) || !enif_get_int(env, argv[4], &h) ||
+      w < 1 || h < 1 || w > SHM_MAX_SIZE || h > SHM_MAX_SIZE) {
+    return enif_make_badarg(env);
+  }
+  if (!get_path(env, argv[0], &name)) return enif_make_badarg(env);
+  if (name == NULL || name[0] != '/') {
+    if (name) enif_free(name);
+    return enif_make_badarg(env);
+  }
+
+  res = shm_create(name, x, y, w, h);
+  if (res < 0) enif_free(name);
+  return enif_make_int(env, res);
+}
+
+/* tb_shm_close(Id) -> ok code: unmaps and unlinks the segment */
+static ERL_NIF_TERM nif_tb_shm_close(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+  int id, res = TB_ERR;
+  if (!enif_get_int(env, argv[0], &id)) return enif_make_badarg(env);
+
+  enif_rwlock_rwlock(session_lock);
+  if (id >= 0 && id < SHM_MAX_SEGMENTS && shm_segs[id].hdr != NULL) {
+    shm_unmap(&shm_segs[id]);
+    __atomic_fetch_sub(&shm_count, 1, __ATOMIC_RELAXED);
+    res = TB_OK;
+  }
+  enif_rwlock_rwunlock(session_lock);
+  return enif_make_int(env, res);
+}
+
+/*
+ * Offscreen surfaces.
+ *
+ * A surface is a termbox cell buffer (struct tb_surface) owned by a NIF
+ * resource, so it is freed once no process references it. Drawing into one
+ * takes the session lock shared, since a surface shown as a layer is read by
+ * every present, and the surface's own lock; tb_blit copies it into the back
+ * buffer under each destination row's lock, like any other cell write, so a
+ * panel drawn once costs one copy per frame rather than thousands of cell
+ * writes. The resource type is taken over on upgrade: give it a new name if
+ * struct surface_res_t changes.
+ *
+ * Layers (tb_layer_add) keep their surface's resource alive until they are
+ * removed or termbox shuts down. layer_res maps layer ids to those resources
+ * and is guarded by the session lock.
+ */
+#define SURFACE_MAX_SIZE 4096
+
+struct surface_res_t {
+  ErlNifMutex *lock;
+  struct tb_surface *surface;
+  int layers; /* layers showing it; guarded by the session lock */
+};
+
+static struct surface_res_t *layer_res[TB_OPT_LAYERS_MAX];
+
+static ErlNifResourceType *surface_type = NULL;
+
+static void surface_dtor(ErlNifEnv *env, void *obj)
+{
+  struct surface_res_t *res = obj;
+  tb_surface_free(res->surface);
+  if (res->lock != NULL) enif_mutex_destroy(res->lock);
+}
+
+static int get_surface(ErlNifEnv *env, ERL_NIF_TERM term, struct surface_res_t **out)
+{
+  return enif_get_resource(env, term, surface_type, (void **)out);
+}
+
+/* Takes and releases the surface for drawing. Draws to a surface shown as a
+ * layer change the next frame. */
+static void surface_lock(struct surface_res_t *res)
+{
+  enif_rwlock_rlock(session_lock);
+  enif_mutex_lock(res->lock);
+}
+
+static void surface_unlock(struct surface_res_t *res)
+{
+  if (res->layers > 0) frame_dirty();
+  enif_mutex_unlock(res->lock);
+  enif_rwlock_runlock(session_lock);
+}
+
+/* Removes every layer. Called with the session lock held, before termbox
+ * forgets them. Stores the surfaces in out, which must have room for
+ * TB_OPT_LAYERS_MAX, for the caller to release once the lock is dropped, and
+ * returns how many. */
+static int layers_release(void **out)
+{
+  int id, n = 0;
+  for (id = 0; id < TB_OPT_LAYERS_MAX; id++) {
+    if (layer_res[id] == NULL) continue;
+    tb_layer_remove(id);
+    layer_res[id]->layers--;
+    out[n++] = layer_res[id];
+    layer_res[id] = NULL;
+  }
+  return n;
+}
+
+/* tb_surface_new(Width, Height) -> Surface | ErrorCode */
+static ERL_NIF_TERM nif_tb_surface_new(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+  struct surface_res_t *res;
+  ERL_NIF_TERM term;
+  int w, h;
+  if (!enif_get_int(env, argv[0], &w) || !enif_get_int(env, argv[1], &h) ||
+      w < 1 || h < 1 || w > SURFACE_MAX_SIZE || h > SURFACE_MAX_SIZE) {
+    return enif_make_badarg(env);
+  }
+
+  res = enif_alloc_resource(surface_type, sizeof(struct surface_res_t));
+  if (res == NULL) return enif_make_int(env, TB_ERR_MEM);
+  res->lock = enif_mutex_create("termbox2_surface");
+  res->surface = tb_surface_new(w, h);
+  if (res->lock == NULL || res->surface == NULL) {
+    enif_release_resource(res);
+    return enif_make_int(env, TB_ERR_MEM);
+  }
+  term = enif_make_resource(env, res);
+  enif_release_resource(res);
+  return term;
+}
+
+static ERL_NIF_TERM nif_tb_surface_size(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+  struct surface_res_t *res;
+  if (!get_surface(env, argv[0], &res)) return enif_make_badarg(env);
+  return enif_make_tuple2(env,
+                          enif_make_int(env, tb_surface_width(res->surface)),
+                          enif_make_int(env, tb_surface_height(res->surface)));
+}
+
+/* Like tb_set_cells, into a surface */
+static ERL_NIF_TERM nif_tb_surface_set_cells(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+  struct surface_res_t *res;
+  struct nif_cell_t *cells;
+  unsigned n, i;
+  int rv, ret = TB_OK;
+  if (!get_surface(env, argv[0], &res)) return enif_make_badarg(env);
+  rv = get_cells(env, argv[1], &cells, &n);
+  if (rv == TB_ERR) return enif_make_badarg(env);
+  if (rv != TB_OK) return enif_make_int(env, rv);
+
+  surface_lock(res);
+  for (i = 0; i < n; i++) {
+    rv = tb_surface_set_cell(res->surface, cells[i].x, cells[i].y, cells[i].ch,
+                             cells[i].fg, cells[i].bg);
+    if (rv != TB_OK && ret == TB_OK) ret = rv;
+  }
+  surface_unlock(res);
+
+  enif_free(cells);
+  return enif_make_int(env, ret);
+}
+
+/* tb_surface_print(Surface, X, Y, Fg, Bg, String): UTF-8 aware, wide
+ * characters take two cells */
+static ERL_NIF_TERM nif_tb_surface_print(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+  struct surface_res_t *res;
+  int x, y, rv;
+  unsigned long fg, bg;
+  ErlNifBinary binary;
+  char *string;
+  if (!get_surface(env, argv[0], &res) ||
+      !enif_get_int(env, argv[1], &x) || !enif_get_int(env, argv[2], &y) ||
+      !enif_get_uint64(env, argv[3], &fg) || !enif_get_uint64(env, argv[4], &bg) ||
+      !enif_inspect_binary(env, argv[5], &binary)) {
+    return enif_make_badarg(env);
+  }
+
+  string = enif_alloc(binary.size + 1);
+  if (string == NULL) return enif_make_int(env, TB_ERR_MEM);
+  memcpy(string, binary.data, binary.size);
+  string[binary.size] = '\0';
+
+  surface_lock(res);
+  rv = tb_surface_print(res->surface, x, y, fg, bg, NULL, string);
+  surface_unlock(res);
+
+  enif_free(string);
+  return enif_make_int(env, rv);
+}
+
+/* tb_surface_fill(Surface, {X, Y, W, H}, Ch, Fg, Bg) */
+static ERL_NIF_TERM nif_tb_surface_fill(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+  struct surface_res_t *res;
+  int rect[4], rv;
+  uint32_t ch;
+  unsigned long fg, bg;
+  if (!get_surface(env, argv[0], &res) || !get_rect(env, argv[1], rect) ||
+      !enif_get_uint(env, argv[2], &ch) ||
+      !enif_get_uint64(env, argv[3], &fg) || !enif_get_uint64(env, argv[4], &bg)) {
+    return enif_make_badarg(env);
+  }
+
+  surface_lock(res);
+  rv = tb_surface_fill(res->surface, rect[0], rect[1], rect[2], rect[3], ch, fg, bg);
+  surface_unlock(res);
+  return enif_make_int(env, rv);
+}
+
+/* tb_blit(Surface, {SrcX, SrcY, W, H}, DstX, DstY[, Clip]): copies the
+ * rectangle into the back buffer, clipped on both sides. Row by row, so each
+ * row lock is held only for its own copy. */
+static ERL_NIF_TERM nif_tb_blit(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+  struct surface_res_t *res;
+  struct tb_clip c;
+  const struct tb_clip *clip = NULL;
+  int rect[4], dx, dy, y, y0, y1, sh, th, rv = TB_OK;
+  int64_t ady;
+  if (!get_surface(env, argv[0], &res) || !get_rect(env, argv[1], rect) ||
+      !enif_get_int(env, argv[2], &dx) || !enif_get_int(env, argv[3], &dy) ||
+      (argc > 4 && !get_clip(env, argv[4], &c, &clip))) {
+    return enif_make_badarg(env);
+  }
+
+  enif_rwlock_rlock(session_lock);
+  enif_mutex_lock(res->lock);
+  th = tb_height();
+  if (th < 0) {
+    rv = th;
+  } else {
+    /* Only the rows inside both the surface and the screen, which dy is
+     * relative to the clip origin of */
+    ady = (int64_t)dy + (int)clip_row(clip);
+    sh = tb_surface_height(res->surface);
+    y0 = 0;
+    if (rect[1] + y0 < 0) y0 = -rect[1];
+    if (ady + y0 < 0) y0 = (int)-ady;
+    y1 = rect[3];
+    if (rect[1] + y1 > sh) y1 = sh - rect[1];
+    if (ady + y1 > th) y1 = (int)(th - ady);
+    for (y = y0; y < y1; y++) {
+      row_lock((unsigned)(ady + y));
+      tb_blit_clip(clip, res->surface, rect[0], rect[1] + y, rect[2], 1, dx, dy + y);
+      row_unlock((unsigned)(ady + y));
+    }
+    frame_dirty();
+  }
+  enif_mutex_unlock(res->lock);
+  enif_rwlock_runlock(session_lock);
+  return enif_make_int(env, rv);
 }
 
+/* tb_blend_rect({X, Y, W, H}, Rgba, Flags[, Clip]): one row at a time under
+ * its row lock, like tb_blit */
+static ERL_NIF_TERM nif_tb_blend_rect(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+  struct tb_clip c;
+  const struct tb_clip *clip = NULL;
+  int rect[4], flags, y, y0, y1, th, rv = TB_OK;
+  uint32_t rgba;
+  int64_t ay;
+  if (!get_rect(env, argv[0], rect) || !enif_get_uint(env, argv[1], &rgba) ||
+      !enif_get_int(env, argv[2], &flags) ||
+      (argc > 3 && !get_clip(env, argv[3], &c, &clip))) {
+    return enif_make_badarg(env);
+  }
+
+  enif_rwlock_rlock(session_lock);
+  th = tb_height();
+  if (th < 0) {
+    rv = th;
+  } else {
+    ay = (int64_t)rect[1] + (int)clip_row(clip);
+    y0 = ay < 0 ? (int)-ay : 0;
+    y1 = ay + rect[3] > th ? (int)(th - ay) : rect[3];
+    for (y = y0; y < y1 && rv == TB_OK; y++) {
+      row_lock((unsigned)(ay + y));
+      rv = tb_blend_rect_clip(clip, rect[0], rect[1] + y, rect[2], 1, rgba, flags);
+      row_unlock((unsigned)(ay + y));
+    }
+    frame_dirty();
+  }
+  enif_rwlock_runlock(session_lock);
+  return enif_make_int(env, rv);
+}
+
+/* tb_surface_blend(Dst, Src, {SrcX, SrcY, W, H}, DstX, DstY, Alpha) */
+static ERL_NIF_TERM nif_tb_surface_blend(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+  struct surface_res_t *dst, *src, *first, *second;
+  int rect[4], dx, dy, rv;
+  unsigned alpha;
+  if (!get_surface(env, argv[0], &dst) || !get_surface(env, argv[1], &src) ||
+      !get_rect(env, argv[2], rect) || !enif_get_int(env, argv[3], &dx) ||
+      !enif_get_int(env, argv[4], &dy) || !enif_get_uint(env, argv[5], &alpha) ||
+      alpha > 255) {
+    return enif_make_badarg(env);
+  }
+  if (dst == src) return enif_make_int(env, TB_ERR);
+
+  /* Two surface locks, always taken in address order */
+  first = dst < src ? dst : src;
+  second = dst < src ? src : dst;
+  enif_rwlock_rlock(session_lock);
+  enif_mutex_lock(first->lock);
+  enif_mutex_lock(second->lock);
+  rv = tb_surface_blend(dst->surface, src->surface, rect[0], rect[1], rect[2], rect[3],
+                        dx, dy, (uint8_t)alpha);
+  if (dst->layers > 0) frame_dirty();
+  enif_mutex_unlock(second->lock);
+  enif_mutex_unlock(first->lock);
+  enif_rwlock_runlock(session_lock);
+  return enif_make_int(env, rv);
+}
+
+/* tb_blend_blit(Surface, {SrcX, SrcY, W, H}, DstX, DstY, Alpha[, Clip]):
+ * like tb_blit, composited over the back buffer with opacity Alpha */
+static ERL_NIF_TERM nif_tb_blend_blit(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+  struct surface_res_t *res;
+  struct tb_clip c;
+  const struct tb_clip *clip = NULL;
+  int rect[4], dx, dy, y, y0, y1, sh, th, rv = TB_OK;
+  unsigned alpha;
+  int64_t ady;
+  if (!get_surface(env, argv[0], &res) || !get_rect(env, argv[1], rect) ||
+      !enif_get_int(env, argv[2], &dx) || !enif_get_int(env, argv[3], &dy) ||
+      !enif_get_uint(env, argv[4], &alpha) || alpha > 255 ||
+      (argc > 5 && !get_clip(env, argv[5], &c, &clip))) {
+    return enif_make_badarg(env);
+  }
+
+  enif_rwlock_rlock(session_lock);
+  enif_mutex_lock(res->lock);
+  th = tb_height();
+  if (th < 0) {
+    rv = th;
+  } else {
+    ady = (int64_t)dy + (int)clip_row(clip);
+    sh = tb_surface_height(res->surface);
+    y0 = 0;
+    if (rect[1] + y0 < 0) y0 = -rect[1];
+    if (ady + y0 < 0) y0 = (int)-ady;
+    y1 = rect[3];
+    if (rect[1] + y1 > sh) y1 = sh - rect[1];
+    if (ady + y1 > th) y1 = (int)(th - ady);
+    for (y = y0; y < y1 && rv == TB_OK; y++) {
+      row_lock((unsigned)(ady + y));
+      rv = tb_surface_blend_clip(clip, NULL, res->surface, rect[0], rect[1] + y, rect[2], 1,
+                            dx, dy + y, (uint8_t)alpha);
+      row_unlock((unsigned)(ady + y));
+    }
+    frame_dirty();
+  }
+  enif_mutex_unlock(res->lock);
+  enif_rwlock_runlock(session_lock);
+  return enif_make_int(env, rv);
+}
+
+static ERL_NIF_TERM nif_tb_set_blend_defaults(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+  uint32_t fg, bg;
+  int res;
+  if (!enif_get_uint(env, argv[0], &fg) || !enif_get_uint(env, argv[1], &bg)) {
+    return enif_make_badarg(env);
+  }
+  with_session_lock(res, (frame_dirty(), tb_set_blend_defaults(fg, bg)));
+  return enif_make_int(env, res);
+}
+
+/* tb_layer_add(Surface, X, Y, Z) -> Id | ErrorCode (negative) */
+static ERL_NIF_TERM nif_tb_layer_add(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+  struct surface_res_t *res;
+  int x, y, z, id;
+  if (!get_surface(env, argv[0], &res) || !enif_get_int(env, argv[1], &x) ||
+      !enif_get_int(env, argv[2], &y) || !enif_get_int(env, argv[3], &z)) {
+    return enif_make_badarg(env);
+  }
+
+  enif_rwlock_rwlock(session_lock);
+  id = tb_layer_add(res->surface, x, y, z);
+  if (id >= 0) {
+    enif_keep_resource(res);
+    layer_res[id] = res;
+    res->layers++;
+    frame_dirty();
+  }
+  enif_rwlock_rwunlock(session_lock);
+  return enif_make_int(env, id);
+}
+
+/* tb_layer_move(Id, X, Y, Z) */
+static ERL_NIF_TERM nif_tb_layer_move(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+  int id, x, y, z, res;
+  if (!enif_get_int(env, argv[0], &id) || !enif_get_int(env, argv[1], &x) ||
+      !enif_get_int(env, argv[2], &y) || !enif_get_int(env, argv[3], &z)) {
+    return enif_make_badarg(env);
+  }
+  with_session_lock(res, (frame_dirty(), tb_layer_move(id, x, y, z)));
+  return enif_make_int(env, res);
+}
+
+/* tb_layer_show(Id, Visible): Visible is 1 to show, 0 to hide */
+static ERL_NIF_TERM nif_tb_layer_show(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+  int id, visible, res;
+  if (!enif_get_int(env, argv[0], &id) || !enif_get_int(env, argv[1], &visible)) {
+    return enif_make_badarg(env);
+  }
+  with_session_lock(res, (frame_dirty(), tb_layer_show(id, visible)));
+  return enif_make_int(env, res);
+}
+
+static ERL_NIF_TERM nif_tb_layer_remove(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+  struct surface_res_t *res = NULL;
+  int id, rv;
+  if (!enif_get_int(env, argv[0], &id)) return enif_make_badarg(env);
+
+  enif_rwlock_rwlock(session_lock);
+  rv = tb_layer_remove(id);
+  if (rv == TB_OK) {
+    res = layer_res[id];
+    layer_res[id] = NULL;
+    res->layers--;
+    frame_dirty();
+  }
+  enif_rwlock_rwunlock(session_lock);
+  /* Outside the lock: this may free the surface */
+  if (res != NULL) enif_release_resource(res);
+  return enif_make_int(env, rv);
+}
+
+/*
+ * Canvases.
+ *
+ * A canvas (struct tb_canvas) is a sparse tiled cell area, up to
+ * CANVAS_MAX_SIZE cells a side, owned by a NIF resource like a surface and
+ * drawn under the same locks. Showing one (tb_canvas_show) maps its viewport
+ * onto a rectangle of the screen at every present and keeps the resource
+ * alive until it is hidden or termbox shuts down; canvas_res holds those
+ * resources and is guarded by the session lock. Scrolling is a viewport
+ * change under the session lock: nothing is re-sent from Erlang, and
+ * tb_present scrolls the terminal where it can. The resource type is taken
+ * over on upgrade: give it a new name if struct canvas_res_t changes.
+ */
+#define CANVAS_MAX_SIZE (1 << 20)
+
+struct canvas_res_t {
+  ErlNifMutex *lock;
+  struct tb_canvas *canvas;
+  int shown; /* guarded by the session lock */
+};
+
+static struct canvas_res_t *canvas_res[TB_OPT_CANVASES_MAX];
+
+static ErlNifResourceType *canvas_type = NULL;
+
+static void canvas_dtor(ErlNifEnv *env, void *obj)
+{
+  struct canvas_res_t *res = obj;
+  tb_canvas_free(res->canvas);
+  if (res->lock != NULL) enif_mutex_destroy(res->lock);
+}
+
+static int get_canvas(ErlNifEnv *env, ERL_NIF_TERM term, struct canvas_res_t **out)
+{
+  return enif_get_resource(env, term, canvas_type, (void **)out);
+}
+
+static void canvas_lock(struct canvas_res_t *res)
+{
+  enif_rwlock_rlock(session_lock);
+  enif_mutex_lock(res->lock);
+}
+
+static void canvas_unlock(struct canvas_res_t *res)
+{
+  if (res->shown) frame_dirty();
+  enif_mutex_unlock(res->lock);
+  enif_rwlock_runlock(session_lock);
+}
+
+/* Hides every canvas. Called with the session lock held, before termbox
+ * forgets them. Stores the canvases in out, which must have room for
+ * TB_OPT_CANVASES_MAX, for the caller to release once the lock is dropped,
+ * and returns how many. */
+static int canvases_release(void **out)
+{
+  int i, n = 0;
+  for (i = 0; i < TB_OPT_CANVASES_MAX; i++) {
+    if (canvas_res[i] == NULL) continue;
+    tb_canvas_hide(canvas_res[i]->canvas);
+    canvas_res[i]->shown = 0;
+    out[n++] = canvas_res[i];
+    canvas_res[i] = NULL;
+  }
+  return n;
+}
+
+/* tb_canvas_new(Width, Height) -> Canvas | ErrorCode */
+static ERL_NIF_TERM nif_tb_canvas_new(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+  struct canvas_res_t *res;
+  ERL_NIF_TERM term;
+  int w, h;
+  if (!enif_get_int(env, argv[0], &w) || !enif_get_int(env, argv[1], &h) ||
+      w < 1 || h < 1 || w > CANVAS_MAX_SIZE || h > CANVAS_MAX_SIZE) {
+    return enif_make_badarg(env);
+  }
+
+  res = enif_alloc_resource(canvas_type, sizeof(struct canvas_res_t));
+  if (res == NULL) return enif_make_int(env, TB_ERR_MEM);
+  res->shown = 0;
+  res->lock = enif_mutex_create("termbox2_canvas");
+  res->canvas = tb_canvas_new(w, h);
+  if (res->lock == NULL || res->canvas == NULL) {
+    enif_release_resource(res);
+    return enif_make_int(env, TB_ERR_MEM);
+  }
+  term = enif_make_resource(env, res);
+  enif_release_resource(res);
+  return term;
+}
+
+/* tb_canvas_info(Canvas) -> {Width, Height, Tiles} */
+static ERL_NIF_TERM nif_tb_canvas_info(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+  struct canvas_res_t *res;
+  int tiles;
+  if (!get_canvas(env, argv[0], &res)) return enif_make_badarg(env);
+  enif_mutex_lock(res->lock);
+  tiles = tb_canvas_tiles(res->canvas);
+  enif_mutex_unlock(res->lock);
+  return enif_make_tuple3(env,
+                          enif_make_int(env, tb_canvas_width(res->canvas)),
+                          enif_make_int(env, tb_canvas_height(res->canvas)),
+                          enif_make_int(env, tiles));
+}
+
+/* Like tb_set_cells, into a canvas */
+static ERL_NIF_TERM nif_tb_canvas_set_cells(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+  struct canvas_res_t *res;
+  struct nif_cell_t *cells;
+  unsigned n, i;
+  int rv, ret = TB_OK;
+  if (!get_canvas(env, argv[0], &res)) return enif_make_badarg(env);
+  rv = get_cells(env, argv[1], &cells, &n);
+  if (rv == TB_ERR) return enif_make_badarg(env);
+  if (rv != TB_OK) return enif_make_int(env, rv);
+
+  canvas_lock(res);
+  for (i = 0; i < n; i++) {
+    rv = tb_canvas_set_cell(res->canvas, cells[i].x, cells[i].y, cells[i].ch,
+                            cells[i].fg, cells[i].bg);
+    if (rv != TB_OK && ret == TB_OK) ret = rv;
+  }
+  canvas_unlock(res);
+
+  enif_free(cells);
+  return enif_make_int(env, ret);
+}
+
+/* tb_canvas_print(Canvas, X, Y, Fg, Bg, String) */
+static ERL_NIF_TERM nif_tb_canvas_print(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+  struct canvas_res_t *res;
+  int x, y, rv;
+  unsigned long fg, bg;
+  ErlNifBinary binary;
+  char *string;
+  if (!get_canvas(env, argv[0], &res) ||
+      !enif_get_int(env, argv[1], &x) || !enif_get_int(env, argv[2], &y) ||
+      !enif_get_uint64(env, argv[3], &fg) || !enif_get_uint64(env, argv[4], &bg) ||
+      !enif_inspect_binary(env, argv[5], &binary)) {
+    return enif_make_badarg(env);
+  }
+
+  string = enif_alloc(binary.size + 1);
+  if (string == NULL) return enif_make_int(env, TB_ERR_MEM);
+  memcpy(string, binary.data, binary.size);
+  string[binary.size] = '\0';
+
+  canvas_lock(res);
+  rv = tb_canvas_print(res->canvas, x, y, fg, bg, NULL, string);
+  canvas_unlock(res);
+
+  enif_free(string);
+  return enif_make_int(env, rv);
+}
+
+/* tb_canvas_fill(Canvas, {X, Y, W, H}, Ch, Fg, Bg) */
+static ERL_NIF_TERM nif_tb_canvas_fill(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+  struct canvas_res_t *res;
+  int rect[4], rv;
+  uint32_t ch;
+  unsigned long fg, bg;
+  if (!get_canvas(env, argv[0], &res) || !get_rect(env, argv[1], rect) ||
+      rect[2] < 0 || rect[3] < 0 || rect[2] > CANVAS_MAX_SIZE || rect[3] > CANVAS_MAX_SIZE ||
+      !enif_get_uint(env, argv[2], &ch) ||
+      !enif_get_uint64(env, argv[3], &fg) || !enif_get_uint64(env, argv[4], &bg)) {
+    return enif_make_badarg(env);
+  }
+
+  canvas_lock(res);
+  rv = tb_canvas_fill(res->canvas, rect[0], rect[1], rect[2], rect[3], ch, fg, bg);
+  canvas_unlock(res);
+  return enif_make_int(env, rv);
+}
+
+/* Returns the index of res in canvas_res (a free slot for NULL), or -1 */
+static int canvas_res_slot(const struct canvas_res_t *res)
+{
+  int i;
+  for (i = 0; i < TB_OPT_CANVASES_MAX; i++) {
+    if (canvas_res[i] == res) return i;
+  }
+  return -1;
+}
+
+/* tb_canvas_show(Canvas, {X, Y, W, H}): shows the canvas in that rectangle of
+ * the screen, or moves it there */
+static ERL_NIF_TERM nif_tb_canvas_show(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+  struct canvas_res_t *res;
+  int rect[4], rv, i;
+  if (!get_canvas(env, argv[0], &res) || !get_rect(env, argv[1], rect) ||
+      rect[0] < -CANVAS_MAX_SIZE || rect[0] > CANVAS_MAX_SIZE ||
+      rect[1] < -CANVAS_MAX_SIZE || rect[1] > CANVAS_MAX_SIZE ||
+      rect[2] < 0 || rect[3] < 0 || rect[2] > CANVAS_MAX_SIZE || rect[3] > CANVAS_MAX_SIZE) {
+    return enif_make_badarg(env);
+  }
+
+  enif_rwlock_rwlock(session_lock);
+  i = res->shown ? 0 : canvas_res_slot(NULL);
+  rv = i < 0 ? TB_ERR : tb_canvas_show(res->canvas, rect[0], rect[1], rect[2], rect[3]);
+  if (rv == TB_OK && !res->shown) {
+    enif_keep_resource(res);
+    canvas_res[i] = res;
+    res->shown = 1;
+  }
+  if (rv == TB_OK) frame_dirty();
+  enif_rwlock_rwunlock(session_lock);
+  return enif_make_int(env, rv);
+}
+
+static ERL_NIF_TERM nif_tb_canvas_hide(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+  struct canvas_res_t *res;
+  int rv, i;
+  if (!get_canvas(env, argv[0], &res)) return enif_make_badarg(env);
+
+  enif_rwlock_rwlock(session_lock);
+  i = canvas_res_slot(res);
+  rv = i < 0 ? TB_ERR : tb_canvas_hide(res->canvas);
+  if (rv == TB_OK) {
+    canvas_res[i] = NULL;
+    res->shown = 0;
+    frame_dirty();
+  }
+  enif_rwlock_rwunlock(session_lock);
+  /* Outside the lock: this may free the canvas */
+  if (rv == TB_OK) enif_release_resource(res);
+  return enif_make_int(env, rv);
+}
+
+/* tb_canvas_scroll_to(Canvas, Vx, Vy): puts canvas cell Vx,Vy at the top
+ * left of the rectangle it is shown in */
+static ERL_NIF_TERM nif_tb_canvas_scroll_to(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+  struct canvas_res_t *res;
+  int vx, vy, rv;
+  if (!get_canvas(env, argv[0], &res) ||
+      !enif_get_int(env, argv[1], &vx) || !enif_get_int(env, argv[2], &vy) ||
+      vx < -CANVAS_MAX_SIZE || vx > CANVAS_MAX_SIZE ||
+      vy < -CANVAS_MAX_SIZE || vy > CANVAS_MAX_SIZE) {
+    return enif_make_badarg(env);
+  }
+
+  enif_rwlock_rwlock(session_lock);
+  rv = tb_canvas_scroll_to(res->canvas, vx, vy);
+  if (res->shown) frame_dirty();
+  enif_rwlock_rwunlock(session_lock);
+  return enif_make_int(env, rv);
+}
+
+/*
+ * Anything that can wait on the terminal runs on a dirty IO scheduler: init
+ * (terminfo I/O, tcsetattr), shutdown (tcsetattr(TCSAFLUSH) drains output),
+ * the calls that write to the tty and may block on a slow or stopped reader,
+ * and the event waits. Batched drawing (tb_set_cells) stays on normal
+ * schedulers: it only touches the back buffer.
+ */
 static ErlNifFunc nif_funcs[] = {
-    {"tb_init", 0, nif_tb_init},
-    {"tb_shutdown", 0, nif_tb_shutdown},
+    {"tb_init", 0, nif_tb_init, ERL_NIF_DIRTY_JOB_IO_BOUND},
+    {"tb_shutdown", 0, nif_tb_shutdown, ERL_NIF_DIRTY_JOB_IO_BOUND},
     {"tb_width", 0, nif_tb_width},
     {"tb_height", 0, nif_tb_height},
     {"tb_clear", 0, nif_tb_clear},
-    {"tb_present", 0, nif_tb_present},
+    {"tb_present", 0, nif_tb_present, ERL_NIF_DIRTY_JOB_IO_BOUND},
+    {"tb_present_async", 1, nif_tb_present_async},
+    {"tb_set_frames_in_flight", 1, nif_tb_set_frames_in_flight},
+    {"tb_last_present_ts", 0, nif_tb_last_present_ts},
+    {"tb_get_features", 0, nif_tb_get_features},
+    {"tb_get_term_version", 0, nif_tb_get_term_version},
     {"tb_set_cursor", 2, nif_tb_set_cursor},
     {"tb_hide_cursor", 0, nif_tb_hide_cursor},
     {"tb_set_cell", 5, nif_tb_set_cell},
-    {"tb_peek_event", 1, nif_tb_peek_event, ERL_NIF_DIRTY_JOB_CPU_BOUND},
-    {"tb_poll_event", 0, nif_tb_poll_event, ERL_NIF_DIRTY_JOB_CPU_BOUND},
+    {"tb_set_cell", 6, nif_tb_set_cell},
+    {"tb_set_cells", 1, nif_tb_set_cells},
+    {"tb_set_cells", 2, nif_tb_set_cells},
+    {"tb_get_cell", 3, nif_tb_get_cell},
+    {"tb_peek_event", 1, nif_tb_peek_event, ERL_NIF_DIRTY_JOB_IO_BOUND},
+    {"tb_poll_event", 0, nif_tb_poll_event, ERL_NIF_DIRTY_JOB_IO_BOUND},
     {"tb_print", 5, nif_tb_print},
+    {"tb_print", 6, nif_tb_print},
+    {"tb_clip_make", 2, nif_tb_clip_make},
     {"tb_set_clear_attrs", 2, nif_tb_set_clear_attrs},
-    {"tb_set_input_mode", 1, nif_tb_set_input_mode},
-    {"tb_set_output_mode", 1, nif_tb_set_output_mode}
+    {"tb_set_input_mode", 1, nif_tb_set_input_mode, ERL_NIF_DIRTY_JOB_IO_BOUND},
+    {"tb_set_output_mode", 1, nif_tb_set_output_mode},
+    {"tb_set_present_policy", 1, nif_tb_set_present_policy, ERL_NIF_DIRTY_JOB_IO_BOUND},
+    {"tb_set_present_threads", 1, nif_tb_set_present_threads},
+    {"tb_set_output_backlog", 1, nif_tb_set_output_backlog, ERL_NIF_DIRTY_JOB_IO_BOUND},
+    {"tb_set_frame_rate", 1, nif_tb_set_frame_rate, ERL_NIF_DIRTY_JOB_IO_BOUND},
+    {"tb_event_queue_configure", 2, nif_tb_event_queue_configure},
+    {"tb_event_queue_fill", 0, nif_tb_event_queue_fill},
+    {"tb_event_queue_take", 1, nif_tb_event_queue_take},
+    {"tb_event_queue_stats", 0, nif_tb_event_queue_stats},
+    {"tb_event_notify", 1, nif_tb_event_notify},
+    {"tb_event_subscribe", 5, nif_tb_event_subscribe},
+    {"tb_event_unsubscribe", 1, nif_tb_event_unsubscribe},
+    {"tb_set_input_replay", 2, nif_tb_set_input_replay, ERL_NIF_DIRTY_JOB_IO_BOUND},
+    {"tb_input_replay_remaining", 0, nif_tb_input_replay_remaining},
+    {"tb_set_input_record", 1, nif_tb_set_input_record, ERL_NIF_DIRTY_JOB_IO_BOUND},
+    {"tb_shm_open", 5, nif_tb_shm_open, ERL_NIF_DIRTY_JOB_IO_BOUND},
+    {"tb_shm_close", 1, nif_tb_shm_close, ERL_NIF_DIRTY_JOB_IO_BOUND},
+    {"tb_surface_new", 2, nif_tb_surface_new},
+    {"tb_surface_size", 1, nif_tb_surface_size},
+    {"tb_surface_set_cells", 2, nif_tb_surface_set_cells},
+    {"tb_surface_print", 6, nif_tb_surface_print},
+    {"tb_surface_fill", 5, nif_tb_surface_fill},
+    {"tb_blit", 4, nif_tb_blit},
+    {"tb_blit", 5, nif_tb_blit},
+    {"tb_blend_rect", 3, nif_tb_blend_rect},
+    {"tb_blend_rect", 4, nif_tb_blend_rect},
+    {"tb_surface_blend", 6, nif_tb_surface_blend},
+    {"tb_blend_blit", 5, nif_tb_blend_blit},
+    {"tb_blend_blit", 6, nif_tb_blend_blit},
+    {"tb_set_blend_defaults", 2, nif_tb_set_blend_defaults},
+    {"tb_layer_add", 4, nif_tb_layer_add},
+    {"tb_layer_move", 4, nif_tb_layer_move},
+    {"tb_layer_show", 2, nif_tb_layer_show},
+    {"tb_layer_remove", 1, nif_tb_layer_remove},
+    {"tb_canvas_new", 2, nif_tb_canvas_new},
+    {"tb_canvas_info", 1, nif_tb_canvas_info},
+    {"tb_canvas_set_cells", 2, nif_tb_canvas_set_cells},
+    {"tb_canvas_print", 6, nif_tb_canvas_print},
+    {"tb_canvas_fill", 5, nif_tb_canvas_fill},
+    {"tb_canvas_show", 2, nif_tb_canvas_show},
+    {"tb_canvas_hide", 1, nif_tb_canvas_hide},
+    {"tb_canvas_scroll_to", 3, nif_tb_canvas_scroll_to}
+};
+
+/*
+ * Hot upgrade.
+ *
+ * Every loaded copy of this library has its own termbox globals and event
+ * queue. When the module is reloaded, the new copy takes the live session
+ * over from the old one through the old copy's priv_data, so the terminal
+ * is neither reset nor repainted. Bump NIF_HANDOFF_MAGIC whenever struct
+ * nif_handoff_t changes.
+ */
+
+#define NIF_HANDOFF_MAGIC "tb2nif11"
+
+struct nif_handoff_t {
+  char magic[8];
+  const char *version;
+  void *(*session_state)(size_t *size);
+  int (*session_release)(void);
+  struct evq_t *evq;
+  size_t evq_size;
+  ErlNifRWLock **lock;
+  int (*notify_pid)(ErlNifPid *pid);
+  int (*frame_rate)(void);
+  struct subs_t *subs;
+  size_t sub_size;
+  struct shm_seg_t *shm;
+  int *shm_count;
+  struct surface_res_t **layer_res;
+  struct canvas_res_t **canvas_res;
+};
+
+/* The process the reactor notifies, if it is running */
+static int reactor_pid(ErlNifPid *pid)
+{
+  int running;
+  enif_mutex_lock(reactor.lock);
+  running = reactor.running && !reactor.stop;
+  if (running) *pid = reactor.pid;
+  enif_mutex_unlock(reactor.lock);
+  return running;
+}
+
+static int frame_rate(void)
+{
+  return __atomic_load_n(&frames.rate, __ATOMIC_ACQUIRE);
+}
+
+static struct nif_handoff_t handoff = {
+  NIF_HANDOFF_MAGIC,
+  TB_VERSION_STR,
+  tb_session_state,
+  tb_session_release,
+  &evq,
+  sizeof(struct evq_t),
+  &session_lock,
+  reactor_pid,
+  frame_rate,
+  &subs,
+  sizeof(struct sub_t),
+  shm_segs,
+  &shm_count,
+  layer_res,
+  canvas_res
 };
 
-ERL_NIF_INIT(termbox2, nif_funcs, NULL, NULL, NULL, NULL)
+static void unload(ErlNifEnv *env, void *priv_data);
+
+static int load(ErlNifEnv *env, void **priv_data, ERL_NIF_TERM load_info)
+{
+  session_lock = enif_rwlock_create("termbox2_session");
+  writer.lock = enif_mutex_create("termbox2_writer");
+  writer.cond = enif_cond_create("termbox2_writer");
+  reactor.lock = enif_mutex_create("termbox2_reactor");
+  frames.lock = enif_mutex_create("termbox2_frames");
+  async.msg_env = enif_alloc_env();
+  subs_env = enif_alloc_env();
+  surface_type = enif_open_resource_type(env, NULL, "termbox2_surface", surface_dtor,
+                                         ERL_NIF_RT_CREATE | ERL_NIF_RT_TAKEOVER, NULL);
+  canvas_type = enif_open_resource_type(env, NULL, "termbox2_canvas", canvas_dtor,
+                                        ERL_NIF_RT_CREATE | ERL_NIF_RT_TAKEOVER, NULL);
+  if (session_lock == NULL || writer.lock == NULL || writer.cond == NULL ||
+      reactor.lock == NULL || frames.lock == NULL || async.msg_env == NULL ||
+      subs_env == NULL || surface_type == NULL || canvas_type == NULL ||
+      pipe(reactor.wakefd) != 0 || pipe(frames.wakefd) != 0) {
+    unload(env, NULL);
+    return 1;
+  }
+  fcntl(reactor.wakefd[0], F_SETFL, O_NONBLOCK);
+  fcntl(reactor.wakefd[1], F_SETFL, O_NONBLOCK);
+  fcntl(frames.wakefd[0], F_SETFL, O_NONBLOCK);
+  fcntl(frames.wakefd[1], F_SETFL, O_NONBLOCK);
+#ifdef __linux__
+  /* Without it the clock falls back to poll() timeouts */
+  frames.timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+#endif
+  *priv_data = &handoff;
+  return 0;
+}
+
+static int upgrade(ErlNifEnv *env, void **priv_data, void **old_priv_data, ERL_NIF_TERM load_info)
+{
+  struct nif_handoff_t *old = *old_priv_data;
+  ErlNifPid owner;
+  size_t size;
+  void *state;
+  int rv = 0, notify = 0, rate = 0;
+
+  if (load(env, priv_data, load_info) != 0) return 1;
+
+  /* A copy from before handoff existed has nothing to take over; start
+   * uninitialized as on a fresh load. */
+  if (old == NULL || memcmp(old->magic, NIF_HANDOFF_MAGIC, 8) != 0) return 0;
+
+  /* Processes still running old code may be drawing */
+  enif_rwlock_rwlock(*old->lock);
+  state = old->session_state(&size);
+  if (state == NULL) {
+    rv = 0;
+  } else if (strcmp(old->version, TB_VERSION_STR) != 0 ||
+             old->evq_size != sizeof(struct evq_t) ||
+             old->sub_size != sizeof(struct sub_t) ||
+             tb_session_adopt(state, size) != TB_OK) {
+    /* Refuse rather than misread an incompatible layout; the old code keeps
+     * running with its session. */
+    rv = 1;
+  } else {
+    evq = *old->evq;
+    memset(old->evq, 0, sizeof(struct evq_t));
+    subs = *old->subs;
+    memset(old->subs, 0, sizeof(struct subs_t));
+    /* Producers keep writing into the same mappings */
+    memcpy(shm_segs, old->shm, sizeof(shm_segs));
+    memset(old->shm, 0, sizeof(shm_segs));
+    shm_count = *old->shm_count;
+    *old->shm_count = 0;
+    /* The layers and shown canvases themselves came with the session */
+    memcpy(layer_res, old->layer_res, sizeof(layer_res));
+    memset(old->layer_res, 0, sizeof(layer_res));
+    memcpy(canvas_res, old->canvas_res, sizeof(canvas_res));
+    memset(old->canvas_res, 0, sizeof(canvas_res));
+    old->session_release();
+    notify = old->notify_pid(&owner);
+    rate = old->frame_rate();
+  }
+  enif_rwlock_rwunlock(*old->lock);
+
+  /* The old copy's writer, reactor and frame clock, if any, find the session
+   * gone and idle until that copy is unloaded */
+  if (rv == 0 && tb_set_output_backlog(-1) > 0 && writer_start() != 0) {
+    tb_set_output_backlog(0);
+  }
+  if (rv == 0 && notify) reactor_start(&owner);
+  if (rv == 0 && rate > 0) frames_start(rate);
+  if (rv != 0) unload(env, NULL);
+  return rv;
+}
+
+static void unload(ErlNifEnv *env, void *priv_data)
+{
+  void *held[TB_OPT_LAYERS_MAX + TB_OPT_CANVASES_MAX];
+  int n, i;
+
+  /* A session nobody took over: give the terminal back */
+  if (writer.lock != NULL) writer_stop();
+  if (reactor.lock != NULL) reactor_stop();
+  if (frames.lock != NULL) frames_stop();
+  if (async.msg_env != NULL) async_cancel(env, TB_ERR_NOT_INIT);
+  n = layers_release(held);
+  n += canvases_release(held + n);
+  tb_shutdown();
+  for (i = 0; i < n; i++) enif_release_resource(held[i]);
+  evq_free();
+  subs_free();
+  shm_close_all();
+  async_free();
+  if (subs_env != NULL) enif_free_env(subs_env);
+  subs_env = NULL;
+  if (session_lock != NULL) enif_rwlock_destroy(session_lock);
+  if (writer.cond != NULL) enif_cond_destroy(writer.cond);
+  if (writer.lock != NULL) enif_mutex_destroy(writer.lock);
+  if (reactor.lock != NULL) enif_mutex_destroy(reactor.lock);
+  if (reactor.wakefd[0] >= 0) close(reactor.wakefd[0]);
+  if (reactor.wakefd[1] >= 0) close(reactor.wakefd[1]);
+  if (frames.lock != NULL) enif_mutex_destroy(frames.lock);
+  if (frames.wakefd[0] >= 0) close(frames.wakefd[0]);
+  if (frames.wakefd[1] >= 0) close(frames.wakefd[1]);
+  if (frames.timerfd >= 0) close(frames.timerfd);
+  session_lock = NULL;
+  writer.cond = NULL;
+  writer.lock = NULL;
+  reactor.lock = NULL;
+  reactor.wakefd[0] = reactor.wakefd[1] = -1;
+  frames.lock = NULL;
+  frames.wakefd[0] = frames.wakefd[1] = -1;
+  frames.timerfd = -1;
+}
+
+ERL_NIF_INIT(termbox2, nif_funcs, load, NULL, upgrade, unload)
@@ -0,0 +1,56 @@
+/*
+ * Shared-memory cell staging for external producers.
+ *
+ * ExTermbox.open_shared_buffer/3 (tb_shm_open in the NIF) creates a POSIX
+ * shared-memory object that maps onto a rectangle of the screen. Another OS
+ * process opens it with shm_open(name, O_RDWR, 0) and mmap(MAP_SHARED), and
+ * writes cells into it directly; every present copies the rows it marked
+ * dirty into the back buffer. Nothing goes through Erlang.
+ *
+ * Layout, in native byte order, with every field naturally aligned:
+ *
+ *   struct tb_shm_header                        at offset 0
+ *   uint64_t dirty[(height + 63) / 64]          at offset sizeof(header)
+ *   struct tb_shm_cell cells[height][width]     at offset header.cells_offset
+ *
+ * The NIF fills in the header before setting magic. Producers must treat
+ * width, height, cell_size and cells_offset as read-only; the NIF keeps its
+ * own copy and ignores any change to them. Bit (y % 64) of dirty[y / 64]
+ * marks row y for copying; bits past the last row are ignored. Producers write
+ * under the seqlock in seq:
+ *
+ *   1. atomically increment seq (it becomes odd),
+ *   2. write cells and set the dirty bits of the rows written (atomic OR),
+ *   3. atomically increment seq again with release ordering (even).
+ *
+ * A present that finds seq odd, or changed while it copied, leaves the dirty
+ * rows for the next present, so it never shows a torn update. One producer
+ * per segment; the NIF never writes cells. A cell with ch 0 leaves the back
+ * buffer cell under it unchanged, so a producer can draw sparse overlays.
+ * fg and bg take the same TB_* attribute bits as tb_set_cell.
+ */
+#ifndef TERMBOX2_SHM_H
+#define TERMBOX2_SHM_H
+
+#include <stdint.h>
+
+#define TB_SHM_MAGIC "tb2shm01"
+
+struct tb_shm_header {
+  char magic[8];         /* TB_SHM_MAGIC once the segment is ready */
+  uint32_t width;        /* cells per row */
+  uint32_t height;       /* rows */
+  uint32_t cell_size;    /* sizeof(struct tb_shm_cell) */
+  uint32_t cells_offset; /* byte offset of cells[0][0] */
+  uint32_t seq;          /* seqlock, odd while a producer writes */
+  uint32_t pad;
+  uint64_t presented;    /* bumped by the NIF after each copy it makes */
+};
+
+struct tb_shm_cell {
+  uint32_t ch; /* a Unicode codepoint, or 0 for no change */
+  uint32_t fg;
+  uint32_t bg;
+};
+
+#endif /* TERMBOX2_SHM_H */
@@ -31,9 +31,18 @@ defmodule ExTermbox do
   ## Architecture
 
   `ExTermbox` relies on a `GenServer`, typically registered as `ExTermbox.Server`,
-  to manage the lifecycle of the `termbox2` NIF library and handle asynchronous
-  events. Most functions in this module are thin wrappers that send messages
-  (calls or casts) to this server process.
+  to manage the lifecycle of the `termbox2` NIF library. Configuration and query
+  functions in this module are thin wrappers that send calls to this server
+  process. Events are delivered by a separate `ExTermbox.Input` process that the
+  server supervises, so input is never stuck behind configuration calls.
+
+  Drawing (`change_cell/6`, `set_cells/2`, `print/6`, `clear/1`, `set_cursor/3`
+  and `present/1`) calls the NIF directly from the calling process. The NIF
+  guards the terminal session with a lock, so any number of processes (e.g., one
+  per widget) can draw concurrently without queueing behind the server's
+  mailbox. Cell writes only lock the rows they touch, so processes drawing
+  disjoint rows (e.g., one per pane) do not wait for each other; `present/1`
+  briefly excludes them.
 
   See `ExTermbox.Server` for implementation details.
 
@@ -45,9 +54,10 @@ defmodule ExTermbox do
   2.  **API Calls:** Use functions like `change_cell/5`, `clear/0`, `print/5`, etc.
       These functions communicate with the running `ExTermbox.Server`.
   3.  **Display:** Call `ExTermbox.present/0` to synchronize the internal back
-      buffer with the terminal screen.
-  4.  **Events:** The `ExTermbox.Server` automatically polls for terminal events
-      (keyboard, mouse, resize) using `tb_peek_event()` via the NIF. Events are
+      buffer with the terminal screen, or set a frame rate (`set_frame_rate/2`)
+      and let the NIF present whatever was drawn at most that often.
+  4.  **Events:** `ExTermbox.Input` automatically picks up terminal events
+      (keyboard, mouse, resize) from the NIF's event queue. Events are
       parsed into `%ExTermbox.Event{}` structs and sent as messages in the format
       `{:termbox_event, event}` to the owner process (the one that called `init/1`).
       You do not need to manually poll for events.
@@ -82,6 +92,21 @@ defmodule ExTermbox do
   # Registered name for the GenServer
   @server_name ExTermbox.Server
 
+  # The calling process's clip stack (see push_clip/1), innermost first
+  @clip_key {__MODULE__, :clips}
+
+  @compile {:no_warn_undefined, [
+    {:termbox2, :tb_blend_rect, 4},
+    {:termbox2, :tb_clear, 0},
+    {:termbox2, :tb_clip_make, 2},
+    {:termbox2, :tb_get_cell, 3},
+    {:termbox2, :tb_present, 0},
+    {:termbox2, :tb_present_async, 1},
+    {:termbox2, :tb_set_cell, 6},
+    {:termbox2, :tb_set_cells, 2},
+    {:termbox2, :tb_set_cursor, 2}
+  ]}
+
   @doc """
   Initializes the termbox library by starting the `ExTermbox.Server` GenServer.
 
@@ -104,8 +129,35 @@ defmodule ExTermbox do
       Defaults to `#{inspect(@server_name)}`.
     - `:owner` (pid): The PID to receive termbox events. Defaults to `self()`.
       This is typically not overridden directly, as `init/1` sets it.
-    - `:poll_interval_ms` (pos_integer): The interval in milliseconds for polling
-      terminal events via `tb_peek_event`. Defaults to `10`.
+    - `:poll_interval_ms` (pos_integer): How long to wait, in milliseconds, before
+      retrying delivery of events the owner had no room for. Input itself is
+      picked up by a native thread as soon as it arrives, so an idle terminal
+      costs no wakeups; only builds without that thread poll at this interval.
+      Defaults to `10`.
+    - `:event_queue_size` (pos_integer): Capacity of the native event queue that
+      holds events the owner has not taken yet. Defaults to `1024`.
+    - `:overflow` (atom): What the native event queue does when it is full, one of
+      `:drop_oldest_motion`, `:coalesce` or `:block`. See `event_stats/1`.
+      Defaults to `:coalesce`.
+    - `:max_owner_queue` (pos_integer): Events are only delivered while the owner's
+      message queue is shorter than this. Defaults to `1000`.
+    - `:present_policy` (atom): `:always` or `:visible`. See `set_present_policy/2`.
+      Defaults to `:always`.
+    - `:present_threads` (pos_integer): Threads used to diff and encode large frames.
+      See `set_present_threads/2`. Defaults to `1`.
+    - `:output_backlog` (non_neg_integer): Bytes of output that may wait for a slow
+      terminal before frames are skipped. See `set_output_backlog/2`. Defaults to `0`.
+    - `:frames_in_flight` (pos_integer): How many frames from `present_async/1`
+      may be waiting for the terminal before further requests are coalesced,
+      from 1 to 16. Defaults to `2`.
+    - `:frame_rate` (non_neg_integer): Present drawn frames from a native frame
+      clock at most this many times per second. See `set_frame_rate/2`.
+      Defaults to `0` (present explicitly).
+    - `:replay_input` (String.t): Replay input from this recording instead of
+      reading the terminal, starting right after initialization. See `replay_input/3`.
+    - `:replay_speed` (atom | non_neg_integer): Speed for `:replay_input`.
+      Defaults to `:realtime`.
+    - `:record_input` (String.t): Record all terminal input to this file. See `record_input/2`.
 
   All options are passed down to `ExTermbox.Server.start_link/1`.
   """
@@ -216,26 +268,301 @@ defmodule ExTermbox do
   end
 
   @doc ~S"""
-  Retrieves the character, foreground, and background attributes of a specific cell
-  by querying the `ExTermbox.Server`.
+  Returns counters for the native event queue by querying the `ExTermbox.Server`.
+
+  Events read from the terminal are held in a bounded queue inside the NIF and
+  handed to the owner only while its mailbox is shorter than `:max_owner_queue`
+  (see `init/1`). When the queue fills up, the `:overflow` policy applies:
 
-  **Note:** This function is not currently implemented in v2.0.0. The underlying
-  `tb_get_cell/2` function is not available in the current termbox2_nif version.
-  Calls will return `{:error, {:not_implemented, "..."}}`.
-  
-  This feature may be added in a future version when the NIF library is updated.
+    - `:drop_oldest_motion` evicts the oldest mouse motion event (or the oldest
+      event if none are motion) to make room.
+    - `:coalesce` merges a mouse motion or resize event into the previous queued
+      event of the same kind, and evicts like `:drop_oldest_motion` otherwise.
+    - `:block` stops reading from the terminal until the owner catches up, so
+      input waits in the tty instead of being dropped.
 
-  Returns `{:ok, {char_codepoint, fg_attribute, bg_attribute}}` on success,
-  or `{:error, reason}` on failure.
+  Returns `{:ok, %{queued: n, dropped: n, coalesced: n}}`, where `dropped` and
+  `coalesced` count events since the server started.
 
   Arguments:
-    - `x`: The zero-based column index.
-    - `y`: The zero-based row index.
     - `server`: The registered name or PID of the server (defaults to `#{inspect(@server_name)}`).
   """
-  @spec get_cell(integer, integer, atom | pid) :: {:ok, {integer, integer, integer}} | {:error, any}
-  def get_cell(x, y, server \\ @server_name) when is_integer(x) and is_integer(y) do
-    GenServer.call(server, {:get_cell, x, y})
+  @spec event_stats(atom | pid) ::
+          {:ok, %{queued: non_neg_integer, dropped: non_neg_integer, coalesced: non_neg_integer}}
+          | {:error, any}
+  def event_stats(server \\ @server_name) do
+    GenServer.call(server, :event_stats)
+  end
+
+  @doc ~S"""
+  Subscribes the calling process to the terminal events matching `filter`.
+
+  The NIF sends each matching event straight to the subscriber as
+  `{:termbox_raw_event, raw}` as soon as it is read, independently of the
+  owner (which still receives every event). Turn `raw` into an
+  `%ExTermbox.Event{}` with `ExTermbox.Event.from_raw/1`. Subscribing again
+  replaces the filter; subscribers are dropped when they exit.
+
+  Filter options:
+    - `:types` (list of atoms): Event types to receive, from `:key`, `:resize`,
+      `:mouse` and `:focus`. Defaults to all of them.
+    - `:region` (`{x, y, w, h}`): Only receive mouse events inside this
+      rectangle. Defaults to the whole screen.
+    - `:keys` (list): Only receive key events for these keys (atoms from
+      `ExTermbox.Constants.keys/0`) and characters (codepoints, e.g. `?q`), at
+      most 32 of each. Defaults to every key.
+
+  Arguments:
+    - `filter`: Keyword list of the options above.
+    - `server`: The registered name or PID of the server (defaults to `#{inspect(@server_name)}`).
+
+  Returns `:ok` on success, or `{:error, reason}` otherwise.
+  """
+  @spec subscribe(keyword, atom | pid) :: :ok | {:error, any()}
+  def subscribe(filter \\ [], server \\ @server_name) do
+    types =
+      filter
+      |> Keyword.get(:types, Map.keys(Constants.event_types()))
+      |> Enum.reduce(0, &Bitwise.bor(&2, Bitwise.bsl(1, Constants.event_type(&1))))
+
+    region = Keyword.get(filter, :region) || {0, 0, -1, -1}
+    {keys, chars} = Enum.split_with(Keyword.get(filter, :keys, []), &is_atom/1)
+    keys = Enum.map(keys, &Constants.key/1)
+
+    GenServer.call(server, {:subscribe, self(), types, region, keys, chars})
+  end
+
+  @doc ~S"""
+  Removes the calling process's event subscription (see `subscribe/2`).
+
+  Arguments:
+    - `server`: The registered name or PID of the server (defaults to `#{inspect(@server_name)}`).
+
+  Returns `:ok`.
+  """
+  @spec unsubscribe(atom | pid) :: :ok
+  def unsubscribe(server \\ @server_name) do
+    GenServer.call(server, {:unsubscribe, self()})
+  end
+
+  @doc ~S"""
+  Returns what is known about the terminal's features by querying the
+  `ExTermbox.Server`.
+
+  On initialization termbox asks the terminal (DA1, XTVERSION and DECRQM
+  queries) without waiting for the answers, and starts from the results cached
+  for the same terminal on an earlier run. The answers replace them as soon as
+  they arrive, usually within one round trip. `present/1` uses synchronized
+  output (`:sync_output`) and REP (`:rep`) when available; the other features
+  are informational.
+
+  Returns `{:ok, %{features: [atom], version: String.t()}}`, where `features`
+  are names from `ExTermbox.Constants.features/0` and `version` is the
+  terminal's XTVERSION reply (e.g., `"XTerm(390)"`), or `""` if unknown.
+
+  Arguments:
+    - `server`: The registered name or PID of the server (defaults to `#{inspect(@server_name)}`).
+  """
+  @spec terminal_features(atom | pid) ::
+          {:ok, %{features: [atom], version: String.t()}} | {:error, any}
+  def terminal_features(server \\ @server_name) do
+    GenServer.call(server, :terminal_features)
+  end
+
+  @doc ~S"""
+  Replays recorded input instead of reading the terminal, by sending a request
+  to the `ExTermbox.Server`.
+
+  Events are parsed from the recording exactly as if they had been typed, so
+  a whole application (parser, server, owner and presents) can be benchmarked
+  against a captured session without anyone at the keyboard. The terminal is
+  not read until the recording runs out. Both files written by
+  `record_input/2` and asciicast v2/v3 recordings made with
+  `asciinema rec --stdin` are understood; asciicast resizes are replayed as
+  resize events.
+
+  Arguments:
+    - `path`: The recording to replay, or `nil` to stop the current replay.
+    - `speed`: `:realtime` keeps the recorded timing, `:max` delivers input as
+      fast as it is consumed, and an integer is a percentage of recorded time
+      (`200` replays twice as fast). Use `overflow: :block` at init if nothing
+      may be dropped at `:max`.
+    - `server`: The registered name or PID of the server (defaults to `#{inspect(@server_name)}`).
+
+  Returns `:ok` on success, `{:error, :invalid_replay_speed}` for an unknown
+  speed, or `{:error, {reason, code}}` if the file cannot be read or is not a
+  recognized recording (`:replay_format`).
+  """
+  @spec replay_input(String.t() | nil, atom | non_neg_integer, atom | pid) :: :ok | {:error, any}
+  def replay_input(path, speed \\ :realtime, server \\ @server_name) do
+    if (is_integer(speed) and speed >= 0) or Map.has_key?(Constants.replay_speeds(), speed) do
+      GenServer.call(server, {:set_input_replay, path || "", speed})
+    else
+      {:error, :invalid_replay_speed}
+    end
+  end
+
+  @doc ~S"""
+  Returns how many records of the current input replay are still to be
+  delivered, by querying the `ExTermbox.Server`. Returns `{:ok, 0}` once the
+  replay has finished and `{:ok, nil}` if no replay was started.
+
+  Arguments:
+    - `server`: The registered name or PID of the server (defaults to `#{inspect(@server_name)}`).
+  """
+  @spec input_replay_remaining(atom | pid) :: {:ok, non_neg_integer | nil} | {:error, any}
+  def input_replay_remaining(server \\ @server_name) do
+    GenServer.call(server, :input_replay_remaining)
+  end
+
+  @doc ~S"""
+  Records all terminal input, with its timing and resizes, to a file that
+  `replay_input/3` can play back. Replaces any recording in progress.
+
+  Arguments:
+    - `path`: The file to write, or `nil` to stop recording.
+    - `server`: The registered name or PID of the server (defaults to `#{inspect(@server_name)}`).
+
+  Returns `:ok` on success or `{:error, reason}` if the file cannot be created.
+  """
+  @spec record_input(String.t() | nil, atom | pid) :: :ok | {:error, any}
+  def record_input(path, server \\ @server_name) do
+    GenServer.call(server, {:set_input_record, path || ""})
+  end
+
+  @doc ~S"""
+  Opens a shared-memory buffer that other OS processes can draw into.
+
+  Creates the POSIX shared-memory object `name` (e.g., `"/myapp-video"`) and
+  maps it onto the `w` x `h` rectangle of the screen at `x`, `y`. A producer
+  in any language opens it with `shm_open`/`mmap` and writes cells straight
+  into it; every present copies the rows it marked dirty into the back buffer,
+  without going through Erlang. `c_src/termbox2_shm.h` documents the memory
+  layout and the seqlock producers write under. With a frame rate set
+  (`set_frame_rate/2`), the frame clock presents producer updates by itself.
+
+  At most 8 buffers can be open at once. They are closed (and unlinked) by
+  `close_shared_buffer/2` or when termbox shuts down.
+
+  Arguments:
+    - `name`: Shared-memory object name, starting with `/`. It must not exist yet.
+    - `rect`: `{x, y, w, h}`, with `w` and `h` from 1 to 4096.
+    - `server`: The registered name or PID of the server (defaults to `#{inspect(@server_name)}`).
+
+  Returns `{:ok, id}` on success, or `{:error, reason}` otherwise.
+  """
+  @spec open_shared_buffer(String.t(), {integer, integer, pos_integer, pos_integer}, atom | pid) ::
+          {:ok, non_neg_integer} | {:error, any}
+  def open_shared_buffer(name, {x, y, w, h}, server \\ @server_name)
+      when is_binary(name) and is_integer(x) and is_integer(y) and
+             is_integer(w) and w in 1..4096 and is_integer(h) and h in 1..4096 do
+    if String.starts_with?(name, "/") do
+      GenServer.call(server, {:shm_open, name, x, y, w, h})
+    else
+      {:error, :invalid_name}
+    end
+  end
+
+  @doc ~S"""
+  Closes a buffer opened with `open_shared_buffer/3` and unlinks its
+  shared-memory object. Cells it already drew stay on screen.
+
+  Arguments:
+    - `id`: The id returned by `open_shared_buffer/3`.
+    - `server`: The registered name or PID of the server (defaults to `#{inspect(@server_name)}`).
+
+  Returns `:ok` on success, or `{:error, reason}` if no such buffer is open.
+  """
+  @spec close_shared_buffer(non_neg_integer, atom | pid) :: :ok | {:error, any}
+  def close_shared_buffer(id, server \\ @server_name) when is_integer(id) do
+    GenServer.call(server, {:shm_close, id})
+  end
+
+  @doc ~S"""
+  Sets the present policy by sending a request to the `ExTermbox.Server`.
+
+  With `:always` (the default) every `present/1` is written to the terminal.
+  With `:visible`, presents are deferred while the terminal reports that it has
+  lost focus (requires the `:focus` input mode) or while the process is
+  suspended with SIGTSTP; the latest frame is flushed once the terminal is
+  focused or resumed again.
+
+  Arguments:
+    - `policy`: `:always` or `:visible` (see `ExTermbox.Constants.present_policies/0`).
+    - `server`: The registered name or PID of the server (defaults to `#{inspect(@server_name)}`).
+
+  Returns `:ok` on success, `{:error, :invalid_present_policy}` if the policy is
+  unrecognized, or `{:error, reason}` otherwise.
+  """
+  @spec set_present_policy(atom, atom | pid) :: :ok | {:error, any()}
+  def set_present_policy(policy, server \\ @server_name) when is_atom(policy) do
+    case Map.fetch(Constants.present_policies(), policy) do
+      {:ok, policy_int} -> GenServer.call(server, {:set_present_policy, policy_int})
+      :error -> {:error, :invalid_present_policy}
+    end
+  end
+
+  @doc ~S"""
+  Sets how many threads `present/1` uses, by sending a request to the `ExTermbox.Server`.
+
+  With more than one thread, frames of at least 65536 cells (e.g., a 1000x500
+  canvas) are split into bands of rows that are diffed and encoded in parallel
+  and written in row order. Each band starts with an explicit cursor move and
+  attribute reset, so the terminal ends up showing the same frame. Smaller
+  frames are always presented on the calling thread. Workers are started by the
+  next `present/1`.
+
+  Arguments:
+    - `n`: Number of threads, from 1 (the default, no workers) to 64.
+    - `server`: The registered name or PID of the server (defaults to `#{inspect(@server_name)}`).
+
+  Returns `:ok` on success, or `{:error, reason}` otherwise.
+  """
+  @spec set_present_threads(pos_integer, atom | pid) :: :ok | {:error, any()}
+  def set_present_threads(n, server \\ @server_name) when is_integer(n) do
+    GenServer.call(server, {:set_present_threads, n})
+  end
+
+  @doc ~S"""
+  Sets the output backlog limit by sending a request to the `ExTermbox.Server`.
+
+  With `0` (the default) `present/1` returns once the terminal has taken the
+  whole frame, so a slow or stalled terminal blocks every presenting process.
+  With a positive limit, output the terminal does not take right away is kept
+  in a backlog that a native writer thread drains as the terminal becomes
+  writable, and `present/1` never waits. While the backlog exceeds `max` bytes,
+  frames are skipped; the latest one is presented once the terminal catches up.
+
+  Arguments:
+    - `max`: Backlog limit in bytes, or `0` for blocking writes.
+    - `server`: The registered name or PID of the server (defaults to `#{inspect(@server_name)}`).
+
+  Returns `:ok` on success, or `{:error, reason}` otherwise.
+  """
+  @spec set_output_backlog(non_neg_integer, atom | pid) :: :ok | {:error, any()}
+  def set_output_backlog(max, server \\ @server_name) when is_integer(max) do
+    GenServer.call(server, {:set_output_backlog, max})
+  end
+
+  @doc ~S"""
+  Sets the frame rate of the native frame clock by sending a request to the `ExTermbox.Server`.
+
+  With a positive rate, drawing marks the back buffer dirty and a native thread
+  presents it at most `fps` times per second, so processes only draw and never
+  need to call `present/1`. However many draws happen between two frames, only
+  the resulting frame is diffed and written, and a screen nobody draws to is
+  not presented at all. `present/1` still works and counts as a frame.
+
+  Arguments:
+    - `fps`: Maximum frames per second, from 1 to 1000, or `0` (the default) to
+      stop the clock.
+    - `server`: The registered name or PID of the server (defaults to `#{inspect(@server_name)}`).
+
+  Returns `:ok` on success, or `{:error, reason}` otherwise.
+  """
+  @spec set_frame_rate(non_neg_integer, atom | pid) :: :ok | {:error, any()}
+  def set_frame_rate(fps, server \\ @server_name) when is_integer(fps) do
+    GenServer.call(server, {:set_frame_rate, fps})
   end
 
   @doc ~S"""
@@ -245,16 +572,23 @@ defmodule ExTermbox do
   and then calls the `termbox2` NIF function `tb_set_input_mode()`.
 
   Arguments:
-    - `mode`: An input mode atom defined in `ExTermbox.Constants` (e.g., `:esc`, `:alt`, `:mouse`).
+    - `mode`: An input mode atom defined in `ExTermbox.Constants` (e.g., `:esc`, `:alt`, `:mouse`),
+      or a list of them which are combined (e.g., `[:esc, :mouse, :focus]`). The `:focus` flag
+      enables terminal focus reporting, delivered as events of type `:focus` with key
+      `:focus_in` or `:focus_out`.
     - `server`: The registered name or PID of the server (defaults to `#{inspect(@server_name)}`).
 
   Returns `:ok` on success, `{:error, :invalid_input_mode}` if the mode atom is
   unrecognized, or `{:error, reason}` for other GenServer call errors.
   """
-  @spec select_input_mode(atom, atom | pid) :: :ok | {:error, :invalid_input_mode | any()}
-  def select_input_mode(mode, server \\ @server_name) when is_atom(mode) do
+  @spec select_input_mode(atom | [atom], atom | pid) :: :ok | {:error, :invalid_input_mode | any()}
+  def select_input_mode(mode, server \\ @server_name) when is_atom(mode) or is_list(mode) do
     try do
-      mode_int = Constants.input_mode(mode)
+      mode_int =
+        mode
+        |> List.wrap()
+        |> Enum.reduce(0, fn m, acc -> Bitwise.bor(acc, Constants.input_mode(m)) end)
+
       GenServer.call(server, {:set_input_mode, mode_int})
     catch
       :error, {:key_not_found, _, _} -> {:error, :invalid_input_mode}
@@ -263,44 +597,103 @@ defmodule ExTermbox do
   end
 
   @doc ~S"""
-  Clears the internal back buffer by sending a request to the `ExTermbox.Server`.
+  Clears the internal back buffer.
 
-  The server calls the `termbox2` NIF function `tb_clear()`.
+  Calls the `termbox2` NIF function `tb_clear()` directly from the calling process.
   This does not immediately affect the visible terminal; `present/1` must be called
   to synchronize.
 
   Arguments:
-    - `server`: The registered name or PID of the server (defaults to `#{inspect(@server_name)}`).
+    - `server`: Accepted for compatibility; drawing does not go through the server.
 
-  Returns `:ok` on success or `{:error, reason}` if the GenServer call fails.
+  Returns `:ok` on success or `{:error, {reason, code}}` if termbox reports an error
+  (e.g., `:not_init` before `init/1`).
   """
   @spec clear(atom | pid) :: :ok | {:error, any}
-  def clear(server \\ @server_name) do
-    # Clear is usually fast, cast might be okay, but call ensures completion.
-    GenServer.call(server, :clear)
+  def clear(_server \\ @server_name) do
+    p_nif_result(:termbox2.tb_clear())
   end
 
   @doc ~S"""
-  Synchronizes the internal back buffer with the terminal screen by sending a
-  request to the `ExTermbox.Server`.
+  Synchronizes the internal back buffer with the terminal screen.
 
-  The server calls the `termbox2` NIF function `tb_present()`.
+  Calls the `termbox2` NIF function `tb_present()` directly from the calling
+  process (on a dirty IO scheduler). Cells drawn concurrently by other processes
+  are either fully in this frame or left for the next one. Not needed while a
+  frame rate is set (see `set_frame_rate/2`).
 
   Arguments:
-    - `server`: The registered name or PID of the server (defaults to `#{inspect(@server_name)}`).
+    - `server`: Accepted for compatibility; drawing does not go through the server.
 
-  Returns `:ok` on success or `{:error, reason}` if the GenServer call fails.
+  Returns `:ok` on success or `{:error, {reason, code}}` if termbox reports an error.
   """
   @spec present(atom | pid) :: :ok | {:error, any}
-  def present(server \\ @server_name) do
-    # Present must complete before next draw cycle, so use call.
-    GenServer.call(server, :present)
+  def present(_server \\ @server_name) do
+    p_nif_result(:termbox2.tb_present())
   end
 
   @doc ~S"""
-  Sets the cursor position by sending a request to the `ExTermbox.Server`.
+  Queues a present and returns without waiting for it.
+
+  A native writer thread presents the back buffer and, once the terminal has
+  taken the whole frame, sends the calling process
+  `{:presented, ref, stats}`. `stats` is a map with the frame's `:bytes`, the
+  `:latency_us` from this call to the acknowledgement, and how many other
+  requests were `:coalesced` into the same frame. If the frame cannot be
+  presented, `stats` is `{:error, code}` instead.
+
+  At most `:frames_in_flight` presented frames (see `init/1`) wait for the
+  terminal at a time. Requests made while that many are pending share the
+  next frame, which presents whatever has been drawn by the time there is
+  room for it. Combined with an output backlog (`set_output_backlog/2`), the
+  caller can draw the next frame while the previous one is still being
+  written. Without a backlog, drawing waits while a frame is being written.
+
+  While the `:visible` present policy (see `set_present_policy/2`) holds
+  frames back, the next frame waits as well and keeps taking requests until
+  the terminal is shown again.
+
+  Arguments:
+    - `server`: Accepted for compatibility; presenting does not go through the server.
 
-  The server calls the `termbox2` NIF function `tb_set_cursor()`.
+  Returns a reference for the acknowledgement, or `{:error, {reason, code}}` if
+  the present could not be queued.
+  """
+  @spec present_async(atom | pid) :: reference | {:error, any}
+  def present_async(_server \\ @server_name) do
+    ref = make_ref()
+
+    case p_nif_result(:termbox2.tb_present_async(ref)) do
+      :ok -> ref
+      error -> error
+    end
+  end
+
+  @doc ~S"""
+  Returns the time at which the last `present/1` finished writing to the
+  terminal by querying the `ExTermbox.Server`.
+
+  The value is in nanoseconds on the same monotonic clock as
+  `ExTermbox.Event` `:timestamp`, so subtracting an event's timestamp from the
+  timestamp of the first present after handling it gives the input-to-present
+  latency. Returns `{:ok, 0}` if nothing has been presented yet.
+
+  With an output backlog (see `set_output_backlog/2`) a present only counts as
+  finished once the backlog holding its frame has drained, so the value can
+  lag behind the call that queued the frame.
+
+  Arguments:
+    - `server`: The registered name or PID of the server (defaults to `#{inspect(@server_name)}`).
+  """
+  @spec last_present_timestamp(atom | pid) :: {:ok, non_neg_integer} | {:error, any}
+  def last_present_timestamp(server \\ @server_name) do
+    GenServer.call(server, :last_present_timestamp)
+  end
+
+  @doc ~S"""
+  Sets the cursor position.
+
+  Calls the `termbox2` NIF function `tb_set_cursor()` directly from the calling process.
 
   Use `x = -1` and `y = -1` (or the default arguments) to hide the cursor.
   See `ExTermbox.Constants.hide_cursor/0`.
@@ -308,23 +701,21 @@ defmodule ExTermbox do
   Arguments:
     - `x`: The zero-based column index (-1 to hide).
     - `y`: The zero-based row index (-1 to hide).
-    - `server`: The registered name or PID of the server (defaults to `#{inspect(@server_name)}`).
+    - `server`: Accepted for compatibility; drawing does not go through the server.
 
-  Returns `:ok`. This function uses `GenServer.cast`, so errors during the NIF call
-  will not be reported back directly but may be logged by the server.
+  Returns `:ok` on success or `{:error, {reason, code}}` if termbox reports an error.
   """
-  @spec set_cursor(integer, integer, atom | pid) :: :ok
-  def set_cursor(x \\ Constants.hide_cursor(), y \\ Constants.hide_cursor(), server \\ @server_name)
+  @spec set_cursor(integer, integer, atom | pid) :: :ok | {:error, any}
+  def set_cursor(x \\ Constants.hide_cursor(), y \\ Constants.hide_cursor(), _server \\ @server_name)
       when is_integer(x) and is_integer(y) do
-    # Setting cursor is quick, cast is likely fine.
-    GenServer.cast(server, {:set_cursor, x, y})
+    p_nif_result(:termbox2.tb_set_cursor(x, y))
   end
 
   @doc ~S"""
   Changes the character, foreground, and background attributes of a specific cell
-  in the internal back buffer by sending a request to the `ExTermbox.Server`.
+  in the internal back buffer.
 
-  The server calls the `termbox2` NIF function `tb_set_cell()`.
+  Calls the `termbox2` NIF function `tb_set_cell()` directly from the calling process.
   This does not immediately affect the visible terminal; `present/1` must be called
   to synchronize.
 
@@ -339,28 +730,77 @@ defmodule ExTermbox do
       Combine colors (e.g., `Constants.color(:red)`) with attributes
       (e.g., `Constants.attribute(:bold)`) using bitwise OR (`Bitwise.bor/2`).
     - `bg`: The background attribute (an integer constant from `ExTermbox.Constants`).
-    - `server`: The registered name or PID of the server (defaults to `#{inspect(@server_name)}`).
+    - `server`: Accepted for compatibility; drawing does not go through the server.
 
-  Returns `:ok` if the arguments are valid and the request is sent.
-  Returns `{:error, :invalid_char}` if the `char` argument is not a valid single
-  character representation.
+  Returns `:ok` on success, `{:error, :invalid_char}` if the `char` argument is not
+  a valid single character representation, or `{:error, {reason, code}}` if termbox
+  rejects the cell (e.g., `:out_of_bounds`).
 
-  This function uses `GenServer.cast`, so errors during the NIF call itself
-  will not be reported back directly but may be logged by the server.
+  To draw many cells, `set_cells/2` is cheaper: it takes the NIF lock once.
   """
   @spec change_cell(integer, integer, char | String.t(), integer, integer, atom | pid) :: :ok | {:error, any}
-  def change_cell(x, y, char, fg, bg, server \\ @server_name)
+  def change_cell(x, y, char, fg, bg, _server \\ @server_name)
       when is_integer(x) and is_integer(y) and is_integer(fg) and is_integer(bg) do
     # Allow single char string or integer codepoint
     case p_char_to_codepoint(char) do
       {:ok, codepoint} ->
-        # Changing a cell is usually part of a batch, cast is appropriate.
-        GenServer.cast(server, {:change_cell, x, y, codepoint, fg, bg})
+        p_nif_result(:termbox2.tb_set_cell(x, y, codepoint, fg, bg, current_clip()))
       :error ->
         {:error, :invalid_char}
     end
   end
 
+  @doc ~S"""
+  Changes a batch of cells in the internal back buffer with a single NIF call.
+
+  Each cell is a `{x, y, char, fg, bg}` tuple with the same meaning as the
+  arguments of `change_cell/6`, and the batch costs far less than one
+  `change_cell/6` per cell. It is applied under one shared acquisition of the
+  NIF session lock, so a present or resize never sees it half done.
+
+  Other processes keep drawing meanwhile. Each run of consecutive cells on the
+  same row is written under that row's lock and is not interleaved with their
+  writes, but separate runs are: cells on different rows, or a row the list
+  comes back to, may be mixed with another process's drawing.
+
+  Arguments:
+    - `cells`: A list of `{x, y, char, fg, bg}` tuples.
+    - `server`: Accepted for compatibility; drawing does not go through the server.
+
+  Returns `:ok` if every cell was set, `{:error, :invalid_char}` if any `char` is not
+  a valid single character (nothing is drawn), or `{:error, {reason, code}}` for the
+  first cell termbox rejected (the others are still drawn).
+  """
+  @spec set_cells([{integer, integer, char | String.t(), integer, integer}], atom | pid) ::
+          :ok | {:error, any}
+  def set_cells(cells, _server \\ @server_name) when is_list(cells) do
+    cells
+    |> Enum.reduce_while([], fn {x, y, char, fg, bg}, acc ->
+      case p_char_to_codepoint(char) do
+        {:ok, codepoint} -> {:cont, [{x, y, codepoint, fg, bg} | acc]}
+        :error -> {:halt, :error}
+      end
+    end)
+    |> case do
+      :error -> {:error, :invalid_char}
+      reversed -> p_nif_result(:termbox2.tb_set_cells(Enum.reverse(reversed), current_clip()))
+    end
+  end
+
+  # Maps a termbox return code to :ok or {:error, {reason, code}}
+  defp p_nif_result(code) do
+    if code == Constants.error_code(:ok) do
+      :ok
+    else
+      reason =
+        Enum.find_value(Constants.error_codes(), :unknown, fn {name, value} ->
+          if value == code, do: name
+        end)
+
+      {:error, {reason, code}}
+    end
+  end
+
   # Helper to convert various char inputs to a codepoint
   defp p_char_to_codepoint(char) when is_integer(char) do
     {:ok, char}
@@ -380,12 +820,12 @@ defmodule ExTermbox do
   @doc ~S"""
   A convenience function to print a string at a given position with specified attributes.
 
-  This function iterates through the string's characters and calls `change_cell/6`
-  for each one, sending multiple requests to the `ExTermbox.Server`.
+  The string's characters are drawn left to right, one cell each, with a single
+  `set_cells/2` call, so the whole string lands in the same frame.
 
   Note: This function assumes a left-to-right character display and does not handle
   line wrapping or terminal boundaries explicitly. Characters printed beyond the
-  terminal width might be ignored by the underlying `termbox2` library.
+  terminal width are ignored by the underlying `termbox2` library.
 
   Arguments:
     - `x`: The starting zero-based column index.
@@ -393,29 +833,177 @@ defmodule ExTermbox do
     - `fg`: The foreground attribute (integer constant from `ExTermbox.Constants`).
     - `bg`: The background attribute (integer constant from `ExTermbox.Constants`).
     - `str`: The string to print.
-    - `server`: The registered name or PID of the server (defaults to `#{inspect(@server_name)}`).
+    - `server`: Accepted for compatibility; drawing does not go through the server.
 
-  Returns `:ok`. Like `change_cell/6`, this uses `GenServer.cast`, so errors during
-  individual NIF calls are not reported directly.
+  Returns `:ok`. Errors for individual cells (such as characters past the edge of
+  the terminal) are not reported.
   """
   @spec print(integer, integer, integer, integer, String.t(), atom | pid) :: :ok
   def print(x, y, fg, bg, str, server \\ @server_name)
       when is_integer(x) and is_integer(y) and is_integer(fg) and is_integer(bg) and is_binary(str) do
-    # Iterate through codepoints and call change_cell for each
-    # Start pipe with the data
     str
     |> :unicode.characters_to_list()
     |> Enum.with_index()
-    |> Enum.each(fn {codepoint, index} ->
-      # We ignore the return value of change_cell (which is just :ok from cast)
-      change_cell(x + index, y, codepoint, fg, bg, server)
-    end)
-    # Since casts are async, we just return :ok immediately assuming they will eventually succeed.
+    |> Enum.map(fn {codepoint, index} -> {x + index, y, codepoint, fg, bg} end)
+    |> set_cells(server)
+
     :ok
   end
 
+  @doc ~S"""
+  Pushes a clip rectangle and origin for the calling process's drawing into
+  the back buffer.
+
+  Until the matching `pop_clip/0`, `change_cell/6`, `set_cells/2`, `print/6`,
+  `blend_rect/3`, `ExTermbox.Surface.blit/4` and
+  `ExTermbox.Surface.blend_blit/5` called from this process take coordinates
+  relative to the top left corner of `rect`, and cells outside it (or outside
+  any rectangle pushed before it) are rejected natively with
+  `{:error, {:out_of_bounds, code}}`. A widget can then draw in its own
+  coordinates without offsetting or bounds-checking anything itself.
+  `clear/1` and `set_cursor/3` are not affected.
+
+  The stack belongs to the calling process: it is kept in its process
+  dictionary and passed to the NIF with each draw, so processes drawing at
+  the same time each use their own clip, and it goes away with the process.
+
+  Arguments:
+    - `rect`: `{x, y, w, h}`, with `x` and `y` relative to the current origin.
+
+  Returns `:ok`, or `{:error, {reason, code}}` if `w` or `h` is negative.
+  """
+  @spec push_clip({integer, integer, integer, integer}) :: :ok | {:error, any}
+  def push_clip({x, y, w, h} = rect)
+      when is_integer(x) and is_integer(y) and is_integer(w) and is_integer(h) do
+    stack = Process.get(@clip_key, [])
+
+    case :termbox2.tb_clip_make(current_clip(), rect) do
+      code when is_integer(code) ->
+        p_nif_result(code)
+
+      clip ->
+        Process.put(@clip_key, [clip | stack])
+        :ok
+    end
+  end
+
+  @doc ~S"""
+  Pops the clip rectangle the calling process pushed last, restoring its
+  previous origin and clip.
+
+  Returns `:ok`, or `{:error, {reason, code}}` if its stack is empty.
+  """
+  @spec pop_clip() :: :ok | {:error, any}
+  def pop_clip do
+    case Process.get(@clip_key, []) do
+      [_ | rest] ->
+        Process.put(@clip_key, rest)
+        :ok
+
+      [] ->
+        p_nif_result(Constants.error_code(:error))
+    end
+  end
+
+  @doc ~S"""
+  Runs `fun` with `rect` pushed as the clip rectangle (see `push_clip/1`) and
+  pops it afterwards, even if `fun` raises. Returns what `fun` returns.
+  """
+  @spec with_clip({integer, integer, integer, integer}, (-> result)) :: result | {:error, any}
+        when result: any
+  def with_clip(rect, fun) when is_function(fun, 0) do
+    case push_clip(rect) do
+      :ok ->
+        try do
+          fun.()
+        after
+          pop_clip()
+        end
+
+      error ->
+        error
+    end
+  end
+
+  @doc ~S"""
+  Returns the calling process's current clip as passed to the NIF, or `nil`
+  when it has none pushed. Only useful to code that calls the NIF directly.
+  """
+  @spec current_clip() :: tuple | nil
+  def current_clip do
+    case Process.get(@clip_key) do
+      [clip | _] -> clip
+      _ -> nil
+    end
+  end
+
+  @doc ~S"""
+  Reads back a cell, in screen coordinates (the clip does not apply).
+
+  Arguments:
+    - `x`, `y`: The cell.
+    - `buffer`: `:back` for the back buffer being drawn, or `:front` for what
+      the last present sent to the terminal, layers and canvases included. A
+      server name or PID, as earlier versions took here, reads the back buffer.
+
+  Returns `{:ok, {char, fg, bg}}`, or `{:error, {reason, code}}` (e.g.,
+  `:out_of_bounds`, or `:not_init` before `init/1`).
+  """
+  @spec get_cell(integer, integer, :back | :front | atom | pid) ::
+          {:ok, {non_neg_integer, non_neg_integer, non_neg_integer}} | {:error, any}
+  def get_cell(x, y, buffer \\ :back)
+
+  def get_cell(x, y, buffer) when is_integer(x) and is_integer(y) and buffer in [:back, :front] do
+    case :termbox2.tb_get_cell(x, y, if(buffer == :back, do: 1, else: 0)) do
+      {_ch, _fg, _bg} = cell -> {:ok, cell}
+      code -> p_nif_result(code)
+    end
+  end
+
+  def get_cell(x, y, server) when is_integer(x) and is_integer(y) and (is_atom(server) or is_pid(server)) do
+    get_cell(x, y, :back)
+  end
+
+  @doc ~S"""
+  Blends `rgba` over the `{x, y, w, h}` rectangle of the back buffer.
+
+  Every cell keeps its character and style and has its colors mixed toward
+  the `0xRRGGBBAA` color by its alpha, natively and a row at a time, which is
+  cheap enough to dim or tint the screen behind a modal every frame. Only
+  the 24-bit colors of `:truecolor` output can be blended (see
+  `set_output_mode/2`). The rectangle is clipped to the screen and follows
+  `push_clip/1`. Default colors blend as the colors set with
+  `set_blend_defaults/3`.
+
+  Arguments:
+    - `rect`: `{x, y, w, h}` in back buffer coordinates.
+    - `rgba`: Color and opacity; alpha `0` leaves the cells as they are and
+      `255` replaces their colors.
+    - `channels`: `:fg`, `:bg` or both (the default).
+
+  Returns `:ok`, or `{:error, {reason, code}}` if the output mode is not
+  `:truecolor` or termbox is not initialized.
+
+  ## Example
+
+      # Dim everything behind a dialog to 40%
+      :ok = ExTermbox.blend_rect({0, 0, w, h}, 0x00000099)
+  """
+  @spec blend_rect({integer, integer, integer, integer}, non_neg_integer, [:fg | :bg]) ::
+          :ok | {:error, any}
+  def blend_rect({x, y, w, h} = rect, rgba, channels \\ [:fg, :bg])
+      when is_integer(x) and is_integer(y) and is_integer(w) and is_integer(h) and
+             is_integer(rgba) and rgba in 0..0xFFFFFFFF and is_list(channels) do
+    flags =
+      Enum.reduce(channels, 0, fn channel, acc ->
+        Bitwise.bor(acc, Constants.blend_channel(channel))
+      end)
+
+    p_nif_result(:termbox2.tb_blend_rect(rect, rgba, flags, current_clip()))
+  end
+
   # Event polling functions (poll_event/peek_event) are removed as the
-  # GenServer handles event polling automatically and pushes events to the owner.
+  # ExTermbox.Input picks up events automatically and pushes them to the owner.
 
   @doc ~S"""
   Sets the output mode by sending a request to the `ExTermbox.Server`.
@@ -468,6 +1056,27 @@ defmodule ExTermbox do
     end
   end
 
+  @doc ~S"""
+  Sets the colors that default-colored cells blend as, by sending a request
+  to the `ExTermbox.Server`.
+
+  The terminal's own default colors are unknown to termbox, so
+  `blend_rect/3` and `ExTermbox.Surface.blend/6` treat a cell with the
+  default foreground or background as if it had these colors instead. They
+  start out as white (`0xFFFFFF`) on black (`0x000000`).
+
+  Arguments:
+    - `fg`, `bg`: `0xRRGGBB` colors.
+    - `server`: The registered name or PID of the server (defaults to `#{inspect(@server_name)}`).
+
+  Returns `:ok`, or `{:error, reason}` if the call fails.
+  """
+  @spec set_blend_defaults(non_neg_integer, non_neg_integer, atom | pid) :: :ok | {:error, any}
+  def set_blend_defaults(fg, bg, server \\ @server_name)
+      when is_integer(fg) and fg in 0..0xFFFFFF and is_integer(bg) and bg in 0..0xFFFFFF do
+    GenServer.call(server, {:set_blend_defaults, fg, bg})
+  end
+
   @doc """
   [Debug] Causes the C helper process to exit immediately.
   FOR TESTING ONLY.
@@ -0,0 +1,169 @@
+defmodule ExTermbox.Canvas do
+  @moduledoc """
+  Native cell areas much larger than the screen, shown through a viewport.
+
+  A canvas holds a document or map of up to 1048576 cells a side in native
+  memory, split into 64x16 tiles that are only allocated once something is
+  drawn in them, so blank areas cost nothing. Draw into it once with
+  `set_cells/2`, `print/6` and `fill/5`, then `show/2` it in a rectangle of
+  the screen: every present maps the viewport onto that rectangle. Scrolling
+  (`scroll_to/3`) moves the viewport without re-sending any cell from Elixir,
+  and when the rectangle spans the full width of the screen a vertical scroll
+  becomes a terminal scroll plus the rows that scrolled in.
+
+  Cells outside the canvas, or never drawn, are spaces in default colors. The
+  canvas is drawn over whatever is in its rectangle of the back buffer, under
+  any `ExTermbox.Layer`.
+
+  Canvases are garbage collected like surfaces; a shown canvas stays alive
+  until it is hidden or termbox shuts down. At most 8 are shown at once. With
+  a frame rate set (`ExTermbox.set_frame_rate/2`), drawing into a shown
+  canvas or scrolling it presents the next frame by itself.
+
+  ## Example
+
+      {:ok, doc} = ExTermbox.Canvas.new(200, 100_000)
+      lines |> Enum.with_index() |> Enum.each(fn {line, y} ->
+        ExTermbox.Canvas.print(doc, 0, y, fg, bg, line)
+      end)
+      :ok = ExTermbox.Canvas.show(doc, {0, 0, width, height})
+      # on every scroll
+      :ok = ExTermbox.Canvas.scroll_to(doc, 0, top_line)
+  """
+
+  alias ExTermbox.Constants
+
+  @max_size 1_048_576
+
+  @compile {:no_warn_undefined, [
+    {:termbox2, :tb_canvas_new, 2},
+    {:termbox2, :tb_canvas_info, 1},
+    {:termbox2, :tb_canvas_set_cells, 2},
+    {:termbox2, :tb_canvas_print, 6},
+    {:termbox2, :tb_canvas_fill, 5},
+    {:termbox2, :tb_canvas_show, 2},
+    {:termbox2, :tb_canvas_hide, 1},
+    {:termbox2, :tb_canvas_scroll_to, 3}
+  ]}
+
+  @type t :: reference()
+  @type rect :: {integer, integer, non_neg_integer, non_neg_integer}
+
+  @doc ~S"""
+  Creates a blank `w` x `h` canvas.
+
+  Arguments:
+    - `w`, `h`: Size in cells, from 1 to 1048576.
+
+  Returns `{:ok, canvas}`, or `{:error, {reason, code}}` if it cannot be allocated.
+  """
+  @spec new(pos_integer, pos_integer) :: {:ok, t} | {:error, any}
+  def new(w, h) when is_integer(w) and w in 1..@max_size and is_integer(h) and h in 1..@max_size do
+    case :termbox2.tb_canvas_new(w, h) do
+      code when is_integer(code) -> p_nif_result(code)
+      canvas -> {:ok, canvas}
+    end
+  end
+
+  @doc ~S"""
+  Returns the `{w, h}` size of `canvas`.
+  """
+  @spec size(t) :: {pos_integer, pos_integer}
+  def size(canvas) do
+    {w, h, _tiles} = :termbox2.tb_canvas_info(canvas)
+    {w, h}
+  end
+
+  @doc ~S"""
+  Returns the number of tiles of `canvas` that hold cells.
+  """
+  @spec tiles(t) :: non_neg_integer
+  def tiles(canvas) do
+    {_w, _h, tiles} = :termbox2.tb_canvas_info(canvas)
+    tiles
+  end
+
+  @doc ~S"""
+  Changes a batch of cells of `canvas`, given as `{x, y, char, fg, bg}`
+  tuples as for `ExTermbox.Surface.set_cells/2`.
+
+  Returns `:ok` if every cell was set, or `{:error, {reason, code}}` for the
+  first cell outside the canvas (the others are still drawn).
+  """
+  @spec set_cells(t, [{integer, integer, char, integer, integer}]) :: :ok | {:error, any}
+  def set_cells(canvas, cells) when is_list(cells) do
+    p_nif_result(:termbox2.tb_canvas_set_cells(canvas, cells))
+  end
+
+  @doc ~S"""
+  Prints `str` into `canvas` starting at `x`, `y`, laid out natively as
+  `ExTermbox.Surface.print/6` does.
+  """
+  @spec print(t, integer, integer, integer, integer, String.t()) :: :ok | {:error, any}
+  def print(canvas, x, y, fg, bg, str)
+      when is_integer(x) and is_integer(y) and is_integer(fg) and is_integer(bg) and is_binary(str) do
+    p_nif_result(:termbox2.tb_canvas_print(canvas, x, y, fg, bg, str))
+  end
+
+  @doc ~S"""
+  Sets every cell of the `{x, y, w, h}` rectangle of `canvas` to `char` in
+  `fg` and `bg`. The rectangle is clipped to the canvas; every tile it
+  touches is allocated.
+  """
+  @spec fill(t, rect, char, integer, integer) :: :ok | {:error, any}
+  def fill(canvas, {_x, _y, w, h} = rect, char, fg, bg)
+      when w in 0..@max_size and h in 0..@max_size and
+             is_integer(char) and is_integer(fg) and is_integer(bg) do
+    p_nif_result(:termbox2.tb_canvas_fill(canvas, rect, char, fg, bg))
+  end
+
+  @doc ~S"""
+  Shows `canvas` in the `{x, y, w, h}` rectangle of the screen, or moves it
+  there if it is already shown.
+
+  Returns `:ok`, or `{:error, {reason, code}}` if 8 canvases are already
+  shown or termbox is not initialized.
+  """
+  @spec show(t, rect) :: :ok | {:error, any}
+  def show(canvas, {x, y, w, h} = rect)
+      when is_integer(x) and is_integer(y) and w in 0..@max_size and h in 0..@max_size do
+    p_nif_result(:termbox2.tb_canvas_show(canvas, rect))
+  end
+
+  @doc ~S"""
+  Stops showing `canvas`. Whatever is drawn in its rectangle shows again from
+  the next present.
+  """
+  @spec hide(t) :: :ok | {:error, any}
+  def hide(canvas) do
+    p_nif_result(:termbox2.tb_canvas_hide(canvas))
+  end
+
+  @doc ~S"""
+  Moves the viewport of `canvas` so that its cell `vx`, `vy` is at the top
+  left of the rectangle it is shown in.
+
+  Arguments:
+    - `vx`, `vy`: Viewport offset; parts of the viewport past the edges of
+      the canvas are blank.
+  """
+  @spec scroll_to(t, integer, integer) :: :ok | {:error, any}
+  def scroll_to(canvas, vx, vy)
+      when is_integer(vx) and abs(vx) <= @max_size and is_integer(vy) and abs(vy) <= @max_size do
+    p_nif_result(:termbox2.tb_canvas_scroll_to(canvas, vx, vy))
+  end
+
+  # Maps a termbox return code to :ok or {:error, {reason, code}}
+  defp p_nif_result(code) do
+    if code == Constants.error_code(:ok) do
+      :ok
+    else
+      reason =
+        Enum.find_value(Constants.error_codes(), :unknown, fn {name, value} ->
+          if value == code, do: name
+        end)
+
+      {:error, {reason, code}}
+    end
+  end
+end
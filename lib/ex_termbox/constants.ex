@@ -42,6 +42,8 @@ defmodule ExTermbox.Constants do
     mouse_release: 0xFFFF - 26,
     mouse_wheel_up: 0xFFFF - 27,
     mouse_wheel_down: 0xFFFF - 28,
+    focus_in: 0xFFFF - 29,
+    focus_out: 0xFFFF - 30,
     ctrl_tilde: 0x00,
     ctrl_2: 0x00,
     ctrl_a: 0x01,
@@ -104,14 +106,14 @@ defmodule ExTermbox.Constants do
 
   @type attribute :: constant
   @attributes %{
-    bold: 0x0100,
-    underline: 0x0200,
-    reverse: 0x0400,
-    italic: 0x0800,
-    blink: 0x1000,
-    hi_black: 0x2000,
-    bright: 0x4000,
-    dim: 0x8000
+    bold: 0x01000000,
+    underline: 0x02000000,
+    reverse: 0x04000000,
+    italic: 0x08000000,
+    blink: 0x10000000,
+    hi_black: 0x20000000,
+    bright: 0x40000000,
+    dim: 0x80000000
   }
 
   @type modifier :: constant
@@ -127,7 +129,8 @@ defmodule ExTermbox.Constants do
   @event_types %{
     key: 1,
     resize: 2,
-    mouse: 3
+    mouse: 3,
+    focus: 4
   }
 
   @type error_code :: constant
@@ -154,7 +157,8 @@ defmodule ExTermbox.Constants do
     resize_poll: -19,
     resize_read: -20,
     resize_sscanf: -21,
-    cap_collision: -22
+    cap_collision: -22,
+    replay_format: -23
   }
 
   @type input_mode :: constant
@@ -163,6 +167,7 @@ defmodule ExTermbox.Constants do
     esc: 1,
     alt: 2,
     mouse: 4,
+    focus: 8,
     esc_with_mouse: 1 ||| 4,
     alt_with_mouse: 2 ||| 4
   }
@@ -177,6 +182,40 @@ defmodule ExTermbox.Constants do
     truecolor: 5
   }
 
+  @type present_policy :: constant
+  @present_policies %{
+    always: 0,
+    visible: 1
+  }
+
+  @type feature :: constant
+  @features %{
+    sync_output: 0x0001,
+    bracketed_paste: 0x0002,
+    kitty_keyboard: 0x0004,
+    truecolor: 0x0008,
+    rep: 0x0010
+  }
+
+  @type replay_speed :: constant
+  @replay_speeds %{
+    max: 0,
+    realtime: 100
+  }
+
+  @type event_overflow :: constant
+  @event_overflows %{
+    drop_oldest_motion: 0,
+    coalesce: 1,
+    block: 2
+  }
+
+  @type blend_channel :: constant
+  @blend_channels %{
+    fg: 1,
+    bg: 2
+  }
+
   @type hide_cursor :: constant
   @hide_cursor -1
 
@@ -227,7 +266,7 @@ defmodule ExTermbox.Constants do
   def color(name), do: Map.fetch!(@colors, name)
 
   @doc """
-  Retrieves the mapping of attribute constants (assuming 16-bit attributes).
+  Retrieves the mapping of attribute constants (the NIF uses 32-bit attributes).
   """
   @spec attributes() :: %{atom => attribute}
   def attributes, do: @attributes
@@ -238,11 +277,11 @@ defmodule ExTermbox.Constants do
   ## Examples
 
       iex> attribute(:bold)
-      0x0100
+      0x01000000
       iex> attribute(:underline)
-      0x0200
+      0x02000000
       iex> attribute(:italic)
-      0x0800
+      0x08000000
 
   """
   @spec attribute(atom) :: attribute
@@ -265,6 +304,8 @@ defmodule ExTermbox.Constants do
       0x02
       iex> event_type(:mouse)
       0x03
+      iex> event_type(:focus)
+      0x04
 
   """
   @spec event_type(atom) :: event_type
@@ -333,6 +374,8 @@ defmodule ExTermbox.Constants do
       4
       iex> input_mode(:alt_with_mouse)
       6
+      iex> input_mode(:focus)
+      8
 
   """
   @spec input_mode(atom) :: input_mode
@@ -360,6 +403,110 @@ defmodule ExTermbox.Constants do
   @spec output_mode(atom) :: output_mode
   def output_mode(name), do: Map.fetch!(@output_modes, name)
 
+  @doc """
+  Retrieves the mapping of present policy constants.
+  """
+  @spec present_policies() :: %{atom => present_policy}
+  def present_policies, do: @present_policies
+
+  @doc """
+  Retrieves a present policy constant by name
+
+  ## Examples
+
+      iex> present_policy(:always)
+      0
+      iex> present_policy(:visible)
+      1
+
+  """
+  @spec present_policy(atom) :: present_policy
+  def present_policy(name), do: Map.fetch!(@present_policies, name)
+
+  @doc """
+  Retrieves the mapping of terminal feature constants. These are bit flags, as
+  reported by `ExTermbox.terminal_features/1`.
+  """
+  @spec features() :: %{atom => feature}
+  def features, do: @features
+
+  @doc """
+  Retrieves a terminal feature constant by name
+
+  ## Examples
+
+      iex> feature(:sync_output)
+      1
+      iex> feature(:rep)
+      16
+
+  """
+  @spec feature(atom) :: feature
+  def feature(name), do: Map.fetch!(@features, name)
+
+  @doc """
+  Retrieves the mapping of input replay speed constants. Speeds are a
+  percentage of the recorded time, so any other positive integer works too.
+  """
+  @spec replay_speeds() :: %{atom => replay_speed}
+  def replay_speeds, do: @replay_speeds
+
+  @doc """
+  Retrieves an input replay speed constant by name
+
+  ## Examples
+
+      iex> replay_speed(:realtime)
+      100
+      iex> replay_speed(:max)
+      0
+
+  """
+  @spec replay_speed(atom) :: replay_speed
+  def replay_speed(name), do: Map.fetch!(@replay_speeds, name)
+
+  @doc """
+  Retrieves the mapping of event queue overflow policy constants.
+  """
+  @spec event_overflows() :: %{atom => event_overflow}
+  def event_overflows, do: @event_overflows
+
+  @doc """
+  Retrieves an event queue overflow policy constant by name
+
+  ## Examples
+
+      iex> event_overflow(:drop_oldest_motion)
+      0
+      iex> event_overflow(:coalesce)
+      1
+      iex> event_overflow(:block)
+      2
+
+  """
+  @spec event_overflow(atom) :: event_overflow
+  def event_overflow(name), do: Map.fetch!(@event_overflows, name)
+
+  @doc """
+  Retrieves the mapping of blend channel constants.
+  """
+  @spec blend_channels() :: %{atom => blend_channel}
+  def blend_channels, do: @blend_channels
+
+  @doc """
+  Retrieves a blend channel constant by name
+
+  ## Examples
+
+      iex> blend_channel(:fg)
+      1
+      iex> blend_channel(:bg)
+      2
+
+  """
+  @spec blend_channel(atom) :: blend_channel
+  def blend_channel(name), do: Map.fetch!(@blend_channels, name)
+
   @doc """
   Retrieves the hide cursor constant.
 
@@ -372,6 +519,29 @@ defmodule ExTermbox.Constants do
   @spec hide_cursor() :: hide_cursor
   def hide_cursor, do: @hide_cursor
 
+  @doc """
+  Looks up the name of a constant by its value in one of the mappings above
+  (e.g., `error_codes/0`).
+
+  Returns `:unknown` if no name maps to the value.
+
+  ## Examples
+
+      iex> map_integer_to_atom(-6, error_codes())
+      :no_event
+      iex> map_integer_to_atom(42, error_codes())
+      :unknown
+
+  """
+  @spec map_integer_to_atom(integer, %{atom => constant}) :: atom
+  def map_integer_to_atom(int_val, const_map) when is_integer(int_val) and is_map(const_map) do
+    Enum.find_value(const_map, :unknown, fn {key_atom, val} ->
+      if val == int_val, do: key_atom
+    end)
+  end
+
+  def map_integer_to_atom(_, _), do: :unknown
+
   @doc """
   Resolves a color atom (e.g., :red) or integer to its integer value.
   Returns the default color value if the input is invalid or not found.
@@ -2,9 +2,13 @@ defmodule ExTermbox.Event do
   @moduledoc """
   Represents an event received from the termbox library.
 
-  Events are polled by `ExTermbox.Server` and sent to the owner process.
+  Events are delivered to the owner process by `ExTermbox.Input`, and to
+  subscribers (see `ExTermbox.subscribe/2`) in raw form; `from_raw/1` turns
+  those into this struct.
   """
 
+  alias ExTermbox.Constants
+
   @typedoc """
   The event structure.
 
@@ -17,6 +21,11 @@ defmodule ExTermbox.Event do
   * `:h` - New height (for resize events). Integer or nil.
   * `:x` - Mouse x position (for mouse events). Integer or nil.
   * `:y` - Mouse y position (for mouse events). Integer or nil.
+  * `:timestamp` - Monotonic time, in nanoseconds, at which the input this
+    event was decoded from was read from the terminal (the first read, if the
+    sequence arrived in pieces). Only comparable with
+    other termbox timestamps such as `ExTermbox.last_present_timestamp/1`,
+    not with `System.monotonic_time/1`. Integer or nil.
   """
   @type t :: %__MODULE__{
     type: atom(), # :key | :resize | :mouse | etc.
@@ -26,7 +35,8 @@ defmodule ExTermbox.Event do
     w: integer() | nil,
     h: integer() | nil,
     x: integer() | nil,
-    y: integer() | nil
+    y: integer() | nil,
+    timestamp: non_neg_integer() | nil
   }
 
   @enforce_keys [:type]
@@ -38,9 +48,35 @@ defmodule ExTermbox.Event do
     w: nil,
     h: nil,
     x: nil,
-    y: nil
+    y: nil,
+    timestamp: nil
   ]
 
-  # We might add helper functions here later to interpret event data
-  # if the NIF returns raw integers/atoms that need mapping.
+  @doc """
+  Builds an event from the raw tuple the NIF sends, as in the
+  `{:termbox_raw_event, raw}` messages subscribers receive.
+
+  Returns `nil` for an event type this version does not know.
+  """
+  @spec from_raw(tuple()) :: t() | nil
+  def from_raw({type_int, mod_int, key_int, ch_int, w_int, h_int, x_int, y_int, ts}) do
+    case Constants.map_integer_to_atom(type_int, Constants.event_types()) do
+      :unknown ->
+        nil
+
+      type ->
+        # Termbox2 spec: `key` xor `ch` (one will be zero)
+        %__MODULE__{
+          type: type,
+          mod: Constants.map_integer_to_atom(mod_int, Constants.modifiers()),
+          key: if(key_int != 0, do: Constants.map_integer_to_atom(key_int, Constants.keys()), else: nil),
+          ch: if(key_int == 0 and ch_int != 0, do: ch_int, else: nil),
+          w: w_int,
+          h: h_int,
+          x: x_int,
+          y: y_int,
+          timestamp: ts
+        }
+    end
+  end
 end
@@ -0,0 +1,147 @@
+defmodule ExTermbox.Input do
+  @moduledoc """
+  GenServer delivering termbox events to the owner process.
+
+  Started and supervised by `ExTermbox.Server` once the terminal is
+  initialized. It has a mailbox of its own, so event delivery never waits
+  behind configuration calls or draws handled by the server, some of which
+  (e.g., `ExTermbox.set_output_backlog/2` on a slow terminal) can block on the
+  tty. The session and the event queue live in the NIF, so a restarted input
+  process picks up where the previous one left off.
+  """
+  use GenServer
+
+  require Logger
+
+  alias ExTermbox.Constants
+  alias ExTermbox.Event
+
+  @default_poll_interval_ms 10
+  @poll_error_interval_ms 50
+  @default_max_owner_queue 1000
+
+  @compile {:no_warn_undefined, [
+    {:termbox2, :tb_event_queue_fill, 0},
+    {:termbox2, :tb_event_queue_take, 1},
+    {:termbox2, :tb_event_notify, 1}
+  ]}
+
+  # --- Client API ---
+
+  def start_link(opts) do
+    GenServer.start_link(__MODULE__, opts)
+  end
+
+  # --- GenServer Callbacks ---
+
+  @impl true
+  def init(opts) do
+    ok_code = Constants.error_code(:ok)
+    # The native reactor tells us when input arrives; without it, poll
+    reactor = :termbox2.tb_event_notify(self()) == ok_code
+    # Deliver whatever arrived before the reactor was watching
+    send(self(), :poll_events)
+
+    {:ok,
+     %{
+       owner: Keyword.fetch!(opts, :owner),
+       poll_interval_ms: Keyword.get(opts, :poll_interval_ms, @default_poll_interval_ms),
+       max_owner_queue: Keyword.get(opts, :max_owner_queue, @default_max_owner_queue),
+       reactor: reactor,
+       poll_timer: nil
+     }}
+  end
+
+  @impl true
+  def handle_info(:poll_events, state) do
+    {:noreply, p_poll_events(%{state | poll_timer: nil})}
+  end
+
+  # Sent by the native reactor once events are queued, and not again until
+  # some have been taken
+  @impl true
+  def handle_info(:termbox_events, state) do
+    {:noreply, p_poll_events(state)}
+  end
+
+  @impl true
+  def handle_info(msg, state) do
+    Logger.warning("Received unexpected message in #{__MODULE__}: #{inspect(msg)}")
+    {:noreply, state}
+  end
+
+  # --- Private Helpers --- #
+
+  # Pull everything termbox has buffered into the bounded NIF queue, then
+  # hand the owner only as many events as its mailbox has room for. Events
+  # the owner has no room for stay in the NIF queue, where the configured
+  # overflow policy keeps them bounded.
+  defp p_poll_events(state) do
+    case :termbox2.tb_event_queue_fill() do
+      queued when is_integer(queued) and queued >= 0 ->
+        left = p_deliver_events(queued, state)
+        p_schedule_poll(state, left, state.poll_interval_ms)
+
+      error_code when is_integer(error_code) ->
+        error_atom = Constants.map_integer_to_atom(error_code, Constants.error_codes())
+        Logger.warning("Termbox event polling error: #{error_atom} (#{error_code})")
+        p_schedule_poll(state, :error, @poll_error_interval_ms)
+
+      other ->
+        Logger.warning("Unexpected return format from :termbox2.tb_event_queue_fill: #{inspect(other)}")
+        p_schedule_poll(state, :error, @poll_error_interval_ms)
+    end
+  end
+
+  # Without the reactor, poll on a timer. With it, only come back for events
+  # the owner had no room for (or after an error).
+  defp p_schedule_poll(%{reactor: true} = state, 0, _interval), do: state
+
+  defp p_schedule_poll(%{poll_timer: nil} = state, _left, interval) do
+    %{state | poll_timer: Process.send_after(self(), :poll_events, interval)}
+  end
+
+  defp p_schedule_poll(state, _left, _interval), do: state
+
+  # Helper to move queued events to the owner, bounded by its free credits.
+  # Returns the number of events left in the queue.
+  defp p_deliver_events(0, _state), do: 0
+
+  defp p_deliver_events(queued, state) do
+    case p_owner_credits(state) do
+      0 ->
+        queued
+
+      :dead ->
+        # Nobody will take these; drop them rather than retry forever
+        :termbox2.tb_event_queue_take(queued)
+        0
+
+      credits ->
+        events = :termbox2.tb_event_queue_take(credits)
+        Enum.each(events, &p_parse_and_send_event(&1, state))
+        queued - length(events)
+    end
+  end
+
+  # Number of events the owner can take before its mailbox reaches
+  # :max_owner_queue, or :dead once it has exited. Remote owners cannot be
+  # inspected and always get the full allowance.
+  defp p_owner_credits(%{owner: owner, max_owner_queue: max_owner_queue})
+       when node(owner) == node() do
+    case Process.info(owner, :message_queue_len) do
+      {:message_queue_len, len} -> max(max_owner_queue - len, 0)
+      nil -> :dead
+    end
+  end
+
+  defp p_owner_credits(%{max_owner_queue: max_owner_queue}), do: max_owner_queue
+
+  # Map the raw NIF event tuple to an Event struct and send it to the owner
+  defp p_parse_and_send_event(raw, state) do
+    case Event.from_raw(raw) do
+      nil -> Logger.warning("Received unknown event type integer from NIF: #{elem(raw, 0)}")
+      event -> send(state.owner, {:termbox_event, event})
+    end
+  end
+end
@@ -0,0 +1,102 @@
+defmodule ExTermbox.Layer do
+  @moduledoc """
+  Surfaces composited over the screen at present time.
+
+  A layer shows an `ExTermbox.Surface` at a position and z-order on top of
+  the back buffer without drawing into it: every present composites the
+  visible layers into the frame, bottom to top, and leaves the back buffer as
+  it was. Popups, tooltips and modals drawn as layers can therefore be shown,
+  hidden and moved without redrawing the widgets under them, and the present
+  that follows only writes the cells that changed.
+
+  Surface cells whose character is `0` are transparent: whatever is under
+  them shows through. Fill a surface with `0` first (see
+  `ExTermbox.Surface.fill/5`) to draw a shaped overlay.
+
+  Layers are global to the termbox session: any process may move, show,
+  hide or remove one by id. A layer keeps its surface alive until it is
+  removed, and all layers are removed when termbox shuts down. At most 32
+  layers exist at once. With a frame rate set (`ExTermbox.set_frame_rate/2`),
+  changing a layer, or drawing into a surface shown as one, presents the next
+  frame by itself.
+  """
+
+  alias ExTermbox.Constants
+
+  @compile {:no_warn_undefined, [
+    {:termbox2, :tb_layer_add, 4},
+    {:termbox2, :tb_layer_move, 4},
+    {:termbox2, :tb_layer_show, 2},
+    {:termbox2, :tb_layer_remove, 1}
+  ]}
+
+  @type id :: non_neg_integer
+
+  @doc ~S"""
+  Shows `surface` as a new layer with its top left corner at `x`, `y`.
+
+  Arguments:
+    - `surface`: An `ExTermbox.Surface`.
+    - `x`, `y`: Screen position; the layer is clipped to the screen.
+    - `z`: Z-order. Higher is drawn on top; layers with the same `z` are drawn
+      in the order they were added.
+
+  Returns `{:ok, id}`, or `{:error, {reason, code}}` if all layers are in use
+  or termbox is not initialized.
+  """
+  @spec add(ExTermbox.Surface.t(), integer, integer, integer) :: {:ok, id} | {:error, any}
+  def add(surface, x, y, z \\ 0) when is_integer(x) and is_integer(y) and is_integer(z) do
+    case :termbox2.tb_layer_add(surface, x, y, z) do
+      id when id >= 0 -> {:ok, id}
+      code -> p_nif_result(code)
+    end
+  end
+
+  @doc ~S"""
+  Moves layer `id` to `x`, `y` with z-order `z`.
+  """
+  @spec move(id, integer, integer, integer) :: :ok | {:error, any}
+  def move(id, x, y, z) when is_integer(id) and is_integer(x) and is_integer(y) and is_integer(z) do
+    p_nif_result(:termbox2.tb_layer_move(id, x, y, z))
+  end
+
+  @doc ~S"""
+  Shows layer `id` again after `hide/1`.
+  """
+  @spec show(id) :: :ok | {:error, any}
+  def show(id) when is_integer(id) do
+    p_nif_result(:termbox2.tb_layer_show(id, 1))
+  end
+
+  @doc ~S"""
+  Hides layer `id` without removing it. The next present brings back what
+  was under it.
+  """
+  @spec hide(id) :: :ok | {:error, any}
+  def hide(id) when is_integer(id) do
+    p_nif_result(:termbox2.tb_layer_show(id, 0))
+  end
+
+  @doc ~S"""
+  Removes layer `id`. Returns `{:error, {reason, code}}` if there is no such
+  layer.
+  """
+  @spec remove(id) :: :ok | {:error, any}
+  def remove(id) when is_integer(id) do
+    p_nif_result(:termbox2.tb_layer_remove(id))
+  end
+
+  # Maps a termbox return code to :ok or {:error, {reason, code}}
+  defp p_nif_result(code) do
+    if code == Constants.error_code(:ok) do
+      :ok
+    else
+      reason =
+        Enum.find_value(Constants.error_codes(), :unknown, fn {name, value} ->
+          if value == code, do: name
+        end)
+
+      {:error, {reason, code}}
+    end
+  end
+end
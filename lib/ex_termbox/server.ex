@@ -1,6 +1,10 @@
 defmodule ExTermbox.Server do
   @moduledoc """
-  GenServer managing the Termbox NIF lifecycle and event polling.
+  GenServer managing the Termbox NIF lifecycle and configuration.
+
+  Event delivery runs in a separate `ExTermbox.Input` process that this server
+  starts and restarts, so input latency does not depend on what this server
+  is doing. Both work on the one terminal session kept by the NIF.
   """
   use GenServer
 
@@ -9,10 +13,9 @@ defmodule ExTermbox.Server do
 
   # Import Constants for easier access
   alias ExTermbox.Constants
-  alias ExTermbox.Event # Add alias for the Event struct
 
-  @default_poll_interval_ms 10
-  @poll_error_interval_ms 50
+  @default_event_queue_size 1024
+  @default_overflow :coalesce
 
   defstruct owner: nil
 
@@ -21,12 +24,29 @@ defmodule ExTermbox.Server do
     {:termbox2, :tb_height, 0},
     {:termbox2, :tb_clear, 0},
     {:termbox2, :tb_present, 0},
+    {:termbox2, :tb_last_present_ts, 0},
+    {:termbox2, :tb_get_features, 0},
+    {:termbox2, :tb_get_term_version, 0},
     {:termbox2, :tb_set_cell, 5},
     {:termbox2, :tb_set_cursor, 2},
     {:termbox2, :tb_set_clear_attrs, 2},
+    {:termbox2, :tb_set_blend_defaults, 2},
     {:termbox2, :tb_set_input_mode, 1},
     {:termbox2, :tb_set_output_mode, 1},
-    {:termbox2, :tb_peek_event, 1},
+    {:termbox2, :tb_set_present_policy, 1},
+    {:termbox2, :tb_set_present_threads, 1},
+    {:termbox2, :tb_set_output_backlog, 1},
+    {:termbox2, :tb_set_frame_rate, 1},
+    {:termbox2, :tb_set_frames_in_flight, 1},
+    {:termbox2, :tb_event_queue_configure, 2},
+    {:termbox2, :tb_event_queue_stats, 0},
+    {:termbox2, :tb_event_subscribe, 5},
+    {:termbox2, :tb_event_unsubscribe, 1},
+    {:termbox2, :tb_set_input_replay, 2},
+    {:termbox2, :tb_input_replay_remaining, 0},
+    {:termbox2, :tb_set_input_record, 1},
+    {:termbox2, :tb_shm_open, 5},
+    {:termbox2, :tb_shm_close, 1},
     {:termbox2, :tb_shutdown, 0},
     {:termbox2, :tb_init, 0}
   ]}
@@ -47,8 +67,13 @@ defmodule ExTermbox.Server do
     # Ensure NIF is loaded at runtime, after all apps are started
     ExTermbox.NIFLoader.load_nif()
 
-    owner_pid = Keyword.fetch!(opts, :owner)
-    poll_interval_ms = Keyword.get(opts, :poll_interval_ms, @default_poll_interval_ms)
+    event_queue_size = Keyword.get(opts, :event_queue_size, @default_event_queue_size)
+    overflow = Constants.event_overflow(Keyword.get(opts, :overflow, @default_overflow))
+    present_policy = Constants.present_policy(Keyword.get(opts, :present_policy, :always))
+    present_threads = Keyword.get(opts, :present_threads, 1)
+    output_backlog = Keyword.get(opts, :output_backlog, 0)
+    frame_rate = Keyword.get(opts, :frame_rate, 0)
+    frames_in_flight = Keyword.get(opts, :frames_in_flight, 2)
 
     Logger.debug("Initializing Termbox via :termbox2.tb_init()...")
 
@@ -61,9 +86,32 @@ defmodule ExTermbox.Server do
       # Use the pre-fetched ok_code
       ^ok_code ->
         Logger.debug("Termbox initialized successfully.")
-        # Start the event polling loop
-        send(self(), :poll_events)
-        {:ok, %{owner: owner_pid, poll_interval_ms: poll_interval_ms}}
+
+        setup = [
+          event_queue_size: fn -> :termbox2.tb_event_queue_configure(event_queue_size, overflow) end,
+          present_policy: fn -> :termbox2.tb_set_present_policy(present_policy) end,
+          present_threads: fn -> :termbox2.tb_set_present_threads(present_threads) end,
+          output_backlog: fn -> :termbox2.tb_set_output_backlog(output_backlog) end,
+          frame_rate: fn -> :termbox2.tb_set_frame_rate(frame_rate) end,
+          frames_in_flight: fn -> :termbox2.tb_set_frames_in_flight(frames_in_flight) end
+        ]
+
+        case p_apply_setup(setup) do
+          :ok ->
+            p_start_record_and_replay(opts)
+            # Run terminate/2 (and tb_shutdown) when the caller exits, and
+            # restart the input process if it crashes
+            Process.flag(:trap_exit, true)
+            {:ok, input} = ExTermbox.Input.start_link(opts)
+
+            {:ok, %{input: input, input_opts: opts, subscribers: %{}}}
+
+          {:error, option, reason} ->
+            Logger.error("Failed to apply #{inspect(option)}: #{inspect(reason)}")
+            # init/1 failing skips terminate/2, so restore the terminal here
+            :termbox2.tb_shutdown()
+            {:stop, {:termbox_setup_failed, option, reason}}
+        end
 
       # Handle potential error tuples (NIF might return this?)
       {:error, reason} ->
@@ -87,50 +135,30 @@ defmodule ExTermbox.Server do
     end
   end
 
+  # The event queue survives in the NIF, so a new input process delivers
+  # whatever the old one had not
   @impl true
-  def handle_info(:poll_events, state) do
-    # Timeout value passed to tb_peek_event.
-    # We use a short timeout (0ms) because we rely on Process.send_after for polling interval.
-    peek_timeout_ms = 0
-    ok_code = Constants.error_code(:ok) # Typically 0
-    poll_interval_ms = Map.get(state, :poll_interval_ms, @default_poll_interval_ms)
-
-    # Determine the reschedule interval based on the poll result
-    reschedule_interval = 
-      case :termbox2.tb_peek_event(peek_timeout_ms) do
-        # --- Normal Event --- #
-        {:ok, {type_int, mod_int, key_int, ch_int, w_int, h_int, x_int, y_int}} ->
-          p_parse_and_send_event({type_int, mod_int, key_int, ch_int, w_int, h_int, x_int, y_int}, state)
-          poll_interval_ms # Return normal interval
+  def handle_info({:EXIT, input, reason}, %{input: input} = state) do
+    Logger.warning("#{ExTermbox.Input} exited: #{inspect(reason)}. Restarting.")
+    {:ok, input} = ExTermbox.Input.start_link(state.input_opts)
+    {:noreply, %{state | input: input}}
+  end
 
-        # --- Timeout (No Event) --- #
-        ^ok_code ->
-           :ok # Side effect: none
-           poll_interval_ms # Return normal interval
-
-        # --- Specific Unexpected Format from NIF --- #
-        {-6, 0, 0, 0} ->
-          Logger.warning("Termbox event polling received specific error tuple {-6, 0, 0, 0}. Possible TB_ERR_POLL?")
-          @poll_error_interval_ms # Return error interval
-
-        # --- General Error --- #
-        error_code when is_integer(error_code) and error_code < 0 ->
-          error_atom =
-            Constants.error_codes()
-            |> Enum.find_value(:unknown_error_code, fn {k, v} -> if v == error_code, do: k end)
-
-          Logger.warning("Termbox event polling error: #{error_atom} (#{error_code})")
-          @poll_error_interval_ms # Return error interval
-
-        # --- Other Unexpected --- #
-        other ->
-          Logger.warning("Unexpected return format from :termbox2.tb_peek_event: #{inspect(other)}")
-          @poll_error_interval_ms # Return error interval
-      end
+  @impl true
+  def handle_info({:DOWN, monitor, :process, pid, _reason}, state) do
+    case Map.pop(state.subscribers, pid) do
+      {^monitor, subscribers} ->
+        :termbox2.tb_event_unsubscribe(pid)
+        {:noreply, %{state | subscribers: subscribers}}
+
+      _ ->
+        {:noreply, state}
+    end
+  end
 
-    # Schedule the next poll using the determined interval
-    Process.send_after(self(), :poll_events, reschedule_interval)
-    {:noreply, state}
+  @impl true
+  def handle_info({:EXIT, _pid, reason}, state) do
+    {:stop, reason, state}
   end
 
   # Catch-all for other info messages
@@ -149,7 +177,7 @@ defmodule ExTermbox.Server do
     case :termbox2.tb_present() do
       ^ok_code -> {:reply, :ok, state}
       error_code ->
-        error_atom = map_integer_to_atom(error_code, Constants.error_codes())
+        error_atom = Constants.map_integer_to_atom(error_code, Constants.error_codes())
         {:reply, {:error, {error_atom, error_code}}, state}
     end
   end
@@ -161,7 +189,7 @@ defmodule ExTermbox.Server do
     case :termbox2.tb_clear() do
       ^ok_code -> {:reply, :ok, state}
       error_code ->
-        error_atom = map_integer_to_atom(error_code, Constants.error_codes())
+        error_atom = Constants.map_integer_to_atom(error_code, Constants.error_codes())
         {:reply, {:error, {error_atom, error_code}}, state}
     end
   end
@@ -172,7 +200,7 @@ defmodule ExTermbox.Server do
     case :termbox2.tb_width() do
        width when is_integer(width) and width >= 0 -> {:reply, {:ok, width}, state}
        error_code ->
-         error_atom = map_integer_to_atom(error_code, Constants.error_codes())
+         error_atom = Constants.map_integer_to_atom(error_code, Constants.error_codes())
          {:reply, {:error, {error_atom, error_code}}, state}
     end
   end
@@ -183,7 +211,7 @@ defmodule ExTermbox.Server do
     case :termbox2.tb_height() do
        height when is_integer(height) and height >= 0 -> {:reply, {:ok, height}, state}
        error_code ->
-         error_atom = map_integer_to_atom(error_code, Constants.error_codes())
+         error_atom = Constants.map_integer_to_atom(error_code, Constants.error_codes())
          {:reply, {:error, {error_atom, error_code}}, state}
     end
   end
@@ -194,7 +222,7 @@ defmodule ExTermbox.Server do
        # NIF returns input mode on success, or error code
        mode when is_integer(mode) and mode >= 0 -> {:reply, :ok, state} # Assume :ok if return >= 0
        error_code ->
-         error_atom = map_integer_to_atom(error_code, Constants.error_codes())
+         error_atom = Constants.map_integer_to_atom(error_code, Constants.error_codes())
          {:reply, {:error, {error_atom, error_code}}, state}
     end
   end
@@ -205,28 +233,176 @@ defmodule ExTermbox.Server do
       # NIF returns output mode on success, or error code
        mode when is_integer(mode) and mode >= 0 -> {:reply, :ok, state} # Assume :ok if return >= 0
        error_code ->
-         error_atom = map_integer_to_atom(error_code, Constants.error_codes())
+         error_atom = Constants.map_integer_to_atom(error_code, Constants.error_codes())
          {:reply, {:error, {error_atom, error_code}}, state}
     end
   end
 
+  @impl true
+  def handle_call({:set_present_policy, policy_int}, _from, state) do
+    ok_code = Constants.error_code(:ok)
+    case :termbox2.tb_set_present_policy(policy_int) do
+      ^ok_code -> {:reply, :ok, state}
+      error_code ->
+        error_atom = Constants.map_integer_to_atom(error_code, Constants.error_codes())
+        {:reply, {:error, {error_atom, error_code}}, state}
+    end
+  end
+
+  @impl true
+  def handle_call({:set_present_threads, n}, _from, state) do
+    ok_code = Constants.error_code(:ok)
+    case :termbox2.tb_set_present_threads(n) do
+      ^ok_code -> {:reply, :ok, state}
+      error_code ->
+        error_atom = Constants.map_integer_to_atom(error_code, Constants.error_codes())
+        {:reply, {:error, {error_atom, error_code}}, state}
+    end
+  end
+
+  @impl true
+  def handle_call({:set_output_backlog, max}, _from, state) do
+    ok_code = Constants.error_code(:ok)
+    case :termbox2.tb_set_output_backlog(max) do
+      ^ok_code -> {:reply, :ok, state}
+      error_code ->
+        error_atom = Constants.map_integer_to_atom(error_code, Constants.error_codes())
+        {:reply, {:error, {error_atom, error_code}}, state}
+    end
+  end
+
+  @impl true
+  def handle_call({:set_frame_rate, fps}, _from, state) do
+    ok_code = Constants.error_code(:ok)
+    case :termbox2.tb_set_frame_rate(fps) do
+      ^ok_code -> {:reply, :ok, state}
+      error_code ->
+        error_atom = Constants.map_integer_to_atom(error_code, Constants.error_codes())
+        {:reply, {:error, {error_atom, error_code}}, state}
+    end
+  end
+
   @impl true
   def handle_call({:set_clear_attributes, fg_int, bg_int}, _from, state) do
     ok_code = Constants.error_code(:ok)
     case :termbox2.tb_set_clear_attrs(fg_int, bg_int) do
       ^ok_code -> {:reply, :ok, state}
       error_code ->
-        error_atom = map_integer_to_atom(error_code, Constants.error_codes())
+        error_atom = Constants.map_integer_to_atom(error_code, Constants.error_codes())
+        {:reply, {:error, {error_atom, error_code}}, state}
+    end
+  end
+
+  @impl true
+  def handle_call({:set_blend_defaults, fg, bg}, _from, state) do
+    ok_code = Constants.error_code(:ok)
+    case :termbox2.tb_set_blend_defaults(fg, bg) do
+      ^ok_code -> {:reply, :ok, state}
+      error_code ->
+        error_atom = Constants.map_integer_to_atom(error_code, Constants.error_codes())
+        {:reply, {:error, {error_atom, error_code}}, state}
+    end
+  end
+
+  @impl true
+  def handle_call(:last_present_timestamp, _from, state) do
+    {:reply, {:ok, :termbox2.tb_last_present_ts()}, state}
+  end
+
+  @impl true
+  def handle_call({:set_input_replay, path, speed}, _from, state) do
+    ok_code = Constants.error_code(:ok)
+    case :termbox2.tb_set_input_replay(path, p_replay_speed(speed)) do
+      ^ok_code -> {:reply, :ok, state}
+      error_code ->
+        error_atom = Constants.map_integer_to_atom(error_code, Constants.error_codes())
+        {:reply, {:error, {error_atom, error_code}}, state}
+    end
+  end
+
+  @impl true
+  def handle_call({:set_input_record, path}, _from, state) do
+    ok_code = Constants.error_code(:ok)
+    case :termbox2.tb_set_input_record(path) do
+      ^ok_code -> {:reply, :ok, state}
+      error_code ->
+        error_atom = Constants.map_integer_to_atom(error_code, Constants.error_codes())
+        {:reply, {:error, {error_atom, error_code}}, state}
+    end
+  end
+
+  @impl true
+  def handle_call({:shm_open, name, x, y, w, h}, _from, state) do
+    case :termbox2.tb_shm_open(name, x, y, w, h) do
+      id when id >= 0 -> {:reply, {:ok, id}, state}
+      error_code ->
+        error_atom = Constants.map_integer_to_atom(error_code, Constants.error_codes())
+        {:reply, {:error, {error_atom, error_code}}, state}
+    end
+  end
+
+  @impl true
+  def handle_call({:shm_close, id}, _from, state) do
+    ok_code = Constants.error_code(:ok)
+    case :termbox2.tb_shm_close(id) do
+      ^ok_code -> {:reply, :ok, state}
+      error_code ->
+        error_atom = Constants.map_integer_to_atom(error_code, Constants.error_codes())
         {:reply, {:error, {error_atom, error_code}}, state}
     end
   end
 
   @impl true
-  def handle_call({:get_cell, x, y}, _from, state) when is_integer(x) and is_integer(y) do
-    # The tb_get_cell function is not currently implemented in the termbox2_nif library
-    # Return an appropriate error instead of trying to call the missing function
-    Logger.warning("get_cell(#{x}, #{y}) was called, but :termbox2_nif.tb_get_cell/2 is not implemented")
-    {:reply, {:error, {:not_implemented, "tb_get_cell/2 is not available in the current termbox2_nif version"}}, state}
+  def handle_call(:input_replay_remaining, _from, state) do
+    case :termbox2.tb_input_replay_remaining() do
+      -1 -> {:reply, {:ok, nil}, state}
+      remaining -> {:reply, {:ok, remaining}, state}
+    end
+  end
+
+  @impl true
+  def handle_call(:event_stats, _from, state) do
+    {queued, dropped, coalesced} = :termbox2.tb_event_queue_stats()
+    {:reply, {:ok, %{queued: queued, dropped: dropped, coalesced: coalesced}}, state}
+  end
+
+  # Subscribers are monitored so the NIF stops sending to them once they exit
+  @impl true
+  def handle_call({:subscribe, pid, types, region, keys, chars}, _from, state) do
+    ok_code = Constants.error_code(:ok)
+    case :termbox2.tb_event_subscribe(pid, types, region, keys, chars) do
+      ^ok_code ->
+        subscribers = Map.put_new_lazy(state.subscribers, pid, fn -> Process.monitor(pid) end)
+        {:reply, :ok, %{state | subscribers: subscribers}}
+
+      error_code ->
+        error_atom = Constants.map_integer_to_atom(error_code, Constants.error_codes())
+        {:reply, {:error, {error_atom, error_code}}, state}
+    end
+  end
+
+  @impl true
+  def handle_call({:unsubscribe, pid}, _from, state) do
+    :termbox2.tb_event_unsubscribe(pid)
+    {monitor, subscribers} = Map.pop(state.subscribers, pid)
+    if monitor, do: Process.demonitor(monitor, [:flush])
+    {:reply, :ok, %{state | subscribers: subscribers}}
+  end
+
+  @impl true
+  def handle_call(:terminal_features, _from, state) do
+    case :termbox2.tb_get_features() do
+      bits when bits >= 0 ->
+        features =
+          for {name, bit} <- Constants.features(), Bitwise.band(bits, bit) != 0, do: name
+
+        version = :termbox2.tb_get_term_version()
+        {:reply, {:ok, %{features: Enum.sort(features), version: version}}, state}
+
+      error_code ->
+        error_atom = Constants.map_integer_to_atom(error_code, Constants.error_codes())
+        {:reply, {:error, {error_atom, error_code}}, state}
+    end
   end
 
   # Catch-all for unhandled calls
@@ -259,51 +435,60 @@ defmodule ExTermbox.Server do
   end
 
   @impl true
-  def terminate(reason, _state) do
+  def terminate(reason, state) do
     Logger.debug("Terminating Termbox Server. Reason: #{inspect(reason)}. Shutting down NIF.")
+    p_stop_input(Map.get(state, :input))
     :termbox2.tb_shutdown()
     :ok
   end
 
   # --- Private Helpers --- #
 
-  # Helper to parse the raw NIF event tuple and send it to the owner
-  defp p_parse_and_send_event({type_int, mod_int, key_int, ch_int, w_int, h_int, x_int, y_int}, state) do
-    # Map integers to atoms using Constants
-    event_type_atom = map_integer_to_atom(type_int, Constants.event_types())
-    event_mod_atom = map_integer_to_atom(mod_int, Constants.modifiers())
-    event_key_atom = map_integer_to_atom(key_int, Constants.keys())
-
-    # Handle cases where mapping fails (shouldn't happen with valid NIF data)
-    if event_type_atom == :unknown do
-      Logger.warning("Received unknown event type integer from NIF: #{type_int}")
-    else
-      # Construct the event struct with mapped atoms
-      # For key events, decide if `key` or `ch` is primary.
-      # Termbox2 spec: `key` xor `ch` (one will be zero)
-      event_struct = %Event{
-        type: event_type_atom,
-        mod: event_mod_atom,
-        # Prefer the mapped key atom if key_int is non-zero, otherwise use ch_int
-        key: if(key_int != 0, do: event_key_atom, else: nil),
-        ch: if(key_int == 0 and ch_int != 0, do: ch_int, else: nil),
-        # Other fields are direct integers
-        w: w_int,
-        h: h_int,
-        x: x_int,
-        y: y_int
-      }
-      # Send the mapped event to the owner
-      send(state.owner, {:termbox_event, event_struct})
-    end
+  # Stops the input process before the session goes away under it
+  defp p_stop_input(nil), do: :ok
+
+  defp p_stop_input(input) do
+    GenServer.stop(input, :shutdown)
+  catch
+    :exit, _ -> :ok
   end
 
-  # Helper to map integer constants to atoms using a provided map.
-  # Returns the atom key if found, otherwise :unknown.
-  defp map_integer_to_atom(int_val, const_map) when is_integer(int_val) and is_map(const_map) do
-    Enum.find_value(const_map, :unknown, fn {key_atom, val} ->
-      if val == int_val, do: key_atom
+  # Starts recording and/or replaying input when asked to at init.
+  # Runs each setup call in order, stopping at the first that fails
+  defp p_apply_setup(setup) do
+    ok_code = Constants.error_code(:ok)
+
+    Enum.reduce_while(setup, :ok, fn {option, call}, :ok ->
+      case call.() do
+        ^ok_code ->
+          {:cont, :ok}
+
+        code ->
+          {:halt, {:error, option, {Constants.map_integer_to_atom(code, Constants.error_codes()), code}}}
+      end
     end)
   end
-  defp map_integer_to_atom(_, _), do: :unknown # Handle invalid input
+
+  defp p_start_record_and_replay(opts) do
+    if path = Keyword.get(opts, :record_input) do
+      p_log_init_error(:record_input, :termbox2.tb_set_input_record(path))
+    end
+
+    if path = Keyword.get(opts, :replay_input) do
+      speed = p_replay_speed(Keyword.get(opts, :replay_speed, :realtime))
+      p_log_init_error(:replay_input, :termbox2.tb_set_input_replay(path, speed))
+    end
+
+    :ok
+  end
+
+  defp p_replay_speed(percent) when is_integer(percent) and percent >= 0, do: percent
+  defp p_replay_speed(name) when is_atom(name), do: Constants.replay_speed(name)
+
+  defp p_log_init_error(option, code) do
+    if code != Constants.error_code(:ok) do
+      error_atom = Constants.map_integer_to_atom(code, Constants.error_codes())
+      Logger.error("Failed to apply #{inspect(option)}: #{error_atom} (#{code})")
+    end
+  end
 end 
\ No newline at end of file
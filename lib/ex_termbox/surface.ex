@@ -0,0 +1,176 @@
+defmodule ExTermbox.Surface do
+  @moduledoc """
+  Offscreen cell buffers that are drawn once and copied onto the screen.
+
+  A surface is a native cell buffer of any size, independent of the terminal.
+  Draw into it with `set_cells/2`, `print/6` and `fill/5`, then copy it into
+  the back buffer with `blit/4` whenever it should be on screen. Widgets that
+  rarely change but are shown every frame (side panels, help overlays) then
+  cost one native copy per frame instead of re-sending every cell.
+
+  Surfaces are garbage collected: one is freed once no process references it.
+  Like the other drawing functions, these call the NIF from the calling
+  process and do not go through `ExTermbox.Server`. Surfaces can be drawn
+  before `ExTermbox.init/1`; only `blit/4` needs the terminal.
+
+  ## Example
+
+      {:ok, help} = ExTermbox.Surface.new(30, 10)
+      :ok = ExTermbox.Surface.fill(help, {0, 0, 30, 10}, ?\\s, fg, bg)
+      :ok = ExTermbox.Surface.print(help, 1, 1, fg, bg, "q: quit")
+      # every frame
+      :ok = ExTermbox.Surface.blit(help, {0, 0, 30, 10}, 50, 2)
+  """
+
+  alias ExTermbox.Constants
+
+  @max_size 4096
+
+  @compile {:no_warn_undefined, [
+    {:termbox2, :tb_surface_new, 2},
+    {:termbox2, :tb_surface_size, 1},
+    {:termbox2, :tb_surface_set_cells, 2},
+    {:termbox2, :tb_surface_print, 6},
+    {:termbox2, :tb_surface_fill, 5},
+    {:termbox2, :tb_blit, 5},
+    {:termbox2, :tb_surface_blend, 6},
+    {:termbox2, :tb_blend_blit, 6}
+  ]}
+
+  @type t :: reference()
+  @type rect :: {integer, integer, non_neg_integer, non_neg_integer}
+
+  @doc ~S"""
+  Creates a `w` x `h` surface filled with spaces in default colors.
+
+  Arguments:
+    - `w`, `h`: Size in cells, from 1 to 4096.
+
+  Returns `{:ok, surface}`, or `{:error, {reason, code}}` if it cannot be allocated.
+  """
+  @spec new(pos_integer, pos_integer) :: {:ok, t} | {:error, any}
+  def new(w, h) when is_integer(w) and w in 1..@max_size and is_integer(h) and h in 1..@max_size do
+    case :termbox2.tb_surface_new(w, h) do
+      code when is_integer(code) -> p_nif_result(code)
+      surface -> {:ok, surface}
+    end
+  end
+
+  @doc ~S"""
+  Returns the `{w, h}` size of `surface`.
+  """
+  @spec size(t) :: {pos_integer, pos_integer}
+  def size(surface) do
+    :termbox2.tb_surface_size(surface)
+  end
+
+  @doc ~S"""
+  Changes a batch of cells of `surface`.
+
+  Each cell is a `{x, y, char, fg, bg}` tuple as for `ExTermbox.set_cells/2`,
+  with `char` a codepoint.
+
+  Returns `:ok` if every cell was set, or `{:error, {reason, code}}` for the
+  first cell outside the surface (the others are still drawn).
+  """
+  @spec set_cells(t, [{integer, integer, char, integer, integer}]) :: :ok | {:error, any}
+  def set_cells(surface, cells) when is_list(cells) do
+    p_nif_result(:termbox2.tb_surface_set_cells(surface, cells))
+  end
+
+  @doc ~S"""
+  Prints `str` into `surface` starting at `x`, `y`.
+
+  Unlike `ExTermbox.print/6`, the string is laid out natively: wide characters
+  take two cells and combining marks join the previous cell.
+
+  Returns `:ok`, or `{:error, {reason, code}}` if the string runs past the
+  edge of the surface (the part inside it is drawn).
+  """
+  @spec print(t, integer, integer, integer, integer, String.t()) :: :ok | {:error, any}
+  def print(surface, x, y, fg, bg, str)
+      when is_integer(x) and is_integer(y) and is_integer(fg) and is_integer(bg) and is_binary(str) do
+    p_nif_result(:termbox2.tb_surface_print(surface, x, y, fg, bg, str))
+  end
+
+  @doc ~S"""
+  Sets every cell of the `{x, y, w, h}` rectangle of `surface` to `char` in
+  `fg` and `bg`. The rectangle is clipped to the surface.
+  """
+  @spec fill(t, rect, char, integer, integer) :: :ok | {:error, any}
+  def fill(surface, {_x, _y, _w, _h} = rect, char, fg, bg)
+      when is_integer(char) and is_integer(fg) and is_integer(bg) do
+    p_nif_result(:termbox2.tb_surface_fill(surface, rect, char, fg, bg))
+  end
+
+  @doc ~S"""
+  Copies the `{x, y, w, h}` rectangle of `surface` into the back buffer with
+  its top left corner at `dst_x`, `dst_y`.
+
+  Both sides are clipped: whatever falls outside the surface, the screen or
+  the calling process's clip (`ExTermbox.push_clip/1`, which `dst_x` and
+  `dst_y` are relative to) is skipped. Like any drawing, the copy shows after
+  the next present.
+
+  Returns `:ok`, or `{:error, {reason, code}}` (e.g., `:not_init` before
+  `ExTermbox.init/1`).
+  """
+  @spec blit(t, rect, integer, integer) :: :ok | {:error, any}
+  def blit(surface, {_x, _y, _w, _h} = src_rect, dst_x, dst_y)
+      when is_integer(dst_x) and is_integer(dst_y) do
+    p_nif_result(:termbox2.tb_blit(surface, src_rect, dst_x, dst_y, ExTermbox.current_clip()))
+  end
+
+  @doc ~S"""
+  Composites the `{x, y, w, h}` rectangle of `src` over `dst` at `dst_x`,
+  `dst_y` with opacity `alpha`, natively.
+
+  Cells of `src` whose character is `0` are transparent. Elsewhere the
+  background of `dst` is mixed toward that of `src`; a space in `src` keeps
+  the character under it and tints its foreground the same way (frosted
+  glass), and any other character replaces it, fading in from the background
+  under it. Default colors blend as the colors set with
+  `ExTermbox.set_blend_defaults/3`. Both sides are clipped as for `blit/4`.
+
+  Arguments:
+    - `alpha`: Opacity of `src`, from `0` (invisible) to `255` (opaque).
+
+  Returns `:ok`, or `{:error, {reason, code}}` if `dst` and `src` are the
+  same surface.
+  """
+  @spec blend(t, t, rect, integer, integer, 0..255) :: :ok | {:error, any}
+  def blend(dst, src, {_x, _y, _w, _h} = src_rect, dst_x, dst_y, alpha)
+      when is_integer(dst_x) and is_integer(dst_y) and is_integer(alpha) and alpha in 0..255 do
+    p_nif_result(:termbox2.tb_surface_blend(dst, src, src_rect, dst_x, dst_y, alpha))
+  end
+
+  @doc ~S"""
+  Like `blend/6`, but composites `surface` over the back buffer, where
+  `blit/4` would copy it. Needs `:truecolor` output
+  (`ExTermbox.set_output_mode/2`) and follows `ExTermbox.push_clip/1`.
+
+  Returns `:ok`, or `{:error, {reason, code}}` (e.g., `:not_init` before
+  `ExTermbox.init/1`, or any other output mode).
+  """
+  @spec blend_blit(t, rect, integer, integer, 0..255) :: :ok | {:error, any}
+  def blend_blit(surface, {_x, _y, _w, _h} = src_rect, dst_x, dst_y, alpha)
+      when is_integer(dst_x) and is_integer(dst_y) and is_integer(alpha) and alpha in 0..255 do
+    p_nif_result(
+      :termbox2.tb_blend_blit(surface, src_rect, dst_x, dst_y, alpha, ExTermbox.current_clip())
+    )
+  end
+
+  # Maps a termbox return code to :ok or {:error, {reason, code}}
+  defp p_nif_result(code) do
+    if code == Constants.error_code(:ok) do
+      :ok
+    else
+      reason =
+        Enum.find_value(Constants.error_codes(), :unknown, fn {name, value} ->
+          if value == code, do: name
+        end)
+
+      {:error, {reason, code}}
+    end
+  end
+end
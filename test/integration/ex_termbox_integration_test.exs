@@ -6,6 +6,11 @@ defmodule ExTermbox.IntegrationTest do
   # or run via `mix test --include integration`
   @moduletag :integration
 
+  alias ExTermbox.Constants
+  alias ExTermbox.Event
+
+  @compile {:no_warn_undefined, [{:termbox2, :tb_peek_event, 1}]}
+
   setup do
     # Ensure the test process is the owner and receives events
     opts = [owner: self()]
@@ -38,22 +43,17 @@ defmodule ExTermbox.IntegrationTest do
     assert ExTermbox.present() == :ok
   end
 
-  # Test is modified to expect NIF failure until tb_get_cell is implemented
-  # @tag :skip
-  test "get_cell returns not_implemented error" do
-    # We don't need to print anything, just call get_cell on a valid coord
-    x_pos = 0
-    y_pos = 0
-
-    # Attempt to get the cell content
-    result = ExTermbox.get_cell(x_pos, y_pos)
-
-    # Assert that the function returns the appropriate not_implemented error
-    assert match?({:error, {:not_implemented, _}}, result)
-
-    # If the test reaches here, it means get_cell returned the expected error pattern.
-    # Once the NIF is implemented, this test *should* fail, and a proper 
-    # test for get_cell functionality should be implemented.
+  test "reads back cells from the back and front buffers" do
+    fg = Constants.color(:white)
+    bg = Constants.color(:default)
+    assert ExTermbox.change_cell(3, 1, ?x, fg, bg) == :ok
+    assert {:ok, {?x, ^fg, ^bg}} = ExTermbox.get_cell(3, 1)
+    # Not on the terminal until presented
+    assert {:ok, {front, _, _}} = ExTermbox.get_cell(3, 1, :front)
+    assert front != ?x
+    assert ExTermbox.present() == :ok
+    assert {:ok, {?x, ^fg, ^bg}} = ExTermbox.get_cell(3, 1, :front)
+    assert {:error, {:out_of_bounds, _}} = ExTermbox.get_cell(-1, 0)
   end
 
   test "gets width and height" do
@@ -74,6 +74,52 @@ defmodule ExTermbox.IntegrationTest do
     end
   end
 
+  test "draws from many processes concurrently" do
+    fg = Constants.color(:white)
+    bg = Constants.color(:default)
+
+    1..32
+    |> Enum.map(fn i ->
+      Task.async(fn ->
+        for frame <- 1..10 do
+          assert ExTermbox.set_cells([{i, 0, ?a + rem(frame, 26), fg, bg}, {i, 1, ?x, fg, bg}]) == :ok
+          assert ExTermbox.print(0, 2 + rem(i, 4), fg, bg, "widget #{i}") == :ok
+        end
+      end)
+    end)
+    |> Task.await_many()
+
+    assert ExTermbox.present() == :ok
+    # Every batch landed; the last frame each process drew is the one left
+    for i <- 1..32, do: assert({:ok, {?x, ^fg, ^bg}} = ExTermbox.get_cell(i, 1))
+    assert ExTermbox.set_cells([{0, 0, "€", fg, bg}]) == :ok
+    assert ExTermbox.set_cells([{0, 0, "ab", fg, bg}]) == {:error, :invalid_char}
+    assert {:error, {:out_of_bounds, _}} = ExTermbox.change_cell(-1, -1, ?a, fg, bg)
+  end
+
+  test "never tears a cell written by two processes at once" do
+    {:ok, w} = ExTermbox.width()
+    bg = Constants.color(:default)
+
+    # Each process fills the same rows with its own character and color, and
+    # a row of its own
+    1..8
+    |> Enum.map(fn i ->
+      Task.async(fn ->
+        shared = for y <- 0..3, x <- 0..(w - 1), do: {x, y, ?a + i, i, bg}
+        own = for x <- 0..(w - 1), do: {x, 4 + i, ?a + i, i, bg}
+        for _ <- 1..20, do: assert(ExTermbox.set_cells(shared ++ own) == :ok)
+      end)
+    end)
+    |> Task.await_many()
+
+    for y <- Enum.concat(0..3, 5..12), x <- 0..(w - 1) do
+      assert {:ok, {ch, fg, ^bg}} = ExTermbox.get_cell(x, y)
+      assert ch == ?a + fg
+      if y > 4, do: assert(fg == y - 4)
+    end
+  end
+
   test "sets cursor position" do
     # API uses default server name
     assert ExTermbox.set_cursor(5, 10) == :ok
@@ -108,6 +154,433 @@ defmodule ExTermbox.IntegrationTest do
     assert ExTermbox.present() == :ok
   end
 
+  test "sets present threads" do
+    assert ExTermbox.set_present_threads(4) == :ok
+    assert ExTermbox.print(0, 0, Constants.color(:white), Constants.color(:default), "parallel") == :ok
+    assert ExTermbox.present() == :ok
+    assert {:error, {:error, _}} = ExTermbox.set_present_threads(0)
+    assert ExTermbox.set_present_threads(1) == :ok
+  end
+
+  test "sets output backlog" do
+    assert ExTermbox.set_output_backlog(65_536) == :ok
+    assert ExTermbox.print(0, 0, Constants.color(:white), Constants.color(:default), "backlog") == :ok
+    assert ExTermbox.present() == :ok
+    assert {:error, {:error, _}} = ExTermbox.set_output_backlog(-2)
+    assert ExTermbox.set_output_backlog(0) == :ok
+  end
+
+  test "drains the output backlog and presents the frames it skipped" do
+    {:ok, w} = ExTermbox.width()
+    {:ok, h} = ExTermbox.height()
+    # Any full frame exceeds a 1-byte backlog, so the frames after one the
+    # terminal has not taken yet are skipped
+    assert ExTermbox.set_output_backlog(1) == :ok
+
+    for ch <- ?a..?z do
+      for y <- 0..(h - 1) do
+        ExTermbox.print(0, y, Constants.color(:white), Constants.color(:default), String.duplicate(<<ch>>, w))
+      end
+
+      assert ExTermbox.present() == :ok
+    end
+
+    # The writer thread presents the last one once the backlog drains
+    assert wait_for_front(w - 1, h - 1, ?z) == ?z
+    assert {:ok, {?z, _, _}} = ExTermbox.get_cell(0, 0, :front)
+
+    # An acknowledged frame went through the backlog in full
+    assert ExTermbox.print(0, 0, Constants.color(:white), Constants.color(:default), "drained") == :ok
+    ref = ExTermbox.present_async()
+    assert_receive {:presented, ^ref, %{bytes: bytes}}, 1000
+    assert bytes >= byte_size("drained")
+    assert ExTermbox.set_output_backlog(0) == :ok
+  end
+
+  test "restarts the input process" do
+    %{input: input} = :sys.get_state(ExTermbox.Server)
+    Process.exit(input, :kill)
+    Process.sleep(50)
+    %{input: restarted} = :sys.get_state(ExTermbox.Server)
+    assert restarted != input
+    assert Process.alive?(restarted)
+    assert {:ok, %{queued: _}} = ExTermbox.event_stats()
+  end
+
+  test "delivers input as it arrives instead of on a poll timer" do
+    # A poll would not come round again within the test
+    restart(poll_interval_ms: 60_000)
+    %{input: input} = :sys.get_state(ExTermbox.Server)
+    assert %{reactor: true, poll_timer: nil} = :sys.get_state(input)
+
+    replay([key(?k)])
+    assert_receive {:termbox_event, %Event{type: :key, ch: ?k}}, 500
+    # Everything was delivered, so nothing is left to poll for
+    assert %{poll_timer: nil} = :sys.get_state(input)
+  end
+
+  test "drops events once the owner has exited" do
+    owner = spawn(fn -> :ok end)
+    monitor = Process.monitor(owner)
+    assert_receive {:DOWN, ^monitor, :process, ^owner, _}
+    restart(owner: owner, max_owner_queue: 1)
+
+    replay(Enum.map(~c"abc", &key/1))
+    Process.sleep(200)
+    # Nothing is kept for it or retried on a timer
+    assert {:ok, %{queued: 0}} = ExTermbox.event_stats()
+    %{input: input} = :sys.get_state(ExTermbox.Server)
+    assert %{poll_timer: nil} = :sys.get_state(input)
+  end
+
+  test "subscribes to filtered events" do
+    assert ExTermbox.subscribe(types: [:key, :mouse], region: {0, 0, 10, 5}, keys: [:enter, ?q]) == :ok
+    assert {:error, {:error, _}} = ExTermbox.subscribe(keys: List.duplicate(?a, 33))
+    assert ExTermbox.unsubscribe() == :ok
+  end
+
+  test "presents asynchronously" do
+    assert ExTermbox.print(0, 0, Constants.color(:white), Constants.color(:default), "async") == :ok
+    first = ExTermbox.present_async()
+    second = ExTermbox.present_async()
+    assert is_reference(first) and is_reference(second)
+    assert_receive {:presented, ^first, %{bytes: bytes, latency_us: _, coalesced: _}}, 1000
+    assert bytes > 0
+    assert_receive {:presented, ^second, %{}}, 1000
+    assert {:ok, {?a, _, _}} = ExTermbox.get_cell(0, 0, :front)
+  end
+
+  test "defers presents while unfocused and flushes them on focus" do
+    assert ExTermbox.set_present_policy(:visible) == :ok
+    replay([focus(:out)])
+    assert [%Event{type: :focus, key: :focus_out}] = receive_events()
+
+    assert ExTermbox.print(0, 0, Constants.color(:white), Constants.color(:default), "hidden") == :ok
+    assert ExTermbox.present() == :ok
+    assert {:ok, {front, _, _}} = ExTermbox.get_cell(0, 0, :front)
+    assert front != ?h
+
+    # Regaining focus writes the skipped frame without another present
+    replay([focus(:in)])
+    assert [%Event{type: :focus, key: :focus_in}] = receive_events()
+    assert {:ok, {?h, _, _}} = ExTermbox.get_cell(0, 0, :front)
+  end
+
+  test "coalesces async presents made while the terminal is hidden" do
+    assert ExTermbox.set_present_policy(:visible) == :ok
+    replay([focus(:out)])
+    assert [%Event{type: :focus, key: :focus_out}] = receive_events()
+
+    assert ExTermbox.print(0, 0, Constants.color(:white), Constants.color(:default), "async") == :ok
+    refs = for _ <- 1..3, do: ExTermbox.present_async()
+    refute_receive {:presented, _, _}, 100
+    assert {:ok, {front, _, _}} = ExTermbox.get_cell(0, 0, :front)
+    assert front != ?a
+
+    # All three requests share the one frame presented once focus returns
+    replay([focus(:in)])
+
+    for ref <- refs do
+      assert_receive {:presented, ^ref, %{coalesced: 2}}, 1000
+    end
+
+    assert {:ok, {?a, _, _}} = ExTermbox.get_cell(0, 0, :front)
+  end
+
+  test "presents from the frame clock" do
+    fg = Constants.color(:white)
+    bg = Constants.color(:default)
+    {:ok, before} = ExTermbox.last_present_timestamp()
+    assert ExTermbox.set_frame_rate(10) == :ok
+    # Whatever was drawn before the clock started is presented first
+    first = wait_for_present(before)
+    assert first > before
+
+    # Nothing drawn, nothing presented
+    Process.sleep(250)
+    assert ExTermbox.last_present_timestamp() == {:ok, first}
+
+    assert ExTermbox.print(0, 0, fg, bg, "1") == :ok
+    one = wait_for_present(first)
+    assert ExTermbox.print(0, 0, fg, bg, "2") == :ok
+    two = wait_for_present(one)
+    # 10 frames per second apart, less the time the first one took
+    assert two - one >= 80_000_000
+    assert {:ok, {?2, _, _}} = ExTermbox.get_cell(0, 0, :front)
+
+    assert {:error, {:error, _}} = ExTermbox.set_frame_rate(1001)
+    assert ExTermbox.set_frame_rate(0) == :ok
+    assert ExTermbox.print(0, 0, fg, bg, "3") == :ok
+    Process.sleep(250)
+    assert ExTermbox.last_present_timestamp() == {:ok, two}
+    assert {:ok, {?2, _, _}} = ExTermbox.get_cell(0, 0, :front)
+  end
+
+  test "opens and closes a shared buffer" do
+    name = "/ex_termbox_test_#{System.unique_integer([:positive])}"
+    assert {:ok, id} = ExTermbox.open_shared_buffer(name, {0, 0, 10, 2})
+    # The name is taken while the buffer is open
+    assert {:error, {:error, _}} = ExTermbox.open_shared_buffer(name, {0, 0, 10, 2})
+    assert ExTermbox.present() == :ok
+    assert ExTermbox.close_shared_buffer(id) == :ok
+    assert {:error, {:error, _}} = ExTermbox.close_shared_buffer(id)
+    assert ExTermbox.open_shared_buffer("no_slash", {0, 0, 1, 1}) == {:error, :invalid_name}
+  end
+
+  @tag skip: unless(File.dir?("/dev/shm"), do: "needs POSIX shared memory under /dev/shm")
+  test "ignores a producer that rewrites the shared buffer header" do
+    name = "/ex_termbox_test_#{System.unique_integer([:positive])}"
+    assert {:ok, id} = ExTermbox.open_shared_buffer(name, {2, 1, 10, 2})
+    {:ok, shm} = :file.open("/dev/shm" <> name, [:read, :write, :binary, :raw])
+
+    # 40-byte header, one dirty word, then 12-byte cells; (1, 1) lands on (3, 2)
+    :ok = :file.pwrite(shm, 48 + (1 * 10 + 1) * 12, <<?Z::native-32, 0::native-32, 0::native-32>>)
+    # A bogus width, height and cells_offset, and every dirty bit set
+    :ok = :file.pwrite(shm, 8, <<0xFFFFFFFF::native-32, 0xFFFFFFFF::native-32>>)
+    :ok = :file.pwrite(shm, 20, <<0x7FFFFFF0::native-32>>)
+    :ok = :file.pwrite(shm, 40, <<0xFFFFFFFFFFFFFFFF::native-64>>)
+    :ok = :file.close(shm)
+
+    assert ExTermbox.present() == :ok
+    assert {:ok, {?Z, _, _}} = ExTermbox.get_cell(3, 2)
+    assert ExTermbox.close_shared_buffer(id) == :ok
+  end
+
+  test "draws a surface and blits it" do
+    fg = Constants.color(:white)
+    bg = Constants.color(:blue)
+    assert {:ok, surface} = ExTermbox.Surface.new(12, 3)
+    assert ExTermbox.Surface.size(surface) == {12, 3}
+    assert ExTermbox.Surface.fill(surface, {0, 0, 12, 3}, ?\s, fg, bg) == :ok
+    assert ExTermbox.Surface.print(surface, 1, 1, fg, bg, "help") == :ok
+    assert ExTermbox.Surface.set_cells(surface, [{0, 0, ?+, fg, bg}]) == :ok
+    assert {:error, {:out_of_bounds, _}} = ExTermbox.Surface.set_cells(surface, [{12, 0, ?+, fg, bg}])
+    # Clipped against the left edge of the screen
+    assert ExTermbox.Surface.blit(surface, {0, 0, 12, 3}, -2, 0) == :ok
+    assert {:ok, {?\s, ^fg, ^bg}} = ExTermbox.get_cell(0, 0)
+    assert {:ok, {?e, ^fg, ^bg}} = ExTermbox.get_cell(0, 1)
+    assert {:ok, {?p, ^fg, ^bg}} = ExTermbox.get_cell(2, 1)
+    assert {:ok, {?\s, ^fg, ^bg}} = ExTermbox.get_cell(9, 2)
+    assert {:ok, {?\s, _, 0}} = ExTermbox.get_cell(10, 0)
+
+    # Clipped against the caller's clip, relative to its origin
+    assert ExTermbox.with_clip({4, 3, 3, 2}, fn ->
+             ExTermbox.Surface.blit(surface, {0, 0, 12, 3}, -1, -1)
+           end) == :ok
+
+    assert {:ok, {?h, ^fg, ^bg}} = ExTermbox.get_cell(4, 3)
+    assert {:ok, {?l, ^fg, ^bg}} = ExTermbox.get_cell(6, 3)
+    assert {:ok, {?\s, ^fg, ^bg}} = ExTermbox.get_cell(6, 4)
+    assert {:ok, {?\s, _, 0}} = ExTermbox.get_cell(7, 3)
+    assert {:ok, {?\s, _, 0}} = ExTermbox.get_cell(4, 5)
+
+    assert ExTermbox.present() == :ok
+    assert {:ok, {?h, ^fg, ^bg}} = ExTermbox.get_cell(4, 3, :front)
+  end
+
+  test "composites layers" do
+    fg = Constants.color(:white)
+    bg = Constants.color(:red)
+    assert ExTermbox.print(0, 0, fg, Constants.color(:default), "underneath") == :ok
+    assert {:ok, popup} = ExTermbox.Surface.new(6, 2)
+    # Transparent except for the text
+    assert ExTermbox.Surface.fill(popup, {0, 0, 6, 2}, 0, 0, 0) == :ok
+    assert ExTermbox.Surface.print(popup, 0, 0, fg, bg, "popup") == :ok
+    assert {:ok, id} = ExTermbox.Layer.add(popup, 2, 0, 1)
+    assert ExTermbox.present() == :ok
+    assert front_row(0, 10) == "unpopupath"
+    assert {:ok, {?p, ^fg, ^bg}} = ExTermbox.get_cell(2, 0, :front)
+    # Composited into the frame only; the back buffer is left as drawn
+    assert {:ok, {?d, _, _}} = ExTermbox.get_cell(2, 0)
+
+    # Added under the popup, then raised over it
+    assert {:ok, marks} = ExTermbox.Surface.new(2, 1)
+    assert ExTermbox.Surface.fill(marks, {0, 0, 2, 1}, ?#, fg, Constants.color(:blue)) == :ok
+    assert {:ok, marks_id} = ExTermbox.Layer.add(marks, 3, 0, 0)
+    assert ExTermbox.present() == :ok
+    assert front_row(0, 10) == "unpopupath"
+    assert ExTermbox.Layer.move(marks_id, 3, 0, 2) == :ok
+    assert ExTermbox.present() == :ok
+    assert front_row(0, 10) == "unp##upath"
+
+    assert ExTermbox.Layer.move(id, 0, 1, 1) == :ok
+    assert ExTermbox.present() == :ok
+    assert front_row(0, 10) == "und##neath"
+    assert front_row(1, 6) == "popup "
+
+    assert ExTermbox.Layer.hide(id) == :ok
+    assert ExTermbox.present() == :ok
+    assert front_row(1, 6) == "      "
+    assert ExTermbox.Layer.show(id) == :ok
+    assert ExTermbox.present() == :ok
+    assert front_row(1, 6) == "popup "
+
+    assert ExTermbox.Layer.remove(id) == :ok
+    assert ExTermbox.Layer.remove(marks_id) == :ok
+    assert {:error, {:error, _}} = ExTermbox.Layer.remove(id)
+    assert ExTermbox.present() == :ok
+    assert front_row(0, 10) == "underneath"
+    assert front_row(1, 6) == "      "
+  end
+
+  test "clips and translates drawing" do
+    fg = Constants.color(:white)
+    bg = Constants.color(:default)
+    assert ExTermbox.clear() == :ok
+    assert ExTermbox.push_clip({2, 1, 4, 2}) == :ok
+    # Local coordinates, cut at the widget's right edge
+    assert ExTermbox.change_cell(0, 0, ?a, fg, bg) == :ok
+    assert {:error, {:out_of_bounds, _}} = ExTermbox.change_cell(4, 0, ?b, fg, bg)
+    assert {:error, {:out_of_bounds, _}} = ExTermbox.set_cells([{0, 2, ?c, fg, bg}])
+
+    assert ExTermbox.with_clip({1, 1, 10, 10}, fn ->
+             ExTermbox.change_cell(2, 0, ?d, fg, bg)
+           end) == :ok
+
+    assert {:error, {:out_of_bounds, _}} =
+             ExTermbox.with_clip({1, 1, 10, 10}, fn ->
+               ExTermbox.change_cell(3, 0, ?e, fg, bg)
+             end)
+
+    assert ExTermbox.pop_clip() == :ok
+    assert {:error, {:error, _}} = ExTermbox.pop_clip()
+    assert ExTermbox.current_clip() == nil
+    assert ExTermbox.change_cell(10, 0, ?f, fg, bg) == :ok
+
+    assert {:ok, {?a, _, _}} = ExTermbox.get_cell(2, 1)
+    assert {:ok, {?d, _, _}} = ExTermbox.get_cell(5, 2)
+    assert {:ok, {?\s, _, _}} = ExTermbox.get_cell(6, 1)
+    assert {:ok, {?f, _, _}} = ExTermbox.get_cell(10, 0)
+    assert ExTermbox.present() == :ok
+  end
+
+  test "keeps each process's clip to itself" do
+    fg = Constants.color(:white)
+    bg = Constants.color(:default)
+    assert ExTermbox.clear() == :ok
+
+    # Both draw the same local cells at the same time, each in its own clip
+    draw = fn rect, char ->
+      Task.async(fn ->
+        ExTermbox.with_clip(rect, fn ->
+          for _ <- 1..200, y <- 0..2, x <- 0..5 do
+            ExTermbox.change_cell(x, y, char, fg, bg)
+          end
+
+          ExTermbox.current_clip()
+        end)
+      end)
+    end
+
+    a = draw.({0, 0, 3, 2}, ?a)
+    b = draw.({5, 1, 4, 1}, ?b)
+    assert {_, _, _, _, 0, 0} = Task.await(a)
+    assert {_, _, _, _, 5, 1} = Task.await(b)
+    assert ExTermbox.current_clip() == nil
+
+    expected = fn x, y ->
+      cond do
+        x < 3 and y < 2 -> ?a
+        x in 5..8 and y == 1 -> ?b
+        true -> ?\s
+      end
+    end
+
+    for y <- 0..3, x <- 0..10 do
+      want = expected.(x, y)
+      assert {:ok, {^want, _, _}} = ExTermbox.get_cell(x, y)
+    end
+  end
+
+  test "scrolls a canvas" do
+    fg = Constants.color(:white)
+    bg = Constants.color(:default)
+    assert {:ok, doc} = ExTermbox.Canvas.new(200, 100_000)
+    assert ExTermbox.Canvas.tiles(doc) == 0
+    assert ExTermbox.Canvas.print(doc, 0, 0, fg, bg, "first") == :ok
+    assert ExTermbox.Canvas.print(doc, 0, 99_999, fg, bg, "last") == :ok
+    # Only the two tiles drawn in exist
+    assert ExTermbox.Canvas.tiles(doc) == 2
+    assert ExTermbox.Canvas.size(doc) == {200, 100_000}
+    assert {:error, {:out_of_bounds, _}} = ExTermbox.Canvas.print(doc, 0, 100_000, fg, bg, "x")
+    assert ExTermbox.Canvas.show(doc, {0, 0, 20, 5}) == :ok
+    assert ExTermbox.present() == :ok
+    assert ExTermbox.Canvas.scroll_to(doc, 0, 2) == :ok
+    assert ExTermbox.present() == :ok
+    assert ExTermbox.Canvas.scroll_to(doc, 0, 99_998) == :ok
+    assert ExTermbox.present() == :ok
+    # Eight canvases can be shown at once; one more is refused
+    others = for _ <- 1..7, do: elem(ExTermbox.Canvas.new(10, 10), 1)
+    assert Enum.all?(others, &(ExTermbox.Canvas.show(&1, {0, 6, 10, 1}) == :ok))
+    assert {:ok, extra} = ExTermbox.Canvas.new(10, 10)
+    assert {:error, {:error, _}} = ExTermbox.Canvas.show(extra, {0, 6, 10, 1})
+    assert Enum.all?(others, &(ExTermbox.Canvas.hide(&1) == :ok))
+    assert ExTermbox.Canvas.show(extra, {0, 6, 10, 1}) == :ok
+    assert ExTermbox.Canvas.hide(extra) == :ok
+    assert ExTermbox.Canvas.hide(doc) == :ok
+    assert {:error, {:error, _}} = ExTermbox.Canvas.hide(doc)
+    assert ExTermbox.present() == :ok
+  end
+
+  test "blends truecolor overlays" do
+    assert {:error, {:error, _}} = ExTermbox.blend_rect({0, 0, 10, 5}, 0x00000080)
+    assert ExTermbox.set_output_mode(:truecolor) == :ok
+    assert ExTermbox.set_blend_defaults(0xC0C0C0, 0x101010) == :ok
+    assert ExTermbox.print(0, 0, 0xFFFFFF, 0x000000, "behind") == :ok
+    # Dim the screen, then tint only the foreground
+    assert ExTermbox.blend_rect({0, 0, 10, 5}, 0x00000099) == :ok
+    assert ExTermbox.blend_rect({0, 0, 10, 1}, 0xFF000040, [:fg]) == :ok
+
+    assert {:ok, glass} = ExTermbox.Surface.new(6, 2)
+    assert {:ok, label} = ExTermbox.Surface.new(6, 2)
+    assert ExTermbox.Surface.fill(glass, {0, 0, 6, 2}, ?\s, 0xFFFFFF, 0x2040A0) == :ok
+    assert ExTermbox.Surface.print(label, 1, 0, 0xFFFFFF, 0x2040A0, "ok") == :ok
+    assert ExTermbox.Surface.blend(glass, label, {0, 0, 6, 2}, 0, 0, 255) == :ok
+    assert {:error, {:error, _}} = ExTermbox.Surface.blend(glass, glass, {0, 0, 6, 2}, 0, 0, 255)
+    assert ExTermbox.Surface.blend_blit(glass, {0, 0, 6, 2}, 2, 1, 160) == :ok
+    assert ExTermbox.present() == :ok
+    assert ExTermbox.set_output_mode(:normal) == :ok
+  end
+
+  test "reads back blended colors" do
+    assert ExTermbox.set_output_mode(:truecolor) == :ok
+    assert ExTermbox.print(0, 0, 0xFFFFFF, 0x204060, "abcd") == :ok
+    assert ExTermbox.change_cell(4, 0, ?e, Constants.color(:default), Constants.color(:default)) == :ok
+
+    # Alpha 0 changes nothing, not even default colors; 255 replaces the
+    # colors; 0x80 weighs the overlay 129/256
+    assert ExTermbox.blend_rect({0, 0, 1, 1}, 0x80C0FF00) == :ok
+    assert ExTermbox.blend_rect({1, 0, 1, 1}, 0x80C0FFFF) == :ok
+    assert ExTermbox.blend_rect({2, 0, 1, 1}, 0x80C0FF80) == :ok
+    assert ExTermbox.blend_rect({3, 0, 1, 1}, 0x80C0FF80, [:bg]) == :ok
+    assert ExTermbox.blend_rect({4, 0, 1, 1}, 0x80C0FF00) == :ok
+
+    assert ExTermbox.get_cell(0, 0) == {:ok, {?a, 0xFFFFFF, 0x204060}}
+    assert ExTermbox.get_cell(1, 0) == {:ok, {?b, 0x80C0FF, 0x80C0FF}}
+    assert ExTermbox.get_cell(2, 0) == {:ok, {?c, 0xBFDFFF, 0x5080B0}}
+    assert ExTermbox.get_cell(3, 0) == {:ok, {?d, 0xFFFFFF, 0x5080B0}}
+    assert ExTermbox.get_cell(4, 0) == {:ok, {?e, 0, 0}}
+
+    # A character fades in from the background under it; a space tints
+    assert {:ok, dst} = ExTermbox.Surface.new(4, 1)
+    assert {:ok, char} = ExTermbox.Surface.new(1, 1)
+    assert {:ok, glass} = ExTermbox.Surface.new(1, 1)
+    assert ExTermbox.Surface.fill(dst, {0, 0, 4, 1}, ?x, 0xFFFFFF, 0x0000FF) == :ok
+    assert ExTermbox.Surface.fill(char, {0, 0, 1, 1}, ?y, 0x00FF00, 0xFF0000) == :ok
+    assert ExTermbox.Surface.fill(glass, {0, 0, 1, 1}, ?\s, 0xFFFFFF, 0xFF0000) == :ok
+    assert ExTermbox.Surface.blend(dst, char, {0, 0, 1, 1}, 0, 0, 0) == :ok
+    assert ExTermbox.Surface.blend(dst, char, {0, 0, 1, 1}, 1, 0, 255) == :ok
+    assert ExTermbox.Surface.blend(dst, char, {0, 0, 1, 1}, 2, 0, 128) == :ok
+    assert ExTermbox.Surface.blend(dst, glass, {0, 0, 1, 1}, 3, 0, 128) == :ok
+    assert ExTermbox.Surface.blit(dst, {0, 0, 4, 1}, 0, 1) == :ok
+
+    assert ExTermbox.get_cell(0, 1) == {:ok, {?x, 0xFFFFFF, 0x0000FF}}
+    assert ExTermbox.get_cell(1, 1) == {:ok, {?y, 0x00FF00, 0xFF0000}}
+    assert ExTermbox.get_cell(2, 1) == {:ok, {?y, 0x00807E, 0x80007E}}
+    assert ExTermbox.get_cell(3, 1) == {:ok, {?x, 0xFF7E7E, 0x80007E}}
+    assert ExTermbox.set_output_mode(:normal) == :ok
+  end
+
   test "sets clear attributes" do
     # Use atoms for colors
     fg = :yellow
@@ -129,6 +602,200 @@ defmodule ExTermbox.IntegrationTest do
     assert ExTermbox.present() == :ok
   end
 
+  test "evicts the oldest motion event when the queue overflows" do
+    cast = [key(?a), motion(1), key(?b), motion(2), key(?c), key(?d)]
+
+    restart_with_replay(cast,
+      event_queue_size: 4,
+      overflow: :drop_oldest_motion,
+      max_owner_queue: 1
+    )
+
+    # The replay lands all at once: c and d each evict the oldest motion
+    assert Enum.map(receive_events(), &{&1.type, &1.ch}) ==
+             [{:key, ?a}, {:key, ?b}, {:key, ?c}, {:key, ?d}]
+
+    assert ExTermbox.event_stats() == {:ok, %{queued: 0, dropped: 2, coalesced: 0}}
+  end
+
+  test "evicts the oldest event when the queue overflows without motion" do
+    restart_with_replay(Enum.map(~c"abcdef", &key/1),
+      event_queue_size: 4,
+      overflow: :drop_oldest_motion,
+      max_owner_queue: 1
+    )
+
+    assert Enum.map(receive_events(), & &1.ch) == ~c"cdef"
+    assert ExTermbox.event_stats() == {:ok, %{queued: 0, dropped: 2, coalesced: 0}}
+  end
+
+  test "coalesces repeated resize and motion events" do
+    cast = [resize(30, 7), resize(31, 8), resize(32, 9), key(?a), motion(1), motion(2), motion(3)]
+
+    restart_with_replay(cast,
+      event_queue_size: 4,
+      overflow: :coalesce,
+      max_owner_queue: 1
+    )
+
+    assert [
+             %Event{type: :resize, w: 32, h: 9},
+             %Event{type: :key, ch: ?a},
+             %Event{type: :mouse, x: 3}
+           ] = receive_events()
+
+    assert ExTermbox.event_stats() == {:ok, %{queued: 0, dropped: 0, coalesced: 4}}
+  end
+
+  test "blocks instead of dropping when the queue is full" do
+    restart_with_replay(Enum.map(~c"abcdef", &key/1),
+      event_queue_size: 2,
+      overflow: :block,
+      max_owner_queue: 1
+    )
+
+    assert Enum.map(receive_events(), & &1.ch) == ~c"abcdef"
+    assert ExTermbox.event_stats() == {:ok, %{queued: 0, dropped: 0, coalesced: 0}}
+  end
+
+  test "replays an asciicast v3 recording from init" do
+    restart(replay_input: fixture("input_v3.cast"), replay_speed: :max)
+    assert_replayed_fixture()
+  end
+
+  test "replays an asciicast v2 recording started mid-session" do
+    # Nothing is typed, so only the replay can wake the input reactor
+    assert ExTermbox.replay_input(fixture("input_v2.cast"), :max) == :ok
+    assert_replayed_fixture()
+  end
+
+  test "stamps an escape sequence split across reads with its first read" do
+    # v2 times are absolute: the arrow key arrives in two reads 300 ms apart
+    cast = [~s([0.0, "i", "\\u001b["]), ~s([0.3, "i", "Ab"])]
+    restart_with_replay(cast, replay_speed: :realtime)
+
+    assert [%Event{key: :arrow_up, timestamp: up}, %Event{ch: ?b, timestamp: b}] =
+             receive_events()
+
+    assert b - up >= 250_000_000
+  end
+
+  test "stamps a present behind the output backlog once it drains" do
+    assert ExTermbox.set_output_backlog(65_536) == :ok
+    {:ok, before} = ExTermbox.last_present_timestamp()
+    assert ExTermbox.print(0, 0, Constants.color(:white), Constants.color(:default), "drained") == :ok
+    assert ExTermbox.present() == :ok
+    assert wait_for_present(before) > before
+  end
+
+  test "rebuilds a corrupt terminfo cache" do
+    %{cache: cache} = use_tmp_caches()
+    restart([])
+    path = cache_file(cache, "tbcaps01")
+    good = File.read!(path)
+
+    # Cut off mid-header, then the right magic over inconsistent sizes
+    garbage = "tbcaps01" <> :binary.copy(<<0xFF>>, byte_size(good) - 8)
+
+    for corrupt <- [binary_part(good, 0, 40), garbage] do
+      File.write!(path, corrupt)
+      restart([])
+      assert File.read!(path) == good
+    end
+
+    assert ExTermbox.print(0, 0, Constants.color(:white), Constants.color(:default), "caps") == :ok
+    assert ExTermbox.present() == :ok
+  end
+
+  test "rebuilds a terminfo cache once the terminfo file changes" do
+    %{cache: cache, terminfo: terminfo} = use_tmp_caches()
+    restart([])
+    path = cache_file(cache, "tbcaps01")
+    old = File.read!(path)
+
+    File.touch!(terminfo, System.os_time(:second) - 3600)
+    restart([])
+    assert File.read!(path) != old
+  end
+
+  test "uses built-in caps for a known terminal without reading terminfo" do
+    dir = Path.join(System.tmp_dir!(), "ex_termbox_#{System.unique_integer([:positive])}")
+    on_exit(fn -> File.rm_rf(dir) end)
+    cache = Path.join([dir, "cache", "termbox2"])
+    put_test_env("XDG_CACHE_HOME", Path.join(dir, "cache"))
+    put_test_env("TERMINFO", nil)
+
+    # An exact built-in match never gets as far as terminfo or its cache
+    put_test_env("TERM", "xterm-256color")
+    restart([])
+    assert cache_file(cache, "tbcaps01") == nil
+    assert ExTermbox.print(0, 0, Constants.color(:white), Constants.color(:default), "built-in") == :ok
+    assert ExTermbox.present() == :ok
+
+    # Any other terminal is parsed from terminfo and cached
+    put_test_env("TERM", "xterm-color")
+    restart([])
+    assert cache_file(cache, "tbcaps01")
+  end
+
+  test "takes terminal features from probe replies and caches them" do
+    %{cache: cache} = use_tmp_caches()
+
+    replies = [
+      # DECRPM: synchronized output reset (supported), bracketed paste
+      # permanently reset (not supported)
+      "\\u001b[?2026;2$y",
+      "\\u001b[?2004;4$y",
+      # Kitty keyboard flags
+      "\\u001b[?0u",
+      # XTVERSION, which vouches for REP and truecolor
+      "\\u001bP>|WezTerm 20240203\\u001b\\\\",
+      # DA1 ends the probe
+      "\\u001b[?62;22c"
+    ]
+
+    restart_with_replay(Enum.map(replies, &~s([0.0, "i", "#{&1}"])) ++ [key(?z)], [])
+
+    # Replies are not events, but what follows them still is
+    assert Enum.any?(receive_events(), &match?(%Event{type: :key, ch: ?z}, &1))
+
+    assert ExTermbox.terminal_features() ==
+             {:ok,
+              %{
+                features: [:kitty_keyboard, :rep, :sync_output, :truecolor],
+                version: "WezTerm 20240203"
+              }}
+
+    assert File.read!(cache_file(cache, "tbprob01")) =~ "WezTerm 20240203"
+  end
+
+  test "waits for the terminal on a dirty scheduler" do
+    online = :erlang.system_info(:schedulers_online)
+    on_exit(fn -> :erlang.system_flag(:schedulers_online, online) end)
+    :erlang.system_flag(:schedulers_online, 1)
+
+    # Nothing is typed, so this waits out its whole timeout. On the one
+    # normal scheduler it would stall every other process until then.
+    started = System.monotonic_time(:millisecond)
+    task = Task.async(fn -> :termbox2.tb_peek_event(500) end)
+    for _ <- 1..5, do: Process.sleep(10)
+    assert System.monotonic_time(:millisecond) - started < 250
+
+    no_event = Constants.error_code(:no_event)
+    assert {^no_event, _, _, _} = Task.await(task)
+  end
+
+  test "stops init when a setup option is rejected" do
+    Process.flag(:trap_exit, true)
+    ExTermbox.shutdown()
+
+    assert {:error, {:termbox_setup_failed, :present_threads, {:error, _}}} =
+             ExTermbox.init(owner: self(), present_threads: 0)
+
+    # The terminal was released, so a fresh session starts
+    assert {:ok, _} = ExTermbox.init(owner: self())
+  end
+
   # REMOVE: Test related to obsolete debug_send_event
   # test "receives synthetic event via debug command", context do ... end
 
@@ -145,4 +812,138 @@ defmodule ExTermbox.IntegrationTest do
     :ok
   end
 
+  # Restarts the server with the test process as owner, replaying cast (a list
+  # of asciicast events) as fast as it is consumed
+  defp restart_with_replay(cast, opts) do
+    restart(Keyword.merge([replay_input: write_cast(cast), replay_speed: :max], opts))
+  end
+
+  # Replays cast into the running session as fast as it is consumed
+  defp replay(cast), do: assert(ExTermbox.replay_input(write_cast(cast), :max) == :ok)
+
+  defp write_cast(cast) do
+    path = Path.join(System.tmp_dir!(), "ex_termbox_#{System.unique_integer([:positive])}.cast")
+    File.write!(path, [~s({"version": 2}\n) | Enum.map(cast, &[&1, "\n"])])
+    on_exit(fn -> File.rm(path) end)
+    path
+  end
+
+  # Restarts the server with extra options and, unless given, the test
+  # process as owner
+  defp restart(opts) do
+    # The server is linked to the test process
+    Process.flag(:trap_exit, true)
+    server = GenServer.whereis(ExTermbox.Server)
+    ExTermbox.shutdown()
+    # Take the exit out of the mailbox, which :max_owner_queue counts
+    assert_receive {:EXIT, ^server, :shutdown}
+    assert {:ok, _} = ExTermbox.init(Keyword.merge([owner: self()], opts))
+  end
+
+  defp key(ch), do: ~s([0.01, "i", "#{<<ch::utf8>>}"])
+  defp motion(x), do: ~s([0.01, "i", "\\u001b[<35;#{x + 1};1M"])
+  defp resize(w, h), do: ~s([0.01, "r", "#{w}x#{h}"])
+  defp focus(:in), do: ~s([0.01, "i", "\\u001b[I"])
+  defp focus(:out), do: ~s([0.01, "i", "\\u001b[O"])
+
+  defp fixture(name), do: Path.expand("../fixtures/#{name}", __DIR__)
+
+  # Points termbox's caches at a fresh directory and TERMINFO at a copy of the
+  # terminal's terminfo entry, both taking effect on the next restart
+  defp use_tmp_caches do
+    dir = Path.join(System.tmp_dir!(), "ex_termbox_#{System.unique_integer([:positive])}")
+    term = System.get_env("TERM", "")
+    entry = Path.join(String.slice(term, 0, 1), term)
+
+    source =
+      Enum.find(
+        ["/usr/share/terminfo", "/lib/terminfo", "/usr/lib/terminfo", "/etc/terminfo"],
+        &File.regular?(Path.join(&1, entry))
+      )
+
+    assert term != "" and source, "no terminfo entry for TERM=#{inspect(term)}"
+    terminfo = Path.join([dir, "terminfo", entry])
+    File.mkdir_p!(Path.dirname(terminfo))
+    File.cp!(Path.join(source, entry), terminfo)
+    on_exit(fn -> File.rm_rf(dir) end)
+
+    put_test_env("XDG_CACHE_HOME", Path.join(dir, "cache"))
+    put_test_env("TERMINFO", Path.join(dir, "terminfo"))
+    %{cache: Path.join([dir, "cache", "termbox2"]), terminfo: terminfo}
+  end
+
+  # Sets (or with nil, unsets) an environment variable for this test only
+  defp put_test_env(name, value) do
+    old = System.get_env(name)
+    if value, do: System.put_env(name, value), else: System.delete_env(name)
+    on_exit(fn -> if old, do: System.put_env(name, old), else: System.delete_env(name) end)
+  end
+
+  # The cache entry in dir whose file starts with magic, or nil
+  defp cache_file(dir, magic) do
+    case File.ls(dir) do
+      {:ok, names} ->
+        names
+        |> Enum.map(&Path.join(dir, &1))
+        |> Enum.find(&String.starts_with?(File.read!(&1), magic))
+
+      {:error, _} ->
+        nil
+    end
+  end
+
+  # Both fixtures hold the same input: a header size, a key, a UTF-16
+  # surrogate pair, a resize and an arrow key
+  defp assert_replayed_fixture do
+    assert [
+             %Event{type: :resize, w: 20, h: 5},
+             %Event{type: :key, ch: ?a},
+             %Event{type: :key, ch: 0x1F600},
+             %Event{type: :resize, w: 30, h: 6},
+             %Event{type: :key, key: :arrow_up}
+           ] = receive_events()
+
+    assert ExTermbox.input_replay_remaining() == {:ok, 0}
+  end
+
+  # Polls until the last present is stamped later than before, for up to 1 s
+  defp wait_for_present(before, tries \\ 100) do
+    {:ok, ts} = ExTermbox.last_present_timestamp()
+
+    if ts > before or tries == 0 do
+      ts
+    else
+      Process.sleep(10)
+      wait_for_present(before, tries - 1)
+    end
+  end
+
+  # Polls until the terminal's cell at x, y holds ch, for up to 1 s
+  defp wait_for_front(x, y, ch, tries \\ 100) do
+    {:ok, {front, _, _}} = ExTermbox.get_cell(x, y, :front)
+
+    if front == ch or tries == 0 do
+      front
+    else
+      Process.sleep(10)
+      wait_for_front(x, y, ch, tries - 1)
+    end
+  end
+
+  # The first w characters of row y on the terminal
+  defp front_row(y, w) do
+    for x <- 0..(w - 1), into: "" do
+      {:ok, {ch, _, _}} = ExTermbox.get_cell(x, y, :front)
+      <<ch::utf8>>
+    end
+  end
+
+  # Collects the owner's events until none arrive for 200 ms
+  defp receive_events(acc \\ []) do
+    receive do
+      {:termbox_event, event} -> receive_events([event | acc])
+    after
+      200 -> Enum.reverse(acc)
+    end
+  end
 end